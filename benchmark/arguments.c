@@ -0,0 +1,93 @@
+/* Time argument lookup and set.
+ *
+ * Compares vips_object_set(), which looks names up in the class name table
+ * and sets members directly, with g_object_set(), which goes through the
+ * GObject property system. Names are tried in canonical form ("no-rotate")
+ * and in the "_" form C code usually uses ("no_rotate").
+ *
+ * Build with:
+ *
+ * 	gcc -O2 -Wall arguments.c `pkg-config vips --cflags --libs` \
+ * 		-o arguments
+ *
+ * and run with the number of loops as the optional first argument.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <vips/vips.h>
+
+static void
+report( const char *name, gint64 start, int n )
+{
+	double usec = g_get_monotonic_time() - start;
+
+	printf( "%-32s %8.1f ns per call\n", name, 1000.0 * usec / n );
+}
+
+static void
+time_lookup( VipsObject *object, const char *name, int n )
+{
+	GParamSpec *pspec;
+	VipsArgumentClass *argument_class;
+	VipsArgumentInstance *argument_instance;
+	char label[256];
+	gint64 start;
+	int i;
+
+	start = g_get_monotonic_time();
+	for( i = 0; i < n; i++ )
+		if( vips_object_get_argument( object, name,
+			&pspec, &argument_class, &argument_instance ) )
+			vips_error_exit( NULL );
+
+	vips_snprintf( label, 256, "lookup \"%s\"", name );
+	report( label, start, n );
+}
+
+int
+main( int argc, char **argv )
+{
+	int n;
+	VipsObject *object;
+	gint64 start;
+	int i;
+
+	if( VIPS_INIT( argv[0] ) )
+		vips_error_exit( NULL );
+
+	n = argc > 1 ? atoi( argv[1] ) : 1000000;
+	printf( "%d loops\n", n );
+
+	if( !(object = VIPS_OBJECT( vips_operation_new( "thumbnail_image" ) )) )
+		vips_error_exit( NULL );
+
+	time_lookup( object, "width", n );
+	time_lookup( object, "no-rotate", n );
+	time_lookup( object, "no_rotate", n );
+
+	start = g_get_monotonic_time();
+	for( i = 0; i < n; i++ )
+		if( vips_object_set( object,
+			"width", 128,
+			"no_rotate", TRUE,
+			"crop", VIPS_INTERESTING_CENTRE,
+			NULL ) )
+			vips_error_exit( NULL );
+	report( "vips_object_set() 3 args", start, n );
+
+	start = g_get_monotonic_time();
+	for( i = 0; i < n; i++ )
+		g_object_set( object,
+			"width", 128,
+			"no_rotate", TRUE,
+			"crop", VIPS_INTERESTING_CENTRE,
+			NULL );
+	report( "g_object_set() 3 args", start, n );
+
+	g_object_unref( object );
+
+	vips_shutdown();
+
+	return( 0 );
+}
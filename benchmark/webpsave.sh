@@ -0,0 +1,53 @@
+#!/bin/bash
+
+# time and peak memory use for a large webpsave
+#
+# webpsave fills the libwebp picture in strips, so peak memory should be 
+# about the size of the picture (1.5 bytes per pixel for lossy, 4 for 
+# lossless) plus the compressed output, not a full copy of the image as well
+
+uname -a
+vips --version
+
+# sample2.v is 290x442 pixels ... replicate this many times horizontally and 
+# vertically to get a large test image
+tile=${1:-28}
+
+echo building test image ...
+echo "tile=$tile"
+vips replicate sample2.v temp.v $tile $tile
+if [ $? != 0 ]; then
+  echo "build of test image failed -- out of disc space?"
+  exit 1
+fi
+echo -n "test image is" `vipsheader -f width temp.v` 
+echo " by" `vipsheader -f height temp.v` "pixels"
+
+echo reported real-time and peak RSS are best of three runs
+echo mode real-time peak-rss-kb
+
+for mode in "" "[lossless]" "[smart_subsample]"; do
+  best_t=
+  best_m=
+  for run in 1 2 3; do
+    /usr/bin/time -o time.txt -f "%e %M" vips copy temp.v "temp.webp$mode"
+    if [ $? != 0 ]; then
+      echo "benchmark failed -- install problem?"
+      exit 1
+    fi
+    r=`cat time.txt`
+    t=${r% *}
+    m=${r#* }
+    # times are decimal seconds, so compare with awk, not as strings
+    if [[ -z $best_t ]] || 
+      awk -v t=$t -v b=$best_t 'BEGIN { exit !(t < b) }'; then
+      best_t=$t
+    fi
+    if [[ -z $best_m || $m -lt $best_m ]]; then
+      best_m=$m
+    fi
+  done
+  echo "${mode:-[lossy]}" $best_t $best_m
+done
+
+rm -f temp.v temp.webp time.txt
@@ -6,6 +6,9 @@
  * 	- missing implementation of VImage::write()
  * 11/6/16
  * 	- added arithmetic assignment overloads, += etc.
+ * 18/10/20
+ * 	- set and get args with vips_object_set_argument_value(), skipping
+ * 	  the GObject property system
  */
 
 /*
@@ -361,7 +364,8 @@ VOption::set( const char *name, VipsBlob **value )
 	return( this );
 }
 
-// just g_object_set_property(), except we allow set enum from string
+// like g_object_set_property(), except we allow set enum from string, and
+// we set the arg directly rather than going via GObject
 static void
 set_property( VipsObject *object, const char *name, const GValue *value )
 {
@@ -395,11 +399,18 @@ set_property( VipsObject *object, const char *name, const GValue *value )
 
 		g_value_init( &value2, pspec_type );
 		g_value_set_enum( &value2, enum_value );
-		g_object_set_property( G_OBJECT( object ), name, &value2 );
+		if( vips_object_set_argument_value( object, 
+			argument_class, &value2 ) ) {
+			g_warning( "%s", vips_error_buffer() );
+			vips_error_clear();
+		}
 		g_value_unset( &value2 );
 	}
-	else
-		g_object_set_property( G_OBJECT( object ), name, value );
+	else if( vips_object_set_argument_value( object, 
+		argument_class, value ) ) {
+		g_warning( "%s", vips_error_buffer() );
+		vips_error_clear();
+	}
 }
 
 // walk the options and set props on the operation
@@ -434,8 +445,20 @@ VOption::get_operation( VipsOperation *operation )
 		if( ! (*i)->input ) {
 			const char *name = (*i)->name;
 
-			g_object_get_property( G_OBJECT( operation ),
-				name, &(*i)->value );
+			GParamSpec *pspec;
+			VipsArgumentClass *argument_class;
+			VipsArgumentInstance *argument_instance;
+
+			if( vips_object_get_argument( VIPS_OBJECT( operation ),
+				name, &pspec, &argument_class, 
+				&argument_instance ) ||
+				vips_object_get_argument_value( 
+					VIPS_OBJECT( operation ),
+					argument_class, &(*i)->value ) ) {
+				g_warning( "%s", vips_error_buffer() );
+				vips_error_clear();
+				continue;
+			}
 
 #ifdef VIPS_DEBUG_VERBOSE
 			printf( "get_operation: " );
@@ -845,6 +845,7 @@ vips_arithmetic_operation_init( void )
 	extern GType vips_profile_get_type( void ); 
 	extern GType vips_measure_get_type( void ); 
 	extern GType vips_getpoint_get_type( void ); 
+	extern GType vips_getpoints_get_type( void ); 
 	extern GType vips_round_get_type( void ); 
 	extern GType vips_relational_get_type( void ); 
 	extern GType vips_relational_const_get_type( void ); 
@@ -884,6 +885,7 @@ vips_arithmetic_operation_init( void )
 	vips_profile_get_type(); 
 	vips_measure_get_type();
 	vips_getpoint_get_type();
+	vips_getpoints_get_type();
 	vips_round_get_type();
 	vips_relational_get_type();
 	vips_relational_const_get_type(); 
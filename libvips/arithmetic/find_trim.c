@@ -5,6 +5,10 @@
  * 18/9/17 kleisauke 
  * 	- missing bandor
  * 	- only flatten if there is an alpha
+ * 18/10/20
+ * 	- scan in from each edge and stop at the first object pixel, so we
+ * 	  usually only compute a thin border
+ * 	- scan each band with vips_sink(), so large images stay parallel
  */
 
 /*
@@ -66,11 +70,285 @@ typedef VipsOperationClass VipsFindTrimClass;
 
 G_DEFINE_TYPE( VipsFindTrim, vips_find_trim, VIPS_TYPE_OPERATION );
 
+/* Search bands of the mask at least this many pixels deep. Bands double in
+ * depth each time we find nothing.
+ */
+#define TRIM_STRIP (32)
+
+/* The bounding box of the object pixels in a band of the mask. The sink
+ * threads each find a box for their tile and merge it in here.
+ */
+typedef struct _VipsFindTrimBand {
+	VipsRect band;
+	GMutex *lock;
+
+	int left;
+	int top;
+	int right;
+	int bottom;
+} VipsFindTrimBand;
+
+static int
+vips_find_trim_band_scan( VipsRegion *region, 
+	void *seq, void *a, void *b, gboolean *stop )
+{
+	VipsFindTrimBand *band = (VipsFindTrimBand *) a;
+	VipsRect *r = &region->valid;
+
+	int left, top, right, bottom;
+	int x, y;
+
+	left = r->width;
+	right = -1;
+	top = -1;
+	bottom = -1;
+	for( y = 0; y < r->height; y++ ) {
+		VipsPel *p = VIPS_REGION_ADDR( region, r->left, r->top + y );
+
+		for( x = 0; x < r->width && !p[x]; x++ ) 
+			;
+		if( x == r->width ) 
+			continue;
+		left = VIPS_MIN( left, x );
+
+		for( x = r->width - 1; !p[x]; x-- ) 
+			;
+		right = VIPS_MAX( right, x );
+
+		if( top == -1 )
+			top = y;
+		bottom = y;
+	}
+
+	if( right >= 0 ) {
+		int x0 = band->band.left + r->left;
+		int y0 = band->band.top + r->top;
+
+		g_mutex_lock( band->lock );
+		band->left = VIPS_MIN( band->left, x0 + left );
+		band->right = VIPS_MAX( band->right, x0 + right );
+		band->top = VIPS_MIN( band->top, y0 + top );
+		band->bottom = VIPS_MAX( band->bottom, y0 + bottom );
+		g_mutex_unlock( band->lock );
+	}
+
+	return( 0 );
+}
+
+/* Find the bounding box of the object pixels in a band of the mask. The band
+ * is computed in parallel with vips_sink(). found->width is zero if the band
+ * is all background.
+ */
+static int
+vips_find_trim_band( VipsImage *mask, VipsRect *r, VipsRect *found )
+{
+	VipsImage *t;
+	VipsFindTrimBand band;
+	int result;
+
+	if( vips_extract_area( mask, &t, 
+		r->left, r->top, r->width, r->height, NULL ) )
+		return( -1 );
+
+	band.band = *r;
+	band.lock = vips_g_mutex_new();
+	band.left = VIPS_RECT_RIGHT( r );
+	band.top = VIPS_RECT_BOTTOM( r );
+	band.right = -1;
+	band.bottom = -1;
+
+	result = vips_sink( t, 
+		NULL, vips_find_trim_band_scan, NULL, &band, NULL );
+
+	vips_g_mutex_free( band.lock );
+	g_object_unref( t );
+
+	if( result )
+		return( -1 );
+
+	if( band.right >= 0 ) {
+		found->left = band.left;
+		found->top = band.top;
+		found->width = band.right - band.left + 1;
+		found->height = band.bottom - band.top + 1;
+	}
+	else {
+		found->left = 0;
+		found->top = 0;
+		found->width = 0;
+		found->height = 0;
+	}
+
+	return( 0 );
+}
+
+/* Scan in from each edge of the mask. Usually only a thin border is 
+ * background, so we compute very little of the mask.
+ */
+static int
+vips_find_trim_scan( VipsFindTrim *find_trim, VipsImage *mask )
+{
+	int width = mask->Xsize;
+	int height = mask->Ysize;
+
+	int tile_width;
+	int tile_height;
+	int n_lines;
+	int strip;
+	int depth;
+	VipsRect r;
+	VipsRect found;
+	int left, top, right, bottom;
+	int i;
+
+	/* Make the first band deep enough to give every worker some tiles,
+	 * otherwise the scan of a wide image will run on a single thread.
+	 */
+	vips_get_tile_size( mask, &tile_width, &tile_height, &n_lines );
+	strip = VIPS_MAX( TRIM_STRIP, n_lines * vips_concurrency_get() );
+
+	/* Search down for the top edge. If we find nothing, there's no 
+	 * object.
+	 */
+	top = -1;
+	depth = strip;
+	for( i = 0; i < height; i += depth, depth *= 2 ) {
+		r.left = 0;
+		r.top = i;
+		r.width = width;
+		r.height = VIPS_MIN( depth, height - i );
+		if( vips_find_trim_band( mask, &r, &found ) )
+			return( -1 );
+		if( found.width > 0 ) {
+			top = found.top;
+			break;
+		}
+	}
+
+	if( top == -1 ) {
+		g_object_set( find_trim,
+			"left", width,
+			"top", height,
+			"width", 0,
+			"height", 0,
+			NULL ); 
+
+		return( 0 );
+	}
+
+	/* There's an object, so the other searches must succeed. The bottom
+	 * search stops at top, the left and right searches only need to
+	 * look between top and bottom.
+	 */
+	bottom = top;
+	depth = strip;
+	for( i = height; i > top; i -= depth, depth *= 2 ) {
+		r.left = 0;
+		r.top = VIPS_MAX( top, i - depth );
+		r.width = width;
+		r.height = i - r.top;
+		if( vips_find_trim_band( mask, &r, &found ) )
+			return( -1 );
+		if( found.width > 0 ) {
+			bottom = VIPS_RECT_BOTTOM( &found ) - 1;
+			break;
+		}
+	}
+
+	left = 0;
+	depth = strip;
+	for( i = 0; i < width; i += depth, depth *= 2 ) {
+		r.left = i;
+		r.top = top;
+		r.width = VIPS_MIN( depth, width - i );
+		r.height = bottom - top + 1;
+		if( vips_find_trim_band( mask, &r, &found ) )
+			return( -1 );
+		if( found.width > 0 ) {
+			left = found.left;
+			break;
+		}
+	}
+
+	right = left;
+	depth = strip;
+	for( i = width; i > left; i -= depth, depth *= 2 ) {
+		r.left = VIPS_MAX( left, i - depth );
+		r.top = top;
+		r.width = i - r.left;
+		r.height = bottom - top + 1;
+		if( vips_find_trim_band( mask, &r, &found ) )
+			return( -1 );
+		if( found.width > 0 ) {
+			right = VIPS_RECT_RIGHT( &found ) - 1;
+			break;
+		}
+	}
+
+	g_object_set( find_trim,
+		"left", left,
+		"top", top,
+		"width", right - left + 1,
+		"height", bottom - top + 1,
+		NULL ); 
+
+	return( 0 );
+}
+
+/* Sum the whole mask in a single pass, then search the sums. We need this
+ * for sequential images, where we can't scan up from the bottom.
+ */
+static int
+vips_find_trim_project( VipsFindTrim *find_trim, VipsImage *mask )
+{
+	VipsImage **t = (VipsImage **) 
+		vips_object_local_array( VIPS_OBJECT( find_trim ), 12 );
+
+	double left;
+	double top;
+	double right;
+	double bottom;
+
+	/* t[0] == column sums, t[1] == row sums. 
+	 */
+	if( vips_project( mask, &t[0], &t[1], NULL ) )
+		return( -1 );
+
+	/* t[2] == search column sums in from left.
+	 */
+	if( vips_profile( t[0], &t[2], &t[3], NULL ) ||
+		vips_avg( t[3], &left, NULL ) )
+		return( -1 );
+	if( vips_flip( t[0], &t[4], VIPS_DIRECTION_HORIZONTAL, NULL ) ||
+		vips_profile( t[4], &t[5], &t[6], NULL ) ||
+		vips_avg( t[6], &right, NULL ) )
+		return( -1 );
+
+	/* t[7] == search row sums in from top.
+	 */
+	if( vips_profile( t[1], &t[7], &t[8], NULL ) ||
+		vips_avg( t[7], &top, NULL ) )
+		return( -1 );
+	if( vips_flip( t[1], &t[9], VIPS_DIRECTION_VERTICAL, NULL ) ||
+		vips_profile( t[9], &t[10], &t[11], NULL ) ||
+		vips_avg( t[10], &bottom, NULL ) )
+		return( -1 );
+
+	g_object_set( find_trim,
+		"left", (int) left,
+		"top", (int) top,
+		"width", (int) VIPS_MAX( 0, (t[0]->Xsize - right) - left ),
+		"height", (int) VIPS_MAX( 0, (t[1]->Ysize - bottom) - top ),
+		NULL ); 
+
+	return( 0 );
+}
+
 static int
 vips_find_trim_build( VipsObject *object )
 {
 	VipsFindTrim *find_trim = (VipsFindTrim *) object;
-	VipsImage **t = (VipsImage **) vips_object_local_array( object, 20 );
+	VipsImage **t = (VipsImage **) vips_object_local_array( object, 6 );
 
 	VipsImage *in;
 	double *background;
@@ -78,10 +356,6 @@ vips_find_trim_build( VipsObject *object )
 	double *neg_bg;
 	double *ones;
 	int i;
-	double left;
-	double top;
-	double right;
-	double bottom;
 
 	if( VIPS_OBJECT_CLASS( vips_find_trim_parent_class )->build( object ) )
 		return( -1 );
@@ -119,7 +393,8 @@ vips_find_trim_build( VipsObject *object )
 		ones[i] = 1.0;
 	}
 
-	/* Smooth, find difference from bg, abs, threshold.
+	/* Smooth, find difference from bg, abs, threshold. This is not
+	 * computed here, only when we search it.
 	 */
 	if( vips_median( in, &t[1], 3, NULL ) ||
 		vips_linear( t[1], &t[2], ones, neg_bg, n, NULL ) ||
@@ -129,37 +404,14 @@ vips_find_trim_build( VipsObject *object )
 		return( -1 ); 
 	in = t[5];
 
-	/* t[6] == column sums, t[7] == row sums. 
-	 */
-	if( vips_project( in, &t[6], &t[7], NULL ) )
-		return( -1 );
-
-	/* t[8] == search column sums in from left.
-	 */
-	if( vips_profile( t[6], &t[8], &t[9], NULL ) ||
-		vips_avg( t[9], &left, NULL ) )
-		return( -1 );
-	if( vips_flip( t[6], &t[10], VIPS_DIRECTION_HORIZONTAL, NULL ) ||
-		vips_profile( t[10], &t[11], &t[12], NULL ) ||
-		vips_avg( t[12], &right, NULL ) )
-		return( -1 );
-
-	/* t[8] == search column sums in from left.
-	 */
-	if( vips_profile( t[7], &t[13], &t[14], NULL ) ||
-		vips_avg( t[13], &top, NULL ) )
-		return( -1 );
-	if( vips_flip( t[7], &t[15], VIPS_DIRECTION_VERTICAL, NULL ) ||
-		vips_profile( t[15], &t[16], &t[17], NULL ) ||
-		vips_avg( t[16], &bottom, NULL ) )
-		return( -1 );
-
-	g_object_set( find_trim,
-		"left", (int) left,
-		"top", (int) top,
-		"width", (int) VIPS_MAX( 0, (t[6]->Xsize - right) - left ),
-		"height", (int) VIPS_MAX( 0, (t[7]->Ysize - bottom) - top ),
-		NULL ); 
+	if( vips_image_is_sequential( in ) ) {
+		if( vips_find_trim_project( find_trim, in ) )
+			return( -1 );
+	}
+	else {
+		if( vips_find_trim_scan( find_trim, in ) )
+			return( -1 );
+	}
 
 	return( 0 );
 }
@@ -252,12 +504,15 @@ vips_find_trim_init( VipsFindTrim *find_trim )
  *
  * Search @in for the bounding box of the non-background area. 
  *
- * Any alpha is flattened out, then the image is median-filtered, all the row 
- * and column sums of the absolute
- * difference from @background are calculated in a
- * single pass, then the first row or column in each of the
- * four directions where the sum is greater than @threshold gives the bounding
- * box.
+ * Any alpha is flattened out, then the image is median-filtered and any
+ * pixel where the absolute difference from @background is greater than 
+ * @threshold is part of the object. The bounding box is found by scanning 
+ * in from each edge in bands and stopping at the first band with an object 
+ * pixel, so usually only a thin border of the image is computed. Each band 
+ * is computed in parallel. 
+ *
+ * Images opened in sequential mode can't be scanned from the bottom, so for
+ * these the row and column sums are calculated in a single pass instead.
  *
  * If the image is entirely background, vips_find_trim() returns @width == 0
  * and @height == 0.
@@ -0,0 +1,400 @@
+/* read many points from an image
+ *
+ * 18/10/20
+ * 	- from getpoint.c
+ */
+
+/*
+
+    This file is part of VIPS.
+
+    VIPS is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301  USA
+
+ */
+
+/*
+
+    These files are distributed with VIPS - http://www.vips.ecs.soton.ac.uk
+
+ */
+
+/*
+#define VIPS_DEBUG
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /*HAVE_CONFIG_H*/
+#include <vips/intl.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <vips/vips.h>
+#include <vips/internal.h>
+#include <vips/debug.h>
+
+/* Points are grouped into tiles of this size. Each tile is fetched once.
+ */
+#define TILE_SIZE (128)
+
+/* A point, and the tile it falls in.
+ */
+typedef struct _VipsGetpointsPoint {
+	int tile;
+	int index;
+} VipsGetpointsPoint;
+
+typedef struct _VipsGetpoints {
+	VipsOperation parent_instance;
+
+	VipsImage *in;
+	VipsArrayDouble *coords;
+	VipsInterpolate *interpolate;
+	VipsImage *out;
+
+	/* The image we sample, cast to double and perhaps expanded for the
+	 * interpolator.
+	 */
+	VipsImage *image;
+
+	/* Points, sorted by tile, the number of points, and the next one to
+	 * allocate.
+	 */
+	VipsGetpointsPoint *points;
+	int n_points;
+	int next;
+
+	int tiles_across;
+	int window_size;
+	int window_offset;
+	VipsInterpolateMethod interpolate_fn;
+
+	/* The matrix we write results to.
+	 */
+	VipsImage *matrix;
+
+} VipsGetpoints;
+
+typedef VipsOperationClass VipsGetpointsClass;
+
+G_DEFINE_TYPE( VipsGetpoints, vips_getpoints, VIPS_TYPE_OPERATION );
+
+static int
+vips_getpoints_compare( const void *a, const void *b )
+{
+	const VipsGetpointsPoint *p1 = (const VipsGetpointsPoint *) a;
+	const VipsGetpointsPoint *p2 = (const VipsGetpointsPoint *) b;
+
+	if( p1->tile != p2->tile )
+		return( p1->tile - p2->tile );
+
+	return( p1->index - p2->index );
+}
+
+/* Allocate the next group of points in the same tile. Runs single-threaded.
+ */
+static int
+vips_getpoints_allocate( VipsThreadState *state, void *a, gboolean *stop )
+{
+	VipsGetpoints *getpoints = (VipsGetpoints *) a;
+	VipsGetpointsPoint *points = getpoints->points;
+
+	VipsRect image;
+	int tile;
+	int end;
+
+	if( getpoints->next >= getpoints->n_points ) {
+		*stop = TRUE;
+		return( 0 );
+	}
+
+	tile = points[getpoints->next].tile;
+	for( end = getpoints->next;
+		end < getpoints->n_points && points[end].tile == tile; end++ )
+		;
+
+	/* The tile, plus enough for the interpolation stencil.
+	 */
+	image.left = 0;
+	image.top = 0;
+	image.width = getpoints->image->Xsize;
+	image.height = getpoints->image->Ysize;
+	state->pos.left = (tile % getpoints->tiles_across) * TILE_SIZE;
+	state->pos.top = (tile / getpoints->tiles_across) * TILE_SIZE;
+	state->pos.width = TILE_SIZE + getpoints->window_size - 1;
+	state->pos.height = TILE_SIZE + getpoints->window_size - 1;
+	vips_rect_intersectrect( &state->pos, &image, &state->pos );
+
+	state->x = getpoints->next;
+	state->y = end;
+
+	getpoints->next = end;
+
+	return( 0 );
+}
+
+static int
+vips_getpoints_work( VipsThreadState *state, void *a )
+{
+	VipsGetpoints *getpoints = (VipsGetpoints *) a;
+	double *coords = (double *) VIPS_AREA( getpoints->coords )->data;
+	VipsImage *matrix = getpoints->matrix;
+	size_t ps = VIPS_IMAGE_SIZEOF_PEL( getpoints->image );
+
+	int i;
+
+	if( vips_region_prepare( state->reg, &state->pos ) )
+		return( -1 );
+
+	for( i = state->x; i < state->y; i++ ) {
+		int index = getpoints->points[i].index;
+		double x = coords[index * 2];
+		double y = coords[index * 2 + 1];
+		double *q = VIPS_MATRIX( matrix, 0, index );
+
+		if( getpoints->interpolate_fn )
+			getpoints->interpolate_fn( getpoints->interpolate, q,
+				state->reg,
+				x + getpoints->window_offset,
+				y + getpoints->window_offset );
+		else
+			/* Without an interpolator, read the pixel the point 
+			 * falls in.
+			 */
+			memcpy( q, VIPS_REGION_ADDR( state->reg, 
+				(int) x, (int) y ), ps );
+	}
+
+	return( 0 );
+}
+
+static int
+vips_getpoints_build( VipsObject *object )
+{
+	VipsObjectClass *class = VIPS_OBJECT_GET_CLASS( object );
+	VipsGetpoints *getpoints = (VipsGetpoints *) object;
+	VipsImage **t = (VipsImage **) vips_object_local_array( object, 2 );
+
+	VipsImage *in;
+	double *coords;
+	int n;
+	int i;
+
+	if( VIPS_OBJECT_CLASS( vips_getpoints_parent_class )->build( object ) )
+		return( -1 );
+
+	in = getpoints->in;
+	coords = (double *) VIPS_AREA( getpoints->coords )->data;
+	n = VIPS_AREA( getpoints->coords )->n;
+	if( n == 0 ||
+		n % 2 != 0 ) {
+		vips_error( class->nickname,
+			"%s", _( "coords must be a list of x, y pairs" ) );
+		return( -1 );
+	}
+	getpoints->n_points = n / 2;
+
+	if( vips_image_decode( in, &t[0] ) )
+		return( -1 );
+	in = t[0];
+
+	/* Sample as double, then we can copy pixels straight to the output
+	 * matrix.
+	 */
+	if( vips_cast( in, &t[1], vips_band_format_iscomplex( in->BandFmt ) ?
+		VIPS_FORMAT_DPCOMPLEX : VIPS_FORMAT_DOUBLE, NULL ) )
+		return( -1 );
+	in = t[1];
+
+	if( getpoints->interpolate ) {
+		VipsImage *x;
+
+		if( vips_check_noncomplex( class->nickname, in ) )
+			return( -1 );
+
+		getpoints->window_size =
+			vips_interpolate_get_window_size(
+				getpoints->interpolate );
+		getpoints->window_offset =
+			vips_interpolate_get_window_offset(
+				getpoints->interpolate );
+		getpoints->interpolate_fn =
+			vips_interpolate_get_method( getpoints->interpolate );
+
+		/* Expand the input so the stencil never falls off the edge.
+		 */
+		if( vips_embed( in, &x,
+			getpoints->window_offset, getpoints->window_offset,
+			in->Xsize + getpoints->window_size - 1,
+			in->Ysize + getpoints->window_size - 1,
+			"extend", VIPS_EXTEND_COPY,
+			NULL ) )
+			return( -1 );
+		vips_object_local( object, x );
+		getpoints->image = x;
+	}
+	else {
+		getpoints->window_size = 1;
+		getpoints->window_offset = 0;
+		getpoints->interpolate_fn = NULL;
+		getpoints->image = in;
+	}
+
+	/* Check the points, find the tile each falls in, and sort.
+	 */
+	getpoints->tiles_across =
+		VIPS_ROUND_UP( in->Xsize, TILE_SIZE ) / TILE_SIZE;
+	if( !(getpoints->points = VIPS_ARRAY( object,
+		getpoints->n_points, VipsGetpointsPoint )) )
+		return( -1 );
+	for( i = 0; i < getpoints->n_points; i++ ) {
+		double x = coords[i * 2];
+		double y = coords[i * 2 + 1];
+
+		if( x < 0 ||
+			x >= in->Xsize ||
+			y < 0 ||
+			y >= in->Ysize ) {
+			vips_error( class->nickname,
+				_( "point %d out of range" ), i );
+			return( -1 );
+		}
+
+		getpoints->points[i].tile =
+			((int) y / TILE_SIZE) * getpoints->tiles_across +
+			(int) x / TILE_SIZE;
+		getpoints->points[i].index = i;
+	}
+	qsort( getpoints->points, getpoints->n_points,
+		sizeof( VipsGetpointsPoint ), vips_getpoints_compare );
+
+	/* One row per point, one column per band.
+	 */
+	getpoints->matrix = vips_image_new_matrix(
+		VIPS_IMAGE_SIZEOF_PEL( in ) / sizeof( double ),
+		getpoints->n_points );
+	vips_object_local( object, getpoints->matrix );
+
+	getpoints->next = 0;
+	if( vips_threadpool_run( getpoints->image,
+		vips_thread_state_new,
+		vips_getpoints_allocate,
+		vips_getpoints_work,
+		NULL,
+		getpoints ) )
+		return( -1 );
+
+	g_object_set( object, "out", vips_image_new(), NULL ); 
+	if( vips_image_write( getpoints->matrix, getpoints->out ) )
+		return( -1 );
+
+	return( 0 );
+}
+
+static void
+vips_getpoints_class_init( VipsGetpointsClass *class )
+{
+	GObjectClass *gobject_class = (GObjectClass *) class;
+	VipsObjectClass *object_class = (VipsObjectClass *) class;
+
+	gobject_class->set_property = vips_object_set_property;
+	gobject_class->get_property = vips_object_get_property;
+
+	object_class->nickname = "getpoints";
+	object_class->description = _( "read many points from an image" );
+	object_class->build = vips_getpoints_build;
+
+	VIPS_ARG_IMAGE( class, "in", 1,
+		_( "in" ),
+		_( "Input image" ),
+		VIPS_ARGUMENT_REQUIRED_INPUT,
+		G_STRUCT_OFFSET( VipsGetpoints, in ) );
+
+	VIPS_ARG_IMAGE( class, "out", 2,
+		_( "Output" ),
+		_( "Matrix of output values" ),
+		VIPS_ARGUMENT_REQUIRED_OUTPUT,
+		G_STRUCT_OFFSET( VipsGetpoints, out ) );
+
+	VIPS_ARG_BOXED( class, "coords", 5,
+		_( "Coordinates" ),
+		_( "Array of x, y pairs to read" ),
+		VIPS_ARGUMENT_REQUIRED_INPUT,
+		G_STRUCT_OFFSET( VipsGetpoints, coords ),
+		VIPS_TYPE_ARRAY_DOUBLE );
+
+	VIPS_ARG_INTERPOLATE( class, "interpolate", 6,
+		_( "Interpolate" ),
+		_( "Interpolate pixels with this" ),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET( VipsGetpoints, interpolate ) );
+
+}
+
+static void
+vips_getpoints_init( VipsGetpoints *getpoints )
+{
+}
+
+/**
+ * vips_getpoints: (method)
+ * @in: image to read from
+ * @out: (out): output matrix
+ * @coords: (array length=n): x, y pairs to read
+ * @n: number of values in @coords
+ * @...: %NULL-terminated list of optional named arguments
+ *
+ * Optional arguments:
+ *
+ * * @interpolate: interpolate pixels with this
+ *
+ * Reads many pixels from an image. @coords holds @n / 2 x, y pairs.
+ *
+ * Points are grouped by the tile they fall in, and each tile is computed
+ * once, in parallel. This is much quicker than calling vips_getpoint() for
+ * each point.
+ *
+ * @out is a matrix image with one row per point, in the order of @coords,
+ * and one column per band. Complex images have two columns per band.
+ *
+ * Without @interpolate, each point reads the pixel it falls in. Set
+ * @interpolate to sample at subpixel positions. Points outside the image
+ * are an error.
+ *
+ * See also: vips_getpoint().
+ *
+ * Returns: 0 on success, or -1 on error.
+ */
+int
+vips_getpoints( VipsImage *in, VipsImage **out, double *coords, int n, ... )
+{
+	va_list ap;
+	VipsArrayDouble *array;
+	int result;
+
+	array = vips_array_double_new( coords, n );
+
+	va_start( ap, n );
+	result = vips_call_split( "getpoints", ap, in, out, array );
+	va_end( ap );
+
+	vips_area_unref( VIPS_AREA( array ) );
+
+	return( result );
+}
@@ -27,6 +27,8 @@
  * 7/11/11
  * 	- redone as a class
  * 	- track maxpos / minpos too
+ * 18/10/20
+ * 	- add @histogram, find the histogram in the same pass
  */
 
 /*
@@ -67,6 +69,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 
 #include <vips/vips.h>
@@ -80,6 +83,19 @@ typedef struct _VipsStats {
 	VipsImage *out;
 
 	gboolean set;		/* FALSE means no value yet */
+
+	/* Also find the histogram, as vips_hist_find(), and write it here.
+	 */
+	gboolean histogram;
+	VipsImage *hist;
+
+	/* The bins for each band, the number of bands and bins, and the 
+	 * largest bin we've seen.
+	 */
+	unsigned int **bins;
+	int bands;
+	int size;
+	int mx;
 } VipsStats;
 
 typedef VipsStatisticClass VipsStatsClass;
@@ -102,6 +118,64 @@ enum {
 	COL_LAST = 10
 };
 
+static unsigned int **
+vips_stats_bins_new( int bands, int size )
+{
+	unsigned int **bins;
+	int b;
+
+	bins = g_new( unsigned int *, bands );
+	for( b = 0; b < bands; b++ )
+		bins[b] = g_new0( unsigned int, size );
+
+	return( bins );
+}
+
+static void
+vips_stats_bins_free( int bands, unsigned int **bins )
+{
+	int b;
+
+	if( bins ) {
+		for( b = 0; b < bands; b++ )
+			g_free( bins[b] );
+		g_free( bins );
+	}
+}
+
+/* Write the histogram out, as vips_hist_find() would.
+ */
+static int
+vips_stats_write_hist( VipsStats *stats )
+{
+	VipsStatistic *statistic = VIPS_STATISTIC( stats ); 
+	VipsImage *hist = stats->hist;
+
+	unsigned int *obuffer;
+	unsigned int *q;
+	int i, j;
+
+	if( vips_image_pipelinev( hist, 
+		VIPS_DEMAND_STYLE_ANY, statistic->ready, NULL ) ) 
+		return( -1 );
+	vips_image_init_fields( hist,
+		stats->mx + 1, 1, statistic->ready->Bands, 
+		VIPS_FORMAT_UINT, 
+		VIPS_CODING_NONE, VIPS_INTERPRETATION_HISTOGRAM, 1.0, 1.0 );
+
+	if( !(obuffer = VIPS_ARRAY( stats, 
+		VIPS_IMAGE_N_ELEMENTS( hist ), unsigned int )) )
+		return( -1 );
+	for( q = obuffer, j = 0; j < hist->Xsize; j++ )
+		for( i = 0; i < hist->Bands; i++ )
+			*q++ = stats->bins[i][j];
+
+	if( vips_image_write_line( hist, 0, (VipsPel *) obuffer ) )
+		return( -1 );
+
+	return( 0 );
+}
+
 static int
 vips_stats_build( VipsObject *object )
 {
@@ -122,11 +196,20 @@ vips_stats_build( VipsObject *object )
 		g_object_set( object, 
 			"out", vips_image_new_matrix( COL_LAST, bands + 1 ),
 			NULL );
+
+		if( stats->histogram )
+			g_object_set( object, 
+				"hist", vips_image_new(),
+				NULL );
 	}
 
 	if( VIPS_OBJECT_CLASS( vips_stats_parent_class )->build( object ) )
 		return( -1 );
 
+	if( stats->histogram &&
+		vips_stats_write_hist( stats ) )
+		return( -1 );
+
 	pels = (gint64) vips_image_get_width( statistic->in ) * 
 		vips_image_get_height( statistic->in );
 	vals = pels * vips_image_get_bands( statistic->in );
@@ -216,6 +299,22 @@ vips_stats_stop( VipsStatistic *statistic, void *seq )
 		}
 	}
 
+	if( local->bins ) {
+		global->mx = VIPS_MAX( global->mx, local->mx );
+		for( b = 0; b < local->bands; b++ ) {
+			unsigned int *p = local->bins[b];
+			unsigned int *q = global->bins[b];
+
+			int i;
+
+			for( i = 0; i <= local->mx; i++ )
+				q[i] += p[i];
+		}
+
+		vips_stats_bins_free( local->bands, local->bins );
+		local->bins = NULL;
+	}
+
 	VIPS_FREEF( g_object_unref, local->out );
 	VIPS_FREEF( g_free, seq );
 
@@ -228,15 +327,38 @@ static void *
 vips_stats_start( VipsStatistic *statistic )
 {
 	int bands = vips_image_get_bands( statistic->in );
+	VipsStats *global = (VipsStats *) statistic;
 
 	VipsStats *stats;
 
+	/* Make the main histogram on first start. Histograms are 8 or 16 bit,
+	 * as vips_hist_find().
+	 */
+	if( global->histogram &&
+		!global->bins ) {
+		VipsBandFormat format = statistic->ready->BandFmt;
+
+		global->bands = statistic->ready->Bands;
+		global->size = format == VIPS_FORMAT_UCHAR || 
+			format == VIPS_FORMAT_CHAR ? 256 : 65536;
+		global->bins = vips_stats_bins_new( global->bands, 
+			global->size );
+		global->mx = 0;
+	}
+
 	stats = g_new( VipsStats, 1 );
 	if( !(stats->out = vips_image_new_matrix( COL_LAST, bands + 1 )) ) {
 		g_free( stats );
 		return( NULL );
 	}
 	stats->set = FALSE;
+	stats->bins = NULL;
+	stats->mx = 0;
+	if( global->bins ) {
+		stats->bands = global->bands;
+		stats->size = global->size;
+		stats->bins = vips_stats_bins_new( stats->bands, stats->size );
+	}
 
 	return( (void *) stats );
 }
@@ -370,6 +492,74 @@ vips_stats_start( VipsStatistic *statistic )
 	local->set = TRUE; \
 } 
 
+/* Add a line to the histogram. Values are clipped to the range of the bins, 
+ * as vips_cast() would.
+ */
+#define HIST_LOOP( TYPE ) { \
+	TYPE *p = (TYPE *) in; \
+	const int top = local->size - 1; \
+	\
+	for( i = 0; i < n; i++ ) { \
+		for( b = 0; b < bands; b++ ) { \
+			int v = VIPS_CLIP( 0, p[b], top ); \
+			\
+			local->bins[b][v] += 1; \
+			if( v > mx ) \
+				mx = v; \
+		} \
+		\
+		p += bands; \
+	} \
+}
+
+static void
+vips_stats_scan_hist( VipsStats *local, VipsBandFormat format, 
+	void *in, int n )
+{
+	const int bands = local->bands;
+
+	int mx = local->mx;
+
+	int b, i;
+
+	switch( format ) {
+	case VIPS_FORMAT_UCHAR:	{
+		VipsPel *p = (VipsPel *) in;
+
+		for( i = 0; i < n; i++ ) {
+			for( b = 0; b < bands; b++ )
+				local->bins[b][p[b]] += 1;
+
+			p += bands;
+		}
+
+		mx = 255;
+	}
+		break;
+
+	case VIPS_FORMAT_CHAR:
+		HIST_LOOP( signed char ); 
+
+		/* vips_hist_find() casts char to uchar, so we always have 
+		 * 256 bins.
+		 */
+		mx = 255;
+		break; 
+
+	case VIPS_FORMAT_USHORT:	HIST_LOOP( unsigned short ); break; 
+	case VIPS_FORMAT_SHORT:		HIST_LOOP( signed short ); break; 
+	case VIPS_FORMAT_UINT:		HIST_LOOP( unsigned int ); break;
+	case VIPS_FORMAT_INT:		HIST_LOOP( signed int ); break; 
+	case VIPS_FORMAT_FLOAT:		HIST_LOOP( float ); break; 
+	case VIPS_FORMAT_DOUBLE:	HIST_LOOP( double ); break; 
+
+	default: 
+		g_assert_not_reached();
+	}
+
+	local->mx = mx;
+}
+
 /* Loop over region, accumulating a sum in *tmp.
  */
 static int
@@ -395,9 +585,26 @@ vips_stats_scan( VipsStatistic *statistic, void *seq,
 		g_assert_not_reached();
 	}
 
+	if( local->bins )
+		vips_stats_scan_hist( local, 
+			statistic->ready->BandFmt, in, n );
+
 	return( 0 );
 }
 
+static void
+vips_stats_finalize( GObject *gobject )
+{
+	VipsStats *stats = (VipsStats *) gobject;
+
+	if( stats->bins ) {
+		vips_stats_bins_free( stats->bands, stats->bins );
+		stats->bins = NULL;
+	}
+
+	G_OBJECT_CLASS( vips_stats_parent_class )->finalize( gobject );
+}
+
 static void
 vips_stats_class_init( VipsStatsClass *class )
 {
@@ -405,6 +612,7 @@ vips_stats_class_init( VipsStatsClass *class )
 	VipsObjectClass *object_class = (VipsObjectClass *) class;
 	VipsStatisticClass *sclass = VIPS_STATISTIC_CLASS( class );
 
+	gobject_class->finalize = vips_stats_finalize;
 	gobject_class->set_property = vips_object_set_property;
 	gobject_class->get_property = vips_object_get_property;
 
@@ -421,6 +629,19 @@ vips_stats_class_init( VipsStatsClass *class )
 		_( "Output array of statistics" ),
 		VIPS_ARGUMENT_REQUIRED_OUTPUT, 
 		G_STRUCT_OFFSET( VipsStats, out ) );
+
+	VIPS_ARG_BOOL( class, "histogram", 110, 
+		_( "Histogram" ), 
+		_( "Also find the histogram" ),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET( VipsStats, histogram ),
+		FALSE );
+
+	VIPS_ARG_IMAGE( class, "hist", 111, 
+		_( "Hist" ), 
+		_( "Output histogram" ),
+		VIPS_ARGUMENT_OPTIONAL_OUTPUT, 
+		G_STRUCT_OFFSET( VipsStats, hist ) );
 }
 
 static void
@@ -434,6 +655,11 @@ vips_stats_init( VipsStats *stats )
  * @out: (out): image of statistics
  * @...: %NULL-terminated list of optional named arguments
  *
+ * Optional arguments:
+ *
+ * * @histogram: %gboolean, also find the histogram
+ * * @hist: output #VipsImage, the histogram
+ *
  * Find many image statistics in a single pass through the data. @out is a
  * one-band #VIPS_FORMAT_DOUBLE image of at least 10 columns by n + 1 
  * (where n is number of bands in image @in) 
@@ -448,7 +674,13 @@ vips_stats_init( VipsStats *stats )
  * If there is more than one maxima or minima, one of them will be chosen at 
  * random. 
  *
- * See also: vips_avg(), vips_min().
+ * Set @histogram to also find the histogram of all bands in the same pass, 
+ * and return it in @hist. This is the same as vips_hist_find(): values are 
+ * cast to u8 or u16, and @hist is always u32. One call to vips_stats() can
+ * replace separate calls to vips_avg(), vips_deviate(), vips_min(), 
+ * vips_max() and vips_hist_find(), and only reads the image once.
+ *
+ * See also: vips_avg(), vips_min(), vips_hist_find().
  *
  * Returns: 0 on success, -1 on error
  */
@@ -2,6 +2,12 @@
  *
  * 11/12/15
  * 	- from join.c
+ * 18/10/20
+ * 	- find inputs from the grid position, not by searching
+ * 	- make input regions on first use
+ * 	- add "lazy" to keep inputs open only while they are in use
+ * 	- in lazy mode, don't close inputs which share an upstream image with
+ * 	  inputs in use
  */
 
 /*
@@ -64,42 +70,383 @@ typedef struct _VipsArrayjoin {
 	int hspacing;
 	int vspacing;
 
+	gboolean lazy;
+
+	int n;
 	int down;
 	VipsRect *rects;
 
+	/* The sized and aligned inputs we make regions on.
+	 */
+	VipsImage **size;
+
+	/* In lazy mode, the number of regions on each input across all
+	 * threads, the open inputs with no regions (most recently used
+	 * first) and the link for each one, the number of open inputs, and 
+	 * how many we allow.
+	 */
+	GMutex *lock;
+	int *use;
+
+	/* Inputs which share an upstream image are in the same group, and 
+	 * the number of regions on each group. Closing an input closes its
+	 * upstream too, so we can only close inputs from idle groups.
+	 */
+	int *group;
+	int *group_use;
+
+	GQueue *idle;
+	GList **idle_link;
+	int n_open;
+	int max_open;
+
 } VipsArrayjoin;
 
 typedef VipsConversionClass VipsArrayjoinClass;
 
 G_DEFINE_TYPE( VipsArrayjoin, vips_arrayjoin, VIPS_TYPE_CONVERSION );
 
+static void
+vips_arrayjoin_finalize( GObject *gobject )
+{
+	VipsArrayjoin *join = (VipsArrayjoin *) gobject;
+
+	VIPS_FREEF( vips_g_mutex_free, join->lock );
+	VIPS_FREEF( g_queue_free, join->idle );
+
+	G_OBJECT_CLASS( vips_arrayjoin_parent_class )->finalize( gobject );
+}
+
+/* A thread is about to make a region on input i. 
+ */
+static void
+vips_arrayjoin_acquire( VipsArrayjoin *join, int i )
+{
+	g_mutex_lock( join->lock );
+
+	if( join->idle_link[i] ) {
+		g_queue_delete_link( join->idle, join->idle_link[i] );
+		join->idle_link[i] = NULL;
+	}
+	else if( join->use[i] == 0 )
+		join->n_open += 1;
+	join->use[i] += 1;
+	join->group_use[join->group[i]] += 1;
+
+	/* Close idle inputs, oldest first, until we are back under budget.
+	 * Inputs which have regions can't be closed, so we can go over.
+	 */
+	while( join->n_open > join->max_open &&
+		!g_queue_is_empty( join->idle ) ) {
+		int j = GPOINTER_TO_INT( g_queue_pop_tail( join->idle ) );
+
+		VIPS_DEBUG_MSG( "vips_arrayjoin_acquire: closing %d\n", j );
+
+		join->idle_link[j] = NULL;
+		join->n_open -= 1;
+		if( join->group_use[join->group[j]] == 0 )
+			vips_image_minimise_all( join->size[j] );
+	}
+
+	g_mutex_unlock( join->lock );
+}
+
+/* A thread has freed its region on input i.
+ */
+static void
+vips_arrayjoin_release( VipsArrayjoin *join, int i )
+{
+	g_mutex_lock( join->lock );
+
+	g_assert( join->use[i] > 0 );
+
+	join->use[i] -= 1;
+	join->group_use[join->group[i]] -= 1;
+	if( join->use[i] == 0 ) {
+		g_queue_push_head( join->idle, GINT_TO_POINTER( i ) );
+		join->idle_link[i] = join->idle->head;
+	}
+
+	g_mutex_unlock( join->lock );
+}
+
+/* Per-thread state. 
+ */
+typedef struct _VipsArrayjoinSequence {
+	VipsArrayjoin *join;
+
+	/* A region for each input, made on first use.
+	 */
+	VipsRegion **ir;
+
+	/* In lazy mode, the inputs we have regions on, most recently used 
+	 * first, and the link for each one.
+	 */
+	GQueue *lru;
+	GList **link;
+
+	/* The inputs touching the current request.
+	 */
+	int *touching;
+} VipsArrayjoinSequence;
+
 static int
-vips_arrayjoin_gen( VipsRegion *or, void *seq, 
+vips_arrayjoin_stop( void *vseq, void *a, void *b )
+{
+	VipsArrayjoinSequence *seq = (VipsArrayjoinSequence *) vseq;
+	VipsArrayjoin *join = seq->join;
+
+	int i;
+
+	if( seq->ir ) 
+		for( i = 0; i < join->n; i++ ) 
+			if( seq->ir[i] ) {
+				VIPS_UNREF( seq->ir[i] );
+				if( join->lazy )
+					vips_arrayjoin_release( join, i );
+			}
+
+	VIPS_FREE( seq->ir );
+	VIPS_FREE( seq->link );
+	VIPS_FREE( seq->touching );
+	VIPS_FREEF( g_queue_free, seq->lru );
+	VIPS_FREE( seq );
+
+	return( 0 );
+}
+
+static void *
+vips_arrayjoin_start( VipsImage *out, void *a, void *b )
+{
+	VipsArrayjoin *join = (VipsArrayjoin *) b;
+
+	VipsArrayjoinSequence *seq;
+
+	if( !(seq = VIPS_NEW( NULL, VipsArrayjoinSequence )) )
+		return( NULL );
+
+	seq->join = join;
+	seq->ir = g_new0( VipsRegion *, join->n );
+	seq->touching = g_new( int, join->n );
+	seq->lru = NULL;
+	seq->link = NULL;
+	if( join->lazy ) {
+		seq->lru = g_queue_new();
+		seq->link = g_new0( GList *, join->n );
+	}
+
+	return( seq );
+}
+
+/* Get the region for input i, making it if necessary.
+ */
+static VipsRegion *
+vips_arrayjoin_get_region( VipsArrayjoinSequence *seq, int i )
+{
+	VipsArrayjoin *join = seq->join;
+
+	if( !seq->ir[i] ) {
+		if( join->lazy )
+			vips_arrayjoin_acquire( join, i );
+
+		if( !(seq->ir[i] = vips_region_new( join->size[i] )) ) {
+			if( join->lazy )
+				vips_arrayjoin_release( join, i );
+			return( NULL );
+		}
+
+		if( join->lazy ) {
+			g_queue_push_head( seq->lru, GINT_TO_POINTER( i ) );
+			seq->link[i] = seq->lru->head;
+		}
+	}
+	else if( join->lazy ) {
+		g_queue_unlink( seq->lru, seq->link[i] );
+		g_queue_push_head_link( seq->lru, seq->link[i] );
+	}
+
+	return( seq->ir[i] );
+}
+
+/* In lazy mode, free the regions this thread has used least recently. We 
+ * keep enough for a row of inputs, since we are usually asked for strips.
+ */
+static void
+vips_arrayjoin_trim( VipsArrayjoinSequence *seq )
+{
+	VipsArrayjoin *join = seq->join;
+
+	while( g_queue_get_length( seq->lru ) > join->across ) {
+		GList *link = g_queue_pop_tail_link( seq->lru );
+		int i = GPOINTER_TO_INT( link->data );
+
+		g_list_free_1( link );
+		seq->link[i] = NULL;
+		VIPS_UNREF( seq->ir[i] );
+		vips_arrayjoin_release( join, i );
+	}
+}
+
+/* Find the inputs which might touch r. Inputs sit on a regular grid, 
+ * except that the final image is stretched to the right edge, so we can
+ * work them out from the position of r. 
+ */
+static int
+vips_arrayjoin_find( VipsArrayjoin *join, VipsRect *r, int *touching )
+{
+	int pitch_x = join->hspacing + join->shim;
+	int pitch_y = join->vspacing + join->shim;
+	int x0 = r->left / pitch_x;
+	int x1 = VIPS_MIN( join->across - 1, 
+		(VIPS_RECT_RIGHT( r ) - 1) / pitch_x );
+	int y0 = r->top / pitch_y;
+	int y1 = VIPS_MIN( join->down - 1, 
+		(VIPS_RECT_BOTTOM( r ) - 1) / pitch_y );
+
+	int n_touching;
+	int x, y;
+
+	n_touching = 0;
+	for( y = y0; y <= y1; y++ ) 
+		for( x = x0; x <= x1; x++ ) {
+			int i = y * join->across + x;
+
+			if( i >= join->n - 1 ) {
+				touching[n_touching++] = join->n - 1;
+				break;
+			}
+
+			touching[n_touching++] = i;
+		}
+
+	return( n_touching );
+}
+
+static int
+vips_arrayjoin_gen( VipsRegion *or, void *vseq, 
 	void *a, void *b, gboolean *stop )
 {
-	VipsRegion **ir = (VipsRegion **) seq;
+	VipsArrayjoinSequence *seq = (VipsArrayjoinSequence *) vseq;
 	VipsArrayjoin *join = (VipsArrayjoin *) b;
 	VipsRect *r = &or->valid;
-	int n = VIPS_AREA( join->in )->n;
 
+	int *touching = seq->touching;
+
+	int n_touching;
 	int i;
+	int result;
+
+	n_touching = vips_arrayjoin_find( join, r, touching );
 
 	/* Does this rect fit within one of our inputs? If it does, we
 	 * can pass just the request on.
+	 *
+	 * In lazy mode we may free the input region before our output is 
+	 * done with, so we must copy.
 	 */
-	for( i = 0; i < n; i++ ) 
-		if( vips_rect_includesrect( &join->rects[i], r ) ) 
-			return( vips__insert_just_one( or, ir[i],
-				join->rects[i].left, join->rects[i].top ) ); 
+	if( !join->lazy &&
+		n_touching == 1 &&
+		vips_rect_includesrect( &join->rects[touching[0]], r ) ) {
+		VipsRegion *ir;
+
+		if( !(ir = vips_arrayjoin_get_region( seq, touching[0] )) )
+			return( -1 );
+
+		return( vips__insert_just_one( or, ir,
+			join->rects[touching[0]].left, 
+			join->rects[touching[0]].top ) ); 
+	}
 
 	/* Output requires more than one input. Paste all touching inputs into
 	 * the output.
 	 */
-	for( i = 0; i < n; i++ ) 
-		if( vips__insert_paste_region( or, ir[i], &join->rects[i] ) )
-			return( -1 );
+	result = 0;
+	for( i = 0; i < n_touching; i++ ) {
+		VipsRegion *ir;
+
+		if( !(ir = vips_arrayjoin_get_region( seq, touching[i] )) ||
+			vips__insert_paste_region( or, ir, 
+				&join->rects[touching[i]] ) ) {
+			result = -1;
+			break;
+		}
+	}
 
-	return( 0 );
+	if( join->lazy )
+		vips_arrayjoin_trim( seq );
+
+	return( result );
+}
+
+/* Find the group an input is in.
+ */
+static int
+vips_arrayjoin_group_find( VipsArrayjoin *join, int i )
+{
+	while( join->group[i] != i )
+		i = join->group[i];
+
+	return( i );
+}
+
+/* State while we group inputs: every image we've seen upstream of an input,
+ * and the input we are walking now.
+ */
+typedef struct _VipsArrayjoinGroup {
+	GHashTable *upstream;
+	int i;
+} VipsArrayjoinGroup;
+
+/* Look at an image upstream of an input. If another input has already 
+ * reached it, merge their groups.
+ */
+static void *
+vips_arrayjoin_group_link( VipsImage *image, void *a, void *b )
+{
+	VipsArrayjoin *join = (VipsArrayjoin *) a;
+	VipsArrayjoinGroup *group = (VipsArrayjoinGroup *) b;
+
+	int j;
+
+	/* Indexes are stored +1, so NULL means not found. 
+	 */
+	if( (j = GPOINTER_TO_INT( 
+		g_hash_table_lookup( group->upstream, image ) )) ) 
+		join->group[vips_arrayjoin_group_find( join, group->i )] = 
+			vips_arrayjoin_group_find( join, j - 1 );
+	else
+		g_hash_table_insert( group->upstream, 
+			image, GINT_TO_POINTER( group->i + 1 ) );
+
+	return( NULL );
+}
+
+/* Put inputs which share an upstream image into the same group.
+ */
+static void
+vips_arrayjoin_group_build( VipsArrayjoin *join, VipsImage **size, int n )
+{
+	VipsArrayjoinGroup group;
+	int i;
+
+	join->group = VIPS_ARRAY( join, n, int ); 
+	join->group_use = VIPS_ARRAY( join, n, int ); 
+	for( i = 0; i < n; i++ ) {
+		join->group[i] = i;
+		join->group_use[i] = 0;
+	}
+
+	group.upstream = g_hash_table_new( g_direct_hash, g_direct_equal );
+	for( i = 0; i < n; i++ ) {
+		group.i = i;
+		vips__link_map( size[i], TRUE, 
+			(VipsSListMap2Fn) vips_arrayjoin_group_link, 
+			join, &group );
+	}
+	g_hash_table_destroy( group.upstream );
+
+	for( i = 0; i < n; i++ ) 
+		join->group[i] = vips_arrayjoin_group_find( join, i );
 }
 
 static int
@@ -130,6 +477,7 @@ vips_arrayjoin_build( VipsObject *object )
 	 */
 	if( n == 0 )
 		return( -1 ); 
+	join->n = n;
 
 	/* Move all input images to a common format and number of bands.
 	 */
@@ -267,6 +615,27 @@ vips_arrayjoin_build( VipsObject *object )
 			return( -1 );
 	}
 
+	join->size = size;
+
+	/* In lazy mode, inputs start closed and are opened when a thread
+	 * first needs them. We leave half the file budget for the operation
+	 * cache.
+	 */
+	if( join->lazy ) {
+		join->lock = vips_g_mutex_new();
+		join->use = VIPS_ARRAY( join, n, int ); 
+		memset( join->use, 0, n * sizeof( int ) );
+		join->idle = g_queue_new();
+		join->idle_link = VIPS_ARRAY( join, n, GList * ); 
+		memset( join->idle_link, 0, n * sizeof( GList * ) );
+		join->n_open = 0;
+		join->max_open = VIPS_MAX( 1, vips_cache_get_max_files() / 2 );
+		vips_arrayjoin_group_build( join, size, n );
+
+		for( i = 0; i < n; i++ ) 
+			vips_image_minimise_all( size[i] );
+	}
+
 	if( vips_image_pipeline_array( conversion->out, 
 		VIPS_DEMAND_STYLE_THINSTRIP, size ) )
 		return( -1 );
@@ -275,7 +644,7 @@ vips_arrayjoin_build( VipsObject *object )
 	conversion->out->Ysize = output_height;
 
 	if( vips_image_generate( conversion->out,
-		vips_start_many, vips_arrayjoin_gen, vips_stop_many, 
+		vips_arrayjoin_start, vips_arrayjoin_gen, vips_arrayjoin_stop, 
 		size, join ) )
 		return( -1 );
 
@@ -291,6 +660,7 @@ vips_arrayjoin_class_init( VipsArrayjoinClass *class )
 
 	VIPS_DEBUG_MSG( "vips_arrayjoin_class_init\n" );
 
+	gobject_class->finalize = vips_arrayjoin_finalize;
 	gobject_class->set_property = vips_object_set_property;
 	gobject_class->get_property = vips_object_get_property;
 
@@ -356,6 +726,13 @@ vips_arrayjoin_class_init( VipsArrayjoinClass *class )
 		G_STRUCT_OFFSET( VipsArrayjoin, vspacing ),
 		1, 1000000, 1 );
 
+	VIPS_ARG_BOOL( class, "lazy", 11, 
+		_( "Lazy" ), 
+		_( "Only keep inputs open while they are being read" ),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET( VipsArrayjoin, lazy ),
+		FALSE );
+
 }
 
 static void
@@ -397,6 +774,7 @@ vips_arrayjoinv( VipsImage **in, VipsImage **out, int n, va_list ap )
  * * @valign: #VipsAlign, low, centre or high alignment
  * * @hspacing: %gint, horizontal distance between images
  * * @vspacing: %gint, vertical distance between images
+ * * @lazy: %gboolean, only keep inputs open while they are being read
  *
  * Lay out the images in @in in a grid. The grid is @across images across and
  * however high is necessary to use up all of @in. Images are set down
@@ -415,6 +793,16 @@ vips_arrayjoinv( VipsImage **in, VipsImage **out, int n, va_list ap )
  *
  * Boxes are joined and separated by @shim pixels. This defaults to 0.
  *
+ * Set @lazy to join very large numbers of images, for example a grid of
+ * thousands of microscope fields. Each input is closed (see 
+ * vips_image_minimise_all()) until a thread needs pixels from it, threads 
+ * free the regions they have used least recently, and idle inputs are 
+ * closed again, oldest first, to keep the number open to about half of 
+ * vips_cache_get_max_files(). Closing an input closes everything upstream 
+ * of it, so inputs which share an upstream image, for example crops of one
+ * file, are only closed when none of them are being read. Lazy mode works 
+ * best with independent inputs.
+ *
  * If the number of bands in the input images differs, all but one of the 
  * images must have one band. In this case, an n-band image is formed from the 
  * one-band image by joining n copies of the one-band image together, and then
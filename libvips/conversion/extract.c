@@ -37,6 +37,8 @@
  * 	- gtkdoc
  * 26/10/11
  * 	- redone as a class
+ * 18/10/20
+ * 	- hint the area we need to the loader, if we are reading from one
  */
 
 /*
@@ -139,6 +141,8 @@ vips_extract_area_build( VipsObject *object )
 	VipsConversion *conversion = VIPS_CONVERSION( object );
 	VipsExtractArea *extract = (VipsExtractArea *) object;
 
+	VipsRect area;
+
 	if( VIPS_OBJECT_CLASS( vips_extract_area_parent_class )->
 		build( object ) )
 		return( -1 );
@@ -159,6 +163,16 @@ vips_extract_area_build( VipsObject *object )
 		VIPS_DEMAND_STYLE_THINSTRIP, extract->in, NULL ) )
 		return( -1 );
 
+	/* If we're reading directly from a loader, it may be able to skip
+	 * decoding the parts we don't need.
+	 */
+	area.left = extract->left;
+	area.top = extract->top;
+	area.width = extract->width;
+	area.height = extract->height;
+	if( vips__foreign_load_hint_roi( extract->in, conversion->out, &area ) )
+		return( -1 );
+
         conversion->out->Xsize = extract->width;
         conversion->out->Ysize = extract->height;
         conversion->out->Xoffset = -extract->left;
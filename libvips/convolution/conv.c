@@ -92,6 +92,7 @@ vips_conv_build( VipsObject *object )
 
 	switch( conv->precision ) { 
 	case VIPS_PRECISION_FLOAT:
+	case VIPS_PRECISION_RECURSIVE:
 		if( vips_convf( in, &t[1], convolution->M, NULL ) ||
 			vips_image_write( t[1], convolution->out ) )
 			return( -1 ); 
@@ -207,6 +208,9 @@ vips_conv_init( VipsConv *conv )
  * Disable the vector path with `--vips-novector` or `VIPS_NOVECTOR` or
  * vips_vector_set_enabled().
  *
+ * #VIPS_PRECISION_RECURSIVE is treated as #VIPS_PRECISION_FLOAT, since 
+ * there's no recursive filter for a general mask. 
+ *
  * If @precision is #VIPS_PRECISION_APPROXIMATE then, like
  * #VIPS_PRECISION_INTEGER, @mask is converted to int before convolution, and 
  * the output image 
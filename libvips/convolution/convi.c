@@ -78,6 +78,10 @@
  * 	- fix leak of vectors, thanks MHeimbuc 
  * 14/10/17
  * 	- switch to half-float for vector path
+ * 18/10/20
+ * 	- C path accumulates a line at a time per mask element, with 
+ * 	  runtime-dispatched clones for AVX2 / AVX-512, so int formats 
+ * 	  vectorise without orc
  */
 
 /*
@@ -120,6 +124,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <limits.h>
 
 #include <vips/vips.h>
@@ -197,6 +202,10 @@ typedef struct {
 	 */
 	short *t1;
 	short *t2;
+
+	/* A line of int accumulators for the C path.
+	 */
+	int *acc;
 } VipsConviSequence;
 
 static void
@@ -237,6 +246,7 @@ vips_convi_stop( void *vseq, void *a, void *b )
 	VIPS_FREE( seq->offsets );
 	VIPS_FREE( seq->t1 );
 	VIPS_FREE( seq->t2 );
+	VIPS_FREE( seq->acc );
 
 	return( 0 );
 }
@@ -259,13 +269,18 @@ vips_convi_start( VipsImage *out, void *a, void *b )
 	seq->last_bpl = -1;
 	seq->t1 = NULL;
 	seq->t2 = NULL;
+	seq->acc = NULL;
 
 	seq->ir = vips_region_new( in );
 
 	/* C mode.
 	 */
 	if( convi->nnz ) {
-		if( !(seq->offsets = VIPS_ARRAY( NULL, convi->nnz, int )) ) { 
+		seq->offsets = VIPS_ARRAY( NULL, convi->nnz, int );
+		seq->acc = VIPS_ARRAY( NULL, VIPS_IMAGE_N_ELEMENTS( in ), int );
+
+		if( !seq->offsets ||
+			!seq->acc ) { 
 			vips_convi_stop( seq, in, convi );
 			return( NULL );
 		}
@@ -588,27 +603,51 @@ vips_convi_gen_vector( VipsRegion *or,
 	return( 0 );
 }
 
-/* INT inner loops.
+/* Add a line of pixels times a mask element to a line of accumulators. 
+ *
+ * These are simple enough for the compiler to vectorise. Where we can, make 
+ * clones for wider vector units and pick one at runtime from the CPU
+ * features.
+ */
+#define ACC_INT( NAME, TYPE ) \
+static void VIPS_TARGET_CLONES \
+vips_convi_acc_ ## NAME( int * restrict acc, \
+	TYPE * restrict p, int c, int n ) \
+{ \
+	int x; \
+	\
+	for( x = 0; x < n; x++ ) \
+		acc[x] += c * p[x]; \
+}
+
+ACC_INT( uchar, unsigned char )
+ACC_INT( char, signed char )
+ACC_INT( ushort, unsigned short )
+ACC_INT( short, signed short )
+ACC_INT( uint, unsigned int )
+ACC_INT( int, signed int )
+
+/* INT inner loops. Integer add wraps, so summing a line at a time per mask 
+ * element gives exactly the same result as summing a pixel at a time.
  */
-#define CONV_INT( TYPE, CLIP ) { \
+#define CONV_INT( NAME, TYPE, CLIP ) { \
 	TYPE * restrict p = (TYPE *) VIPS_REGION_ADDR( ir, le, y ); \
 	TYPE * restrict q = (TYPE *) VIPS_REGION_ADDR( or, le, y ); \
 	int * restrict offsets = seq->offsets; \
+	int * restrict acc = seq->acc; \
+	\
+	memset( acc, 0, sz * sizeof( int ) ); \
+	for( i = 0; i < nnz; i++ ) \
+		vips_convi_acc_ ## NAME( acc, p + offsets[i], t[i], sz ); \
 	\
 	for( x = 0; x < sz; x++ ) {  \
 		int sum; \
-		int i; \
-		\
-		sum = 0; \
-		for ( i = 0; i < nnz; i++ ) \
-			sum += t[i] * p[offsets[i]]; \
 		\
-		sum = ((sum + rounding) / scale) + offset; \
+		sum = ((acc[x] + rounding) / scale) + offset; \
 		\
 		CLIP; \
 		\
 		q[x] = sum;  \
-		p += 1; \
 	}  \
 } 
 
@@ -729,27 +768,27 @@ vips_convi_gen( VipsRegion *or,
 	for( y = to; y < bo; y++ ) { 
 		switch( in->BandFmt ) {
 		case VIPS_FORMAT_UCHAR: 	
-			CONV_INT( unsigned char, CLIP_UCHAR( sum ) ); 
+			CONV_INT( uchar, unsigned char, CLIP_UCHAR( sum ) ); 
 			break;
 
 		case VIPS_FORMAT_CHAR:   
-			CONV_INT( signed char, CLIP_CHAR( sum ) ); 
+			CONV_INT( char, signed char, CLIP_CHAR( sum ) ); 
 			break;
 
 		case VIPS_FORMAT_USHORT: 
-			CONV_INT( unsigned short, CLIP_USHORT( sum ) ); 
+			CONV_INT( ushort, unsigned short, CLIP_USHORT( sum ) ); 
 			break;
 
 		case VIPS_FORMAT_SHORT:  
-			CONV_INT( signed short, CLIP_SHORT( sum ) ); 
+			CONV_INT( short, signed short, CLIP_SHORT( sum ) ); 
 			break;
 
 		case VIPS_FORMAT_UINT:   
-			CONV_INT( unsigned int, CLIP_NONE( sum ) ); 
+			CONV_INT( uint, unsigned int, CLIP_NONE( sum ) ); 
 			break;
 
 		case VIPS_FORMAT_INT:    
-			CONV_INT( signed int, CLIP_NONE( sum ) ); 
+			CONV_INT( int, signed int, CLIP_NONE( sum ) ); 
 			break;
 
 		case VIPS_FORMAT_FLOAT:  
@@ -67,6 +67,8 @@
  * @VIPS_PRECISION_INTEGER: int everywhere
  * @VIPS_PRECISION_FLOAT: float everywhere
  * @VIPS_PRECISION_APPROXIMATE: approximate integer output
+ * @VIPS_PRECISION_RECURSIVE: recursive filter with float output, where 
+ * supported, float everywhere otherwise
  *
  * How accurate an operation should be. 
  */
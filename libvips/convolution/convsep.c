@@ -5,6 +5,10 @@
  * 8/5/17
  *      - default to float ... int will often lose precision and should not be
  *        the default
+ * 18/10/20
+ * 	- fuse the two passes for horizontal masks: run the horizontal pass
+ * 	  into a small ring of rows and consume them immediately in the 
+ * 	  vertical pass, so the intermediate image is never made
  */
 
 /*
@@ -40,8 +44,11 @@
 #include <vips/intl.h>
 
 #include <stdio.h>
+#include <limits.h>
 
 #include <vips/vips.h>
+#include <vips/vector.h>
+#include <vips/internal.h>
 
 #include "pconvolution.h"
 
@@ -51,12 +58,487 @@ typedef struct {
 	VipsPrecision precision; 
 	int layers; 
 	int cluster; 
+
+	/* For the fused path: the mask as a 1D array, in int and double
+	 * forms, and the scale and offset for the horizontal pass. The 
+	 * vertical pass always has offset zero.
+	 */
+	int n;
+	int *icoeff;
+	double *coeff;
+	double scale;
+	double offset;
 } VipsConvsep;
 
 typedef VipsConvolutionClass VipsConvsepClass;
 
 G_DEFINE_TYPE( VipsConvsep, vips_convsep, VIPS_TYPE_CONVOLUTION );
 
+/* Our sequence value.
+ */
+typedef struct {
+	VipsRegion *ir;		/* Input region */
+
+	/* A ring of n lines of horizontal pass output, and the lines in
+	 * order for the vertical pass.
+	 */
+	VipsPel *ring;
+	size_t ring_line;
+	VipsPel **lines;
+} VipsConvsepSequence;
+
+static int
+vips_convsep_stop( void *vseq, void *a, void *b )
+{
+	VipsConvsepSequence *seq = (VipsConvsepSequence *) vseq;
+
+	VIPS_UNREF( seq->ir );
+	VIPS_FREE( seq->ring );
+	VIPS_FREE( seq->lines );
+
+	return( 0 );
+}
+
+static void *
+vips_convsep_start( VipsImage *out, void *a, void *b )
+{
+	VipsImage *in = (VipsImage *) a;
+	VipsConvsep *convsep = (VipsConvsep *) b;
+
+	VipsConvsepSequence *seq;
+
+	if( !(seq = VIPS_NEW( out, VipsConvsepSequence )) )
+		return( NULL );
+
+	seq->ir = vips_region_new( in );
+	seq->ring = NULL;
+	seq->ring_line = 0;
+	seq->lines = VIPS_ARRAY( NULL, convsep->n, VipsPel * );
+
+	if( !seq->ir ||
+		!seq->lines ) {
+		vips_convsep_stop( seq, in, convsep );
+		return( NULL );
+	}
+
+	return( seq );
+}
+
+/* Horizontal pass, int arithmetic, into line @row of the ring.
+ */
+#define HCONV_INT( TYPE, CLIP ) { \
+	TYPE * restrict p = (TYPE *) VIPS_REGION_ADDR( ir, r->left, to + y ); \
+	TYPE * restrict q = (TYPE *) row; \
+	\
+	for( x = 0; x < sz; x++ ) { \
+		int sum; \
+		\
+		sum = 0; \
+		for( i = 0; i < n; i++ ) \
+			sum += it[i] * p[i * ps]; \
+		\
+		sum = ((sum + rounding) / iscale) + ioffset; \
+		\
+		CLIP; \
+		\
+		q[x] = sum; \
+		p += 1; \
+	} \
+}
+
+/* Vertical pass, int arithmetic, from the ring to the output.
+ */
+#define VCONV_INT( TYPE, CLIP ) { \
+	TYPE * restrict q = (TYPE *) \
+		VIPS_REGION_ADDR( or, r->left, to + y - (n - 1) ); \
+	\
+	for( x = 0; x < sz; x++ ) { \
+		int sum; \
+		\
+		sum = 0; \
+		for( i = 0; i < n; i++ ) \
+			sum += it[i] * ((TYPE *) lines[i])[x]; \
+		\
+		sum = (sum + rounding) / iscale; \
+		\
+		CLIP; \
+		\
+		q[x] = sum; \
+	} \
+}
+
+/* Horizontal pass, float arithmetic.
+ */
+#define HCONV_FLOAT( ITYPE, OTYPE ) { \
+	ITYPE * restrict p = (ITYPE *) VIPS_REGION_ADDR( ir, r->left, to + y ); \
+	OTYPE * restrict q = (OTYPE *) row; \
+	\
+	for( x = 0; x < sz; x++ ) { \
+		double sum; \
+		\
+		sum = 0; \
+		for( i = 0; i < n; i++ ) \
+			sum += t[i] * p[i * ps]; \
+		\
+		q[x] = (sum / scale) + offset; \
+		p += 1; \
+	} \
+}
+
+/* Vertical pass, float arithmetic.
+ */
+#define VCONV_FLOAT( TYPE ) { \
+	TYPE * restrict q = (TYPE *) \
+		VIPS_REGION_ADDR( or, r->left, to + y - (n - 1) ); \
+	\
+	for( x = 0; x < sz; x++ ) { \
+		double sum; \
+		\
+		sum = 0; \
+		for( i = 0; i < n; i++ ) \
+			sum += t[i] * ((TYPE *) lines[i])[x]; \
+		\
+		q[x] = sum / scale; \
+	} \
+}
+
+/* Various integer range clips.
+ */
+#define CLIP_UCHAR( V ) \
+G_STMT_START { \
+	if( (V) < 0 ) \
+		(V) = 0; \
+	else if( (V) > UCHAR_MAX ) \
+		(V) = UCHAR_MAX; \
+} G_STMT_END
+
+#define CLIP_CHAR( V ) \
+G_STMT_START { \
+	if( (V) < SCHAR_MIN ) \
+		(V) = SCHAR_MIN; \
+	else if( (V) > SCHAR_MAX ) \
+		(V) = SCHAR_MAX; \
+} G_STMT_END
+
+#define CLIP_USHORT( V ) \
+G_STMT_START { \
+	if( (V) < 0 ) \
+		(V) = 0; \
+	else if( (V) > USHRT_MAX ) \
+		(V) = USHRT_MAX; \
+} G_STMT_END
+
+#define CLIP_SHORT( V ) \
+G_STMT_START { \
+	if( (V) < SHRT_MIN ) \
+		(V) = SHRT_MIN; \
+	else if( (V) > SHRT_MAX ) \
+		(V) = SHRT_MAX; \
+} G_STMT_END
+
+#define CLIP_NONE( V ) {}
+
+/* Run the horizontal pass for one line into the ring. 
+ */
+static void
+vips_convsep_hline( VipsConvsep *convsep, VipsRegion *ir, VipsRect *r, 
+	int y, VipsPel *row )
+{
+	VipsImage *in = ir->im;
+	const int n = convsep->n;
+	int * restrict it = convsep->icoeff;
+	double * restrict t = convsep->coeff;
+	double scale = convsep->scale;
+	double offset = convsep->offset;
+	int iscale = scale;
+	int ioffset = offset;
+	int rounding = iscale / 2;
+	int ps = in->Bands * 
+		(vips_band_format_iscomplex( in->BandFmt ) ? 2 : 1);
+	int sz = r->width * ps;
+	int to = r->top;
+
+	int x, i;
+
+	if( convsep->precision == VIPS_PRECISION_INTEGER ) 
+		switch( in->BandFmt ) {
+		case VIPS_FORMAT_UCHAR: 	
+			HCONV_INT( unsigned char, CLIP_UCHAR( sum ) ); 
+			return;
+
+		case VIPS_FORMAT_CHAR:   
+			HCONV_INT( signed char, CLIP_CHAR( sum ) ); 
+			return;
+
+		case VIPS_FORMAT_USHORT: 
+			HCONV_INT( unsigned short, CLIP_USHORT( sum ) ); 
+			return;
+
+		case VIPS_FORMAT_SHORT:  
+			HCONV_INT( signed short, CLIP_SHORT( sum ) ); 
+			return;
+
+		case VIPS_FORMAT_UINT:   
+			HCONV_INT( unsigned int, CLIP_NONE( sum ) ); 
+			return;
+
+		case VIPS_FORMAT_INT:    
+			HCONV_INT( signed int, CLIP_NONE( sum ) ); 
+			return;
+
+		default:
+			break;
+		}
+
+	switch( in->BandFmt ) {
+	case VIPS_FORMAT_UCHAR: 	
+		HCONV_FLOAT( unsigned char, float ); 
+		break;
+
+	case VIPS_FORMAT_CHAR:   
+		HCONV_FLOAT( signed char, float ); 
+		break;
+
+	case VIPS_FORMAT_USHORT: 
+		HCONV_FLOAT( unsigned short, float ); 
+		break;
+
+	case VIPS_FORMAT_SHORT:  
+		HCONV_FLOAT( signed short, float ); 
+		break;
+
+	case VIPS_FORMAT_UINT:   
+		HCONV_FLOAT( unsigned int, float ); 
+		break;
+
+	case VIPS_FORMAT_INT:    
+		HCONV_FLOAT( signed int, float ); 
+		break;
+
+	case VIPS_FORMAT_FLOAT:  
+	case VIPS_FORMAT_COMPLEX:  
+		HCONV_FLOAT( float, float ); 
+		break;
+
+	case VIPS_FORMAT_DOUBLE: 
+	case VIPS_FORMAT_DPCOMPLEX:  
+		HCONV_FLOAT( double, double ); 
+		break;
+
+	default:
+		g_assert_not_reached();
+	}
+}
+
+/* Run the vertical pass over the ring for one output line.
+ */
+static void
+vips_convsep_vline( VipsConvsep *convsep, VipsRegion *or, 
+	int y, VipsPel **lines )
+{
+	VipsImage *out = or->im;
+	VipsRect *r = &or->valid;
+	const int n = convsep->n;
+	int * restrict it = convsep->icoeff;
+	double * restrict t = convsep->coeff;
+	double scale = convsep->scale;
+	int iscale = scale;
+	int rounding = iscale / 2;
+	int sz = VIPS_REGION_N_ELEMENTS( or ) * 
+		(vips_band_format_iscomplex( out->BandFmt ) ? 2 : 1);
+	int to = r->top;
+
+	int x, i;
+
+	if( convsep->precision == VIPS_PRECISION_INTEGER ) 
+		switch( out->BandFmt ) {
+		case VIPS_FORMAT_UCHAR: 	
+			VCONV_INT( unsigned char, CLIP_UCHAR( sum ) ); 
+			return;
+
+		case VIPS_FORMAT_CHAR:   
+			VCONV_INT( signed char, CLIP_CHAR( sum ) ); 
+			return;
+
+		case VIPS_FORMAT_USHORT: 
+			VCONV_INT( unsigned short, CLIP_USHORT( sum ) ); 
+			return;
+
+		case VIPS_FORMAT_SHORT:  
+			VCONV_INT( signed short, CLIP_SHORT( sum ) ); 
+			return;
+
+		case VIPS_FORMAT_UINT:   
+			VCONV_INT( unsigned int, CLIP_NONE( sum ) ); 
+			return;
+
+		case VIPS_FORMAT_INT:    
+			VCONV_INT( signed int, CLIP_NONE( sum ) ); 
+			return;
+
+		default:
+			break;
+		}
+
+	switch( out->BandFmt ) {
+	case VIPS_FORMAT_FLOAT:  
+	case VIPS_FORMAT_COMPLEX:  
+		VCONV_FLOAT( float ); 
+		break;
+
+	case VIPS_FORMAT_DOUBLE: 
+	case VIPS_FORMAT_DPCOMPLEX:  
+		VCONV_FLOAT( double ); 
+		break;
+
+	default:
+		g_assert_not_reached();
+	}
+}
+
+/* Fused convolution. Each input line is run through the horizontal pass
+ * into a ring of n lines. As soon as we have n lines, we can make an 
+ * output line with the vertical pass.
+ */
+static int
+vips_convsep_gen( VipsRegion *or, void *vseq, void *a, void *b, gboolean *stop )
+{
+	VipsConvsepSequence *seq = (VipsConvsepSequence *) vseq;
+	VipsConvsep *convsep = (VipsConvsep *) b;
+	VipsRegion *ir = seq->ir;
+	VipsRect *r = &or->valid;
+	const int n = convsep->n;
+	size_t ring_line = VIPS_REGION_SIZEOF_LINE( or );
+
+	VipsRect s;
+	int y, i;
+
+	s = *r;
+	s.width += n - 1;
+	s.height += n - 1;
+	if( vips_region_prepare( ir, &s ) )
+		return( -1 );
+
+	if( ring_line > seq->ring_line ) {
+		VIPS_FREE( seq->ring );
+		if( !(seq->ring = VIPS_ARRAY( NULL, n * ring_line, VipsPel )) )
+			return( -1 );
+		seq->ring_line = ring_line;
+	}
+
+	VIPS_GATE_START( "vips_convsep_gen: work" ); 
+
+	for( y = 0; y < s.height; y++ ) {
+		vips_convsep_hline( convsep, ir, r, y, 
+			seq->ring + (y % n) * ring_line );
+
+		if( y >= n - 1 ) {
+			for( i = 0; i < n; i++ )
+				seq->lines[i] = seq->ring + 
+					((y - (n - 1) + i) % n) * ring_line;
+
+			vips_convsep_vline( convsep, or, y, seq->lines );
+		}
+	}
+
+	VIPS_GATE_STOP( "vips_convsep_gen: work" ); 
+
+	VIPS_COUNT_PIXELS( or, "vips_convsep_gen" ); 
+
+	return( 0 );
+}
+
+/* Can we use the fused path? We need a horizontal mask, since we rely on 
+ * the first pass being horizontal, and for int precision we only want it 
+ * if convi would not be using its vector path.
+ */
+static gboolean
+vips_convsep_can_fuse( VipsConvsep *convsep, VipsImage *in )
+{
+	VipsConvolution *convolution = (VipsConvolution *) convsep;
+
+	if( convolution->M->Ysize != 1 )
+		return( FALSE );
+
+	switch( convsep->precision ) {
+	case VIPS_PRECISION_FLOAT:
+	case VIPS_PRECISION_RECURSIVE:
+		return( TRUE );
+
+	case VIPS_PRECISION_INTEGER:
+		return( !(vips_vector_isenabled() &&
+			in->BandFmt == VIPS_FORMAT_UCHAR) );
+
+	default:
+		return( FALSE );
+	}
+}
+
+static int
+vips_convsep_fused( VipsConvsep *convsep, VipsImage *in, VipsImage **out )
+{
+	VipsObject *object = (VipsObject *) convsep;
+	VipsConvolution *convolution = (VipsConvolution *) convsep;
+	VipsImage **t = (VipsImage **) vips_object_local_array( object, 2 );
+
+	VipsImage *M;
+	int i;
+
+	M = convolution->M;
+	if( convsep->precision == VIPS_PRECISION_INTEGER ) {
+		/* The same int mask that convi would make.
+		 */
+		if( vips__image_intize( M, &t[0] ) )
+			return( -1 ); 
+		M = t[0];
+
+		convsep->scale = VIPS_RINT( vips_image_get_scale( M ) ); 
+		convsep->offset = VIPS_RINT( vips_image_get_offset( M ) ); 
+	}
+	else {
+		convsep->scale = vips_image_get_scale( M ); 
+		convsep->offset = vips_image_get_offset( M ); 
+	}
+
+	convsep->n = M->Xsize;
+	if( !(convsep->coeff = VIPS_ARRAY( object, convsep->n, double )) ||
+		!(convsep->icoeff = VIPS_ARRAY( object, convsep->n, int )) )
+		return( -1 );
+	for( i = 0; i < convsep->n; i++ ) {
+		convsep->coeff[i] = *VIPS_MATRIX( M, i, 0 );
+		convsep->icoeff[i] = convsep->coeff[i];
+	}
+
+	if( vips_embed( in, &t[1], 
+		convsep->n / 2, convsep->n / 2, 
+		in->Xsize + convsep->n - 1, in->Ysize + convsep->n - 1,
+		"extend", VIPS_EXTEND_COPY,
+		NULL ) )
+		return( -1 );
+	in = t[1]; 
+
+	*out = vips_image_new();
+	if( vips_image_pipelinev( *out, 
+		VIPS_DEMAND_STYLE_SMALLTILE, in, NULL ) )
+		return( -1 );
+
+	if( convsep->precision != VIPS_PRECISION_INTEGER &&
+		vips_band_format_isint( in->BandFmt ) ) 
+		(*out)->BandFmt = VIPS_FORMAT_FLOAT;
+	(*out)->Xsize -= convsep->n - 1;
+	(*out)->Ysize -= convsep->n - 1;
+
+	if( vips_image_generate( *out, 
+		vips_convsep_start, vips_convsep_gen, vips_convsep_stop, 
+		in, convsep ) )
+		return( -1 );
+
+	(*out)->Xoffset = -convsep->n / 2;
+	(*out)->Yoffset = -convsep->n / 2;
+
+	return( 0 );
+}
+
 static int
 vips_convsep_build( VipsObject *object )
 {
@@ -64,7 +546,7 @@ vips_convsep_build( VipsObject *object )
 	VipsConvolution *convolution = (VipsConvolution *) object;
 	VipsConvsep *convsep = (VipsConvsep *) object;
 	VipsImage **t = (VipsImage **) 
-		vips_object_local_array( object, 4 );
+		vips_object_local_array( object, 5 );
 
 	VipsImage *in;
 
@@ -85,6 +567,14 @@ vips_convsep_build( VipsObject *object )
 			return( -1 ); 
 		in = t[0];
 	}
+	else if( vips_convsep_can_fuse( convsep, in ) ) {
+		/* Unpack for processing, as vips_conv() does.
+		 */
+		if( vips_image_decode( in, &t[4] ) ||
+			vips_convsep_fused( convsep, t[4], &t[1] ) )
+			return( -1 ); 
+		in = t[1];
+	}
 	else { 
 		/* Take a copy, since we must set the offset.
 		 */
@@ -179,6 +669,11 @@ vips_convsep_init( VipsConvsep *convsep )
  * rotated by 90 degrees. This is much faster for certain types of mask
  * (gaussian blur, for example) than doing a full 2D convolution.
  *
+ * For 1xn masks, the two passes are usually run together, so the
+ * intermediate image is never made. The exception is
+ * #VIPS_PRECISION_INTEGER on #VIPS_FORMAT_UCHAR images, where the vector 
+ * path in vips_conv() is faster. 
+ *
  * See also: vips_conv(), vips_gaussmat().
  *
  * Returns: 0 on success, -1 on error
@@ -4,6 +4,9 @@
  * 	- from vips_sharpen()
  * 19/11/14
  * 	- change parameters to be more imagemagick-like
+ * 18/10/20
+ * 	- add VIPS_PRECISION_RECURSIVE, a Young-van Vliet IIR gaussian whose
+ * 	  cost does not depend on sigma
  */
 
 /*
@@ -64,6 +67,370 @@ typedef VipsOperationClass VipsGaussblurClass;
 
 G_DEFINE_TYPE( VipsGaussblur, vips_gaussblur, VIPS_TYPE_OPERATION );
 
+/* The recursive filter. 
+ *
+ * Young, I. T. and van Vliet, L. J., "Recursive implementation of the 
+ * Gaussian filter", Signal Processing 44 (1995) 139-151.
+ *
+ * A third-order causal pass followed by a third-order anti-causal pass, 
+ * once horizontally and once vertically. Each output pixel costs the same 
+ * however large sigma is. 
+ *
+ * To make this work with tiles, each pass reads a margin of pixels either 
+ * side of the area it is computing and runs the filter over that too, so 
+ * the filter state has settled by the time we reach pixels we output. The 
+ * impulse response is very close to a gaussian, so a margin of a few sigma 
+ * is enough.
+ */
+typedef struct _VipsGaussrec {
+	/* Filter coefficients, b[0] normalised out.
+	 */
+	double B;
+	double b1;
+	double b2;
+	double b3;
+
+	/* Number of pixels we run the filter over either side of an output
+	 * area.
+	 */
+	int margin;
+} VipsGaussrec;
+
+typedef struct {
+	VipsRegion *ir;
+
+	/* Filter workspace, three extra elements at each end for the
+	 * boundary conditions.
+	 */
+	double *buf;
+	int buf_size;
+} VipsGaussrecSeq;
+
+/* Don't use the recursive path below this sigma, the coefficient 
+ * approximation breaks down.
+ */
+#define VIPS_GAUSSREC_MIN_SIGMA (0.5)
+
+static void
+vips_gaussrec_init( VipsGaussrec *rec, double sigma )
+{
+	double q, q2, q3;
+	double b0;
+
+	if( sigma >= 2.5 )
+		q = 0.98711 * sigma - 0.96330;
+	else
+		q = 3.97156 - 4.14554 * sqrt( 1.0 - 0.26891 * sigma );
+	q2 = q * q;
+	q3 = q2 * q;
+
+	b0 = 1.57825 + 2.44413 * q + 1.4281 * q2 + 0.422205 * q3;
+	rec->b1 = (2.44413 * q + 2.85619 * q2 + 1.26661 * q3) / b0;
+	rec->b2 = -(1.4281 * q2 + 1.26661 * q3) / b0;
+	rec->b3 = 0.422205 * q3 / b0;
+	rec->B = 1.0 - (rec->b1 + rec->b2 + rec->b3);
+
+	/* 4 sigma is where a gaussian falls to 0.0003, plus a few pixels for
+	 * the filter order.
+	 */
+	rec->margin = VIPS_CEIL( 4 * sigma ) + 3;
+}
+
+static int
+vips_gaussrec_stop( void *vseq, void *a, void *b )
+{
+	VipsGaussrecSeq *seq = (VipsGaussrecSeq *) vseq;
+
+	VIPS_UNREF( seq->ir );
+	VIPS_FREE( seq->buf );
+
+	return( 0 );
+}
+
+static void *
+vips_gaussrec_start( VipsImage *out, void *a, void *b )
+{
+	VipsImage *in = (VipsImage *) a;
+
+	VipsGaussrecSeq *seq;
+
+	if( !(seq = VIPS_NEW( out, VipsGaussrecSeq )) )
+		return( NULL );
+
+	seq->ir = vips_region_new( in );
+	seq->buf = NULL;
+	seq->buf_size = 0;
+
+	return( seq );
+}
+
+/* Make sure the workspace can hold at least @n doubles.
+ */
+static int
+vips_gaussrec_buf( VipsGaussrecSeq *seq, int n )
+{
+	if( n > seq->buf_size ) {
+		VIPS_FREE( seq->buf );
+		if( !(seq->buf = VIPS_ARRAY( NULL, n, double )) )
+			return( -1 );
+		seq->buf_size = n;
+	}
+
+	return( 0 );
+}
+
+/* Filter one line of pixels. @w is the workspace, with three spare elements
+ * at each end. @n pixels of @p are filtered, and the @m to @m + @n_out of 
+ * them are written to @q. @p and @q are stepped by @stride.
+ */
+#define HLINE( TYPE ) { \
+	TYPE * restrict p = (TYPE *) VIPS_REGION_ADDR( ir, s.left, y ); \
+	TYPE * restrict q = (TYPE *) VIPS_REGION_ADDR( or, r->left, y ); \
+	\
+	for( b = 0; b < bands; b++ ) { \
+		w[0] = w[1] = w[2] = p[b]; \
+		for( i = 0; i < n; i++ ) \
+			w[i + 3] = rec->B * p[i * bands + b] + \
+				rec->b1 * w[i + 2] + \
+				rec->b2 * w[i + 1] + \
+				rec->b3 * w[i]; \
+		\
+		w[n + 3] = w[n + 4] = w[n + 5] = w[n + 2]; \
+		for( i = n - 1; i >= 0; i-- ) \
+			w[i + 3] = rec->B * w[i + 3] + \
+				rec->b1 * w[i + 4] + \
+				rec->b2 * w[i + 5] + \
+				rec->b3 * w[i + 6]; \
+		\
+		for( i = 0; i < r->width; i++ ) \
+			q[i * bands + b] = w[i + rec->margin + 3]; \
+	} \
+}
+
+static int
+vips_gaussrec_generate_horizontal( VipsRegion *or, 
+	void *vseq, void *a, void *b_, gboolean *stop )
+{
+	VipsGaussrecSeq *seq = (VipsGaussrecSeq *) vseq;
+	VipsImage *in = (VipsImage *) a;
+	VipsGaussrec *rec = (VipsGaussrec *) b_;
+	VipsRegion *ir = seq->ir;
+	VipsRect *r = &or->valid;
+	int bands = in->Bands;
+
+	VipsRect s;
+	int n;
+	double *w;
+	int y, b, i;
+
+	s = *r;
+	s.width += 2 * rec->margin;
+	if( vips_region_prepare( ir, &s ) )
+		return( -1 );
+
+	n = s.width;
+	if( vips_gaussrec_buf( seq, n + 6 ) )
+		return( -1 );
+	w = seq->buf;
+
+	for( y = r->top; y < VIPS_RECT_BOTTOM( r ); y++ ) 
+		switch( in->BandFmt ) {
+		case VIPS_FORMAT_FLOAT:
+			HLINE( float );
+			break;
+
+		case VIPS_FORMAT_DOUBLE:
+			HLINE( double );
+			break;
+
+		default:
+			g_assert_not_reached();
+		}
+
+	return( 0 );
+}
+
+/* Filter a block of columns. We run down the rows, keeping a full line of
+ * filter state per row, so we always access memory in order.
+ */
+#define VBLOCK( TYPE ) { \
+	TYPE * restrict p; \
+	TYPE * restrict q; \
+	double * restrict w0; \
+	double * restrict w1; \
+	double * restrict w2; \
+	double * restrict w3; \
+	\
+	p = (TYPE *) VIPS_REGION_ADDR( ir, r->left, s.top ); \
+	for( i = 0; i < 3; i++ ) { \
+		w0 = w + i * ne; \
+		for( x = 0; x < ne; x++ ) \
+			w0[x] = p[x]; \
+	} \
+	\
+	for( y = 0; y < n; y++ ) { \
+		p = (TYPE *) VIPS_REGION_ADDR( ir, r->left, s.top + y ); \
+		w0 = w + (y + 3) * ne; \
+		w1 = w0 - ne; \
+		w2 = w1 - ne; \
+		w3 = w2 - ne; \
+		\
+		for( x = 0; x < ne; x++ ) \
+			w0[x] = rec->B * p[x] + \
+				rec->b1 * w1[x] + \
+				rec->b2 * w2[x] + \
+				rec->b3 * w3[x]; \
+	} \
+	\
+	w1 = w + (n + 2) * ne; \
+	for( i = 0; i < 3; i++ ) { \
+		w0 = w + (n + 3 + i) * ne; \
+		for( x = 0; x < ne; x++ ) \
+			w0[x] = w1[x]; \
+	} \
+	\
+	for( y = n - 1; y >= 0; y-- ) { \
+		w0 = w + (y + 3) * ne; \
+		w1 = w0 + ne; \
+		w2 = w1 + ne; \
+		w3 = w2 + ne; \
+		\
+		for( x = 0; x < ne; x++ ) \
+			w0[x] = rec->B * w0[x] + \
+				rec->b1 * w1[x] + \
+				rec->b2 * w2[x] + \
+				rec->b3 * w3[x]; \
+	} \
+	\
+	for( y = 0; y < r->height; y++ ) { \
+		q = (TYPE *) VIPS_REGION_ADDR( or, r->left, r->top + y ); \
+		w0 = w + (y + rec->margin + 3) * ne; \
+		\
+		for( x = 0; x < ne; x++ ) \
+			q[x] = w0[x]; \
+	} \
+}
+
+static int
+vips_gaussrec_generate_vertical( VipsRegion *or, 
+	void *vseq, void *a, void *b_, gboolean *stop )
+{
+	VipsGaussrecSeq *seq = (VipsGaussrecSeq *) vseq;
+	VipsImage *in = (VipsImage *) a;
+	VipsGaussrec *rec = (VipsGaussrec *) b_;
+	VipsRegion *ir = seq->ir;
+	VipsRect *r = &or->valid;
+	int ne = r->width * in->Bands;
+
+	VipsRect s;
+	int n;
+	double *w;
+	int x, y, i;
+
+	s = *r;
+	s.height += 2 * rec->margin;
+	if( vips_region_prepare( ir, &s ) )
+		return( -1 );
+
+	n = s.height;
+	if( vips_gaussrec_buf( seq, (n + 6) * ne ) )
+		return( -1 );
+	w = seq->buf;
+
+	switch( in->BandFmt ) {
+	case VIPS_FORMAT_FLOAT:
+		VBLOCK( float );
+		break;
+
+	case VIPS_FORMAT_DOUBLE:
+		VBLOCK( double );
+		break;
+
+	default:
+		g_assert_not_reached();
+	}
+
+	return( 0 );
+}
+
+static int
+vips_gaussrec_pass( VipsGaussrec *rec, 
+	VipsImage *in, VipsImage **out, VipsDirection direction )
+{
+	VipsGenerateFn gen;
+
+	*out = vips_image_new(); 
+	if( vips_image_pipelinev( *out, 
+		VIPS_DEMAND_STYLE_SMALLTILE, in, NULL ) )
+		return( -1 );
+
+	if( direction == VIPS_DIRECTION_HORIZONTAL ) { 
+		(*out)->Xsize -= 2 * rec->margin;
+		gen = vips_gaussrec_generate_horizontal;
+	}
+	else {
+		(*out)->Ysize -= 2 * rec->margin;
+		gen = vips_gaussrec_generate_vertical;
+	}
+
+	if( vips_image_generate( *out, 
+		vips_gaussrec_start, gen, vips_gaussrec_stop, in, rec ) )
+		return( -1 );
+
+	return( 0 );
+}
+
+/* Blur with the recursive filter. Output is float, or double for double 
+ * input, the same as vips_conv() with VIPS_PRECISION_FLOAT.
+ */
+static int
+vips_gaussblur_recursive( VipsGaussblur *gaussblur, VipsImage **out )
+{
+	VipsObject *object = VIPS_OBJECT( gaussblur );
+	VipsObjectClass *class = VIPS_OBJECT_GET_CLASS( gaussblur );
+	VipsImage **t = (VipsImage **) vips_object_local_array( object, 5 );
+
+	VipsGaussrec *rec;
+	VipsImage *in;
+
+	if( !(rec = VIPS_NEW( object, VipsGaussrec )) )
+		return( -1 );
+	vips_gaussrec_init( rec, gaussblur->sigma );
+
+	g_info( "gaussblur recursive margin %d", rec->margin );
+
+	in = gaussblur->in;
+
+	if( vips_image_decode( in, &t[0] ) )
+		return( -1 );
+	in = t[0];
+
+	if( vips_check_noncomplex( class->nickname, in ) )
+		return( -1 );
+
+	if( vips_cast( in, &t[1], in->BandFmt == VIPS_FORMAT_DOUBLE ?
+		VIPS_FORMAT_DOUBLE : VIPS_FORMAT_FLOAT, NULL ) ||
+		vips_embed( t[1], &t[2], 
+			rec->margin, rec->margin, 
+			in->Xsize + 2 * rec->margin, 
+			in->Ysize + 2 * rec->margin,
+			"extend", VIPS_EXTEND_COPY,
+			NULL ) ||
+		vips_gaussrec_pass( rec, 
+			t[2], &t[3], VIPS_DIRECTION_HORIZONTAL ) ||
+		vips_gaussrec_pass( rec, 
+			t[3], &t[4], VIPS_DIRECTION_VERTICAL ) )
+		return( -1 );
+
+	t[4]->Xoffset = 0;
+	t[4]->Yoffset = 0;
+
+	*out = t[4];
+	g_object_ref( *out );
+
+	return( 0 );
+}
+
 static int
 vips_gaussblur_build( VipsObject *object )
 {
@@ -73,9 +440,29 @@ vips_gaussblur_build( VipsObject *object )
 	if( VIPS_OBJECT_CLASS( vips_gaussblur_parent_class )->build( object ) )
 		return( -1 );
 
+	if( gaussblur->precision == VIPS_PRECISION_RECURSIVE &&
+		gaussblur->sigma >= VIPS_GAUSSREC_MIN_SIGMA ) {
+		if( vips_gaussblur_recursive( gaussblur, &t[1] ) )
+			return( -1 );
+
+		g_object_set( object, "out", vips_image_new(), NULL ); 
+
+		if( vips_image_write( t[1], gaussblur->out ) )
+			return( -1 );
+
+		vips_reorder_margin_hint( gaussblur->out, 
+			4 * gaussblur->sigma + 1 );
+
+		return( 0 );
+	}
+
+	/* Tiny sigma with the recursive filter falls back to float FIR.
+	 */
 	if( vips_gaussmat( &t[0], gaussblur->sigma, gaussblur->min_ampl, 
 		"separable", TRUE,
-		"precision", gaussblur->precision,
+		"precision", 
+			gaussblur->precision == VIPS_PRECISION_RECURSIVE ?
+				VIPS_PRECISION_FLOAT : gaussblur->precision,
 		NULL ) )
 		return( -1 ); 
 
@@ -87,7 +474,9 @@ vips_gaussblur_build( VipsObject *object )
 	g_info( "gaussblur mask width %d", t[0]->Xsize );
 
 	if( vips_convsep( gaussblur->in, &t[1], t[0], 
-		"precision", gaussblur->precision,
+		"precision", 
+			gaussblur->precision == VIPS_PRECISION_RECURSIVE ?
+				VIPS_PRECISION_FLOAT : gaussblur->precision,
 		NULL ) )
 		return( -1 );
 
@@ -174,6 +563,13 @@ vips_gaussblur_init( VipsGaussblur *gaussblur )
  * Set @min_ampl smaller to generate a larger, more accurate mask. Set @sigma
  * larger to make the blur more blurry. 
  *
+ * If @precision is #VIPS_PRECISION_RECURSIVE, a recursive (IIR) 
+ * approximation to a gaussian is used instead. Each output pixel then takes 
+ * the same time to compute however large @sigma is, so this is much faster 
+ * for large @sigma, at the cost of a small loss of accuracy. @min_ampl is 
+ * ignored, the output is #VIPS_FORMAT_FLOAT (#VIPS_FORMAT_DOUBLE for double 
+ * input), and @sigma below 0.5 falls back to #VIPS_PRECISION_FLOAT. 
+ *
  * See also: vips_gaussmat(), vips_convsep().
  * 
  * Returns: 0 on success, -1 on error.
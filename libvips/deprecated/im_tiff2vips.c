@@ -93,7 +93,8 @@ im_tiff_read( const char *filename, VipsImage *out,
 
 	if( !(source = vips_source_new_from_file( filename )) )
 		return( -1 );
-	if( vips__tiff_read_source( source, out, page, n, autorotate ) ) {
+	if( vips__tiff_read_source( source, out, 
+		page, n, autorotate, VIPS_ACCESS_RANDOM ) ) {
 		VIPS_UNREF( source );
 		return( -1 );
 	}
@@ -176,7 +176,8 @@ vips_foreign_save_csv_build( VipsObject *object )
 		vips_check_uncoded( class->nickname, save->ready ) )
 		return( -1 );
 
-	if( vips_sink_disc( save->ready, vips_foreign_save_csv_block, csv ) )
+	if( vips_sink_disc( save->ready, vips_foreign_save_csv_block, csv ) ||
+		vips_target_end( csv->target ) )
 		return( -1 );
 
 	return( 0 );
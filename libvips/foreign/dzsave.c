@@ -87,6 +87,8 @@
  * 	- add IIIF layout
  * 24/4/20 [IllyaMoskvin]
  * 	- better IIIF tile naming
+ * 18/10/20
+ * 	- shrink strips in parallel
  */
 
 /*
@@ -1761,7 +1763,7 @@ strip_shrink( Layer *layer )
 		if( vips_rect_isempty( &target ) )
 			break;
 
-		(void) vips_region_shrink_method( from, to, 
+		(void) vips__region_shrink_threaded( from, to, 
 			&target, region_shrink );
 
 		below->write_y += target.height;
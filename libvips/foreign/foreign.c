@@ -64,6 +64,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <vips/vips.h>
 #include <vips/internal.h>
@@ -305,6 +306,29 @@
  */
 static GQuark vips__foreign_load_operation = 0; 
 
+/* Set on images which have hinted a region of interest to the load 
+ * operation they read from.
+ */
+static GQuark vips__foreign_load_roi = 0; 
+
+/* Region of interest state, attached to the load operation. We keep this
+ * out of VipsForeignLoad so we don't change the public struct.
+ */
+static GQuark vips__foreign_load_roi_state = 0; 
+
+typedef struct _VipsForeignLoadRoi {
+	/* The union of the regions of interest hinted by operations 
+	 * downstream of @out, see vips__foreign_load_hint_roi(). 
+	 */
+	VipsRect roi;
+	gboolean set;
+
+	/* Set by the start function if every image downstream of @out gave 
+	 * a hint. Loaders can then skip pixels outside @roi.
+	 */
+	gboolean active;
+} VipsForeignLoadRoi;
+
 /**
  * VipsForeignFlags: 
  * @VIPS_FOREIGN_NONE: no flags set
@@ -895,6 +919,68 @@ vips_foreign_load_iscompat( VipsImage *a, VipsImage *b )
 	return( TRUE );
 }
 
+/* We can only let the loader skip pixels outside the region of interest if
+ * this is a sequential load (so it can't be shared via the operation cache), 
+ * and if every image reading from @out has told us what it needs. 
+ */
+static VipsForeignLoadRoi *
+vips_foreign_load_roi_get( VipsForeignLoad *load )
+{
+	return( (VipsForeignLoadRoi *) 
+		g_object_get_qdata( G_OBJECT( load ), 
+			vips__foreign_load_roi_state ) ); 
+}
+
+/* Get the roi state, making it if necessary.
+ */
+static VipsForeignLoadRoi *
+vips_foreign_load_roi_get_new( VipsForeignLoad *load )
+{
+	VipsForeignLoadRoi *state;
+
+	if( !(state = vips_foreign_load_roi_get( load )) ) {
+		state = g_new0( VipsForeignLoadRoi, 1 );
+		g_object_set_qdata_full( G_OBJECT( load ), 
+			vips__foreign_load_roi_state, state, 
+			(GDestroyNotify) g_free ); 
+	}
+
+	return( state );
+}
+
+/* Is the roi active, and does it exclude the line at @top.
+ */
+static gboolean
+vips_foreign_load_roi_excludes( VipsForeignLoad *load, int top )
+{
+	VipsForeignLoadRoi *state = vips_foreign_load_roi_get( load );
+
+	return( state &&
+		state->active &&
+		top < state->roi.top );
+}
+
+static gboolean
+vips_foreign_load_roi_usable( VipsForeignLoad *load )
+{
+	VipsForeignLoadRoi *state = vips_foreign_load_roi_get( load );
+
+	GSList *p;
+
+	if( !state ||
+		!state->set ||
+		!(load->flags & VIPS_FOREIGN_SEQUENTIAL) ||
+		load->access == VIPS_ACCESS_RANDOM )
+		return( FALSE );
+
+	for( p = load->out->downstream; p; p = p->next ) 
+		if( !g_object_get_qdata( G_OBJECT( p->data ), 
+			vips__foreign_load_roi ) )
+			return( FALSE );
+
+	return( TRUE );
+}
+
 /* Our start function ... do the lazy open, if necessary, and return a region
  * on the new image.
  */
@@ -913,6 +999,23 @@ vips_foreign_load_start( VipsImage *out, void *a, void *b )
 		if( !(load->real = vips_foreign_load_temp( load )) )
 			return( NULL );
 
+		/* Fix the region of interest before the loader starts 
+		 * reading.
+		 */
+		if( vips_foreign_load_roi_usable( load ) ) {
+			VipsForeignLoadRoi *state = 
+				vips_foreign_load_roi_get( load );
+
+			state->active = TRUE;
+
+#ifdef DEBUG
+			printf( "vips_foreign_load_start: roi "
+				"left = %d, top = %d, width = %d, height = %d\n",
+				state->roi.left, state->roi.top, 
+				state->roi.width, state->roi.height );
+#endif /*DEBUG*/
+		}
+
 #ifdef DEBUG
 		printf( "vips_foreign_load_start: triggering ->load()\n" );
 #endif /*DEBUG*/
@@ -969,9 +1072,23 @@ vips_foreign_load_generate( VipsRegion *or,
 	void *seq, void *a, void *b, gboolean *stop )
 {
 	VipsRegion *ir = (VipsRegion *) seq;
+	VipsForeignLoad *load = VIPS_FOREIGN_LOAD( b );
 
         VipsRect *r = &or->valid;
 
+	/* The loader may have skipped lines above the region of interest.
+	 * Something that did not give a hint must have started reading from
+	 * us.
+	 */
+	if( vips_foreign_load_roi_excludes( load, r->top ) ) {
+		VipsObjectClass *class = VIPS_OBJECT_GET_CLASS( load );
+
+		vips_error( class->nickname, 
+			_( "out of order read -- line %d is above the "
+			"region of interest" ), r->top );
+		return( -1 );
+	}
+
         /* Ask for input we need.
          */
         if( vips_region_prepare( ir, r ) )
@@ -1037,6 +1154,11 @@ vips_foreign_load_build( VipsObject *object )
 	vips_image_set_string( load->out, 
 		VIPS_META_LOADER, class->nickname );
 
+	/* So downstream can find us to hint a region of interest.
+	 */
+	g_object_set_qdata( G_OBJECT( load->out ), 
+		vips__foreign_load_operation, load ); 
+
 #ifdef DEBUG
 	printf( "vips_foreign_load_build: triggering ->header()\n" );
 #endif /*DEBUG*/
@@ -1207,6 +1329,582 @@ vips_foreign_load_invalidate( VipsImage *image )
 	}
 }
 
+/* Operations like vips_extract_area() call this on their input during
+ * build to tell the loader, if @in came directly from one, which part of the
+ * image @out will need. @out must already be attached downstream of @in.
+ *
+ * Hints are unioned and fixed when the first pixel is read. Sequential
+ * loaders can then skip lines above the region of interest without decoding
+ * them, as long as every image reading from the loader gave a hint.
+ */
+int
+vips__foreign_load_hint_roi( VipsImage *in, VipsImage *out, 
+	const VipsRect *roi )
+{
+	VipsForeignLoad *load;
+	VipsForeignLoadRoi *state;
+
+	if( !(load = g_object_get_qdata( G_OBJECT( in ), 
+		vips__foreign_load_operation )) ||
+		load->out != in ) 
+		return( 0 );
+
+	state = vips_foreign_load_roi_get_new( load );
+
+	if( load->real ) {
+		/* The read has started and the roi is fixed. We can still
+		 * serve this, unless it needs lines we may have skipped.
+		 */
+		if( state->active &&
+			roi->top < state->roi.top ) {
+			VipsObjectClass *class = VIPS_OBJECT_GET_CLASS( load );
+
+			vips_error( class->nickname, "%s", 
+				_( "region of interest changed after "
+					"read started" ) );
+			return( -1 );
+		}
+	}
+	else if( state->set ) 
+		vips_rect_unionrect( &state->roi, roi, &state->roi );
+	else {
+		state->roi = *roi;
+		state->set = TRUE;
+	}
+
+	g_object_set_qdata( G_OBJECT( out ), 
+		vips__foreign_load_roi, load ); 
+
+	return( 0 );
+}
+
+/* Loaders can call this on the image they are loading into (load->real) to
+ * find the region of interest, if one is active. 
+ */
+gboolean
+vips__foreign_load_get_roi( VipsImage *image, VipsRect *roi )
+{
+	VipsForeignLoad *load;
+	VipsForeignLoadRoi *state;
+
+	if( !(load = g_object_get_qdata( G_OBJECT( image ), 
+		vips__foreign_load_operation )) ||
+		load->real != image ||
+		!(state = vips_foreign_load_roi_get( load )) ||
+		!state->active )
+		return( FALSE );
+
+	*roi = state->roi;
+
+	return( TRUE );
+}
+
+/* Shrink-on-load for loaders which can only produce full-resolution rows
+ * (png, gif, tiff). Set the header of @image for a block shrink by @shrink. 
+ * Pages shrink independently, so page boundaries stay on output lines.
+ *
+ * Xres and Yres are left alone, like jpegload shrink-on-load.
+ */
+int
+vips__foreign_load_shrink_header( VipsImage *image, int shrink )
+{
+	int page_height;
+	int n_pages;
+
+	if( shrink <= 1 ||
+		image->Coding != VIPS_CODING_NONE )
+		return( 0 );
+
+	page_height = vips_image_get_page_height( image );
+	n_pages = image->Ysize / page_height;
+
+	if( image->Xsize / shrink <= 0 ||
+		page_height / shrink <= 0 ) {
+		vips_error( "VipsForeignLoad", 
+			"%s", _( "image has shrunk to nothing" ) );
+		return( -1 );
+	}
+
+	image->Xsize /= shrink;
+	image->Ysize = n_pages * (page_height / shrink);
+	if( vips_image_get_typeof( image, VIPS_META_PAGE_HEIGHT ) )
+		vips_image_set_int( image, 
+			VIPS_META_PAGE_HEIGHT, page_height / shrink );
+
+	return( 0 );
+}
+
+typedef struct _VipsForeignLoadShrink {
+	VipsImage *in;
+	int shrink;
+
+	/* Input and output page height. Output line y comes from page 
+	 * y / out_page_height.
+	 */
+	int in_page_height;
+	int out_page_height;
+
+	/* Weight by the final band.
+	 */
+	gboolean has_alpha;
+
+	/* Bytes we need to sum one output line.
+	 */
+	size_t sizeof_sum;
+} VipsForeignLoadShrink;
+
+typedef struct _VipsForeignLoadShrinkSequence {
+	VipsRegion *ir;
+
+	VipsPel *sum;
+} VipsForeignLoadShrinkSequence;
+
+static int
+vips_foreign_load_shrink_stop( void *vseq, void *a, void *b )
+{
+	VipsForeignLoadShrinkSequence *seq = 
+		(VipsForeignLoadShrinkSequence *) vseq;
+
+	VIPS_FREEF( g_object_unref, seq->ir );
+	VIPS_FREE( seq->sum );
+	VIPS_FREE( seq );
+
+	return( 0 );
+}
+
+static void *
+vips_foreign_load_shrink_start( VipsImage *out, void *a, void *b )
+{
+	VipsForeignLoadShrink *shrink = (VipsForeignLoadShrink *) a;
+
+	VipsForeignLoadShrinkSequence *seq;
+
+	if( !(seq = VIPS_NEW( NULL, VipsForeignLoadShrinkSequence )) )
+		return( NULL );
+
+	seq->ir = vips_region_new( shrink->in );
+	if( !(seq->sum = VIPS_ARRAY( NULL, shrink->sizeof_sum, VipsPel )) ) {
+		vips_foreign_load_shrink_stop( seq, a, b );
+		return( NULL );
+	}
+
+	return( (void *) seq );
+}
+
+/* Add a line of input to the sums. Each output pixel takes @s adjacent 
+ * input pixels.
+ */
+#define SHRINK_ADD( ACC_TYPE, TYPE ) { \
+	ACC_TYPE * restrict sum = (ACC_TYPE *) seq->sum; \
+	TYPE * restrict p = (TYPE *) in; \
+	\
+	for( x = 0; x < width; x++ ) { \
+		for( i = 0; i < s; i++ ) { \
+			for( k = 0; k < ne; k++ ) \
+				sum[k] += p[k]; \
+			p += ne; \
+		} \
+		sum += ne; \
+	} \
+}
+
+/* With an alpha, weight each pixel by its alpha, or transparent pixels will 
+ * bleed their colour into the edges of opaque areas.
+ */
+#define SHRINK_ADD_ALPHA( TYPE ) { \
+	double * restrict sum = (double *) seq->sum; \
+	TYPE * restrict p = (TYPE *) in; \
+	\
+	for( x = 0; x < width; x++ ) { \
+		for( i = 0; i < s; i++ ) { \
+			double alpha = p[ne - 1]; \
+			\
+			for( k = 0; k < ne - 1; k++ ) \
+				sum[k] += p[k] * alpha; \
+			sum[ne - 1] += alpha; \
+			p += ne; \
+		} \
+		sum += ne; \
+	} \
+}
+
+#define SHRINK_IAVG( ACC_TYPE, TYPE ) { \
+	ACC_TYPE * restrict sum = (ACC_TYPE *) seq->sum; \
+	TYPE * restrict q = (TYPE *) out; \
+	\
+	for( x = 0; x < sz; x++ ) \
+		q[x] = (sum[x] + n / 2) / n; \
+}
+
+#define SHRINK_FAVG( TYPE ) { \
+	double * restrict sum = (double *) seq->sum; \
+	TYPE * restrict q = (TYPE *) out; \
+	\
+	for( x = 0; x < sz; x++ ) \
+		q[x] = sum[x] / n; \
+}
+
+#define SHRINK_AVG_ALPHA( TYPE, ROUND ) { \
+	double * restrict sum = (double *) seq->sum; \
+	TYPE * restrict q = (TYPE *) out; \
+	\
+	for( x = 0; x < width; x++ ) { \
+		double alpha = sum[ne - 1]; \
+		\
+		for( k = 0; k < ne - 1; k++ ) \
+			q[k] = alpha == 0.0 ? 0 : ROUND( sum[k] / alpha ); \
+		q[ne - 1] = ROUND( alpha / n ); \
+		\
+		sum += ne; \
+		q += ne; \
+	} \
+}
+
+#define SHRINK_NOROUND( V ) (V)
+
+/* Sum one line of input into seq->sum.
+ */
+static void
+vips_foreign_load_shrink_add( VipsForeignLoadShrink *shrink, 
+	VipsForeignLoadShrinkSequence *seq, VipsPel *in, int width )
+{
+	const int s = shrink->shrink;
+	const int ne = shrink->in->Bands * 
+		(vips_band_format_iscomplex( shrink->in->BandFmt ) ? 2 : 1);
+
+	int x, i, k;
+
+	if( shrink->has_alpha ) 
+		switch( shrink->in->BandFmt ) {
+		case VIPS_FORMAT_UCHAR:
+			SHRINK_ADD_ALPHA( unsigned char ); break;
+		case VIPS_FORMAT_CHAR:
+			SHRINK_ADD_ALPHA( signed char ); break;
+		case VIPS_FORMAT_USHORT:
+			SHRINK_ADD_ALPHA( unsigned short ); break;
+		case VIPS_FORMAT_SHORT:
+			SHRINK_ADD_ALPHA( signed short ); break;
+		case VIPS_FORMAT_UINT:
+			SHRINK_ADD_ALPHA( unsigned int ); break;
+		case VIPS_FORMAT_INT:
+			SHRINK_ADD_ALPHA( signed int ); break;
+		case VIPS_FORMAT_FLOAT:
+			SHRINK_ADD_ALPHA( float ); break;
+		case VIPS_FORMAT_DOUBLE:
+			SHRINK_ADD_ALPHA( double ); break;
+
+		default:
+			g_assert_not_reached();
+		}
+	else
+		switch( shrink->in->BandFmt ) {
+		case VIPS_FORMAT_UCHAR:
+			SHRINK_ADD( int, unsigned char ); break;
+		case VIPS_FORMAT_CHAR:
+			SHRINK_ADD( int, signed char ); break;
+		case VIPS_FORMAT_USHORT:
+			SHRINK_ADD( int, unsigned short ); break;
+		case VIPS_FORMAT_SHORT:
+			SHRINK_ADD( int, signed short ); break;
+		case VIPS_FORMAT_UINT:
+			SHRINK_ADD( double, unsigned int ); break;
+		case VIPS_FORMAT_INT:
+			SHRINK_ADD( double, signed int ); break;
+		case VIPS_FORMAT_FLOAT:
+		case VIPS_FORMAT_COMPLEX:
+			SHRINK_ADD( double, float ); break;
+		case VIPS_FORMAT_DOUBLE:
+		case VIPS_FORMAT_DPCOMPLEX:
+			SHRINK_ADD( double, double ); break;
+
+		default:
+			g_assert_not_reached();
+		}
+}
+
+/* Average seq->sum to a line of output.
+ */
+static void
+vips_foreign_load_shrink_avg( VipsForeignLoadShrink *shrink, 
+	VipsForeignLoadShrinkSequence *seq, VipsPel *out, int width )
+{
+	const int n = shrink->shrink * shrink->shrink;
+	const int ne = shrink->in->Bands * 
+		(vips_band_format_iscomplex( shrink->in->BandFmt ) ? 2 : 1);
+	const int sz = width * ne;
+
+	int x, k;
+
+	if( shrink->has_alpha ) 
+		switch( shrink->in->BandFmt ) {
+		case VIPS_FORMAT_UCHAR:
+			SHRINK_AVG_ALPHA( unsigned char, VIPS_RINT ); break;
+		case VIPS_FORMAT_CHAR:
+			SHRINK_AVG_ALPHA( signed char, VIPS_RINT ); break;
+		case VIPS_FORMAT_USHORT:
+			SHRINK_AVG_ALPHA( unsigned short, VIPS_RINT ); break;
+		case VIPS_FORMAT_SHORT:
+			SHRINK_AVG_ALPHA( signed short, VIPS_RINT ); break;
+		case VIPS_FORMAT_UINT:
+			SHRINK_AVG_ALPHA( unsigned int, VIPS_RINT ); break;
+		case VIPS_FORMAT_INT:
+			SHRINK_AVG_ALPHA( signed int, VIPS_RINT ); break;
+		case VIPS_FORMAT_FLOAT:
+			SHRINK_AVG_ALPHA( float, SHRINK_NOROUND ); break;
+		case VIPS_FORMAT_DOUBLE:
+			SHRINK_AVG_ALPHA( double, SHRINK_NOROUND ); break;
+
+		default:
+			g_assert_not_reached();
+		}
+	else
+		switch( shrink->in->BandFmt ) {
+		case VIPS_FORMAT_UCHAR:
+			SHRINK_IAVG( int, unsigned char ); break;
+		case VIPS_FORMAT_CHAR:
+			SHRINK_IAVG( int, signed char ); break;
+		case VIPS_FORMAT_USHORT:
+			SHRINK_IAVG( int, unsigned short ); break;
+		case VIPS_FORMAT_SHORT:
+			SHRINK_IAVG( int, signed short ); break;
+		case VIPS_FORMAT_UINT:
+			SHRINK_IAVG( double, unsigned int ); break;
+		case VIPS_FORMAT_INT:
+			SHRINK_IAVG( double, signed int ); break;
+		case VIPS_FORMAT_FLOAT:
+		case VIPS_FORMAT_COMPLEX:
+			SHRINK_FAVG( float ); break;
+		case VIPS_FORMAT_DOUBLE:
+		case VIPS_FORMAT_DPCOMPLEX:
+			SHRINK_FAVG( double ); break;
+
+		default:
+			g_assert_not_reached();
+		}
+}
+
+static int
+vips_foreign_load_shrink_gen( VipsRegion *or, 
+	void *vseq, void *a, void *b, gboolean *stop )
+{
+	VipsForeignLoadShrinkSequence *seq = 
+		(VipsForeignLoadShrinkSequence *) vseq;
+	VipsForeignLoadShrink *shrink = (VipsForeignLoadShrink *) a;
+	VipsRect *r = &or->valid;
+	const int s = shrink->shrink;
+
+	int y, z;
+
+	/* One output line at a time, so we only ever need @s lines of input
+	 * in memory.
+	 */
+	for( y = 0; y < r->height; y++ ) {
+		int page = (r->top + y) / shrink->out_page_height;
+		int line = (r->top + y) % shrink->out_page_height;
+
+		VipsRect need;
+
+		need.left = r->left * s;
+		need.top = page * shrink->in_page_height + line * s;
+		need.width = r->width * s;
+		need.height = s;
+		if( vips_region_prepare( seq->ir, &need ) )
+			return( -1 );
+
+		memset( seq->sum, 0, shrink->sizeof_sum );
+		for( z = 0; z < s; z++ ) 
+			vips_foreign_load_shrink_add( shrink, seq,
+				VIPS_REGION_ADDR( seq->ir, 
+					need.left, need.top + z ), 
+				r->width );
+		vips_foreign_load_shrink_avg( shrink, seq,
+			VIPS_REGION_ADDR( or, r->left, r->top + y ), 
+			r->width );
+	}
+
+	return( 0 );
+}
+
+/* Block shrink @in by an integer factor and write to @real, see 
+ * vips__foreign_load_shrink_header(). Loaders load the full-res image to a 
+ * temporary @in, then call this from their load() method.
+ *
+ * This is a streaming box filter: we pull @shrink input lines per output 
+ * line and never hold more than that, plus whatever the loader's own 
+ * sequential line cache keeps.
+ */
+int
+vips__foreign_load_shrink( VipsImage *in, VipsImage *real, int shrink )
+{
+	VipsImage **t = (VipsImage **) 
+		vips_object_local_array( VIPS_OBJECT( real ), 2 );
+
+	VipsForeignLoadShrink *state;
+
+	/* The loader will signal errors on @in, so it needs to be able to 
+	 * find the load operation. Don't copy the region of interest, it's 
+	 * in output coordinates.
+	 */
+	g_object_set_qdata( G_OBJECT( in ), vips__foreign_load_operation, 
+		g_object_get_qdata( G_OBJECT( real ), 
+			vips__foreign_load_operation ) ); 
+
+	if( shrink <= 1 ||
+		in->Coding != VIPS_CODING_NONE ) 
+		return( vips_image_write( in, real ) );
+
+	t[0] = vips_image_new();
+	if( !(state = VIPS_NEW( t[0], VipsForeignLoadShrink )) ||
+		vips_image_pipelinev( t[0], 
+			VIPS_DEMAND_STYLE_FATSTRIP, in, NULL ) ||
+		vips__foreign_load_shrink_header( t[0], shrink ) ) 
+		return( -1 );
+
+	state->in = in;
+	state->shrink = shrink;
+	state->in_page_height = vips_image_get_page_height( in );
+	state->out_page_height = state->in_page_height / shrink;
+	state->has_alpha = vips_image_hasalpha( in ) &&
+		!vips_band_format_iscomplex( in->BandFmt );
+	state->sizeof_sum = (size_t) t[0]->Xsize * in->Bands * 
+		vips_format_sizeof( VIPS_FORMAT_DPCOMPLEX );
+
+	if( vips_image_generate( t[0],
+		vips_foreign_load_shrink_start, 
+		vips_foreign_load_shrink_gen, 
+		vips_foreign_load_shrink_stop, 
+		state, NULL ) ) 
+		return( -1 );
+	in = t[0];
+
+	/* Keep output lines in order, as vips_shrinkv() does, so threads 
+	 * can't run ahead and push lines we still need out of the loader's
+	 * cache.
+	 */
+	if( vips_image_is_sequential( in ) ) {
+		if( vips_sequential( in, &t[1], 
+			"tile_height", VIPS__FATSTRIP_HEIGHT, 
+			NULL ) ) 
+			return( -1 );
+		in = t[1];
+	}
+
+	if( vips_image_write( in, real ) )
+		return( -1 );
+
+	return( 0 );
+}
+
+/* A pool of interchangeable document handles, for loaders whose libraries 
+ * can run one thread per handle, but can't share a handle between threads. 
+ * Handles are opened on demand, up to @max.
+ */
+struct _VipsForeignPool {
+	GMutex *lock;
+
+	/* Signalled when a handle is returned or an open fails.
+	 */
+	GCond *returned;
+
+	/* Open handles not in use, and the number we've opened in total.
+	 */
+	GSList *free;
+	int n_handles;
+	int max_handles;
+
+	VipsForeignPoolOpenFn open_fn;
+	GDestroyNotify free_fn;
+	void *a;
+};
+
+VipsForeignPool *
+vips__foreign_pool_new( int max_handles, 
+	VipsForeignPoolOpenFn open_fn, GDestroyNotify free_fn, void *a )
+{
+	VipsForeignPool *pool;
+
+	pool = g_new0( VipsForeignPool, 1 );
+	pool->lock = vips_g_mutex_new();
+	pool->returned = vips_g_cond_new();
+	pool->max_handles = VIPS_MAX( 1, max_handles );
+	pool->open_fn = open_fn;
+	pool->free_fn = free_fn;
+	pool->a = a;
+
+	return( pool );
+}
+
+/* All handles must have been returned.
+ */
+void
+vips__foreign_pool_free( VipsForeignPool *pool )
+{
+	g_assert( g_slist_length( pool->free ) == pool->n_handles );
+
+	g_slist_free_full( pool->free, pool->free_fn );
+	VIPS_FREEF( vips_g_mutex_free, pool->lock );
+	VIPS_FREEF( vips_g_cond_free, pool->returned );
+	g_free( pool );
+}
+
+/* Add a handle the loader has already opened, perhaps for the header.
+ */
+void
+vips__foreign_pool_add( VipsForeignPool *pool, void *handle )
+{
+	g_mutex_lock( pool->lock );
+	pool->free = g_slist_prepend( pool->free, handle );
+	pool->n_handles += 1;
+	g_cond_signal( pool->returned );
+	g_mutex_unlock( pool->lock );
+}
+
+/* Take a handle from the pool, opening a new one if they are all busy and
+ * we are below the limit, or waiting for one to be returned otherwise.
+ */
+void *
+vips__foreign_pool_get( VipsForeignPool *pool )
+{
+	void *handle;
+
+	g_mutex_lock( pool->lock );
+
+	while( !pool->free && 
+		pool->n_handles >= pool->max_handles )
+		g_cond_wait( pool->returned, pool->lock );
+
+	if( pool->free ) {
+		handle = pool->free->data;
+		pool->free = g_slist_delete_link( pool->free, pool->free );
+		g_mutex_unlock( pool->lock );
+
+		return( handle );
+	}
+
+	/* Opening can be slow, don't hold the lock.
+	 */
+	pool->n_handles += 1;
+	g_mutex_unlock( pool->lock );
+
+	if( !(handle = pool->open_fn( pool->a )) ) {
+		g_mutex_lock( pool->lock );
+		pool->n_handles -= 1;
+		g_cond_signal( pool->returned );
+		g_mutex_unlock( pool->lock );
+	}
+
+	return( handle );
+}
+
+void
+vips__foreign_pool_put( VipsForeignPool *pool, void *handle )
+{
+	g_mutex_lock( pool->lock );
+	pool->free = g_slist_prepend( pool->free, handle );
+	g_cond_signal( pool->returned );
+	g_mutex_unlock( pool->lock );
+}
+
 /* Abstract base class for image savers.
  */
 
@@ -2135,6 +2833,9 @@ vips_foreign_operation_init( void )
 	extern GType vips_foreign_load_gif_file_get_type( void ); 
 	extern GType vips_foreign_load_gif_buffer_get_type( void ); 
 	extern GType vips_foreign_load_gif_source_get_type( void ); 
+	extern GType vips_foreign_save_gif_file_get_type( void ); 
+	extern GType vips_foreign_save_gif_buffer_get_type( void ); 
+	extern GType vips_foreign_save_gif_target_get_type( void ); 
 
 	vips_foreign_load_csv_file_get_type(); 
 	vips_foreign_load_csv_source_get_type(); 
@@ -2192,6 +2893,12 @@ vips_foreign_operation_init( void )
 	vips_foreign_load_gif_source_get_type(); 
 #endif /*HAVE_GIFLIB*/
 
+#if defined(HAVE_GIFLIB) && defined(HAVE_IMAGEQUANT)
+	vips_foreign_save_gif_file_get_type(); 
+	vips_foreign_save_gif_buffer_get_type(); 
+	vips_foreign_save_gif_target_get_type(); 
+#endif /*defined(HAVE_GIFLIB) && defined(HAVE_IMAGEQUANT)*/
+
 #ifdef HAVE_GSF
 	vips_foreign_save_dz_file_get_type(); 
 	vips_foreign_save_dz_buffer_get_type(); 
@@ -2286,4 +2993,8 @@ vips_foreign_operation_init( void )
 
 	vips__foreign_load_operation = 
 		g_quark_from_static_string( "vips-foreign-load-operation" ); 
+	vips__foreign_load_roi = 
+		g_quark_from_static_string( "vips-foreign-load-roi" ); 
+	vips__foreign_load_roi_state = 
+		g_quark_from_static_string( "vips-foreign-load-roi-state" ); 
 }
@@ -39,6 +39,10 @@
  * 	- add gifload_source
  * 5/2/20 alon-ne
  * 	- fix DISPOSE_BACKGROUND and DISPOSE_PREVIOUS
+ * 18/10/20
+ * 	- add "shrink" for block shrink-on-load
+ * 	- index frames during header scan so we can skip to a keyframe 
+ * 	  rather than rendering every earlier page
  */
 
 /*
@@ -130,6 +134,26 @@
 	(G_TYPE_INSTANCE_GET_CLASS( (obj), \
 	VIPS_TYPE_FOREIGN_LOAD_GIF, VipsForeignLoadGifClass ))
 
+/* What we note about each frame during header scan.
+ */
+typedef struct _VipsForeignLoadGifFrame {
+	/* The position in the source of the first record after the end of 
+	 * the previous frame. This includes any extensions for this frame.
+	 */
+	gint64 offset;
+
+	/* From the graphics control extension for this frame, if any.
+	 */
+	int dispose;
+	gboolean transparent;
+
+	/* A keyframe covers the whole canvas, has no transparency, and does 
+	 * not dispose itself. Rendering can start from here without any 
+	 * earlier pages.
+	 */
+	gboolean keyframe;
+} VipsForeignLoadGifFrame;
+
 typedef struct _VipsForeignLoadGif {
 	VipsForeignLoad parent_object;
 
@@ -141,6 +165,10 @@ typedef struct _VipsForeignLoadGif {
 	 */
 	int n;
 
+	/* Block shrink each page by this integer factor.
+	 */
+	int shrink;
+
 	/* Load from this source (set by subclasses).
 	 */
 	VipsSource *source;
@@ -160,6 +188,12 @@ typedef struct _VipsForeignLoadGif {
 	int *delays;
 	int delays_length;
 
+	/* Frame index, also delays_length long. Only valid if the header 
+	 * scan saw no errors.
+	 */
+	VipsForeignLoadGifFrame *frames;
+	gboolean indexed;
+
 	/* Number of times to loop the animation.
 	 */
 	int loop;
@@ -420,6 +454,7 @@ vips_foreign_load_gif_dispose( GObject *gobject )
 	VIPS_FREE( gif->comment );
 	VIPS_FREE( gif->line );
 	VIPS_FREE( gif->delays );
+	VIPS_FREE( gif->frames );
 
 	G_OBJECT_CLASS( vips_foreign_load_gif_parent_class )->
 		dispose( gobject );
@@ -452,7 +487,7 @@ vips_foreign_load_gif_is_a_source( VipsSource *source )
 	return( FALSE );
 }
 
-/* Make sure delays is allocated and large enough.
+/* Make sure delays and frames are allocated and large enough.
  */
 static void
 vips_foreign_load_gif_allocate_delays( VipsForeignLoadGif *gif )
@@ -464,8 +499,16 @@ vips_foreign_load_gif_allocate_delays( VipsForeignLoadGif *gif )
 		gif->delays_length = gif->delays_length + gif->n_pages + 64;
 		gif->delays = (int *) g_realloc( gif->delays,
 			gif->delays_length * sizeof( int ) );
-		for( i = old; i < gif->delays_length; i++ )
+		gif->frames = (VipsForeignLoadGifFrame *) g_realloc( 
+			gif->frames,
+			gif->delays_length * sizeof( VipsForeignLoadGifFrame ) );
+		for( i = old; i < gif->delays_length; i++ ) {
 			gif->delays[i] = 40;
+			gif->frames[i].offset = -1;
+			gif->frames[i].dispose = DISPOSAL_UNSPECIFIED;
+			gif->frames[i].transparent = FALSE;
+			gif->frames[i].keyframe = FALSE;
+		}
 	}
 }
 
@@ -509,6 +552,7 @@ vips_foreign_load_gif_scan_image( VipsForeignLoadGif *gif )
 
 	ColorMapObject *map;
 	GifByteType *extension;
+	VipsForeignLoadGifFrame *frame;
 
 	if( DGifGetImageDesc( gif->file ) == GIF_ERROR ) {
 		vips_foreign_load_gif_error( gif );
@@ -552,6 +596,19 @@ vips_foreign_load_gif_scan_image( VipsForeignLoadGif *gif )
 			return( -1 );
 	} while( extension != NULL );
 
+	/* A frame which replaces every pixel and leaves itself in place as 
+	 * the backdrop (and the restore point for DISPOSE_PREVIOUS) for the 
+	 * next frame makes everything before it irrelevant.
+	 */
+	frame = &gif->frames[gif->n_pages];
+	frame->keyframe = file->Image.Left == 0 &&
+		file->Image.Top == 0 &&
+		file->Image.Width == file->SWidth &&
+		file->Image.Height == file->SHeight &&
+		!frame->transparent &&
+		(frame->dispose == DISPOSAL_UNSPECIFIED ||
+		 frame->dispose == DISPOSE_DO_NOT);
+
 	return( 0 );
 }
 
@@ -632,6 +689,16 @@ vips_foreign_load_gif_scan_extension( VipsForeignLoadGif *gif )
 				gif->has_transparency = TRUE;
 			}
 
+			if( extension[0] == 4 ) {
+				VipsForeignLoadGifFrame *frame = 
+					&gif->frames[gif->n_pages];
+
+				frame->transparent = 
+					extension[1] & TRANSPARENT_MASK;
+				frame->dispose = (extension[1] >> 
+					DISPOSE_SHIFT) & DISPOSE_MASK;
+			}
+
 			/* giflib uses centiseconds, we use ms.
 			 */
 			gif->delays[gif->n_pages] =
@@ -715,7 +782,12 @@ vips_foreign_load_gif_set_header( VipsForeignLoadGif *gif, VipsImage *image )
 /* Attempt to quickly scan a GIF and discover what we need for our header. We
  * need to scan the whole file to get n_pages, transparency and colour. 
  *
- * Don't flag errors during header scan. Many GIFs do not follow spec.
+ * We also build the frame index here. giflib reads the source with no 
+ * lookahead, so the source position between records is exactly where the 
+ * next record starts.
+ *
+ * Don't flag errors during header scan. Many GIFs do not follow spec. We 
+ * don't trust the index if there were any errors, though.
  */
 static int
 vips_foreign_load_gif_scan( VipsForeignLoadGif *gif )
@@ -723,18 +795,33 @@ vips_foreign_load_gif_scan( VipsForeignLoadGif *gif )
 	VipsObjectClass *class = VIPS_OBJECT_GET_CLASS( gif );
 
 	GifRecordType record;
+	gint64 offset;
 
 	VIPS_DEBUG_MSG( "vips_foreign_load_gif_scan:\n" );
 
 	gif->n_pages = 0;
+	gif->indexed = TRUE;
+	offset = -1;
 
 	do {
-		if( DGifGetRecordType( gif->file, &record ) == GIF_ERROR )
+		if( offset == -1 &&
+			(offset = vips_source_seek( gif->source, 
+				0, SEEK_CUR )) == -1 ) {
+			vips_error_clear();
+			gif->indexed = FALSE;
+		}
+
+		if( DGifGetRecordType( gif->file, &record ) == GIF_ERROR ) {
+			gif->indexed = FALSE;
 			continue;
+		}
 
 		switch( record ) {
 		case IMAGE_DESC_RECORD_TYPE:
-			(void) vips_foreign_load_gif_scan_image( gif );
+			gif->frames[gif->n_pages].offset = offset;
+			offset = -1;
+			if( vips_foreign_load_gif_scan_image( gif ) )
+				gif->indexed = FALSE;
 			gif->n_pages += 1;
 			vips_foreign_load_gif_allocate_delays( gif );
 			break;
@@ -743,7 +830,8 @@ vips_foreign_load_gif_scan( VipsForeignLoadGif *gif )
 			/* We need to fetch the extensions to check for
 			 * cmaps and transparency.
 			 */
-			(void) vips_foreign_load_gif_scan_extension( gif );
+			if( vips_foreign_load_gif_scan_extension( gif ) )
+				gif->indexed = FALSE;
 			break;
 
 		case TERMINATE_RECORD_TYPE:
@@ -804,7 +892,8 @@ vips_foreign_load_gif_header( VipsForeignLoad *load )
 	if( !(gif->line =
 		VIPS_ARRAY( NULL, gif->file->SWidth, GifPixelType )) ||
 		vips_foreign_load_gif_scan( gif ) ||
-		vips_foreign_load_gif_set_header( gif, load->out ) ) {
+		vips_foreign_load_gif_set_header( gif, load->out ) ||
+		vips__foreign_load_shrink_header( load->out, gif->shrink ) ) {
 		(void) vips_foreign_load_gif_close_giflib( gif );
 
 		return( -1 );
@@ -1126,6 +1215,39 @@ vips_foreign_load_gif_next_page( VipsForeignLoadGif *gif )
 	return( 0 );
 }
 
+/* Move the read point to the last keyframe at or before @page, as long as 
+ * it's ahead of the next page we would render. The pages we jump over can't 
+ * affect the keyframe, so we just forget any dispose state.
+ */
+static int
+vips_foreign_load_gif_seek_keyframe( VipsForeignLoadGif *gif, int page )
+{
+	int i;
+
+	if( !gif->indexed )
+		return( 0 );
+
+	for( i = page; i > gif->current_page; i-- )
+		if( gif->frames[i].keyframe )
+			break;
+	if( i <= gif->current_page )
+		return( 0 );
+
+	VIPS_DEBUG_MSG( "vips_foreign_load_gif_seek_keyframe: "
+		"skipping from page %d to keyframe %d\n", 
+		gif->current_page, i );
+
+	if( vips_source_seek( gif->source, 
+		gif->frames[i].offset, SEEK_SET ) == -1 )
+		return( -1 );
+
+	gif->current_page = i;
+	gif->dispose = DISPOSAL_UNSPECIFIED;
+	gif->transparent_index = NO_TRANSPARENT_INDEX;
+
+	return( 0 );
+}
+
 static int
 vips_foreign_load_gif_generate( VipsRegion *or,
 	void *seq, void *a, void *b, gboolean *stop )
@@ -1154,6 +1276,13 @@ vips_foreign_load_gif_generate( VipsRegion *or,
 		g_assert( line >= 0 && line < gif->frame->Ysize );
 		g_assert( page >= 0 && page < gif->n_pages );
 
+		/* Skip ahead to the nearest keyframe, if that saves us
+		 * rendering any pages.
+		 */
+		if( gif->current_page <= page &&
+			vips_foreign_load_gif_seek_keyframe( gif, page ) )
+			return( -1 );
+
 		/* current_page == 0 means we've not loaded any pages yet. So
 		 * we need to have loaded the page beyond the page we want.
 		 */
@@ -1273,7 +1402,7 @@ vips_foreign_load_gif_load( VipsForeignLoad *load )
 		vips_sequential( t[0], &t[1],
 			"tile_height", VIPS__FATSTRIP_HEIGHT,
 			NULL ) ||
-		vips_image_write( t[1], load->real ) )
+		vips__foreign_load_shrink( t[1], load->real, gif->shrink ) )
 		return( -1 );
 
 	return( 0 );
@@ -1313,14 +1442,23 @@ vips_foreign_load_gif_class_init( VipsForeignLoadGifClass *class )
 		G_STRUCT_OFFSET( VipsForeignLoadGif, n ),
 		-1, 100000, 1 );
 
+	VIPS_ARG_INT( class, "shrink", 22,
+		_( "Shrink" ),
+		_( "Shrink factor on load" ),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET( VipsForeignLoadGif, shrink ),
+		1, 16, 1 );
+
 }
 
 static void
 vips_foreign_load_gif_init( VipsForeignLoadGif *gif )
 {
 	gif->n = 1;
+	gif->shrink = 1;
 	gif->transparent_index = NO_TRANSPARENT_INDEX;
 	gif->delays = NULL;
+	gif->frames = NULL;
 	gif->delays_length = 0;
 	gif->loop = 1;
 	gif->comment = NULL;
@@ -1569,6 +1707,7 @@ vips_foreign_load_gif_source_init( VipsForeignLoadGifSource *source )
  *
  * * @page: %gint, page (frame) to read
  * * @n: %gint, load this many pages
+ * * @shrink: %gint, shrink by this integer factor during load
  *
  * Read a GIF file into a VIPS image.
  *
@@ -1582,6 +1721,9 @@ vips_foreign_load_gif_source_init( VipsForeignLoadGifSource *source )
  * The whole GIF is rendered into memory on header access. The output image
  * will be 1, 2, 3 or 4 bands depending on what the reader finds in the file.
  *
+ * Set @shrink to block shrink each page by an integer factor as it is
+ * rendered, see vips_pngload(). 
+ *
  * See also: vips_image_new_from_file().
  *
  * Returns: 0 on success, -1 on error.
@@ -1610,6 +1752,7 @@ vips_gifload( const char *filename, VipsImage **out, ... )
  *
  * * @page: %gint, page (frame) to read
  * * @n: %gint, load this many pages
+ * * @shrink: %gint, shrink by this integer factor during load
  *
  * Read a GIF-formatted memory block into a VIPS image. Exactly as
  * vips_gifload(), but read from a memory buffer.
@@ -1651,6 +1794,7 @@ vips_gifload_buffer( void *buf, size_t len, VipsImage **out, ... )
  *
  * * @page: %gint, page (frame) to read
  * * @n: %gint, load this many pages
+ * * @shrink: %gint, shrink by this integer factor during load
  *
  * Exactly as vips_gifload(), but read from a source.
  *
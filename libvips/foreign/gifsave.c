@@ -0,0 +1,1457 @@
+/* save as GIF with giflib and libimagequant
+ *
+ * 18/10/20
+ * 	- from heifsave.c
+ * 	- quantise frames in parallel
+ * 	- reserve the transparent palette entry before quantising
+ */
+
+/*
+
+    This file is part of VIPS.
+
+    VIPS is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301  USA
+
+ */
+
+/*
+
+    These files are distributed with VIPS - http://www.vips.ecs.soton.ac.uk
+
+ */
+
+/*
+#define DEBUG_VERBOSE
+#define DEBUG
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /*HAVE_CONFIG_H*/
+#include <vips/intl.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include <vips/vips.h>
+#include <vips/internal.h>
+
+#if defined(HAVE_GIFLIB) && defined(HAVE_IMAGEQUANT)
+
+#include <gif_lib.h>
+
+#include "pforeign.h"
+#include "quantise.h"
+
+/* giflib 5 has error returns from most functions, and a per-file error code.
+ */
+#ifdef GIFLIB_MAJOR
+#  if GIFLIB_MAJOR > 4
+#    define HAVE_GIFLIB_5
+#  endif
+#endif
+
+#ifndef HAVE_GIFLIB_5
+#define DISPOSE_DO_NOT            1
+#define DISPOSE_BACKGROUND        2
+#define GifMakeMapObject MakeMapObject
+#define GifFreeMapObject FreeMapObject
+#endif
+
+/* One frame of the animation on its way to the file.
+ */
+typedef struct _VipsForeignSaveGifFrame {
+	struct _VipsForeignSaveGif *gif;
+
+	/* The page number.
+	 */
+	int page;
+
+	/* The whole frame as RGBA, and the frame before it, or NULL for the
+	 * first frame, or if we are not computing frame differences.
+	 */
+	VipsPel *rgba;
+	VipsPel *previous;
+
+	/* The part of the frame we write. Pixels inside this which have not
+	 * changed since the previous frame are made transparent.
+	 */
+	VipsRect rect;
+	VipsPel *pixels;
+
+	/* The quantised pixels, and the palette they index.
+	 */
+	VipsPel *index;
+	VipsQuantisePalette palette;
+	int transparent;
+} VipsForeignSaveGifFrame;
+
+typedef struct _VipsForeignSaveGif {
+	VipsForeignSave parent_object;
+
+	/* Where to write (set by subclasses).
+	 */
+	VipsTarget *target;
+
+	/* Quantisation parameters.
+	 */
+	int colours;
+	int Q;
+	double dither;
+
+	/* Use one palette for all frames.
+	 */
+	gboolean global_palette;
+
+	int page_width;
+	int page_height;
+	int n_pages;
+
+	/* Compute frame differences, ie. write just the parts of each frame
+	 * which changed. We only do this for opaque images, since a pixel
+	 * going from opaque to transparent needs a different dispose.
+	 */
+	gboolean diff;
+
+	/* The frame we are assembling from sink_disc() output.
+	 */
+	VipsPel *rgba;
+
+	/* The last frame of the previous batch, for differencing.
+	 */
+	VipsPel *previous;
+
+	/* Frames are quantised in batches, each frame on a separate
+	 * worker. We only hold this many frames at once.
+	 */
+	VipsForeignSaveGifFrame *batch;
+	int batch_size;
+	int n_batch;
+
+	/* The shared palette, if we are making one. It's computed from
+	 * the first batch of frames.
+	 */
+	VipsQuantisePalette palette;
+	int transparent;
+	gboolean have_palette;
+
+	/* Delays in ms, and loop count.
+	 */
+	int *delays;
+	int delays_length;
+	int loop;
+
+	GifFileType *file;
+
+	/* Set once the screen descriptor has been written.
+	 */
+	gboolean have_header;
+
+} VipsForeignSaveGif;
+
+typedef VipsForeignSaveClass VipsForeignSaveGifClass;
+
+G_DEFINE_ABSTRACT_TYPE( VipsForeignSaveGif, vips_foreign_save_gif,
+	VIPS_TYPE_FOREIGN_SAVE );
+
+static void
+vips_foreign_save_gif_error( VipsForeignSaveGif *gif )
+{
+	VipsObjectClass *class = VIPS_OBJECT_GET_CLASS( gif );
+
+	int error;
+
+#ifdef HAVE_GIFLIB_5
+	error = gif->file ? gif->file->Error : 0;
+	vips_error( class->nickname, "%s", GifErrorString( error ) );
+#else /*!HAVE_GIFLIB_5*/
+	error = GifLastError();
+	vips_error( class->nickname, _( "giflib error %d" ), error );
+#endif /*HAVE_GIFLIB_5*/
+}
+
+static void
+vips_foreign_save_gif_frame_free( VipsForeignSaveGifFrame *frame )
+{
+	VIPS_FREE( frame->rgba );
+	VIPS_FREE( frame->pixels );
+	VIPS_FREE( frame->index );
+	frame->previous = NULL;
+}
+
+static int
+vips_foreign_save_gif_close( VipsForeignSaveGif *gif )
+{
+	int result;
+
+	result = 0;
+
+#ifdef HAVE_GIFLIB_5
+	if( gif->file ) {
+		int error;
+
+		if( EGifCloseFile( gif->file, &error ) == GIF_ERROR ) {
+			vips_error( "gifsave", "%s", GifErrorString( error ) );
+			result = -1;
+		}
+		gif->file = NULL;
+	}
+#else /*!HAVE_GIFLIB_5*/
+	if( gif->file ) {
+		if( EGifCloseFile( gif->file ) == GIF_ERROR ) {
+			vips_error( "gifsave",
+				_( "giflib error %d" ), GifLastError() );
+			result = -1;
+		}
+		gif->file = NULL;
+	}
+#endif /*HAVE_GIFLIB_5*/
+
+	return( result );
+}
+
+static void
+vips_foreign_save_gif_dispose( GObject *gobject )
+{
+	VipsForeignSaveGif *gif = (VipsForeignSaveGif *) gobject;
+
+	int i;
+
+	(void) vips_foreign_save_gif_close( gif );
+
+	if( gif->batch ) {
+		for( i = 0; i < gif->batch_size; i++ )
+			vips_foreign_save_gif_frame_free( &gif->batch[i] );
+		VIPS_FREE( gif->batch );
+	}
+	VIPS_FREE( gif->rgba );
+	VIPS_FREE( gif->previous );
+	VIPS_FREE( gif->delays );
+	VIPS_UNREF( gif->target );
+
+	G_OBJECT_CLASS( vips_foreign_save_gif_parent_class )->
+		dispose( gobject );
+}
+
+/* Callback from giflib with a chunk of compressed output.
+ */
+static int
+vips_foreign_save_gif_write( GifFileType *file, const GifByteType *buf, int n )
+{
+	VipsForeignSaveGif *gif = (VipsForeignSaveGif *) file->UserData;
+
+	if( vips_target_write( gif->target, buf, n ) )
+		return( 0 );
+
+	return( n );
+}
+
+/* Find the bounding box of the pixels which differ from the previous frame.
+ */
+static void
+vips_foreign_save_gif_frame_diff( VipsForeignSaveGifFrame *frame )
+{
+	VipsForeignSaveGif *gif = frame->gif;
+	int width = gif->page_width;
+	int height = gif->page_height;
+
+	int left, right, top, bottom;
+	int x, y;
+
+	left = width;
+	right = -1;
+	top = height;
+	bottom = -1;
+
+	for( y = 0; y < height; y++ ) {
+		guint32 *p = (guint32 *) frame->rgba + y * width;
+		guint32 *q = (guint32 *) frame->previous + y * width;
+
+		for( x = 0; x < width; x++ )
+			if( p[x] != q[x] )
+				break;
+		if( x == width )
+			continue;
+
+		left = VIPS_MIN( left, x );
+		top = VIPS_MIN( top, y );
+		bottom = y;
+
+		for( x = width - 1; x > right; x-- )
+			if( p[x] != q[x] ) {
+				right = x;
+				break;
+			}
+	}
+
+	if( bottom == -1 ) {
+		/* Nothing changed, but we must still write a frame to keep
+		 * the timing. Write a single transparent pixel.
+		 */
+		frame->rect.left = 0;
+		frame->rect.top = 0;
+		frame->rect.width = 1;
+		frame->rect.height = 1;
+	}
+	else {
+		frame->rect.left = left;
+		frame->rect.top = top;
+		frame->rect.width = right - left + 1;
+		frame->rect.height = bottom - top + 1;
+	}
+}
+
+/* Find the area to write, and copy it out with unchanged pixels made
+ * transparent.
+ */
+static int
+vips_foreign_save_gif_frame_analyse( VipsForeignSaveGifFrame *frame )
+{
+	VipsForeignSaveGif *gif = frame->gif;
+
+	int x, y;
+
+	if( frame->previous )
+		vips_foreign_save_gif_frame_diff( frame );
+	else {
+		frame->rect.left = 0;
+		frame->rect.top = 0;
+		frame->rect.width = gif->page_width;
+		frame->rect.height = gif->page_height;
+	}
+
+	if( !(frame->pixels = VIPS_ARRAY( NULL,
+		4 * frame->rect.width * frame->rect.height, VipsPel )) ||
+		!(frame->index = VIPS_ARRAY( NULL,
+			frame->rect.width * frame->rect.height, VipsPel )) )
+		return( -1 );
+
+	for( y = 0; y < frame->rect.height; y++ ) {
+		int offset = (frame->rect.top + y) * gif->page_width +
+			frame->rect.left;
+		guint32 *p = (guint32 *) frame->rgba + offset;
+		guint32 *q = (guint32 *) frame->pixels +
+			y * frame->rect.width;
+
+		if( frame->previous ) {
+			guint32 *r = (guint32 *) frame->previous + offset;
+
+			for( x = 0; x < frame->rect.width; x++ )
+				q[x] = p[x] == r[x] ? 0 : p[x];
+		}
+		else
+			memcpy( q, p, frame->rect.width * sizeof( guint32 ) );
+	}
+
+	return( 0 );
+}
+
+static int
+vips_foreign_save_gif_find_colour( const VipsQuantisePalette *palette, 
+	VipsQuantiseColour c )
+{
+	int best;
+	int best_distance;
+	int i;
+
+	best = 0;
+	best_distance = INT_MAX;
+	for( i = 0; i < palette->count; i++ ) {
+		const VipsQuantiseColour *p = &palette->entries[i];
+		int dr = p->r - c.r;
+		int dg = p->g - c.g;
+		int db = p->b - c.b;
+		int da = p->a - c.a;
+		int distance = dr * dr + dg * dg + db * db + da * da;
+
+		if( distance < best_distance ) {
+			best = i;
+			best_distance = distance;
+		}
+	}
+
+	return( best );
+}
+
+/* The number of colours to ask the quantiser for. If we will need a 
+ * transparent entry, we keep a slot free for it, so adding it never costs
+ * us a real colour.
+ */
+static int
+vips_foreign_save_gif_max_colours( int colours, gboolean transparent )
+{
+	return( transparent ? VIPS_MAX( 2, colours - 1 ) : colours );
+}
+
+/* GIF transparency is binary. Make sure the palette has a transparent entry
+ * if we will need one, and return its index.
+ */
+static int
+vips_foreign_save_gif_transparent( VipsQuantisePalette *palette, int colours,
+	gboolean needed )
+{
+	int i;
+
+	for( i = 0; i < palette->count; i++ )
+		if( palette->entries[i].a < 128 )
+			return( i );
+
+	if( !needed )
+		return( -1 );
+
+	/* We reserve a slot before quantising, so this can only happen if 
+	 * we were asked for two colours. Sacrifice the last one.
+	 */
+	if( palette->count >= colours )
+		palette->count = colours - 1;
+	i = palette->count;
+	palette->entries[i].r = 0;
+	palette->entries[i].g = 0;
+	palette->entries[i].b = 0;
+	palette->entries[i].a = 0;
+	palette->count += 1;
+
+	return( i );
+}
+
+static int
+vips_foreign_save_gif_frame_quantise( VipsForeignSaveGifFrame *frame )
+{
+	VipsForeignSaveGif *gif = frame->gif;
+	int n_pels = frame->rect.width * frame->rect.height;
+
+	VipsQuantiseAttr *attr;
+	VipsQuantiseImage *image;
+	VipsQuantiseResult *result;
+	const VipsQuantisePalette *lp;
+	gboolean has_transparency;
+	int i;
+
+	has_transparency = FALSE;
+	for( i = 0; i < n_pels; i++ )
+		if( frame->pixels[i * 4 + 3] == 0 ) {
+			has_transparency = TRUE;
+			break;
+		}
+
+	attr = vips__quantise_attr_create();
+	vips__quantise_set_quality( attr, 0, gif->Q );
+	if( !(image = vips__quantise_image_create_rgba( attr, frame->pixels,
+		frame->rect.width, frame->rect.height, 0 )) ) {
+		vips_error( "gifsave", "%s", _( "quantisation failed" ) );
+		VIPS_FREEF( vips__quantise_attr_destroy, attr );
+		return( -1 );
+	}
+
+	if( gif->have_palette ) {
+		/* Fixed colours are never moved by the quantiser, so this
+		 * just remaps to the shared palette.
+		 */
+		vips__quantise_set_max_colors( attr, 
+			VIPS_MAX( 2, gif->palette.count ) );
+		for( i = 0; i < gif->palette.count; i++ )
+			vips__quantise_image_add_fixed_color( image,
+				gif->palette.entries[i] );
+	}
+	else
+		vips__quantise_set_max_colors( attr, 
+			vips_foreign_save_gif_max_colours( gif->colours, 
+				has_transparency ) );
+
+	result = NULL;
+	if( vips__quantise_image_quantize( image, attr, &result ) ) {
+		vips_error( "gifsave", "%s", _( "quantisation failed" ) );
+		VIPS_FREEF( vips__quantise_image_destroy, image );
+		VIPS_FREEF( vips__quantise_attr_destroy, attr );
+		return( -1 );
+	}
+
+	vips__quantise_set_dithering_level( result, gif->dither );
+
+	if( vips__quantise_write_remapped_image( result, image, 
+		frame->index, n_pels ) ) {
+		vips_error( "gifsave", "%s", _( "quantisation failed" ) );
+		VIPS_FREEF( vips__quantise_result_destroy, result );
+		VIPS_FREEF( vips__quantise_image_destroy, image );
+		VIPS_FREEF( vips__quantise_attr_destroy, attr );
+		return( -1 );
+	}
+
+	/* The palette can be refined during remap, so we must fetch it
+	 * afterwards.
+	 */
+	lp = vips__quantise_get_palette( result );
+
+	if( gif->have_palette ) {
+		/* The quantiser can reorder the palette, so map its indexes
+		 * back to the shared one.
+		 */
+		VipsPel map[256];
+
+		for( i = 0; i < lp->count; i++ )
+			map[i] = vips_foreign_save_gif_find_colour(
+				&gif->palette, lp->entries[i] );
+		for( i = 0; i < n_pels; i++ )
+			frame->index[i] = map[frame->index[i]];
+
+		frame->palette = gif->palette;
+		frame->transparent = gif->transparent;
+	}
+	else {
+		frame->palette = *lp;
+		frame->transparent = vips_foreign_save_gif_transparent(
+			&frame->palette, gif->colours, has_transparency );
+	}
+
+	/* Force all transparent pixels to the transparent index. The
+	 * quantiser can pick any nearby colour for them.
+	 */
+	if( has_transparency &&
+		frame->transparent >= 0 )
+		for( i = 0; i < n_pels; i++ )
+			if( frame->pixels[i * 4 + 3] == 0 )
+				frame->index[i] = frame->transparent;
+
+	VIPS_FREEF( vips__quantise_result_destroy, result );
+	VIPS_FREEF( vips__quantise_image_destroy, image );
+	VIPS_FREEF( vips__quantise_attr_destroy, attr );
+
+	return( 0 );
+}
+
+typedef int (*VipsForeignSaveGifFrameFn)( VipsForeignSaveGifFrame *frame );
+
+/* Run a function over the frames of a batch.
+ */
+typedef struct _VipsForeignSaveGifBatchRun {
+	VipsForeignSaveGifFrameFn fn;
+
+	/* Set if any frame fails.
+	 */
+	int failed;
+} VipsForeignSaveGifBatchRun;
+
+static void
+vips_foreign_save_gif_batch_work( void *data, void *user_data )
+{
+	VipsForeignSaveGifFrame *frame = (VipsForeignSaveGifFrame *) data;
+	VipsForeignSaveGifBatchRun *run = 
+		(VipsForeignSaveGifBatchRun *) user_data;
+
+	if( run->fn( frame ) )
+		g_atomic_int_set( &run->failed, 1 );
+}
+
+/* Run fn on every frame in the batch, in parallel. 
+ *
+ * We are called from inside the sink_disc write callback, so we must not 
+ * use vips_threadpool_run(): it minimises the image it runs on when it 
+ * finishes, and that would flush caches and close files in the pipeline 
+ * we are saving. Use a private set of threads instead.
+ */
+static int
+vips_foreign_save_gif_batch_run( VipsForeignSaveGif *gif, 
+	VipsForeignSaveGifFrameFn fn )
+{
+	VipsForeignSaveGifBatchRun run;
+	GThreadPool *pool;
+	int i;
+
+	/* Not worth starting any threads for a single frame.
+	 */
+	if( gif->n_batch == 1 )
+		return( fn( &gif->batch[0] ) );
+
+	run.fn = fn;
+	run.failed = 0;
+
+	pool = g_thread_pool_new( vips_foreign_save_gif_batch_work, &run,
+		VIPS_MIN( vips_concurrency_get(), gif->n_batch ), 
+		FALSE, NULL );
+	for( i = 0; i < gif->n_batch; i++ )
+		g_thread_pool_push( pool, &gif->batch[i], NULL );
+
+	/* Wait for every frame to finish.
+	 */
+	g_thread_pool_free( pool, FALSE, TRUE );
+
+	if( run.failed )
+		return( -1 );
+
+	return( 0 );
+}
+
+/* Build the shared palette from the histogram of the first batch.
+ */
+static int
+vips_foreign_save_gif_build_palette( VipsForeignSaveGif *gif )
+{
+	VipsQuantiseAttr *attr;
+	VipsQuantiseHistogram *histogram;
+	VipsQuantiseImage *images[256];
+	VipsQuantiseResult *result;
+	gboolean needs_transparency;
+	int i;
+
+	/* Frame differences need a transparent entry, and we can't know if
+	 * later frames will need one. 
+	 */
+	needs_transparency = !gif->diff || gif->n_pages > 1;
+
+	attr = vips__quantise_attr_create();
+	vips__quantise_set_quality( attr, 0, gif->Q );
+	vips__quantise_set_max_colors( attr, 
+		vips_foreign_save_gif_max_colours( gif->colours, 
+			needs_transparency ) );
+	histogram = vips__quantise_histogram_create( attr );
+
+	for( i = 0; i < gif->n_batch; i++ ) {
+		VipsForeignSaveGifFrame *frame = &gif->batch[i];
+
+		images[i] = vips__quantise_image_create_rgba( attr, 
+			frame->pixels, 
+			frame->rect.width, frame->rect.height, 0 );
+		vips__quantise_histogram_add_image( histogram, 
+			attr, images[i] );
+	}
+
+	result = NULL;
+	if( vips__quantise_histogram_quantize( histogram, attr, &result ) ) {
+		vips_error( "gifsave", "%s", _( "quantisation failed" ) );
+		for( i = 0; i < gif->n_batch; i++ )
+			VIPS_FREEF( vips__quantise_image_destroy, images[i] );
+		VIPS_FREEF( vips__quantise_histogram_destroy, histogram );
+		VIPS_FREEF( vips__quantise_attr_destroy, attr );
+		return( -1 );
+	}
+
+	gif->palette = *vips__quantise_get_palette( result );
+	gif->transparent = vips_foreign_save_gif_transparent( &gif->palette,
+		gif->colours, needs_transparency );
+	gif->have_palette = TRUE;
+
+	VIPS_FREEF( vips__quantise_result_destroy, result );
+	for( i = 0; i < gif->n_batch; i++ )
+		VIPS_FREEF( vips__quantise_image_destroy, images[i] );
+	VIPS_FREEF( vips__quantise_histogram_destroy, histogram );
+	VIPS_FREEF( vips__quantise_attr_destroy, attr );
+
+	return( 0 );
+}
+
+/* Make a giflib colour map from a quantiser palette. GIF colour maps must be a
+ * power of two in size.
+ */
+static ColorMapObject *
+vips_foreign_save_gif_colormap( const VipsQuantisePalette *palette )
+{
+	ColorMapObject *map;
+	GifColorType colors[256];
+	int bits;
+	int i;
+
+	for( bits = 1; (1 << bits) < palette->count; bits++ )
+		;
+
+	memset( colors, 0, sizeof( colors ) );
+	for( i = 0; i < palette->count; i++ ) {
+		colors[i].Red = palette->entries[i].r;
+		colors[i].Green = palette->entries[i].g;
+		colors[i].Blue = palette->entries[i].b;
+	}
+
+	if( !(map = GifMakeMapObject( 1 << bits, colors )) )
+		vips_error( "gifsave", "%s", _( "out of memory" ) );
+
+	return( map );
+}
+
+static int
+vips_foreign_save_gif_write_header( VipsForeignSaveGif *gif )
+{
+	VipsForeignSave *save = (VipsForeignSave *) gif;
+
+	ColorMapObject *map;
+	int result;
+
+	map = NULL;
+	if( gif->have_palette &&
+		!(map = vips_foreign_save_gif_colormap( &gif->palette )) )
+		return( -1 );
+
+	result = EGifPutScreenDesc( gif->file,
+		gif->page_width, gif->page_height, 8, 0, map );
+	VIPS_FREEF( GifFreeMapObject, map );
+	if( result == GIF_ERROR ) {
+		vips_foreign_save_gif_error( gif );
+		return( -1 );
+	}
+
+	/* Loop 1 means play once, so no NETSCAPE extension.
+	 */
+	if( gif->n_pages > 1 &&
+		gif->loop != 1 ) {
+		int count = gif->loop == 0 ? 0 : gif->loop - 1;
+		GifByteType data[3];
+
+		data[0] = 1;
+		data[1] = count & 0xff;
+		data[2] = (count >> 8) & 0xff;
+
+#ifdef HAVE_GIFLIB_5
+		if( EGifPutExtensionLeader( gif->file,
+				APPLICATION_EXT_FUNC_CODE ) == GIF_ERROR ||
+			EGifPutExtensionBlock( gif->file,
+				11, "NETSCAPE2.0" ) == GIF_ERROR ||
+			EGifPutExtensionBlock( gif->file,
+				3, data ) == GIF_ERROR ||
+			EGifPutExtensionTrailer( gif->file ) == GIF_ERROR ) {
+			vips_foreign_save_gif_error( gif );
+			return( -1 );
+		}
+#else /*!HAVE_GIFLIB_5*/
+		if( EGifPutExtensionFirst( gif->file,
+				APPLICATION_EXT_FUNC_CODE,
+				11, "NETSCAPE2.0" ) == GIF_ERROR ||
+			EGifPutExtensionLast( gif->file,
+				APPLICATION_EXT_FUNC_CODE,
+				3, data ) == GIF_ERROR ) {
+			vips_foreign_save_gif_error( gif );
+			return( -1 );
+		}
+#endif /*HAVE_GIFLIB_5*/
+	}
+
+	if( !save->strip &&
+		vips_image_get_typeof( save->ready, "gif-comment" ) ) {
+		const char *comment;
+
+		if( vips_image_get_string( save->ready,
+			"gif-comment", &comment ) )
+			return( -1 );
+		if( EGifPutComment( gif->file, comment ) == GIF_ERROR ) {
+			vips_foreign_save_gif_error( gif );
+			return( -1 );
+		}
+	}
+
+	gif->have_header = TRUE;
+
+	return( 0 );
+}
+
+/* Write a quantised frame. giflib LZW-compresses as we go.
+ */
+static int
+vips_foreign_save_gif_frame_write( VipsForeignSaveGifFrame *frame )
+{
+	VipsForeignSaveGif *gif = frame->gif;
+
+	GifByteType gce[4];
+	int dispose;
+	int delay;
+	ColorMapObject *map;
+	int result;
+	int y;
+
+	/* When we are differencing, each frame is drawn on top of the
+	 * previous one. Otherwise, clear to transparent before the next
+	 * frame.
+	 */
+	dispose = gif->diff ? DISPOSE_DO_NOT : DISPOSE_BACKGROUND;
+
+	/* giflib uses centiseconds.
+	 */
+	delay = 40;
+	if( gif->delays &&
+		frame->page < gif->delays_length )
+		delay = gif->delays[frame->page];
+	delay = VIPS_CLIP( 0, VIPS_RINT( delay / 10.0 ), 0xffff );
+
+	gce[0] = (dispose << 2) | (frame->transparent >= 0 ? 1 : 0);
+	gce[1] = delay & 0xff;
+	gce[2] = (delay >> 8) & 0xff;
+	gce[3] = frame->transparent >= 0 ? frame->transparent : 0;
+	if( EGifPutExtension( gif->file,
+		GRAPHICS_EXT_FUNC_CODE, 4, gce ) == GIF_ERROR ) {
+		vips_foreign_save_gif_error( gif );
+		return( -1 );
+	}
+
+	map = NULL;
+	if( !gif->have_palette &&
+		!(map = vips_foreign_save_gif_colormap( &frame->palette )) )
+		return( -1 );
+
+	result = EGifPutImageDesc( gif->file,
+		frame->rect.left, frame->rect.top,
+		frame->rect.width, frame->rect.height,
+		FALSE, map );
+	VIPS_FREEF( GifFreeMapObject, map );
+	if( result == GIF_ERROR ) {
+		vips_foreign_save_gif_error( gif );
+		return( -1 );
+	}
+
+	for( y = 0; y < frame->rect.height; y++ )
+		if( EGifPutLine( gif->file,
+			frame->index + y * frame->rect.width,
+			frame->rect.width ) == GIF_ERROR ) {
+			vips_foreign_save_gif_error( gif );
+			return( -1 );
+		}
+
+	return( 0 );
+}
+
+/* Quantise the batch in parallel, then write in order.
+ */
+static int
+vips_foreign_save_gif_batch_write( VipsForeignSaveGif *gif )
+{
+	VipsPel *last;
+	int i;
+
+#ifdef DEBUG
+	printf( "vips_foreign_save_gif_batch_write: %d frames\n",
+		gif->n_batch );
+#endif /*DEBUG*/
+
+	if( gif->n_batch == 0 )
+		return( 0 );
+
+	/* Each frame is differenced against the one before, so the first
+	 * needs the end of the previous batch.
+	 */
+	for( i = 0; i < gif->n_batch; i++ ) {
+		VipsForeignSaveGifFrame *frame = &gif->batch[i];
+
+		if( !gif->diff )
+			frame->previous = NULL;
+		else if( i == 0 )
+			frame->previous = frame->page > 0 ?
+				gif->previous : NULL;
+		else
+			frame->previous = gif->batch[i - 1].rgba;
+	}
+
+	if( vips_foreign_save_gif_batch_run( gif,
+		vips_foreign_save_gif_frame_analyse ) )
+		return( -1 );
+
+	if( gif->global_palette &&
+		!gif->have_palette &&
+		vips_foreign_save_gif_build_palette( gif ) )
+		return( -1 );
+
+	if( vips_foreign_save_gif_batch_run( gif,
+		vips_foreign_save_gif_frame_quantise ) )
+		return( -1 );
+
+	if( !gif->have_header &&
+		vips_foreign_save_gif_write_header( gif ) )
+		return( -1 );
+
+	for( i = 0; i < gif->n_batch; i++ )
+		if( vips_foreign_save_gif_frame_write( &gif->batch[i] ) )
+			return( -1 );
+
+	/* Keep the last frame for the next batch, and free the rest.
+	 */
+	last = gif->batch[gif->n_batch - 1].rgba;
+	gif->batch[gif->n_batch - 1].rgba = NULL;
+	VIPS_FREE( gif->previous );
+	gif->previous = last;
+
+	for( i = 0; i < gif->n_batch; i++ )
+		vips_foreign_save_gif_frame_free( &gif->batch[i] );
+	gif->n_batch = 0;
+
+	return( 0 );
+}
+
+static int
+vips_foreign_save_gif_write_block( VipsRegion *region, VipsRect *area,
+	void *a )
+{
+	VipsForeignSaveGif *gif = (VipsForeignSaveGif *) a;
+	int bands = region->im->Bands;
+
+	int x, y;
+
+	for( y = 0; y < area->height; y++ ) {
+		int page = (area->top + y) / gif->page_height;
+		int line = (area->top + y) % gif->page_height;
+
+		VipsPel *p = VIPS_REGION_ADDR( region, 0, area->top + y );
+		VipsPel *q;
+
+		if( !gif->rgba &&
+			!(gif->rgba = VIPS_ARRAY( NULL,
+				4 * gif->page_width * gif->page_height,
+				VipsPel )) )
+			return( -1 );
+		q = gif->rgba + 4 * line * gif->page_width;
+
+		/* Transparency is binary, so threshold alpha, and zap
+		 * transparent pixels so they all match.
+		 */
+		for( x = 0; x < gif->page_width; x++ ) {
+			if( (bands == 2 || bands == 4) &&
+				p[bands - 1] < 128 ) {
+				q[0] = 0;
+				q[1] = 0;
+				q[2] = 0;
+				q[3] = 0;
+			}
+			else if( bands < 3 ) {
+				q[0] = p[0];
+				q[1] = p[0];
+				q[2] = p[0];
+				q[3] = 255;
+			}
+			else {
+				q[0] = p[0];
+				q[1] = p[1];
+				q[2] = p[2];
+				q[3] = 255;
+			}
+
+			p += bands;
+			q += 4;
+		}
+
+		/* Did we just complete a page? Hand it to the batch.
+		 */
+		if( line == gif->page_height - 1 ) {
+			VipsForeignSaveGifFrame *frame =
+				&gif->batch[gif->n_batch];
+
+			frame->page = page;
+			frame->rgba = gif->rgba;
+			gif->rgba = NULL;
+			gif->n_batch += 1;
+
+			if( gif->n_batch == gif->batch_size ||
+				page == gif->n_pages - 1 )
+				if( vips_foreign_save_gif_batch_write( gif ) )
+					return( -1 );
+		}
+	}
+
+	return( 0 );
+}
+
+static int
+vips_foreign_save_gif_build( VipsObject *object )
+{
+	VipsObjectClass *class = VIPS_OBJECT_GET_CLASS( object );
+	VipsForeignSave *save = (VipsForeignSave *) object;
+	VipsForeignSaveGif *gif = (VipsForeignSaveGif *) object;
+
+	int i;
+
+	if( VIPS_OBJECT_CLASS( vips_foreign_save_gif_parent_class )->
+		build( object ) )
+		return( -1 );
+
+	gif->page_width = save->ready->Xsize;
+	gif->page_height = vips_image_get_page_height( save->ready );
+	gif->n_pages = save->ready->Ysize / gif->page_height;
+
+	if( gif->page_width > 65535 ||
+		gif->page_height > 65535 ) {
+		vips_error( class->nickname, "%s", _( "frame too large" ) );
+		return( -1 );
+	}
+
+	/* Frame differences only work for opaque images.
+	 */
+	gif->diff = save->ready->Bands == 1 ||
+		save->ready->Bands == 3;
+
+	/* Animation metadata.
+	 */
+	if( vips_image_get_typeof( save->ready, "delay" ) ) {
+		int *delays;
+
+		if( vips_image_get_array_int( save->ready,
+			"delay", &delays, &gif->delays_length ) )
+			return( -1 );
+		if( !(gif->delays = VIPS_ARRAY( NULL,
+			gif->delays_length, int )) )
+			return( -1 );
+		memcpy( gif->delays, delays,
+			gif->delays_length * sizeof( int ) );
+	}
+	else if( vips_image_get_typeof( save->ready, "gif-delay" ) ) {
+		int delay;
+
+		if( vips_image_get_int( save->ready, "gif-delay", &delay ) )
+			return( -1 );
+		gif->delays_length = gif->n_pages;
+		if( !(gif->delays = VIPS_ARRAY( NULL, gif->n_pages, int )) )
+			return( -1 );
+		for( i = 0; i < gif->n_pages; i++ )
+			gif->delays[i] = delay * 10;
+	}
+
+	gif->loop = 0;
+	if( vips_image_get_typeof( save->ready, "loop" ) ) {
+		if( vips_image_get_int( save->ready, "loop", &gif->loop ) )
+			return( -1 );
+	}
+	else if( vips_image_get_typeof( save->ready, "gif-loop" ) ) {
+		/* DEPRECATED "gif-loop" is one less than "loop", except
+		 * that 0 means forever.
+		 */
+		if( vips_image_get_int( save->ready, "gif-loop", &gif->loop ) )
+			return( -1 );
+		if( gif->loop != 0 )
+			gif->loop += 1;
+	}
+
+	/* Quantising is the slow part, so we do a batch of frames in
+	 * parallel.
+	 */
+	gif->batch_size = VIPS_CLIP( 1, vips_concurrency_get(), 256 );
+	if( !(gif->batch = VIPS_ARRAY( NULL,
+		gif->batch_size, VipsForeignSaveGifFrame )) )
+		return( -1 );
+	memset( gif->batch, 0,
+		gif->batch_size * sizeof( VipsForeignSaveGifFrame ) );
+	for( i = 0; i < gif->batch_size; i++ )
+		gif->batch[i].gif = gif;
+
+#ifdef HAVE_GIFLIB_5
+{
+	int error;
+
+	if( !(gif->file = EGifOpen( gif,
+		vips_foreign_save_gif_write, &error )) ) {
+		vips_error( class->nickname, "%s", GifErrorString( error ) );
+		return( -1 );
+	}
+	EGifSetGifVersion( gif->file, TRUE );
+}
+#else /*!HAVE_GIFLIB_5*/
+	EGifSetGifVersion( "89a" );
+	if( !(gif->file = EGifOpen( gif, vips_foreign_save_gif_write )) ) {
+		vips_foreign_save_gif_error( gif );
+		return( -1 );
+	}
+#endif /*HAVE_GIFLIB_5*/
+
+	if( vips_sink_disc( save->ready,
+		vips_foreign_save_gif_write_block, gif ) )
+		return( -1 );
+
+	/* Writes the trailer.
+	 */
+	if( vips_foreign_save_gif_close( gif ) )
+		return( -1 );
+
+	if( vips_target_end( gif->target ) )
+		return( -1 );
+
+	return( 0 );
+}
+
+static const char *vips_foreign_save_gif_suffs[] = { ".gif", NULL };
+
+#define UC VIPS_FORMAT_UCHAR
+
+static int vips_foreign_save_gif_bandfmt[10] = {
+/* UC  C   US  S   UI  I   F   X   D   DX */
+   UC, UC, UC, UC, UC, UC, UC, UC, UC, UC
+};
+
+static void
+vips_foreign_save_gif_class_init( VipsForeignSaveGifClass *class )
+{
+	GObjectClass *gobject_class = G_OBJECT_CLASS( class );
+	VipsObjectClass *object_class = (VipsObjectClass *) class;
+	VipsForeignClass *foreign_class = (VipsForeignClass *) class;
+	VipsForeignSaveClass *save_class = (VipsForeignSaveClass *) class;
+
+	gobject_class->dispose = vips_foreign_save_gif_dispose;
+	gobject_class->set_property = vips_object_set_property;
+	gobject_class->get_property = vips_object_get_property;
+
+	object_class->nickname = "gifsave_base";
+	object_class->description = _( "save as gif" );
+	object_class->build = vips_foreign_save_gif_build;
+
+	foreign_class->suffs = vips_foreign_save_gif_suffs;
+
+	save_class->saveable = VIPS_SAVEABLE_RGBA_ONLY;
+	save_class->format_table = vips_foreign_save_gif_bandfmt;
+
+	VIPS_ARG_INT( class, "colours", 10,
+		_( "Colours" ),
+		_( "Max number of palette colours" ),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET( VipsForeignSaveGif, colours ),
+		2, 256, 256 );
+
+	VIPS_ARG_INT( class, "Q", 11,
+		_( "Quality" ),
+		_( "Quantisation quality" ),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET( VipsForeignSaveGif, Q ),
+		0, 100, 100 );
+
+	VIPS_ARG_DOUBLE( class, "dither", 12,
+		_( "Dithering" ),
+		_( "Amount of dithering" ),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET( VipsForeignSaveGif, dither ),
+		0.0, 1.0, 1.0 );
+
+	VIPS_ARG_BOOL( class, "global_palette", 13,
+		_( "Global palette" ),
+		_( "Use one palette for all frames" ),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET( VipsForeignSaveGif, global_palette ),
+		FALSE );
+
+}
+
+static void
+vips_foreign_save_gif_init( VipsForeignSaveGif *gif )
+{
+	gif->colours = 256;
+	gif->Q = 100;
+	gif->dither = 1.0;
+	gif->transparent = -1;
+}
+
+typedef struct _VipsForeignSaveGifFile {
+	VipsForeignSaveGif parent_object;
+
+	/* Filename for save.
+	 */
+	char *filename;
+
+} VipsForeignSaveGifFile;
+
+typedef VipsForeignSaveGifClass VipsForeignSaveGifFileClass;
+
+G_DEFINE_TYPE( VipsForeignSaveGifFile, vips_foreign_save_gif_file,
+	vips_foreign_save_gif_get_type() );
+
+static int
+vips_foreign_save_gif_file_build( VipsObject *object )
+{
+	VipsForeignSaveGif *gif = (VipsForeignSaveGif *) object;
+	VipsForeignSaveGifFile *file = (VipsForeignSaveGifFile *) object;
+
+	if( !(gif->target = vips_target_new_to_file( file->filename )) )
+		return( -1 );
+
+	if( VIPS_OBJECT_CLASS( vips_foreign_save_gif_file_parent_class )->
+		build( object ) )
+		return( -1 );
+
+	return( 0 );
+}
+
+static void
+vips_foreign_save_gif_file_class_init( VipsForeignSaveGifFileClass *class )
+{
+	GObjectClass *gobject_class = G_OBJECT_CLASS( class );
+	VipsObjectClass *object_class = (VipsObjectClass *) class;
+
+	gobject_class->set_property = vips_object_set_property;
+	gobject_class->get_property = vips_object_get_property;
+
+	object_class->nickname = "gifsave";
+	object_class->description = _( "save image to gif file" );
+	object_class->build = vips_foreign_save_gif_file_build;
+
+	VIPS_ARG_STRING( class, "filename", 1,
+		_( "Filename" ),
+		_( "Filename to save to" ),
+		VIPS_ARGUMENT_REQUIRED_INPUT,
+		G_STRUCT_OFFSET( VipsForeignSaveGifFile, filename ),
+		NULL );
+
+}
+
+static void
+vips_foreign_save_gif_file_init( VipsForeignSaveGifFile *file )
+{
+}
+
+typedef struct _VipsForeignSaveGifBuffer {
+	VipsForeignSaveGif parent_object;
+
+	/* Save to a buffer.
+	 */
+	VipsArea *buf;
+
+} VipsForeignSaveGifBuffer;
+
+typedef VipsForeignSaveGifClass VipsForeignSaveGifBufferClass;
+
+G_DEFINE_TYPE( VipsForeignSaveGifBuffer, vips_foreign_save_gif_buffer,
+	vips_foreign_save_gif_get_type() );
+
+static int
+vips_foreign_save_gif_buffer_build( VipsObject *object )
+{
+	VipsForeignSaveGif *gif = (VipsForeignSaveGif *) object;
+	VipsForeignSaveGifBuffer *buffer =
+		(VipsForeignSaveGifBuffer *) object;
+
+	VipsBlob *blob;
+
+	if( !(gif->target = vips_target_new_to_memory()) )
+		return( -1 );
+
+	if( VIPS_OBJECT_CLASS( vips_foreign_save_gif_buffer_parent_class )->
+		build( object ) )
+		return( -1 );
+
+	g_object_get( gif->target, "blob", &blob, NULL );
+	g_object_set( buffer, "buffer", blob, NULL );
+	vips_area_unref( VIPS_AREA( blob ) );
+
+	return( 0 );
+}
+
+static void
+vips_foreign_save_gif_buffer_class_init(
+	VipsForeignSaveGifBufferClass *class )
+{
+	GObjectClass *gobject_class = G_OBJECT_CLASS( class );
+	VipsObjectClass *object_class = (VipsObjectClass *) class;
+
+	gobject_class->set_property = vips_object_set_property;
+	gobject_class->get_property = vips_object_get_property;
+
+	object_class->nickname = "gifsave_buffer";
+	object_class->description = _( "save image to gif buffer" );
+	object_class->build = vips_foreign_save_gif_buffer_build;
+
+	VIPS_ARG_BOXED( class, "buffer", 1,
+		_( "Buffer" ),
+		_( "Buffer to save to" ),
+		VIPS_ARGUMENT_REQUIRED_OUTPUT,
+		G_STRUCT_OFFSET( VipsForeignSaveGifBuffer, buf ),
+		VIPS_TYPE_BLOB );
+
+}
+
+static void
+vips_foreign_save_gif_buffer_init( VipsForeignSaveGifBuffer *buffer )
+{
+}
+
+typedef struct _VipsForeignSaveGifTarget {
+	VipsForeignSaveGif parent_object;
+
+	VipsTarget *target;
+} VipsForeignSaveGifTarget;
+
+typedef VipsForeignSaveGifClass VipsForeignSaveGifTargetClass;
+
+G_DEFINE_TYPE( VipsForeignSaveGifTarget, vips_foreign_save_gif_target,
+	vips_foreign_save_gif_get_type() );
+
+static int
+vips_foreign_save_gif_target_build( VipsObject *object )
+{
+	VipsForeignSaveGif *gif = (VipsForeignSaveGif *) object;
+	VipsForeignSaveGifTarget *target =
+		(VipsForeignSaveGifTarget *) object;
+
+	if( target->target ) {
+		gif->target = target->target;
+		g_object_ref( gif->target );
+	}
+
+	if( VIPS_OBJECT_CLASS( vips_foreign_save_gif_target_parent_class )->
+		build( object ) )
+		return( -1 );
+
+	return( 0 );
+}
+
+static void
+vips_foreign_save_gif_target_class_init(
+	VipsForeignSaveGifTargetClass *class )
+{
+	GObjectClass *gobject_class = G_OBJECT_CLASS( class );
+	VipsObjectClass *object_class = (VipsObjectClass *) class;
+
+	gobject_class->set_property = vips_object_set_property;
+	gobject_class->get_property = vips_object_get_property;
+
+	object_class->nickname = "gifsave_target";
+	object_class->description = _( "save image to gif target" );
+	object_class->build = vips_foreign_save_gif_target_build;
+
+	VIPS_ARG_OBJECT( class, "target", 1,
+		_( "Target" ),
+		_( "Target to save to" ),
+		VIPS_ARGUMENT_REQUIRED_INPUT,
+		G_STRUCT_OFFSET( VipsForeignSaveGifTarget, target ),
+		VIPS_TYPE_TARGET );
+
+}
+
+static void
+vips_foreign_save_gif_target_init( VipsForeignSaveGifTarget *target )
+{
+}
+
+#endif /*defined(HAVE_GIFLIB) && defined(HAVE_IMAGEQUANT)*/
+
+/**
+ * vips_gifsave: (method)
+ * @in: image to save
+ * @filename: file to write to
+ * @...: %NULL-terminated list of optional named arguments
+ *
+ * Optional arguments:
+ *
+ * * @colours: %gint, max number of palette colours
+ * * @Q: %gint, quantisation quality
+ * * @dither: %gdouble, amount of dithering
+ * * @global_palette: %gboolean, use one palette for all frames
+ *
+ * Write a VIPS image to a file in GIF format. Images are quantised with
+ * libimagequant and compressed with giflib.
+ *
+ * Multi-page images are written as animations. Use the metadata items `loop`
+ * and `delay` to set the number of loops for the animation and the frame
+ * delays. Frames are quantised in parallel, with a few frames in
+ * memory at once. For images with no alpha, only the part of each frame
+ * which has changed since the previous frame is written, and unchanged
+ * pixels within that area are made transparent.
+ *
+ * By default, each frame has its own palette. Set @global_palette to share
+ * one palette between all frames. It is computed from the first few frames.
+ *
+ * Use @colours to set the maximum number of palette colours, @Q to set
+ * the quantisation quality, and @dither to set the amount of Floyd-Steinberg
+ * dithering, as for vips_pngsave().
+ *
+ * GIF transparency is binary, so alpha is thresholded at 128.
+ *
+ * See also: vips_image_write_to_file(), vips_gifload().
+ *
+ * Returns: 0 on success, -1 on error.
+ */
+int
+vips_gifsave( VipsImage *in, const char *filename, ... )
+{
+	va_list ap;
+	int result;
+
+	va_start( ap, filename );
+	result = vips_call_split( "gifsave", ap, in, filename );
+	va_end( ap );
+
+	return( result );
+}
+
+/**
+ * vips_gifsave_buffer: (method)
+ * @in: image to save
+ * @buf: (array length=len) (element-type guint8): return output buffer here
+ * @len: (type gsize): return output length here
+ * @...: %NULL-terminated list of optional named arguments
+ *
+ * Optional arguments:
+ *
+ * * @colours: %gint, max number of palette colours
+ * * @Q: %gint, quantisation quality
+ * * @dither: %gdouble, amount of dithering
+ * * @global_palette: %gboolean, use one palette for all frames
+ *
+ * As vips_gifsave(), but save to a memory buffer.
+ *
+ * The address of the buffer is returned in @buf, the length of the buffer in
+ * @len. You are responsible for freeing the buffer with g_free() when you
+ * are done with it.
+ *
+ * See also: vips_gifsave(), vips_image_write_to_file().
+ *
+ * Returns: 0 on success, -1 on error.
+ */
+int
+vips_gifsave_buffer( VipsImage *in, void **buf, size_t *len, ... )
+{
+	va_list ap;
+	VipsArea *area;
+	int result;
+
+	area = NULL;
+
+	va_start( ap, len );
+	result = vips_call_split( "gifsave_buffer", ap, in, &area );
+	va_end( ap );
+
+	if( !result &&
+		area ) {
+		if( buf ) {
+			*buf = area->data;
+			area->free_fn = NULL;
+		}
+		if( len )
+			*len = area->length;
+
+		vips_area_unref( area );
+	}
+
+	return( result );
+}
+
+/**
+ * vips_gifsave_target: (method)
+ * @in: image to save
+ * @target: save image to this target
+ * @...: %NULL-terminated list of optional named arguments
+ *
+ * Optional arguments:
+ *
+ * * @colours: %gint, max number of palette colours
+ * * @Q: %gint, quantisation quality
+ * * @dither: %gdouble, amount of dithering
+ * * @global_palette: %gboolean, use one palette for all frames
+ *
+ * As vips_gifsave(), but save to a target.
+ *
+ * See also: vips_gifsave(), vips_image_write_to_target().
+ *
+ * Returns: 0 on success, -1 on error.
+ */
+int
+vips_gifsave_target( VipsImage *in, VipsTarget *target, ... )
+{
+	va_list ap;
+	int result;
+
+	va_start( ap, target );
+	result = vips_call_split( "gifsave_target", ap, in, target );
+	va_end( ap );
+
+	return( result );
+}
@@ -16,6 +16,8 @@
  * 	- restart after minimise
  * 15/3/20
  * 	- revise for new VipsSource API
+ * 18/10/20
+ * 	- decode grid images tile by tile, on demand and in parallel
  */
 
 /*
@@ -70,6 +72,33 @@
 
 #include "pforeign.h"
 
+#ifdef HAVE_HEIF_DECODE_IMAGE_TILE
+/* A decoded grid tile. 
+ */
+typedef struct _VipsForeignLoadHeifTile {
+	/* Position in the grid.
+	 */
+	int x;
+	int y;
+
+	/* Set once the decode has finished. Until then, @img is NULL and
+	 * other threads wanting this tile must wait on @tile_done.
+	 */
+	gboolean ready;
+
+	struct heif_image *img;
+	const uint8_t *data;
+	int stride;
+	int width;
+	int height;
+
+	/* Number of generate calls using this tile. We can't drop tiles from
+	 * the cache while they are in use.
+	 */
+	int ref_count;
+} VipsForeignLoadHeifTile;
+#endif /*HAVE_HEIF_DECODE_IMAGE_TILE*/
+
 #define VIPS_TYPE_FOREIGN_LOAD_HEIF (vips_foreign_load_heif_get_type())
 #define VIPS_FOREIGN_LOAD_HEIF( obj ) \
 	(G_TYPE_CHECK_INSTANCE_CAST( (obj), \
@@ -168,6 +197,26 @@ typedef struct _VipsForeignLoadHeif {
 	 */
 	gint64 length;
 
+#ifdef HAVE_HEIF_DECODE_IMAGE_TILE
+	/* Set if we are decoding a grid image tile by tile. 
+	 */
+	gboolean tiled;
+	int tile_width;
+	int tile_height;
+	int tiles_across;
+
+	/* Decoded tiles, most recently used first. Keep at most @max_tiles
+	 * of them. 
+	 */
+	GList *tiles;
+	int max_tiles;
+
+	/* Lock the tile cache, signal @tile_done when a decode finishes.
+	 */
+	GMutex *lock;
+	GCond *tile_done;
+#endif /*HAVE_HEIF_DECODE_IMAGE_TILE*/
+
 } VipsForeignLoadHeif;
 
 typedef struct _VipsForeignLoadHeifClass {
@@ -178,11 +227,28 @@ typedef struct _VipsForeignLoadHeifClass {
 G_DEFINE_ABSTRACT_TYPE( VipsForeignLoadHeif, vips_foreign_load_heif, 
 	VIPS_TYPE_FOREIGN_LOAD );
 
+#ifdef HAVE_HEIF_DECODE_IMAGE_TILE
+static void
+vips_foreign_load_heif_tile_free( VipsForeignLoadHeifTile *tile )
+{
+	VIPS_FREEF( heif_image_release, tile->img );
+	g_free( tile );
+}
+#endif /*HAVE_HEIF_DECODE_IMAGE_TILE*/
+
 static void
 vips_foreign_load_heif_dispose( GObject *gobject )
 {
 	VipsForeignLoadHeif *heif = (VipsForeignLoadHeif *) gobject;
 
+#ifdef HAVE_HEIF_DECODE_IMAGE_TILE
+	g_list_free_full( heif->tiles, 
+		(GDestroyNotify) vips_foreign_load_heif_tile_free );
+	heif->tiles = NULL;
+	VIPS_FREEF( vips_g_mutex_free, heif->lock );
+	VIPS_FREEF( vips_g_cond_free, heif->tile_done );
+#endif /*HAVE_HEIF_DECODE_IMAGE_TILE*/
+
 	heif->data = NULL;
 	VIPS_FREEF( heif_image_release, heif->img );
 	VIPS_FREEF( heif_image_handle_release, heif->handle );
@@ -261,11 +327,102 @@ vips_foreign_load_heif_is_a( const char *buf, int len )
 	return( 0 );
 }
 
+static int
+vips_foreign_load_heif_get_width( VipsForeignLoadHeif *heif, 
+	struct heif_image_handle *handle )
+{
+	int width;
+
+	/* _get_ipse_width() fetches the untransformed dimension, but was only
+	 * added in 1.3.4. Without it, we just use the transformed dimension
+	 * and have to autorotate.
+	 */
+	width = heif_image_handle_get_width( handle );
+#ifdef HAVE_HEIF_IMAGE_HANDLE_GET_ISPE_WIDTH
+	if( !heif->autorotate ) 
+		width = heif_image_handle_get_ispe_width( handle );
+#endif /*HAVE_HEIF_IMAGE_HANDLE_GET_ISPE_WIDTH*/
+
+	return( width );
+}
+
+static int
+vips_foreign_load_heif_get_height( VipsForeignLoadHeif *heif,
+	struct heif_image_handle *handle )
+{
+	int height;
+
+	height = heif_image_handle_get_height( handle );
+#ifdef HAVE_HEIF_IMAGE_HANDLE_GET_ISPE_WIDTH
+	if( !heif->autorotate )
+		height = heif_image_handle_get_ispe_height( handle );
+#endif /*HAVE_HEIF_IMAGE_HANDLE_GET_ISPE_WIDTH*/
+
+	return( height );
+}
+
+#ifdef HAVE_HEIF_DECODE_IMAGE_TILE
+/* TRUE if we can decode @handle tile by tile. We only do this for single
+ * pages without autorotate or thumbnail, there's no point unless there's more than 
+ * one tile, and the grid must cover exactly the image we load.
+ *
+ * get_flags and header must agree, so both use this.
+ */
+static gboolean
+vips_foreign_load_heif_get_tiling( VipsForeignLoadHeif *heif, 
+	struct heif_image_handle *handle, struct heif_image_tiling *tiling )
+{
+	struct heif_error error;
+
+	if( heif->n != 1 ||
+		heif->autorotate ||
+		heif->thumbnail )
+		return( FALSE );
+
+	error = heif_image_handle_get_image_tiling( handle, FALSE, tiling );
+	if( error.code )
+		return( FALSE );
+
+	return( tiling->num_columns * tiling->num_rows > 1 &&
+		tiling->tile_width > 0 &&
+		tiling->tile_height > 0 &&
+		tiling->left_offset == 0 &&
+		tiling->top_offset == 0 &&
+		tiling->image_width == 
+			vips_foreign_load_heif_get_width( heif, handle ) &&
+		tiling->image_height == 
+			vips_foreign_load_heif_get_height( heif, handle ) );
+}
+#endif /*HAVE_HEIF_DECODE_IMAGE_TILE*/
+
 static VipsForeignFlags
 vips_foreign_load_heif_get_flags( VipsForeignLoad *load )
 {
-	/* FIXME .. could support random access for grid images.
+#ifdef HAVE_HEIF_DECODE_IMAGE_TILE
+	VipsForeignLoadHeif *heif = (VipsForeignLoadHeif *) load;
+
+	/* Grid images can be decoded tile by tile, so we support random 
+	 * access and can load just the part we need. @page is not 
+	 * resolved yet, so we can only test the primary image, which is 
+	 * the page we load when @page is not set.
 	 */
+	if( !vips_object_argument_isset( VIPS_OBJECT( load ), "page" ) ) {
+		struct heif_image_handle *handle;
+		struct heif_image_tiling tiling;
+		gboolean tiled;
+
+		if( heif_context_get_primary_image_handle( heif->ctx, 
+			&handle ).code )
+			return( VIPS_FOREIGN_SEQUENTIAL );
+		tiled = vips_foreign_load_heif_get_tiling( heif, 
+			handle, &tiling );
+		heif_image_handle_release( handle );
+
+		if( tiled )
+			return( VIPS_FOREIGN_PARTIAL );
+	}
+#endif /*HAVE_HEIF_DECODE_IMAGE_TILE*/
+
 	return( VIPS_FOREIGN_SEQUENTIAL );
 }
 
@@ -504,40 +661,6 @@ vips_foreign_load_heif_set_header( VipsForeignLoadHeif *heif, VipsImage *out )
 	return( 0 );
 }
 
-static int
-vips_foreign_load_heif_get_width( VipsForeignLoadHeif *heif, 
-	struct heif_image_handle *handle )
-{
-	int width;
-
-	/* _get_ipse_width() fetches the untransformed dimension, but was only
-	 * added in 1.3.4. Without it, we just use the transformed dimension
-	 * and have to autorotate.
-	 */
-	width = heif_image_handle_get_width( handle );
-#ifdef HAVE_HEIF_IMAGE_HANDLE_GET_ISPE_WIDTH
-	if( !heif->autorotate ) 
-		width = heif_image_handle_get_ispe_width( handle );
-#endif /*HAVE_HEIF_IMAGE_HANDLE_GET_ISPE_WIDTH*/
-
-	return( width );
-}
-
-static int
-vips_foreign_load_heif_get_height( VipsForeignLoadHeif *heif,
-	struct heif_image_handle *handle )
-{
-	int height;
-
-	height = heif_image_handle_get_height( handle );
-#ifdef HAVE_HEIF_IMAGE_HANDLE_GET_ISPE_WIDTH
-	if( !heif->autorotate )
-		height = heif_image_handle_get_ispe_height( handle );
-#endif /*HAVE_HEIF_IMAGE_HANDLE_GET_ISPE_WIDTH*/
-
-	return( height );
-}
-
 static int
 vips_foreign_load_heif_header( VipsForeignLoad *load )
 {
@@ -674,6 +797,34 @@ vips_foreign_load_heif_header( VipsForeignLoad *load )
 	}
 #endif /*DEBUG*/
 
+#ifdef HAVE_HEIF_DECODE_IMAGE_TILE
+{
+	struct heif_image_tiling tiling;
+
+	if( vips_foreign_load_heif_set_page( heif, 
+		heif->page, heif->thumbnail ) )
+		return( -1 );
+	if( vips_foreign_load_heif_get_tiling( heif, heif->handle, &tiling ) ) {
+		heif->tiled = TRUE;
+		heif->tile_width = tiling.tile_width;
+		heif->tile_height = tiling.tile_height;
+		heif->tiles_across = tiling.num_columns;
+
+		/* Enough for a row of tiles, plus one for each worker.
+		 */
+		heif->max_tiles = heif->tiles_across + vips_concurrency_get();
+	}
+
+#ifdef DEBUG
+	printf( "tiled = %d\n", heif->tiled );
+	if( heif->tiled ) 
+		printf( "  %d x %d tiles of %d x %d pixels\n", 
+			tiling.num_columns, tiling.num_rows,
+			heif->tile_width, heif->tile_height );
+#endif /*DEBUG*/
+}
+#endif /*HAVE_HEIF_DECODE_IMAGE_TILE*/
+
 	if( vips_foreign_load_heif_set_header( heif, load->out ) )
 		return( -1 );
 
@@ -803,6 +954,215 @@ vips_foreign_load_heif_generate( VipsRegion *or,
 	return( 0 );
 }
 
+#ifdef HAVE_HEIF_DECODE_IMAGE_TILE
+static int
+vips_foreign_load_heif_tile_decode( VipsForeignLoadHeif *heif, 
+	VipsForeignLoadHeifTile *tile, struct heif_image **img )
+{
+	VipsObjectClass *class = VIPS_OBJECT_GET_CLASS( heif );
+	enum heif_chroma chroma = heif->has_alpha ? 
+		heif_chroma_interleaved_RGBA :
+		heif_chroma_interleaved_RGB;
+
+	struct heif_error error;
+	struct heif_decoding_options *options;
+	int width;
+	int height;
+
+#ifdef DEBUG_VERBOSE
+	printf( "vips_foreign_load_heif_tile_decode: %d x %d\n", 
+		tile->x, tile->y );
+#endif /*DEBUG_VERBOSE*/
+
+	/* libheif serialises reads from our source, so we can decode several 
+	 * tiles at once.
+	 */
+	options = heif_decoding_options_alloc();
+	options->ignore_transformations = TRUE;
+	error = heif_image_handle_decode_image_tile( heif->handle, img, 
+		heif_colorspace_RGB, chroma, options, tile->x, tile->y );
+	heif_decoding_options_free( options );
+	if( error.code ) {
+		vips__heif_error( &error );
+		return( -1 );
+	}
+
+	/* Edge tiles can be clipped, but must cover the part of the image
+	 * they are responsible for.
+	 */
+	width = heif_image_get_width( *img, heif_channel_interleaved );
+	height = heif_image_get_height( *img, heif_channel_interleaved );
+	if( width < VIPS_MIN( heif->tile_width, 
+			heif->page_width - tile->x * heif->tile_width ) ||
+		height < VIPS_MIN( heif->tile_height, 
+			heif->page_height - tile->y * heif->tile_height ) ) {
+		VIPS_FREEF( heif_image_release, *img );
+		vips_error( class->nickname, 
+			"%s", _( "bad tile dimensions on decode" ) );
+		return( -1 );
+	}
+
+	return( 0 );
+}
+
+/* Get a decoded tile, from the cache if we can. Several threads can ask for
+ * the same tile at once: only the first decodes, the others wait for it.
+ */
+static VipsForeignLoadHeifTile *
+vips_foreign_load_heif_tile_get( VipsForeignLoadHeif *heif, int x, int y )
+{
+	VipsForeignLoadHeifTile *tile;
+	struct heif_image *img;
+	GList *p;
+	int result;
+
+	g_mutex_lock( heif->lock );
+
+	for(;;) {
+		for( p = heif->tiles; p; p = p->next ) {
+			tile = (VipsForeignLoadHeifTile *) p->data;
+			if( tile->x == x && 
+				tile->y == y ) 
+				break;
+		}
+		if( !p ) 
+			break;
+
+		if( tile->ready ) {
+			/* Move to the front of the LRU.
+			 */
+			heif->tiles = g_list_remove_link( heif->tiles, p );
+			heif->tiles = g_list_concat( p, heif->tiles );
+			tile->ref_count += 1;
+			g_mutex_unlock( heif->lock );
+
+			return( tile );
+		}
+
+		g_cond_wait( heif->tile_done, heif->lock );
+	}
+
+	tile = g_new0( VipsForeignLoadHeifTile, 1 );
+	tile->x = x;
+	tile->y = y;
+	tile->ref_count = 1;
+	heif->tiles = g_list_prepend( heif->tiles, tile );
+
+	g_mutex_unlock( heif->lock );
+
+	img = NULL;
+	result = vips_foreign_load_heif_tile_decode( heif, tile, &img );
+
+	g_mutex_lock( heif->lock );
+
+	if( result ) {
+		heif->tiles = g_list_remove( heif->tiles, tile );
+		vips_foreign_load_heif_tile_free( tile );
+		tile = NULL;
+	}
+	else {
+		tile->img = img;
+		tile->width = heif_image_get_width( img, 
+			heif_channel_interleaved );
+		tile->height = heif_image_get_height( img, 
+			heif_channel_interleaved );
+		tile->data = heif_image_get_plane_readonly( img, 
+			heif_channel_interleaved, &tile->stride );
+		tile->ready = TRUE;
+	}
+
+	g_cond_broadcast( heif->tile_done );
+
+	g_mutex_unlock( heif->lock );
+
+	return( tile );
+}
+
+/* Finished with a tile: trim the cache, oldest first, skipping tiles which 
+ * are still in use or being decoded.
+ */
+static void
+vips_foreign_load_heif_tile_unref( VipsForeignLoadHeif *heif, 
+	VipsForeignLoadHeifTile *tile )
+{
+	GList *p;
+	GList *prev;
+	int n_tiles;
+
+	g_mutex_lock( heif->lock );
+
+	tile->ref_count -= 1;
+
+	n_tiles = g_list_length( heif->tiles );
+	for( p = g_list_last( heif->tiles ); 
+		p && n_tiles > heif->max_tiles; p = prev ) {
+		VipsForeignLoadHeifTile *old = 
+			(VipsForeignLoadHeifTile *) p->data;
+
+		prev = p->prev;
+
+		if( old->ready &&
+			old->ref_count == 0 ) {
+			heif->tiles = g_list_delete_link( heif->tiles, p );
+			vips_foreign_load_heif_tile_free( old );
+			n_tiles -= 1;
+		}
+	}
+
+	g_mutex_unlock( heif->lock );
+}
+
+static int
+vips_foreign_load_heif_generate_tiled( VipsRegion *or, 
+	void *seq, void *a, void *b, gboolean *stop )
+{
+	VipsForeignLoadHeif *heif = (VipsForeignLoadHeif *) a;
+        VipsRect *r = &or->valid;
+	int ps = VIPS_IMAGE_SIZEOF_PEL( or->im );
+
+	int x, y, z;
+
+#ifdef DEBUG_VERBOSE
+	printf( "vips_foreign_load_heif_generate_tiled: "
+		"left = %d, top = %d, width = %d, height = %d\n", 
+		r->left, r->top, r->width, r->height );
+#endif /*DEBUG_VERBOSE*/
+
+	for( y = r->top / heif->tile_height; 
+		y <= (VIPS_RECT_BOTTOM( r ) - 1) / heif->tile_height; y++ )
+		for( x = r->left / heif->tile_width; 
+			x <= (VIPS_RECT_RIGHT( r ) - 1) / heif->tile_width; 
+			x++ ) {
+			VipsForeignLoadHeifTile *tile;
+			VipsRect area;
+			VipsRect hit;
+
+			if( !(tile = vips_foreign_load_heif_tile_get( heif, 
+				x, y )) )
+				return( -1 );
+
+			area.left = x * heif->tile_width;
+			area.top = y * heif->tile_height;
+			area.width = tile->width;
+			area.height = tile->height;
+			vips_rect_intersectrect( r, &area, &hit );
+
+			for( z = 0; z < hit.height; z++ ) 
+				memcpy( VIPS_REGION_ADDR( or, 
+						hit.left, hit.top + z ),
+					tile->data + 
+						(size_t) tile->stride * 
+						(hit.top - area.top + z) +
+						ps * (hit.left - area.left),
+					ps * hit.width );
+
+			vips_foreign_load_heif_tile_unref( heif, tile );
+		}
+
+	return( 0 );
+}
+#endif /*HAVE_HEIF_DECODE_IMAGE_TILE*/
+
 static void
 vips_foreign_load_heif_minimise( VipsObject *object, VipsForeignLoadHeif *heif )
 {
@@ -830,6 +1190,24 @@ vips_foreign_load_heif_load( VipsForeignLoad *load )
 	g_signal_connect( t[0], "minimise", 
 		G_CALLBACK( vips_foreign_load_heif_minimise ), heif ); 
 
+#ifdef HAVE_HEIF_DECODE_IMAGE_TILE
+	/* _set_header() selects the main image for the metadata, we need 
+	 * the thumbnail back if that's what we are decoding. We never change
+	 * page after this, so the generate can use @handle from many threads.
+	 */
+	if( heif->tiled ) {
+		if( vips_foreign_load_heif_set_page( heif, 
+			heif->page, heif->thumbnail ) ||
+			vips_image_generate( t[0],
+				NULL, vips_foreign_load_heif_generate_tiled, 
+				NULL, heif, NULL ) ||
+			vips_image_write( t[0], load->real ) )
+			return( -1 );
+
+		return( 0 );
+	}
+#endif /*HAVE_HEIF_DECODE_IMAGE_TILE*/
+
 	if( vips_image_generate( t[0],
 		NULL, vips_foreign_load_heif_generate, NULL, heif, NULL ) ||
 		vips_sequential( t[0], &t[1], NULL ) ||
@@ -963,6 +1341,11 @@ vips_foreign_load_heif_init( VipsForeignLoadHeif *heif )
 	heif->reader->seek = vips_foreign_load_heif_seek;
 	heif->reader->wait_for_file_size = 
 		vips_foreign_load_heif_wait_for_file_size;
+
+#ifdef HAVE_HEIF_DECODE_IMAGE_TILE
+	heif->lock = vips_g_mutex_new();
+	heif->tile_done = vips_g_cond_new();
+#endif /*HAVE_HEIF_DECODE_IMAGE_TILE*/
 }
 
 typedef struct _VipsForeignLoadHeifFile {
@@ -1219,6 +1602,13 @@ vips_foreign_load_heif_source_init( VipsForeignLoadHeifSource *source )
  * If @thumbnail is %TRUE, then fetch a stored thumbnail rather than the
  * image.
  *
+ * Images stored as a grid of tiles, such as photos from most phones, are 
+ * decoded a tile at a time as regions of the image are needed, and several 
+ * tiles can be decoded at once. Only the tiles a region touches are 
+ * decoded, so crops and shrinks of large images are much quicker, and the 
+ * loader supports random access. This needs libheif 1.19 or later, and 
+ * is only done for single pages with @autorotate off.
+ *
  * Setting @autorotate to %TRUE will make the loader interpret the 
  * orientation tag and automatically rotate the image appropriately during
  * load. 
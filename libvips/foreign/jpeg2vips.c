@@ -106,6 +106,8 @@
  * 	- restart after minimise
  * 14/10/19
  * 	- revise for source IO
+ * 18/10/20
+ * 	- skip scanlines above the region of interest hinted downstream
  */
 
 /*
@@ -737,6 +739,9 @@ read_jpeg_generate( VipsRegion *or,
 	struct jpeg_decompress_struct *cinfo = &jpeg->cinfo;
 	int sz = cinfo->output_width * cinfo->output_components;
 
+#ifdef HAVE_JPEG_SKIP_SCANLINES
+	VipsRect roi;
+#endif /*HAVE_JPEG_SKIP_SCANLINES*/
 	int y;
 
 #ifdef DEBUG_VERBOSE
@@ -801,6 +806,25 @@ read_jpeg_generate( VipsRegion *or,
 		return( -1 );
 	}
 
+#ifdef HAVE_JPEG_SKIP_SCANLINES
+	/* If this strip is entirely above the region of interest downstream 
+	 * has hinted, skip it without decoding. We can't do this if we are
+	 * autorotating, since the roi is in the rotated space.
+	 */
+	if( !jpeg->autorotate &&
+		vips__foreign_load_get_roi( 
+			(VipsImage *) cinfo->client_data, &roi ) &&
+		VIPS_RECT_BOTTOM( r ) <= roi.top ) {
+		vips_region_black( or );
+		jpeg_skip_scanlines( cinfo, r->height );
+		jpeg->y_pos += r->height; 
+
+		VIPS_GATE_STOP( "read_jpeg_generate: work" );
+
+		return( 0 );
+	}
+#endif /*HAVE_JPEG_SKIP_SCANLINES*/
+
 	for( y = 0; y < r->height; y++ ) {
 		JSAMPROW row_pointer[1];
 
@@ -133,7 +133,8 @@ vips_foreign_save_matrix_build( VipsObject *object )
 		return( -1 );
 
 	if( vips_sink_disc( save->ready,
-		vips_foreign_save_matrix_block, matrix ) )
+		vips_foreign_save_matrix_block, matrix ) ||
+		vips_target_end( matrix->target ) )
 		return( -1 );
 
 	return( 0 );
@@ -16,6 +16,8 @@
  * 	- reopen the input if we minimised too early
  * 11/3/20
  * 	- move on top of VipsSource
+ * 18/10/20
+ * 	- render strips in parallel from a pool of documents
  */
 
 /*
@@ -117,14 +119,21 @@ typedef struct _VipsForeignLoadPdf {
 	 */
 	VipsArrayDouble *background;
 
-	/* Poppler is not thread-safe, so we run inside a single-threaded
-	 * cache. On the plus side, this means we only need one @page pointer,
-	 * even though we change this during _generate().
+	/* The document we read the header from. @page is only used during
+	 * header read.
 	 */
 	PopplerDocument *doc;
 	PopplerPage *page;
 	int current_page;
 
+	/* Poppler is not thread-safe, but separate documents can render on 
+	 * separate threads. We keep a pool of documents opened from a memory 
+	 * map of the source, up to one per worker.
+	 */
+	VipsForeignPool *pool;
+	const void *data;
+	size_t length;
+
 	/* Doc has this many pages. 
 	 */
 	int n_pages;
@@ -154,6 +163,7 @@ vips_foreign_load_pdf_dispose( GObject *gobject )
 {
 	VipsForeignLoadPdf *pdf = VIPS_FOREIGN_LOAD_PDF( gobject );
 
+	VIPS_FREEF( vips__foreign_pool_free, pdf->pool );
 	VIPS_UNREF( pdf->page );
 	VIPS_UNREF( pdf->doc );
 	VIPS_UNREF( pdf->source ); 
@@ -376,13 +386,34 @@ vips_foreign_load_pdf_header( VipsForeignLoad *load )
 	return( 0 );
 }
 
+/* Open another document for the pool.
+ */
+static void *
+vips_foreign_load_pdf_open( void *a )
+{
+	VipsForeignLoadPdf *pdf = VIPS_FOREIGN_LOAD_PDF( a );
+
+	GError *error = NULL;
+	PopplerDocument *doc;
+
+	if( !(doc = poppler_document_new_from_data( (char *) pdf->data, 
+		pdf->length, NULL, &error )) ) { 
+		vips_g_error( &error );
+		return( NULL ); 
+	}
+
+	return( doc );
+}
+
 static int
 vips_foreign_load_pdf_generate( VipsRegion *or, 
 	void *seq, void *a, void *b, gboolean *stop )
 {
 	VipsForeignLoadPdf *pdf = VIPS_FOREIGN_LOAD_PDF( a );
+	VipsObjectClass *class = VIPS_OBJECT_GET_CLASS( pdf );
 	VipsRect *r = &or->valid;
 
+	PopplerDocument *doc;
 	int top;
 	int i;
 	int y;
@@ -405,11 +436,26 @@ vips_foreign_load_pdf_generate( VipsRegion *or,
 		if( VIPS_RECT_BOTTOM( &pdf->pages[i] ) > r->top )
 			break;
 
+	/* Each document is only used by one thread at a time.
+	 */
+	if( !(doc = vips__foreign_pool_get( pdf->pool )) )
+		return( -1 );
+
 	top = r->top; 
 	while( top < VIPS_RECT_BOTTOM( r ) ) {
 		VipsRect rect;
 		cairo_surface_t *surface;
 		cairo_t *cr;
+		PopplerPage *page;
+
+		if( !(page = poppler_document_get_page( doc, 
+			pdf->page_no + i )) ) {
+			vips__foreign_pool_put( pdf->pool, doc );
+			vips_error( class->nickname, 
+				_( "unable to load page %d" ), 
+				pdf->page_no + i );
+			return( -1 ); 
+		}
 
 		vips_rect_intersectrect( r, &pdf->pages[i], &rect );
 
@@ -426,19 +472,17 @@ vips_foreign_load_pdf_generate( VipsRegion *or,
 			(pdf->pages[i].left - rect.left) / pdf->scale, 
 			(pdf->pages[i].top - rect.top) / pdf->scale );
 
-		/* poppler is single-threaded, but we don't need to lock since 
-		 * we're running inside a non-threaded tilecache.
-		 */
-		if( vips_foreign_load_pdf_get_page( pdf, pdf->page_no + i ) )
-			return( -1 ); 
-		poppler_page_render( pdf->page, cr );
+		poppler_page_render( page, cr );
 
 		cairo_destroy( cr );
+		g_object_unref( page );
 
 		top += rect.height;
 		i += 1;
 	}
 
+	vips__foreign_pool_put( pdf->pool, doc );
+
 	/* Cairo makes pre-multipled BRGA, we must byteswap and unpremultiply.
 	 */
 	for( y = 0; y < r->height; y++ ) 
@@ -455,11 +499,26 @@ vips_foreign_load_pdf_load( VipsForeignLoad *load )
 	VipsForeignLoadPdf *pdf = VIPS_FOREIGN_LOAD_PDF( load );
 	VipsImage **t = (VipsImage **) 
 		vips_object_local_array( (VipsObject *) load, 2 );
+	int max_docs = vips_concurrency_get();
+
+	int tile_height;
 
 #ifdef DEBUG
 	printf( "vips_foreign_load_pdf_load: %p\n", pdf );
 #endif /*DEBUG*/
 
+	/* Extra documents are opened from memory, so they don't fight over 
+	 * the read position in @source. Our first document can go straight 
+	 * into the pool.
+	 */
+	if( max_docs > 1 &&
+		!(pdf->data = vips_source_map( pdf->source, &pdf->length )) )
+		return( -1 );
+	pdf->pool = vips__foreign_pool_new( max_docs, 
+		vips_foreign_load_pdf_open, (GDestroyNotify) g_object_unref, 
+		pdf );
+	vips__foreign_pool_add( pdf->pool, g_object_ref( pdf->doc ) );
+
 	/* Read to this image, then cache to out, see below.
 	 */
 	t[0] = vips_image_new(); 
@@ -474,12 +533,16 @@ vips_foreign_load_pdf_load( VipsForeignLoad *load )
 		return( -1 );
 
 	/* Don't use tilecache to keep the number of calls to
-	 * pdf_page_render() low. Don't thread the cache, we rely on
-	 * locking to keep pdf single-threaded. Use a large strip size to
-	 * (again) keep the number of calls to page_render low. 
+	 * pdf_page_render() low. Strips are big, again to keep the number
+	 * of renders down, but small enough that a page is shared out
+	 * between our documents. The cache is threaded, so strips render 
+	 * in parallel.
 	 */
+	tile_height = VIPS_CLIP( 256, pdf->pages[0].height / max_docs, 5000 );
+	tile_height = VIPS_MIN( tile_height, pdf->pages[0].height );
 	if( vips_linecache( t[0], &t[1],
-		"tile_height", VIPS_MIN( 5000, pdf->pages[0].height ), 
+		"tile_height", tile_height, 
+		"threaded", TRUE,
 		NULL ) ) 
 		return( -1 );
 	if( vips_image_write( t[1], load->real ) ) 
@@ -873,7 +936,8 @@ vips_foreign_load_pdf_is_a( const char *filename )
  * "pdf-author". They may be useful. 
  *
  * This function only reads the image header and does not render any pixel
- * data. Rendering occurs when pixels are accessed.
+ * data. Rendering occurs when pixels are accessed. Strips render in 
+ * parallel, with up to one open copy of the document per worker thread.
  *
  * See also: vips_image_new_from_file(), vips_magickload().
  *
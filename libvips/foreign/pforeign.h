@@ -85,10 +85,11 @@ int vips__tiff_write_buf( VipsImage *in,
 
 gboolean vips__istiff_source( VipsSource *source );
 gboolean vips__istifftiled_source( VipsSource *source );
+gboolean vips__istiffmappable_source( VipsSource *source, int page, int n );
 int vips__tiff_read_header_source( VipsSource *source, VipsImage *out, 
 	int page, int n, gboolean autorotate );
 int vips__tiff_read_source( VipsSource *source, VipsImage *out,
-	int page, int n, gboolean autorotate );
+	int page, int n, gboolean autorotate, VipsAccess access );
 
 extern const char *vips__foreign_tiff_suffs[];
 
@@ -182,7 +183,8 @@ extern const char *vips__png_suffs[];
 int vips__png_write_target( VipsImage *in, VipsTarget *target,
 	int compress, int interlace, const char *profile,
 	VipsForeignPngFilter filter, gboolean strip,
-	gboolean palette, int colours, int Q, double dither );
+	gboolean palette, int colours, int Q, double dither,
+	gboolean parallel );
 
 /* Map WEBP metadata names to vips names.
  */
@@ -2,6 +2,8 @@
  *
  * 5/12/11
  * 	- from tiffload.c
+ * 18/10/20
+ * 	- add "shrink" for block shrink-on-load
  */
 
 /*
@@ -59,6 +61,10 @@ typedef struct _VipsForeignLoadPng {
 	 */
 	VipsSource *source;
 
+	/* Block shrink by this integer factor during load.
+	 */
+	int shrink;
+
 } VipsForeignLoadPng;
 
 typedef VipsForeignLoadClass VipsForeignLoadPngClass;
@@ -118,7 +124,8 @@ vips_foreign_load_png_header( VipsForeignLoad *load )
 {
 	VipsForeignLoadPng *png = (VipsForeignLoadPng *) load;
 
-	if( vips__png_header_source( png->source, load->out ) )
+	if( vips__png_header_source( png->source, load->out ) ||
+		vips__foreign_load_shrink_header( load->out, png->shrink ) )
 		return( -1 );
 
 	return( 0 );
@@ -128,8 +135,18 @@ static int
 vips_foreign_load_png_load( VipsForeignLoad *load )
 {
 	VipsForeignLoadPng *png = (VipsForeignLoadPng *) load;
-
-	if( vips__png_read_source( png->source, load->real, load->fail ) )
+	VipsImage **t = (VipsImage **) 
+		vips_object_local_array( VIPS_OBJECT( load ), 1 );
+
+	if( png->shrink > 1 ) {
+		t[0] = vips_image_new();
+		if( vips__png_read_source( png->source, t[0], load->fail ) ||
+			vips__foreign_load_shrink( t[0], 
+				load->real, png->shrink ) )
+			return( -1 );
+	}
+	else if( vips__png_read_source( png->source, 
+		load->real, load->fail ) )
 		return( -1 );
 
 	return( 0 );
@@ -144,6 +161,8 @@ vips_foreign_load_png_class_init( VipsForeignLoadPngClass *class )
 	VipsForeignLoadClass *load_class = (VipsForeignLoadClass *) class;
 
 	gobject_class->dispose = vips_foreign_load_png_dispose;
+	gobject_class->set_property = vips_object_set_property;
+	gobject_class->get_property = vips_object_get_property;
 
 	object_class->nickname = "pngload_base";
 	object_class->description = _( "load png base class" );
@@ -158,11 +177,19 @@ vips_foreign_load_png_class_init( VipsForeignLoadPngClass *class )
 	load_class->header = vips_foreign_load_png_header;
 	load_class->load = vips_foreign_load_png_load;
 
+	VIPS_ARG_INT( class, "shrink", 20, 
+		_( "Shrink" ), 
+		_( "Shrink factor on load" ),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET( VipsForeignLoadPng, shrink ),
+		1, 16, 1 );
+
 }
 
 static void
 vips_foreign_load_png_init( VipsForeignLoadPng *png )
 {
+	png->shrink = 1;
 }
 
 typedef struct _VipsForeignLoadPngSource {
@@ -395,12 +422,22 @@ vips_foreign_load_png_buffer_init( VipsForeignLoadPngBuffer *buffer )
  * @out: (out): decompressed image
  * @...: %NULL-terminated list of optional named arguments
  *
+ * Optional arguments:
+ *
+ * * @shrink: %gint, shrink by this integer factor during load
+ *
  * Read a PNG file into a VIPS image. It can read all png images, including 8-
  * and 16-bit images, 1 and 3 channel, with and without an alpha channel.
  *
  * Any ICC profile is read and attached to the VIPS image. It also supports
  * XMP metadata.
  *
+ * Set @shrink to block shrink the image by an integer factor as it is
+ * decoded. Each output pixel is the average of a @shrink x @shrink block of
+ * input pixels (weighted by alpha, if there is an alpha channel), and only a 
+ * few lines of the full-resolution image are ever held in memory. Sizes
+ * round down. vips_thumbnail() uses this automatically.
+ *
  * See also: vips_image_new_from_file().
  *
  * Returns: 0 on success, -1 on error.
@@ -6,6 +6,8 @@
  * 	- compression should be 0-9, not 1-10
  * 20/6/18 [felixbuenemann]
  * 	- support png8 palette write with palette, colours, Q, dither
+ * 18/10/20
+ * 	- add @parallel
  */
 
 /*
@@ -66,6 +68,7 @@ typedef struct _VipsForeignSavePng {
 	int colours;
 	int Q;
 	double dither;
+	gboolean parallel;
 } VipsForeignSavePng;
 
 typedef VipsForeignSaveClass VipsForeignSavePngClass;
@@ -167,6 +170,13 @@ vips_foreign_save_png_class_init( VipsForeignSavePngClass *class )
 		G_STRUCT_OFFSET( VipsForeignSavePng, dither ),
 		0.0, 1.0, 1.0 );
 
+	VIPS_ARG_BOOL( class, "parallel", 17,
+		_( "Parallel" ),
+		_( "Compress in parallel on worker threads" ),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET( VipsForeignSavePng, parallel ),
+		TRUE );
+
 }
 
 static void
@@ -177,6 +187,7 @@ vips_foreign_save_png_init( VipsForeignSavePng *png )
 	png->colours = 256;
 	png->Q = 100;
 	png->dither = 1.0;
+	png->parallel = TRUE;
 }
 
 typedef struct _VipsForeignSavePngTarget {
@@ -203,7 +214,8 @@ vips_foreign_save_png_target_build( VipsObject *object )
 
 	if( vips__png_write_target( save->ready, target->target,
 		png->compression, png->interlace, png->profile, png->filter,
-		save->strip, png->palette, png->colours, png->Q, png->dither ) )
+		save->strip, png->palette, png->colours, png->Q, png->dither,
+		png->parallel ) )
 		return( -1 );
 
 	return( 0 );
@@ -265,7 +277,8 @@ vips_foreign_save_png_file_build( VipsObject *object )
 	if( vips__png_write_target( save->ready, target, 
 		png->compression, png->interlace, 
 		png->profile, png->filter, save->strip, png->palette,
-		png->colours, png->Q, png->dither ) ) {
+		png->colours, png->Q, png->dither,
+		png->parallel ) ) {
 		VIPS_UNREF( target );
 		return( -1 );
 	}
@@ -331,7 +344,7 @@ vips_foreign_save_png_buffer_build( VipsObject *object )
 	if( vips__png_write_target( save->ready, target,
 		png->compression, png->interlace, png->profile, png->filter,
 		save->strip, png->palette, png->colours, png->Q, 
-		png->dither ) ) {
+		png->dither, png->parallel ) ) {
 		VIPS_UNREF( target );
 		return( -1 );
 	}
@@ -389,6 +402,7 @@ vips_foreign_save_png_buffer_init( VipsForeignSavePngBuffer *buffer )
  * * @colours: %gint, max number of palette colours for quantisation
  * * @Q: %gint, quality for 8bpp quantisation (does not exceed @colours)
  * * @dither: %gdouble, amount of dithering for 8bpp quantization
+ * * @parallel: %gboolean, compress in parallel
  *
  * Write a VIPS image to a file as PNG.
  *
@@ -424,6 +438,14 @@ vips_foreign_save_png_buffer_init( VipsForeignSavePngBuffer *buffer )
  * XMP metadata is written to the XMP chunk. PNG comments are written to
  * separate text chunks.
  *
+ * By default, libvips filters scanlines itself and deflates blocks of 
+ * filtered lines in parallel on worker threads, joining them into a single
+ * zlib stream, in the manner of pigz. This is much faster at high 
+ * @compression levels, at the cost of a very slightly larger file. Set
+ * @parallel to %FALSE to have libpng compress on a single thread. Interlaced
+ * images, and images too small to gain anything, are always compressed by 
+ * libpng.
+ *
  * See also: vips_image_new_from_file().
  *
  * Returns: 0 on success, -1 on error.
@@ -458,6 +480,7 @@ vips_pngsave( VipsImage *in, const char *filename, ... )
  * * @colours: %gint, max number of palette colours for quantisation
  * * @Q: %gint, quality for 8bpp quantisation (does not exceed @colours)
  * * @dither: %gdouble, amount of dithering for 8bpp quantization
+ * * @parallel: %gboolean, compress in parallel
  *
  * As vips_pngsave(), but save to a memory buffer. 
  *
@@ -513,6 +536,7 @@ vips_pngsave_buffer( VipsImage *in, void **buf, size_t *len, ... )
  * * @colours: max number of palette colours for quantisation
  * * @Q: quality for 8bpp quantisation (does not exceed @colours)
  * * @dither: amount of dithering for 8bpp quantization
+ * * @parallel: compress in parallel
  *
  * As vips_pngsave(), but save to a target.
  *
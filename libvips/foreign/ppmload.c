@@ -37,6 +37,10 @@
  * 	- faster plus lower memory use
  * 02/02/2020
  * 	- ban max_vaue < 0 
+
+ * 18/10/20
+ * 	- map via vips__image_new_from_source_map(), so large files use
+ * 	  rolling windows
  */
 
 /*
@@ -393,7 +397,8 @@ vips_foreign_load_ppm_header( VipsForeignLoad *load )
 	return( 0 );
 }
 
-/* Read a ppm/pgm file using mmap().
+/* Read a ppm/pgm file using mmap(). Regions on the result point straight 
+ * into the mapped file.
  */
 static int
 vips_foreign_load_ppm_map( VipsForeignLoadPpm *ppm, VipsImage *image )
@@ -402,20 +407,16 @@ vips_foreign_load_ppm_map( VipsForeignLoadPpm *ppm, VipsImage *image )
                 vips_object_local_array( VIPS_OBJECT( ppm ), 3 );
 
 	gint64 header_offset;
-	size_t length;
-	const void *data;
 
 	vips_sbuf_unbuffer( ppm->sbuf );
-	header_offset = vips_source_seek( ppm->source, 0, SEEK_CUR );
-	data = vips_source_map( ppm->source, &length );
-	if( header_offset < 0 || 
-		!data )
+	if( (header_offset = 
+		vips_source_seek( ppm->source, 0, SEEK_CUR )) < 0 )
 		return( -1 );
-	data += header_offset;
-       	length -= header_offset;
 
-	if( !(t[0] = vips_image_new_from_memory( data, length,
-		ppm->width, ppm->height, ppm->bands, ppm->format )) )
+	if( !(t[0] = vips__image_new_from_source_map( ppm->source, 
+		header_offset, 0,
+		ppm->width, ppm->height, ppm->bands, ppm->format,
+		((VipsForeignLoad *) ppm)->access )) )
 		return( -1 );
 
 	if( vips__byteswap_bool( t[0], &t[1],
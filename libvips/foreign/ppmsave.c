@@ -333,7 +333,8 @@ vips_foreign_save_ppm_build( VipsObject *object )
 		ppm->squash = FALSE; 
 	}
 
-	if( vips_foreign_save_ppm( ppm, image ) )
+	if( vips_foreign_save_ppm( ppm, image ) ||
+		vips_target_end( ppm->target ) )
 		return( -1 );
 
 	return( 0 );
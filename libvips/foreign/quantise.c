@@ -2,6 +2,9 @@
  *
  * 20/6/18 
  * 	  - from vipspng.c
+ * 18/10/20
+ * 	  - add wrappers for the libimagequant API
+ * 	  - use them for vips__quantise_image() too
  */
 
 /*
@@ -46,8 +49,111 @@
 #ifdef HAVE_IMAGEQUANT
 
 #include "pforeign.h"
+#include "quantise.h"
 
-#include <libimagequant.h>
+VipsQuantiseAttr *
+vips__quantise_attr_create( void )
+{
+	return( liq_attr_create() );
+}
+
+VipsQuantiseError
+vips__quantise_set_max_colors( VipsQuantiseAttr *attr, int colors )
+{
+	return( liq_set_max_colors( attr, colors ) );
+}
+
+VipsQuantiseError
+vips__quantise_set_quality( VipsQuantiseAttr *attr, int minimum, int maximum )
+{
+	return( liq_set_quality( attr, minimum, maximum ) );
+}
+
+VipsQuantiseImage *
+vips__quantise_image_create_rgba( const VipsQuantiseAttr *attr, 
+	const void *bitmap, int width, int height, double gamma )
+{
+	return( liq_image_create_rgba( attr, bitmap, width, height, gamma ) );
+}
+
+VipsQuantiseError
+vips__quantise_image_add_fixed_color( VipsQuantiseImage *image, 
+	VipsQuantiseColour colour )
+{
+	return( liq_image_add_fixed_color( image, colour ) );
+}
+
+VipsQuantiseError
+vips__quantise_image_quantize( VipsQuantiseImage *image, 
+	VipsQuantiseAttr *attr, VipsQuantiseResult **result_output )
+{
+	return( liq_image_quantize( image, attr, result_output ) );
+}
+
+VipsQuantiseHistogram *
+vips__quantise_histogram_create( const VipsQuantiseAttr *attr )
+{
+	return( liq_histogram_create( attr ) );
+}
+
+VipsQuantiseError
+vips__quantise_histogram_add_image( VipsQuantiseHistogram *histogram, 
+	const VipsQuantiseAttr *attr, VipsQuantiseImage *image )
+{
+	return( liq_histogram_add_image( histogram, attr, image ) );
+}
+
+VipsQuantiseError
+vips__quantise_histogram_quantize( VipsQuantiseHistogram *histogram, 
+	VipsQuantiseAttr *attr, VipsQuantiseResult **result_output )
+{
+	return( liq_histogram_quantize( histogram, attr, result_output ) );
+}
+
+VipsQuantiseError
+vips__quantise_set_dithering_level( VipsQuantiseResult *result, 
+	float dither_level )
+{
+	return( liq_set_dithering_level( result, dither_level ) );
+}
+
+const VipsQuantisePalette *
+vips__quantise_get_palette( VipsQuantiseResult *result )
+{
+	return( liq_get_palette( result ) );
+}
+
+VipsQuantiseError
+vips__quantise_write_remapped_image( VipsQuantiseResult *result, 
+	VipsQuantiseImage *image, void *buffer, size_t buffer_size )
+{
+	return( liq_write_remapped_image( result, image, 
+		buffer, buffer_size ) );
+}
+
+void
+vips__quantise_result_destroy( VipsQuantiseResult *result )
+{
+	liq_result_destroy( result );
+}
+
+void
+vips__quantise_histogram_destroy( VipsQuantiseHistogram *histogram )
+{
+	liq_histogram_destroy( histogram );
+}
+
+void
+vips__quantise_image_destroy( VipsQuantiseImage *image )
+{
+	liq_image_destroy( image );
+}
+
+void
+vips__quantise_attr_destroy( VipsQuantiseAttr *attr )
+{
+	liq_attr_destroy( attr );
+}
 
 /* Track during a quantisation.
  */
@@ -59,9 +165,9 @@ typedef struct _Quantise {
        	int Q;
        	double dither;
 
-	liq_attr *attr;
-	liq_image *input_image;
-	liq_result *quantisation_result;
+	VipsQuantiseAttr *attr;
+	VipsQuantiseImage *input_image;
+	VipsQuantiseResult *quantisation_result;
 	VipsImage *t[5];
 } Quantise;
 
@@ -70,9 +176,9 @@ vips__quantise_free( Quantise *quantise )
 {
 	int i;
 
-	VIPS_FREEF( liq_result_destroy, quantise->quantisation_result );
-	VIPS_FREEF( liq_image_destroy, quantise->input_image );
-	VIPS_FREEF( liq_attr_destroy, quantise->attr );
+	VIPS_FREEF( vips__quantise_result_destroy, quantise->quantisation_result );
+	VIPS_FREEF( vips__quantise_image_destroy, quantise->input_image );
+	VIPS_FREEF( vips__quantise_attr_destroy, quantise->attr );
 
 	for( i = 0; i < VIPS_NUMBER( quantise->t ); i++ )
 		VIPS_UNREF( quantise->t[i] ); 
@@ -109,7 +215,7 @@ vips__quantise_image( VipsImage *in,
 	Quantise *quantise;
 	VipsImage *index;
 	VipsImage *palette;
-	const liq_palette *lp;
+	const VipsQuantisePalette *lp;
 	int i;
 
 	quantise = vips__quantise_new( in, index_out, palette_out, 
@@ -142,21 +248,23 @@ vips__quantise_image( VipsImage *in,
 	}
 	in = quantise->t[2];
 
-	quantise->attr = liq_attr_create();
-	liq_set_max_colors( quantise->attr, colours );
-	liq_set_quality( quantise->attr, 0, Q );
+	quantise->attr = vips__quantise_attr_create();
+	vips__quantise_set_max_colors( quantise->attr, colours );
+	vips__quantise_set_quality( quantise->attr, 0, Q );
 
-	quantise->input_image = liq_image_create_rgba( quantise->attr,
+	quantise->input_image = vips__quantise_image_create_rgba( 
+		quantise->attr,
 		VIPS_IMAGE_ADDR( in, 0, 0 ), in->Xsize, in->Ysize, 0 );
 
-	if( liq_image_quantize( quantise->input_image, quantise->attr, 
-		&quantise->quantisation_result ) ) {
+	if( vips__quantise_image_quantize( quantise->input_image, 
+		quantise->attr, &quantise->quantisation_result ) ) {
 		vips_error( "vips2png", "%s", _( "quantisation failed" ) );
 		vips__quantise_free( quantise ); 
 		return( -1 );
 	}
 
-	liq_set_dithering_level( quantise->quantisation_result, dither );
+	vips__quantise_set_dithering_level( quantise->quantisation_result, 
+		dither );
 
 	index = quantise->t[3] = vips_image_new_memory();
 	vips_image_init_fields( index, 
@@ -168,7 +276,8 @@ vips__quantise_image( VipsImage *in,
 		return( -1 );
 	}
 
-	if( liq_write_remapped_image( quantise->quantisation_result, 
+	if( vips__quantise_write_remapped_image( 
+		quantise->quantisation_result, 
 		quantise->input_image,
 		VIPS_IMAGE_ADDR( index, 0, 0 ), VIPS_IMAGE_N_PELS( index ) ) ) {
 		vips_error( "vips2png", "%s", _( "quantisation failed" ) );
@@ -176,7 +285,7 @@ vips__quantise_image( VipsImage *in,
 		return( -1 );
 	}
 
-	lp = liq_get_palette( quantise->quantisation_result );
+	lp = vips__quantise_get_palette( quantise->quantisation_result );
 
 	palette = quantise->t[4] = vips_image_new_memory();
 	vips_image_init_fields( palette, lp->count, 1, 4,
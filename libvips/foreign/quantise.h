@@ -0,0 +1,94 @@
+/* quantise an image with libimagequant
+ *
+ * 18/10/20
+ * 	- from pforeign.h
+ */
+
+/*
+
+    This file is part of VIPS.
+    
+    VIPS is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301  USA
+
+ */
+
+/*
+
+    These files are distributed with VIPS - http://www.vips.ecs.soton.ac.uk
+
+ */
+
+#ifndef VIPS_QUANTISE_H
+#define VIPS_QUANTISE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif /*__cplusplus*/
+
+#ifdef HAVE_IMAGEQUANT
+
+#include <libimagequant.h>
+
+/* Savers go through these rather than calling libimagequant directly, so
+ * all use of the quantiser is in one place.
+ */
+typedef liq_attr VipsQuantiseAttr;
+typedef liq_image VipsQuantiseImage;
+typedef liq_result VipsQuantiseResult;
+typedef liq_histogram VipsQuantiseHistogram;
+typedef liq_palette VipsQuantisePalette;
+typedef liq_color VipsQuantiseColour;
+typedef liq_error VipsQuantiseError;
+
+VipsQuantiseAttr *vips__quantise_attr_create( void );
+VipsQuantiseError vips__quantise_set_max_colors( VipsQuantiseAttr *attr, 
+	int colors );
+VipsQuantiseError vips__quantise_set_quality( VipsQuantiseAttr *attr, 
+	int minimum, int maximum );
+VipsQuantiseImage *vips__quantise_image_create_rgba( 
+	const VipsQuantiseAttr *attr, 
+	const void *bitmap, int width, int height, double gamma );
+VipsQuantiseError vips__quantise_image_add_fixed_color( 
+	VipsQuantiseImage *image, VipsQuantiseColour colour );
+VipsQuantiseError vips__quantise_image_quantize( VipsQuantiseImage *image, 
+	VipsQuantiseAttr *attr, VipsQuantiseResult **result_output );
+VipsQuantiseHistogram *vips__quantise_histogram_create( 
+	const VipsQuantiseAttr *attr );
+VipsQuantiseError vips__quantise_histogram_add_image( 
+	VipsQuantiseHistogram *histogram, const VipsQuantiseAttr *attr, 
+	VipsQuantiseImage *image );
+VipsQuantiseError vips__quantise_histogram_quantize( 
+	VipsQuantiseHistogram *histogram, VipsQuantiseAttr *attr, 
+	VipsQuantiseResult **result_output );
+VipsQuantiseError vips__quantise_set_dithering_level( 
+	VipsQuantiseResult *result, float dither_level );
+const VipsQuantisePalette *vips__quantise_get_palette( 
+	VipsQuantiseResult *result );
+VipsQuantiseError vips__quantise_write_remapped_image( 
+	VipsQuantiseResult *result, VipsQuantiseImage *image, 
+	void *buffer, size_t buffer_size );
+void vips__quantise_result_destroy( VipsQuantiseResult *result );
+void vips__quantise_histogram_destroy( VipsQuantiseHistogram *histogram );
+void vips__quantise_image_destroy( VipsQuantiseImage *image );
+void vips__quantise_attr_destroy( VipsQuantiseAttr *attr );
+
+#endif /*HAVE_IMAGEQUANT*/
+
+#ifdef __cplusplus
+}
+#endif /*__cplusplus*/
+
+#endif /*VIPS_QUANTISE_H*/
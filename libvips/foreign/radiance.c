@@ -1179,7 +1179,10 @@ vips__rad_save( VipsImage *in, VipsTarget *target )
 		return( -1 );
 	}
 
-	vips_target_finish( target );
+	if( vips_target_end( target ) ) {
+		write_destroy( write );
+		return( -1 );
+	}
 
 	write_destroy( write );
 
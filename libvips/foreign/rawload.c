@@ -3,6 +3,8 @@
  * 14/12/11
  * 5/8/19
  * 	- add @format and @interpretation
+ * 18/10/20
+ * 	- pass @access on to the window manager
  */
 
 /*
@@ -89,6 +91,7 @@ vips_foreign_load_raw_header( VipsForeignLoad *load )
 		vips_format_sizeof_unsafe( raw->format ) * raw->bands,
 		raw->offset )) )
 		return( -1 );
+	vips__window_set_access( out, load->access );
 
 	if( vips_copy( out, &x,
 		"interpretation", raw->interpretation,
@@ -19,6 +19,9 @@
  * 	- requires us to use the gio API to librsvg
  * 11/9/19
  * 	- rework as a sequential loader to reduce overcomputation
+ * 18/10/20
+ * 	- render strips in parallel from a pool of handles
+ * 	- limit the tile cache by memory use
  */
 
 /*
@@ -80,6 +83,11 @@
  */
 #define RSVG_MAX_WIDTH (32767)
 
+/* Keep about this many bytes of rendered tiles in the cache, on top of the
+ * tiles being rendered.
+ */
+#define SVG_CACHE_BYTES (64 * 1024 * 1024)
+
 /* Old librsvg versions don't include librsvg-features.h by default.
  * Newer versions deprecate direct inclusion.
  */
@@ -116,11 +124,30 @@ typedef struct _VipsForeignLoadSvg {
 	 */
 	gboolean unlimited;
 
+	/* The handle we read the header from.
+	 */
 	RsvgHandle *page;
 
+	/* A handle can only be used by one thread at a time, so we render
+	 * from a pool of them, up to one per worker.
+	 */
+	VipsForeignPool *pool;
+
 } VipsForeignLoadSvg;
 
-typedef VipsForeignLoadClass VipsForeignLoadSvgClass;
+typedef struct _VipsForeignLoadSvgClass {
+	VipsForeignLoadClass parent_class;
+
+	/* Open a new handle on the document. Subclasses implement this. 
+	 * It can be called from several threads at once.
+	 */
+	RsvgHandle *(*open)( VipsForeignLoadSvg *svg );
+
+} VipsForeignLoadSvgClass;
+
+#define VIPS_FOREIGN_LOAD_SVG_GET_CLASS( obj ) \
+	(G_TYPE_INSTANCE_GET_CLASS( (obj), \
+	vips_foreign_load_svg_get_type(), VipsForeignLoadSvgClass ))
 
 G_DEFINE_ABSTRACT_TYPE( VipsForeignLoadSvg, vips_foreign_load_svg, 
 	VIPS_TYPE_FOREIGN_LOAD );
@@ -234,6 +261,7 @@ vips_foreign_load_svg_dispose( GObject *gobject )
 {
 	VipsForeignLoadSvg *svg = (VipsForeignLoadSvg *) gobject;
 
+	VIPS_FREEF( vips__foreign_pool_free, svg->pool );
 	VIPS_UNREF( svg->page );
 
 	G_OBJECT_CLASS( vips_foreign_load_svg_parent_class )->
@@ -243,13 +271,15 @@ vips_foreign_load_svg_dispose( GObject *gobject )
 static VipsForeignFlags
 vips_foreign_load_svg_get_flags_filename( const char *filename )
 {
-	return( VIPS_FOREIGN_SEQUENTIAL );
+	/* We can render any part of the image on demand.
+	 */
+	return( VIPS_FOREIGN_PARTIAL );
 }
 
 static VipsForeignFlags
 vips_foreign_load_svg_get_flags( VipsForeignLoad *load )
 {
-	return( VIPS_FOREIGN_SEQUENTIAL );
+	return( VIPS_FOREIGN_PARTIAL );
 }
 
 static void
@@ -303,22 +333,70 @@ vips_foreign_load_svg_parse( VipsForeignLoadSvg *svg, VipsImage *out )
 		4, VIPS_FORMAT_UCHAR,
 		VIPS_CODING_NONE, VIPS_INTERPRETATION_sRGB, res, res );
 
-	/* We render to a linecache, so fat strips work well.
+	/* We render to a tilecache, so fat strips work well.
 	 */
         vips_image_pipelinev( out, VIPS_DEMAND_STYLE_FATSTRIP, NULL );
 
 }
 
+/* Open a handle on a document in memory. 
+ */
+static RsvgHandle *
+vips_foreign_load_svg_open_memory( VipsForeignLoadSvg *svg, 
+	const void *data, size_t length )
+{
+	RsvgHandleFlags flags = svg->unlimited ? RSVG_HANDLE_FLAG_UNLIMITED : 0;
+
+	GError *error = NULL;
+
+	GInputStream *gstream;
+	RsvgHandle *handle;
+
+	gstream = g_memory_input_stream_new_from_data( data, length, NULL );
+	if( !(handle = rsvg_handle_new_from_stream_sync( 
+		gstream, NULL, flags, NULL, &error )) ) {
+		g_object_unref( gstream );
+		vips_g_error( &error );
+		return( NULL ); 
+	}
+	g_object_unref( gstream );
+
+	return( handle );
+}
+
+/* Subclasses call this from their header() once they are ready to open.
+ */
 static int
 vips_foreign_load_svg_header( VipsForeignLoad *load )
 {
 	VipsForeignLoadSvg *svg = (VipsForeignLoadSvg *) load;
+	VipsForeignLoadSvgClass *class = VIPS_FOREIGN_LOAD_SVG_GET_CLASS( svg );
+
+	if( !(svg->page = class->open( svg )) )
+		return( -1 );
 
 	vips_foreign_load_svg_parse( svg, load->out ); 
 
 	return( 0 );
 }
 
+/* Open another handle for the pool, at the same DPI as @page.
+ */
+static void *
+vips_foreign_load_svg_open( void *a )
+{
+	VipsForeignLoadSvg *svg = (VipsForeignLoadSvg *) a;
+	VipsForeignLoadSvgClass *class = VIPS_FOREIGN_LOAD_SVG_GET_CLASS( svg );
+
+	RsvgHandle *handle;
+
+	if( !(handle = class->open( svg )) )
+		return( NULL );
+	rsvg_handle_set_dpi( handle, svg->dpi * svg->scale );
+
+	return( handle );
+}
+
 static int
 vips_foreign_load_svg_generate( VipsRegion *or, 
 	void *seq, void *a, void *b, gboolean *stop )
@@ -327,6 +405,7 @@ vips_foreign_load_svg_generate( VipsRegion *or,
 	VipsObjectClass *class = VIPS_OBJECT_GET_CLASS( svg );
 	VipsRect *r = &or->valid;
 
+	RsvgHandle *handle;
 	cairo_surface_t *surface;
 	cairo_t *cr;
 	int y;
@@ -353,16 +432,23 @@ vips_foreign_load_svg_generate( VipsRegion *or,
 	cairo_translate( cr, -r->left / svg->cairo_scale,
 		-r->top / svg->cairo_scale );
 
-	/* rsvg is single-threaded, but we don't need to lock since we're
-	 * running inside a non-threaded tilecache.
+	/* Each handle is only used by one thread at a time.
 	 */
-	if( !rsvg_handle_render_cairo( svg->page, cr ) ) {
+	if( !(handle = vips__foreign_pool_get( svg->pool )) ) {
+		cairo_destroy( cr );
+		return( -1 );
+	}
+
+	if( !rsvg_handle_render_cairo( handle, cr ) ) {
+		vips__foreign_pool_put( svg->pool, handle );
+		cairo_destroy( cr );
 		vips_operation_invalidate( VIPS_OPERATION( svg ) );
 		vips_error( class->nickname, 
 			"%s", _( "SVG rendering failed" ) );
 		return( -1 );
 	}
 
+	vips__foreign_pool_put( svg->pool, handle );
 	cairo_destroy( cr );
 
 	/* Cairo makes pre-multipled BRGA -- we must byteswap and unpremultiply.
@@ -380,30 +466,50 @@ vips_foreign_load_svg_load( VipsForeignLoad *load )
 {
 	VipsForeignLoadSvg *svg = (VipsForeignLoadSvg *) load;
 	VipsImage **t = (VipsImage **) 
-		vips_object_local_array( (VipsObject *) load, 3 );
+		vips_object_local_array( (VipsObject *) load, 2 );
+	int max_handles = vips_concurrency_get();
+
+	int tile_width;
+	int tile_height;
+	size_t line_bytes;
+	int max_tiles;
+
+	svg->pool = vips__foreign_pool_new( max_handles, 
+		vips_foreign_load_svg_open, (GDestroyNotify) g_object_unref, 
+		svg );
+	vips__foreign_pool_add( svg->pool, g_object_ref( svg->page ) );
 
 	/* librsvg starts to fail if any axis in a single render call is over
-	 * RSVG_MAX_WIDTH pixels. vips_sequential() will use a tilecache where 
-	 * each tile is a strip the width of the image and (in this case) 
-	 * 2000 pixels high. To be able to render images wider than 
-	 * RSVG_MAX_WIDTH pixels, we need to chop these strips up.
-	 * We use a small tilecache between the seq and our gen to do this.
+	 * RSVG_MAX_WIDTH pixels, so we chop the image into tiles no wider 
+	 * than that.
+	 *
+	 * Each render walks the whole document, so tiles are tall to limit 
+	 * overcomputation. They are at most 2000 pixels high, and small 
+	 * enough that the image is shared out between our handles. The cache
+	 * is threaded, so tiles render in parallel.
 	 *
-	 * Make tiles 2000 pixels high to limit overcomputation. 
+	 * Wide tiles can be huge, so we also keep tiles short enough that one
+	 * for each handle fits in SVG_CACHE_BYTES, and size the cache in 
+	 * bytes rather than in rows of tiles.
 	 */
 	t[0] = vips_image_new(); 
 	vips_foreign_load_svg_parse( svg, t[0] ); 
+	tile_width = VIPS_MIN( t[0]->Xsize, RSVG_MAX_WIDTH );
+	line_bytes = (size_t) tile_width * VIPS_IMAGE_SIZEOF_PEL( t[0] );
+	tile_height = VIPS_CLIP( 256, t[0]->Ysize / max_handles, 2000 );
+	tile_height = VIPS_MIN( tile_height, 
+		VIPS_MAX( 16, SVG_CACHE_BYTES / max_handles / line_bytes ) );
+	max_tiles = max_handles + 
+		SVG_CACHE_BYTES / (line_bytes * tile_height);
 	if( vips_image_generate( t[0], 
 		NULL, vips_foreign_load_svg_generate, NULL, svg, NULL ) ||
 		vips_tilecache( t[0], &t[1],
-			"tile_width", VIPS_MIN( t[0]->Xsize, RSVG_MAX_WIDTH ),
-			"tile_height", 2000,
-			"max_tiles", 1,
+			"tile_width", tile_width,
+			"tile_height", tile_height,
+			"max_tiles", max_tiles,
+			"threaded", TRUE,
 			NULL ) ||
-		vips_sequential( t[1], &t[2], 
-			"tile_height", 2000, 
-			NULL ) ||
-		vips_image_write( t[2], load->real ) ) 
+		vips_image_write( t[1], load->real ) ) 
 		return( -1 );
 
 	return( 0 );
@@ -471,9 +577,14 @@ typedef struct _VipsForeignLoadSvgSource {
 	 */
 	VipsSource *source;
 
+	/* We map the source, so we can open many handles on it.
+	 */
+	const void *data;
+	size_t length;
+
 } VipsForeignLoadSvgSource;
 
-typedef VipsForeignLoadClass VipsForeignLoadSvgSourceClass;
+typedef VipsForeignLoadSvgClass VipsForeignLoadSvgSourceClass;
 
 G_DEFINE_TYPE( VipsForeignLoadSvgSource, vips_foreign_load_svg_source, 
 	vips_foreign_load_svg_get_type() );
@@ -491,30 +602,26 @@ vips_foreign_load_svg_source_is_a_source( VipsSource *source )
 	return( vips_foreign_load_svg_is_a( data, bytes_read ) );
 }
 
+static RsvgHandle *
+vips_foreign_load_svg_source_open( VipsForeignLoadSvg *svg )
+{
+	VipsForeignLoadSvgSource *source = (VipsForeignLoadSvgSource *) svg;
+
+	return( vips_foreign_load_svg_open_memory( svg, 
+		source->data, source->length ) );
+}
+
 static int
 vips_foreign_load_svg_source_header( VipsForeignLoad *load )
 {
-	VipsForeignLoadSvg *svg = (VipsForeignLoadSvg *) load;
 	VipsForeignLoadSvgSource *source = 
 		(VipsForeignLoadSvgSource *) load;
-	RsvgHandleFlags flags = svg->unlimited ? RSVG_HANDLE_FLAG_UNLIMITED : 0;
-
-	GError *error = NULL;
 
-	GInputStream *gstream;
-
-	if( vips_source_rewind( source->source ) )
+	if( vips_source_rewind( source->source ) ||
+		!(source->data = vips_source_map( source->source, 
+			&source->length )) )
 		return( -1 );
 
-	gstream = vips_g_input_stream_new_from_source( source->source );
-	if( !(svg->page = rsvg_handle_new_from_stream_sync( 
-		gstream, NULL, flags, NULL, &error )) ) {
-		g_object_unref( gstream );
-		vips_g_error( &error );
-		return( -1 ); 
-	}
-	g_object_unref( gstream );
-
 	return( vips_foreign_load_svg_header( load ) );
 }
 
@@ -537,6 +644,7 @@ vips_foreign_load_svg_source_class_init( VipsForeignLoadSvgSourceClass *class )
 	GObjectClass *gobject_class = G_OBJECT_CLASS( class );
 	VipsObjectClass *object_class = (VipsObjectClass *) class;
 	VipsForeignLoadClass *load_class = (VipsForeignLoadClass *) class;
+	VipsForeignLoadSvgClass *svg_class = (VipsForeignLoadSvgClass *) class;
 
 	gobject_class->set_property = vips_object_set_property;
 	gobject_class->get_property = vips_object_get_property;
@@ -548,6 +656,8 @@ vips_foreign_load_svg_source_class_init( VipsForeignLoadSvgSourceClass *class )
 	load_class->header = vips_foreign_load_svg_source_header;
 	load_class->load = vips_foreign_load_svg_source_load;
 
+	svg_class->open = vips_foreign_load_svg_source_open;
+
 	VIPS_ARG_OBJECT( class, "source", 1,
 		_( "Source" ),
 		_( "Source to load from" ),
@@ -587,26 +697,34 @@ vips_foreign_load_svg_file_is_a( const char *filename )
 		vips_foreign_load_svg_is_a( buf, bytes ) );
 }
 
-static int
-vips_foreign_load_svg_file_header( VipsForeignLoad *load )
+static RsvgHandle *
+vips_foreign_load_svg_file_open( VipsForeignLoadSvg *svg )
 {
-	VipsForeignLoadSvg *svg = (VipsForeignLoadSvg *) load;
-	VipsForeignLoadSvgFile *file = (VipsForeignLoadSvgFile *) load;
+	VipsForeignLoadSvgFile *file = (VipsForeignLoadSvgFile *) svg;
 	RsvgHandleFlags flags = svg->unlimited ? RSVG_HANDLE_FLAG_UNLIMITED : 0;
 
 	GError *error = NULL;
 
 	GFile *gfile;
+	RsvgHandle *handle;
 
 	gfile = g_file_new_for_path( file->filename );
-	if( !(svg->page = rsvg_handle_new_from_gfile_sync( 
+	if( !(handle = rsvg_handle_new_from_gfile_sync( 
 		gfile, flags, NULL, &error )) ) { 
 		g_object_unref( gfile );
 		vips_g_error( &error );
-		return( -1 ); 
+		return( NULL ); 
 	}
 	g_object_unref( gfile );
 
+	return( handle );
+}
+
+static int
+vips_foreign_load_svg_file_header( VipsForeignLoad *load )
+{
+	VipsForeignLoadSvgFile *file = (VipsForeignLoadSvgFile *) load;
+
 	VIPS_SETSTR( load->out->filename, file->filename );
 
 	return( vips_foreign_load_svg_header( load ) );
@@ -631,6 +749,7 @@ vips_foreign_load_svg_file_class_init(
 	VipsObjectClass *object_class = (VipsObjectClass *) class;
 	VipsForeignClass *foreign_class = (VipsForeignClass *) class;
 	VipsForeignLoadClass *load_class = (VipsForeignLoadClass *) class;
+	VipsForeignLoadSvgClass *svg_class = (VipsForeignLoadSvgClass *) class;
 
 	gobject_class->set_property = vips_object_set_property;
 	gobject_class->get_property = vips_object_get_property;
@@ -642,6 +761,8 @@ vips_foreign_load_svg_file_class_init(
 	load_class->is_a = vips_foreign_load_svg_file_is_a;
 	load_class->header = vips_foreign_load_svg_file_header;
 
+	svg_class->open = vips_foreign_load_svg_file_open;
+
 	VIPS_ARG_STRING( class, "filename", 1, 
 		_( "Filename" ),
 		_( "Filename to load from" ),
@@ -670,29 +791,13 @@ typedef VipsForeignLoadSvgClass VipsForeignLoadSvgBufferClass;
 G_DEFINE_TYPE( VipsForeignLoadSvgBuffer, vips_foreign_load_svg_buffer, 
 	vips_foreign_load_svg_get_type() );
 
-static int
-vips_foreign_load_svg_buffer_header( VipsForeignLoad *load )
+static RsvgHandle *
+vips_foreign_load_svg_buffer_open( VipsForeignLoadSvg *svg )
 {
-	VipsForeignLoadSvg *svg = (VipsForeignLoadSvg *) load;
-	VipsForeignLoadSvgBuffer *buffer = 
-		(VipsForeignLoadSvgBuffer *) load;
-	RsvgHandleFlags flags = svg->unlimited ? RSVG_HANDLE_FLAG_UNLIMITED : 0;
+	VipsForeignLoadSvgBuffer *buffer = (VipsForeignLoadSvgBuffer *) svg;
 
-	GError *error = NULL;
-
-	GInputStream *gstream;
-
-	gstream = g_memory_input_stream_new_from_data( 
-		buffer->buf->data, buffer->buf->length, NULL );
-	if( !(svg->page = rsvg_handle_new_from_stream_sync( 
-		gstream, NULL, flags, NULL, &error )) ) { 
-		g_object_unref( gstream );
-		vips_g_error( &error );
-		return( -1 ); 
-	}
-	g_object_unref( gstream );
-
-	return( vips_foreign_load_svg_header( load ) );
+	return( vips_foreign_load_svg_open_memory( svg, 
+		buffer->buf->data, buffer->buf->length ) );
 }
 
 static void
@@ -702,6 +807,7 @@ vips_foreign_load_svg_buffer_class_init(
 	GObjectClass *gobject_class = G_OBJECT_CLASS( class );
 	VipsObjectClass *object_class = (VipsObjectClass *) class;
 	VipsForeignLoadClass *load_class = (VipsForeignLoadClass *) class;
+	VipsForeignLoadSvgClass *svg_class = (VipsForeignLoadSvgClass *) class;
 
 	gobject_class->set_property = vips_object_set_property;
 	gobject_class->get_property = vips_object_get_property;
@@ -709,7 +815,9 @@ vips_foreign_load_svg_buffer_class_init(
 	object_class->nickname = "svgload_buffer";
 
 	load_class->is_a_buffer = vips_foreign_load_svg_is_a;
-	load_class->header = vips_foreign_load_svg_buffer_header;
+	load_class->header = vips_foreign_load_svg_header;
+
+	svg_class->open = vips_foreign_load_svg_buffer_open;
 
 	VIPS_ARG_BOXED( class, "buffer", 1, 
 		_( "Buffer" ),
@@ -746,7 +854,8 @@ vips_foreign_load_svg_buffer_init( VipsForeignLoadSvgBuffer *buffer )
  * scale the rendering by @scale. 
  *
  * This function only reads the image header and does not render any pixel
- * data. Rendering occurs when pixels are accessed.
+ * data. Rendering occurs when pixels are accessed. Tiles render in 
+ * parallel, with up to one open copy of the document per worker thread.
  *
  * SVGs larger than 10MB are normally blocked for security. Set @unlimited to
  * allow SVGs of any size.
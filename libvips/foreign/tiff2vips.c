@@ -197,6 +197,12 @@
  * 	- read logluv images as XYZ
  * 11/4/20 petoor 
  * 	- better handling of aligned reads in multipage tiffs
+ * 18/10/20
+ * 	- skip strips above the region of interest hinted downstream
+ * 	- uncompressed, contiguous strip images are read by mapping the
+ * 	  source, with no decode or copy, and support random access
+ * 	- prefetch the next row of tiles while we decode this one
+ * 	- pass the load access pattern to mapped strips
  */
 
 /*
@@ -321,6 +327,10 @@ typedef struct _Rtiff {
 	int n;
 	gboolean autorotate;
 
+	/* How the pixels will be read, for the hints on mapped strips.
+	 */
+	VipsAccess access;
+
 	/* The TIFF we read.
 	 */
 	TIFF *tiff;
@@ -359,6 +369,11 @@ typedef struct _Rtiff {
 	/* The Y we are reading at. Used to verify strip read is sequential.
 	 */
 	int y_pos;
+
+	/* The last row of tiles we prefetched, counting down all pages. 
+	 * -1 for none.
+	 */
+	int prefetch_row;
 } Rtiff;
 
 /* Test for field exists.
@@ -540,6 +555,7 @@ rtiff_new( VipsSource *source, VipsImage *out,
 	rtiff->page = page;
 	rtiff->n = n;
 	rtiff->autorotate = autorotate;
+	rtiff->access = VIPS_ACCESS_RANDOM;
 	rtiff->tiff = NULL;
 	rtiff->n_pages = 0;
 	rtiff->current_page = -1;
@@ -549,6 +565,7 @@ rtiff_new( VipsSource *source, VipsImage *out,
 	rtiff->plane_buf = NULL;
 	rtiff->contig_buf = NULL;
 	rtiff->y_pos = 0;
+	rtiff->prefetch_row = -1;
 
 	g_signal_connect( out, "close", 
 		G_CALLBACK( rtiff_close_cb ), rtiff ); 
@@ -1762,6 +1779,61 @@ rtiff_fill_region_unaligned( VipsRegion *out,
 	return( 0 );
 }
 
+/* We've just read tiles from the row containing page_y. Ask the source to
+ * fetch the row below in the background, so the IO for that row overlaps
+ * decode of this one. Neighbouring tiles are usually next to each other in
+ * the file, so we join them up into as few requests as we can.
+ *
+ * This does nothing unless prefetch is enabled on the source.
+ */
+static void
+rtiff_prefetch_tile_row( Rtiff *rtiff, int page_no, int page_y )
+{
+	int tile_width = rtiff->header.tile_width;
+	int tile_height = rtiff->header.tile_height;
+	int tiles_down = VIPS_ROUND_UP( rtiff->header.height, tile_height ) / 
+		tile_height;
+	int row = page_y / tile_height + 1;
+	int n_planes = rtiff->header.separate ? 
+		rtiff->header.samples_per_pixel : 1;
+
+	toff_t *offsets;
+	toff_t *byte_counts;
+	gint64 start;
+	gint64 end;
+	int s;
+	int x;
+
+	if( row >= tiles_down ||
+		page_no * tiles_down + row == rtiff->prefetch_row )
+		return;
+	rtiff->prefetch_row = page_no * tiles_down + row;
+
+	if( !TIFFGetField( rtiff->tiff, TIFFTAG_TILEOFFSETS, &offsets ) ||
+		!TIFFGetField( rtiff->tiff, 
+			TIFFTAG_TILEBYTECOUNTS, &byte_counts ) )
+		return;
+
+	start = 0;
+	end = 0;
+	for( s = 0; s < n_planes; s++ ) 
+		for( x = 0; x < rtiff->header.width; x += tile_width ) {
+			ttile_t tile = TIFFComputeTile( rtiff->tiff, 
+				x, row * tile_height, 0, s );
+
+			if( offsets[tile] != end ) {
+				if( end > start )
+					vips_source_prefetch( rtiff->source, 
+						start, end - start );
+				start = offsets[tile];
+			}
+			end = offsets[tile] + byte_counts[tile];
+		}
+
+	if( end > start )
+		vips_source_prefetch( rtiff->source, start, end - start );
+}
+
 /* Loop over the output region, painting in tiles from the file.
  */
 static int
@@ -1810,6 +1882,13 @@ rtiff_fill_region( VipsRegion *out,
 		return( -1 );
 	}
 
+	/* generate leaves the tiff on the page holding the last line of the
+	 * region.
+	 */
+	rtiff_prefetch_tile_row( rtiff, 
+		(VIPS_RECT_BOTTOM( r ) - 1) / page_height,
+		(VIPS_RECT_BOTTOM( r ) - 1) % page_height );
+
 	VIPS_GATE_STOP( "rtiff_fill_region: work" ); 
 
 	return( 0 );
@@ -2035,6 +2114,8 @@ rtiff_stripwise_generate( VipsRegion *or,
 	tsize_t scanline_size = rtiff->header.scanline_size;
         VipsRect *r = &or->valid;
 
+	VipsRect roi;
+	int roi_top;
 	int y;
 
 #ifdef DEBUG_VERBOSE
@@ -2070,6 +2151,14 @@ rtiff_stripwise_generate( VipsRegion *or,
 		return( -1 );
 	}
 
+	/* Strips which end above the region of interest downstream has
+	 * hinted won't be used, we don't need to decode them. 
+	 */
+	roi_top = 0;
+	if( !rtiff->autorotate &&
+		vips__foreign_load_get_roi( rtiff->out, &roi ) )
+		roi_top = roi.top;
+
 	VIPS_GATE_START( "rtiff_stripwise_generate: work" ); 
 
 	y = 0;
@@ -2128,7 +2217,14 @@ rtiff_stripwise_generate( VipsRegion *or,
 		 * We need to read via a buffer if we need to reformat pixels,
 		 * or if this strip is not aligned on a tile boundary.
 		 */
-		if( rtiff->memcpy &&
+		if( VIPS_RECT_BOTTOM( &strip ) <= roi_top ) {
+			int z;
+
+			for( z = 0; z < hit.height; z++ ) 
+				memset( VIPS_REGION_ADDR( or, 0, hit.top + z ), 
+					0, VIPS_REGION_SIZEOF_LINE( or ) );
+		}
+		else if( rtiff->memcpy &&
 			hit.top == strip.top &&
 			hit.height == strip.height ) {
 			if( rtiff_strip_read_interleaved( rtiff, strip_no, 
@@ -2283,6 +2379,98 @@ rtiff_read_stripwise( Rtiff *rtiff, VipsImage *out )
 	return( 0 );
 }
 
+/* TRUE if the pixels for this page sit uncompressed and in order in the 
+ * source, so regions can point directly into a map of the file.
+ */
+static gboolean
+rtiff_can_map( Rtiff *rtiff )
+{
+	RtiffHeader *header = &rtiff->header;
+	int photometric_interpretation = header->photometric_interpretation;
+
+	toff_t *offsets;
+	tsize_t strip_size;
+	int i;
+
+	if( header->tiled ||
+		header->separate ||
+		header->compression != COMPRESSION_NONE ||
+		rtiff->n != 1 ||
+		header->bits_per_sample % 8 != 0 ||
+		header->bits_per_sample == 0 ||
+		header->scanline_size != (tsize_t) header->width * 
+			header->samples_per_pixel * 
+			(header->bits_per_sample / 8) )
+		return( FALSE );
+
+	/* Only the paths in rtiff_pick_reader() which copy samples unaltered.
+	 */
+	if( photometric_interpretation == PHOTOMETRIC_CIELAB ||
+		photometric_interpretation == PHOTOMETRIC_LOGLUV ||
+		photometric_interpretation == PHOTOMETRIC_PALETTE ||
+		photometric_interpretation == PHOTOMETRIC_YCBCR ||
+		photometric_interpretation == PHOTOMETRIC_MINISWHITE )
+		return( FALSE );
+
+	if( !vips_source_is_mappable( rtiff->source ) )
+		return( FALSE );
+
+	/* Strips must follow each other with no gaps.
+	 */
+	if( !TIFFGetField( rtiff->tiff, TIFFTAG_STRIPOFFSETS, &offsets ) )
+		return( FALSE );
+	strip_size = header->rows_per_strip * header->scanline_size;
+	for( i = 1; i < header->number_of_strips; i++ )
+		if( offsets[i] != offsets[0] + i * strip_size )
+			return( FALSE );
+
+	return( TRUE );
+}
+
+/* Uncompressed strip images can be read by mapping the source. There's no
+ * decode and no copy, and we can serve regions in any order.
+ */
+static int
+rtiff_read_mapped( Rtiff *rtiff, VipsImage *out )
+{
+	VipsImage **t = (VipsImage **) 
+		vips_object_local_array( VIPS_OBJECT( out ), 5 );
+
+	toff_t *offsets;
+	VipsBandFormat format;
+
+#ifdef DEBUG
+	printf( "tiff2vips: rtiff_read_mapped\n" );
+#endif /*DEBUG*/
+
+	if( !TIFFGetField( rtiff->tiff, TIFFTAG_STRIPOFFSETS, &offsets ) ) {
+		vips_error( "tiff2vips", "%s", _( "no strip offsets" ) );
+		return( -1 );
+	}
+	if( (format = rtiff_guess_format( rtiff )) == VIPS_FORMAT_NOTSET )
+		return( -1 );
+
+	if( !(t[0] = vips__image_new_from_source_map( rtiff->source, 
+		offsets[0], 0,
+		rtiff->header.width, rtiff->header.height, 
+		rtiff->header.samples_per_pixel, format, rtiff->access )) ||
+		vips__byteswap_bool( t[0], &t[1], 
+			TIFFIsByteSwapped( rtiff->tiff ) ) )
+		return( -1 );
+
+	/* Attach the mapped pixels to an image carrying the tiff header.
+	 */
+	t[2] = vips_image_new();
+	if( vips_image_write( t[1], t[2] ) ||
+		rtiff_set_header( rtiff, t[2] ) ||
+		rtiff_autorotate( rtiff, t[2], &t[3] ) ||
+		rtiff_unpremultiply( rtiff, t[3], &t[4] ) ||
+		vips_image_write( t[4], out ) )
+		return( -1 );
+
+	return( 0 );
+}
+
 /* Load from a tiff dir into one of our tiff header structs.
  */
 static int
@@ -2644,6 +2832,28 @@ vips__istifftiled_source( VipsSource *source )
 	return( vips__testtiff_source( source, TIFFIsTiled ) ); 
 }
 
+/* TRUE if these pages can be read by mapping the source, so we can support
+ * random access.
+ */
+gboolean
+vips__istiffmappable_source( VipsSource *source, int page, int n )
+{
+	VipsImage *image;
+	Rtiff *rtiff;
+	gboolean mappable;
+
+	vips__tiff_init();
+
+	image = vips_image_new();
+	mappable = (rtiff = rtiff_new( source, image, page, n, FALSE )) &&
+		!rtiff_header_read_all( rtiff ) &&
+		rtiff_can_map( rtiff );
+	g_object_unref( image );
+	vips_error_clear();
+
+	return( mappable );
+}
+
 int
 vips__tiff_read_header_source( VipsSource *source, VipsImage *out, 
 	int page, int n, gboolean autorotate )
@@ -2671,7 +2881,7 @@ vips__tiff_read_header_source( VipsSource *source, VipsImage *out,
 
 int
 vips__tiff_read_source( VipsSource *source, VipsImage *out, 
-	int page, int n, gboolean autorotate )
+	int page, int n, gboolean autorotate, VipsAccess access )
 {
 	Rtiff *rtiff;
 
@@ -2684,11 +2894,16 @@ vips__tiff_read_source( VipsSource *source, VipsImage *out,
 	if( !(rtiff = rtiff_new( source, out, page, n, autorotate )) ||
 		rtiff_header_read_all( rtiff ) )
 		return( -1 );
+	rtiff->access = access;
 
 	if( rtiff->header.tiled ) {
 		if( rtiff_read_tilewise( rtiff, out ) )
 			return( -1 );
 	}
+	else if( rtiff_can_map( rtiff ) ) {
+		if( rtiff_read_mapped( rtiff, out ) )
+			return( -1 );
+	}
 	else {
 		if( rtiff_read_stripwise( rtiff, out ) )
 			return( -1 );
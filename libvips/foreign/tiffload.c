@@ -4,6 +4,9 @@
  * 	- from tiffload.c
  * 27/1/17
  * 	- add get_flags for buffer loader
+ * 18/10/20
+ * 	- add "shrink" for block shrink-on-load
+ * 	- uncompressed strip images we can map are PARTIAL
  */
 
 /*
@@ -73,6 +76,10 @@ typedef struct _VipsForeignLoadTiff {
 	 */
 	gboolean autorotate;
 
+	/* Block shrink by this integer factor during load.
+	 */
+	int shrink;
+
 } VipsForeignLoadTiff;
 
 typedef VipsForeignLoadClass VipsForeignLoadTiffClass;
@@ -92,12 +99,16 @@ vips_foreign_load_tiff_dispose( GObject *gobject )
 }
 
 static VipsForeignFlags
-vips_foreign_load_tiff_get_flags_source( VipsSource *source )
+vips_foreign_load_tiff_get_flags_page( VipsSource *source, int page, int n )
 {
 	VipsForeignFlags flags;
 
+	/* Tiled images, and uncompressed strip images we can map, can be read
+	 * in any order.
+	 */
 	flags = 0;
-	if( vips__istifftiled_source( source ) ) 
+	if( vips__istifftiled_source( source ) ||
+		vips__istiffmappable_source( source, page, n ) ) 
 		flags |= VIPS_FOREIGN_PARTIAL;
 	else
 		flags |= VIPS_FOREIGN_SEQUENTIAL;
@@ -105,6 +116,12 @@ vips_foreign_load_tiff_get_flags_source( VipsSource *source )
 	return( flags );
 }
 
+static VipsForeignFlags
+vips_foreign_load_tiff_get_flags_source( VipsSource *source )
+{
+	return( vips_foreign_load_tiff_get_flags_page( source, 0, 1 ) );
+}
+
 static VipsForeignFlags
 vips_foreign_load_tiff_get_flags_filename( const char *filename )
 {
@@ -124,7 +141,8 @@ vips_foreign_load_tiff_get_flags( VipsForeignLoad *load )
 {
 	VipsForeignLoadTiff *tiff = (VipsForeignLoadTiff *) load;
 
-	return( vips_foreign_load_tiff_get_flags_source( tiff->source ) );
+	return( vips_foreign_load_tiff_get_flags_page( tiff->source, 
+		tiff->page, tiff->n ) );
 }
 
 static int
@@ -133,7 +151,8 @@ vips_foreign_load_tiff_header( VipsForeignLoad *load )
 	VipsForeignLoadTiff *tiff = (VipsForeignLoadTiff *) load;
 
 	if( vips__tiff_read_header_source( tiff->source, load->out, 
-		tiff->page, tiff->n, tiff->autorotate ) ) 
+		tiff->page, tiff->n, tiff->autorotate ) ||
+		vips__foreign_load_shrink_header( load->out, tiff->shrink ) ) 
 		return( -1 );
 
 	return( 0 );
@@ -143,9 +162,20 @@ static int
 vips_foreign_load_tiff_load( VipsForeignLoad *load )
 {
 	VipsForeignLoadTiff *tiff = (VipsForeignLoadTiff *) load;
-
-	if( vips__tiff_read_source( tiff->source, load->real, 
-		tiff->page, tiff->n,  tiff->autorotate ) ) 
+	VipsImage **t = (VipsImage **) 
+		vips_object_local_array( VIPS_OBJECT( load ), 1 );
+
+	if( tiff->shrink > 1 ) {
+		t[0] = vips_image_new();
+		if( vips__tiff_read_source( tiff->source, t[0], 
+			tiff->page, tiff->n,  tiff->autorotate, 
+			load->access ) ||
+			vips__foreign_load_shrink( t[0], 
+				load->real, tiff->shrink ) )
+			return( -1 );
+	}
+	else if( vips__tiff_read_source( tiff->source, load->real, 
+		tiff->page, tiff->n,  tiff->autorotate, load->access ) ) 
 		return( -1 );
 
 	return( 0 );
@@ -203,6 +233,13 @@ vips_foreign_load_tiff_class_init( VipsForeignLoadTiffClass *class )
 		VIPS_ARGUMENT_OPTIONAL_INPUT,
 		G_STRUCT_OFFSET( VipsForeignLoadTiff, autorotate ),
 		FALSE );
+
+	VIPS_ARG_INT( class, "shrink", 23, 
+		_( "Shrink" ), 
+		_( "Shrink factor on load" ),
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		G_STRUCT_OFFSET( VipsForeignLoadTiff, shrink ),
+		1, 16, 1 );
 }
 
 static void
@@ -210,6 +247,7 @@ vips_foreign_load_tiff_init( VipsForeignLoadTiff *tiff )
 {
 	tiff->page = 0; 
 	tiff->n = 1; 
+	tiff->shrink = 1; 
 }
 
 typedef struct _VipsForeignLoadTiffSource {
@@ -454,6 +492,7 @@ vips_foreign_load_tiff_buffer_init( VipsForeignLoadTiffBuffer *buffer )
  * * @n: %gint, load this many pages
  * * @autorotate: %gboolean, use orientation tag to rotate the image 
  *   during load
+ * * @shrink: %gint, shrink by this integer factor during load
  *
  * Read a TIFF file into a VIPS image. It is a full baseline TIFF 6 reader, 
  * with extensions for tiled images, multipage images, XYZ and LAB colour 
@@ -485,6 +524,10 @@ vips_foreign_load_tiff_buffer_init( VipsForeignLoadTiffBuffer *buffer )
  * attached as #VIPS_META_IMAGEDESCRIPTION. Data in the photoshop tag is 
  * attached as #VIPS_META_PHOTOSHOP_NAME.
  *
+ * Set @shrink to block shrink each page by an integer factor as it is
+ * decoded, see vips_pngload(). This is useful for large strip TIFFs, which
+ * have no pyramid to load a reduced size from. 
+ *
  * See also: vips_image_new_from_file(), vips_autorot().
  *
  * Returns: 0 on success, -1 on error.
@@ -515,6 +558,7 @@ vips_tiffload( const char *filename, VipsImage **out, ... )
  * * @n: %gint, load this many pages
  * * @autorotate: %gboolean, use orientation tag to rotate the image 
  *   during load
+ * * @shrink: %gint, shrink by this integer factor during load
  *
  * Read a TIFF-formatted memory block into a VIPS image. Exactly as
  * vips_tiffload(), but read from a memory source. 
@@ -558,6 +602,7 @@ vips_tiffload_buffer( void *buf, size_t len, VipsImage **out, ... )
  * * @n: %gint, load this many pages
  * * @autorotate: %gboolean, use orientation tag to rotate the image 
  *   during load
+ * * @shrink: %gint, shrink by this integer factor during load
  *
  * Exactly as vips_tiffload(), but read from a source. 
  *
@@ -193,6 +193,9 @@
  * 	- write XYZ images as logluv
  * 7/2/20 [jclavoie-jive]
  * 	- add PAGENUMBER support
+ * 18/10/20
+ * 	- shrink strips in parallel
+ * 	- pyramid layers now use @region_shrink
  */
 
 /*
@@ -1591,7 +1594,8 @@ layer_strip_shrink( Layer *layer )
 		if( vips_rect_isempty( &target ) )
 			break;
 
-		(void) vips_region_shrink( from, to, &target );
+		(void) vips__region_shrink_threaded( from, to, &target, 
+			layer->wtiff->region_shrink );
 
 		below->write_y += target.height;
 
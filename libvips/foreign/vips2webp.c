@@ -18,6 +18,9 @@
  * 	- set loop even if we strip
  * 14/10/19
  * 	- revise for target IO
+ * 18/10/20
+ * 	- fill the picture in parallel strips, no full-image copy
+ * 	- turn on thread_level
  */
 
 /*
@@ -201,6 +204,10 @@ vips_webp_write_init( VipsWebPWrite *write, VipsImage *image,
 	if( smart_subsample )
 		write->config.use_sharp_yuv = 1;
 
+	/* Let libwebp use a second thread for analysis and entropy coding.
+	 */
+	write->config.thread_level = 1;
+
 	if( !WebPValidateConfig( &write->config ) ) {
 		vips_webp_write_unset( write );
 		vips_error( "vips2webp", "%s", _( "invalid configuration" ) );
@@ -230,39 +237,125 @@ vips_webp_pic_init( VipsWebPWrite *write, WebPPicture *pic )
 	return( TRUE );
 }
 
-/* Write a VipsImage into an unintialised pic.
+/* Strips of this many lines are imported on each worker. It must be even,
+ * so chroma rows never straddle two strips.
+ */
+#define WEBP_STRIP_HEIGHT (16)
+
+/* Import one strip of pixels into a small picture, then copy the converted 
+ * lines into place in the main picture. libwebp converts RGB to YUV in 2x2
+ * blocks, so this gives the same result as importing the whole image at 
+ * once, but we only need the strip in memory, and conversion runs on all 
+ * our workers.
  */
 static int
-write_webp_image( VipsWebPWrite *write, VipsImage *image, WebPPicture *pic ) 
+vips_webp_pic_generate( VipsRegion *region, 
+	void *seq, void *a, void *b, gboolean *stop )
 {
-	VipsImage *memory;
+	WebPPicture *pic = (WebPPicture *) b;
+	VipsRect *r = &region->valid;
+
+	WebPPicture strip;
 	webp_import import;
+	int y;
 
-	if( !vips_webp_pic_init( write, pic ) ) 
-		return( -1 );
+	g_assert( r->left == 0 );
+	g_assert( r->width == pic->width );
+	g_assert( r->top % 2 == 0 );
 
-	if( !(memory = vips_image_copy_memory( image )) ) {
-		WebPPictureFree( pic );
+	if( !WebPPictureInit( &strip ) ) {
+		vips_error( "vips2webp", "%s", _( "picture version error" ) );
 		return( -1 );
 	}
+	strip.use_argb = pic->use_argb;
+	strip.width = r->width;
+	strip.height = r->height;
 
-	pic->width = memory->Xsize;
-	pic->height = memory->Ysize;
-
-	if( memory->Bands == 4 )
+	if( region->im->Bands == 4 )
 		import = WebPPictureImportRGBA;
 	else
 		import = WebPPictureImportRGB;
 
-	if( !import( pic, VIPS_IMAGE_ADDR( memory, 0, 0 ),
-		VIPS_IMAGE_SIZEOF_LINE( memory ) ) ) {
-		VIPS_UNREF( memory );
-		WebPPictureFree( pic );
+	if( !import( &strip, VIPS_REGION_ADDR( region, r->left, r->top ),
+		(int) VIPS_REGION_LSKIP( region ) ) ) {
+		WebPPictureFree( &strip );
 		vips_error( "vips2webp", "%s", _( "picture memory error" ) );
 		return( -1 );
 	}
 
-	VIPS_UNREF( memory );
+	if( pic->use_argb ) {
+		for( y = 0; y < r->height; y++ )
+			memcpy( pic->argb + 
+					(size_t) (r->top + y) * pic->argb_stride,
+				strip.argb + (size_t) y * strip.argb_stride,
+				r->width * sizeof( uint32_t ) );
+	}
+	else {
+		int uv_width = (r->width + 1) / 2;
+		int uv_height = (r->height + 1) / 2;
+		int uv_top = r->top / 2;
+
+		for( y = 0; y < r->height; y++ )
+			memcpy( pic->y + (size_t) (r->top + y) * pic->y_stride,
+				strip.y + (size_t) y * strip.y_stride,
+				r->width );
+
+		for( y = 0; y < uv_height; y++ ) {
+			memcpy( pic->u + (size_t) (uv_top + y) * pic->uv_stride,
+				strip.u + (size_t) y * strip.uv_stride,
+				uv_width );
+			memcpy( pic->v + (size_t) (uv_top + y) * pic->uv_stride,
+				strip.v + (size_t) y * strip.uv_stride,
+				uv_width );
+		}
+
+		/* libwebp leaves out the alpha plane for strips which are
+		 * all opaque.
+		 */
+		if( pic->a ) 
+			for( y = 0; y < r->height; y++ ) {
+				uint8_t *q = pic->a + 
+					(size_t) (r->top + y) * pic->a_stride;
+
+				if( strip.a ) 
+					memcpy( q, 
+						strip.a + 
+						(size_t) y * strip.a_stride,
+						r->width );
+				else
+					memset( q, 255, r->width );
+			}
+	}
+
+	WebPPictureFree( &strip );
+
+	return( 0 );
+}
+
+/* Write a VipsImage into an unintialised pic.
+ */
+static int
+write_webp_image( VipsWebPWrite *write, VipsImage *image, WebPPicture *pic ) 
+{
+	if( !vips_webp_pic_init( write, pic ) ) 
+		return( -1 );
+
+	pic->width = image->Xsize;
+	pic->height = image->Ysize;
+	if( !pic->use_argb )
+		pic->colorspace = image->Bands == 4 ? 
+			WEBP_YUV420A : WEBP_YUV420;
+
+	if( !WebPPictureAlloc( pic ) ) {
+		vips_error( "vips2webp", "%s", _( "picture memory error" ) );
+		return( -1 );
+	}
+
+	if( vips_sink_tile( image, image->Xsize, WEBP_STRIP_HEIGHT,
+		NULL, vips_webp_pic_generate, NULL, write, pic ) ) {
+		WebPPictureFree( pic );
+		return( -1 );
+	}
 
 	return( 0 );
 }
@@ -555,7 +648,10 @@ vips__webp_write_target( VipsImage *image, VipsTarget *target,
 		return( -1 );
 	}
 
-	vips_target_finish( target );
+	if( vips_target_end( target ) ) {
+		vips_webp_write_unset( &write );
+		return( -1 );
+	}
 
 	vips_webp_write_unset( &write );
 
@@ -1,6 +1,8 @@
 /* load vips from a file
  *
  * 24/11/11
+ * 18/10/20
+ * 	- pass @access on to the window manager
  */
 
 /*
@@ -94,6 +96,10 @@ vips_foreign_load_vips_header( VipsForeignLoad *load )
 	if( !(out2 = vips_image_new_mode( vips->filename, "r" )) )
 		return( -1 );
 
+	/* Windows on the file can use this to hint the kernel.
+	 */
+	vips__window_set_access( out2, load->access );
+
 	/* Remove the @out that's there now. 
 	 */
 	g_object_get( load, "out", &out, NULL ); 
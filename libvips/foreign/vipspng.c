@@ -77,6 +77,11 @@
  * 	- restart after minimise
  * 14/10/19
  * 	- revise for connection IO
+ * 18/10/20
+ * 	- add parallel deflate
+ * 	- share one deflate worker pool between saves, only go parallel for
+ * 	  larger images
+ * 	- free the deflate pool in vips_shutdown()
  */
 
 /*
@@ -116,8 +121,6 @@
 #endif /*HAVE_CONFIG_H*/
 #include <vips/intl.h>
 
-#ifdef HAVE_PNG
-
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -128,8 +131,14 @@
 
 #include "pforeign.h"
 
+#ifdef HAVE_PNG
+
 #include <png.h>
 
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif /*HAVE_ZLIB*/
+
 #if PNG_LIBPNG_VER < 10003
 #error "PNG library too old."
 #endif
@@ -916,13 +925,687 @@ write_png_comment( VipsImage *image,
 	return( NULL );
 }
 
+#ifdef HAVE_ZLIB
+
+/* Parallel deflate, after pigz.
+ *
+ * We filter rows ourselves, then cut the filtered stream into blocks and
+ * compress each block on a worker thread as a raw deflate stream. Blocks
+ * end with a sync flush, so they finish on a byte boundary and can simply
+ * be concatenated. Each block is primed with the last 32kb of the block 
+ * before as a dictionary, so we lose very little compression. The zlib 
+ * header and the Adler-32 of the whole stream (combined from the per-block 
+ * checksums) are added around the outside, and each block becomes an IDAT.
+ */
+
+/* Cut the filtered image into blocks of about this size. pigz uses 128kb.
+ */
+#define DEFLATE_BLOCK_SIZE (128 * 1024)
+
+/* Allow this many blocks per worker to be in flight.
+ */
+#define DEFLATE_BLOCKS_PER_THREAD (2)
+
+/* The deflate window.
+ */
+#define DEFLATE_WINDOW (32768)
+
+/* Below this many bytes of pixels, the whole image is only a few blocks 
+ * and the parallel compressor can't win. Leave it to libpng.
+ */
+#define DEFLATE_PARALLEL_THRESHOLD (4 * DEFLATE_BLOCK_SIZE)
+
+typedef struct _DeflateBlock {
+	/* Filtered scanlines to compress.
+	 */
+	unsigned char *in;
+	size_t in_length;
+	size_t in_size;
+
+	/* The input just before this block.
+	 */
+	unsigned char dict[DEFLATE_WINDOW];
+	size_t dict_length;
+
+	/* The final block, end the deflate stream.
+	 */
+	gboolean last;
+
+	int level;
+
+	/* The raw deflate output, and the Adler-32 of @in.
+	 */
+	unsigned char *out;
+	size_t out_length;
+	uLong adler;
+
+	gboolean error;
+
+	/* Up when the block has been compressed.
+	 */
+	VipsSemaphore done;
+} DeflateBlock;
+
+typedef struct _Deflate {
+	Write *write;
+	int level;
+
+	/* Filter bytes per pixel, and bytes per scanline (without the filter
+	 * type byte).
+	 */
+	int bpp;
+	size_t rowbytes;
+	int filter;
+	gboolean swap;
+
+	/* The current and previous unfiltered scanline, MSB first. 
+	 */
+	VipsPel *row;
+	VipsPel *prev;
+
+	/* Scratch for trying each filter type.
+	 */
+	VipsPel *try[5];
+
+	/* The shared worker pool we send blocks to, or NULL to compress
+	 * inline.
+	 */
+	int n_threads;
+	GThreadPool *pool;
+
+	/* Blocks we have sent for compression, oldest first, and the block
+	 * we are filling.
+	 */
+	GQueue *pending;
+	DeflateBlock *current;
+
+	/* Adler-32 of the blocks we've written so far.
+	 */
+	uLong adler;
+	gboolean header_written;
+
+	/* Scanlines we've filtered.
+	 */
+	int y;
+} Deflate;
+
+static void
+deflate_block_free( DeflateBlock *block )
+{
+	VIPS_FREE( block->in );
+	VIPS_FREE( block->out );
+	vips_semaphore_destroy( &block->done );
+	VIPS_FREE( block );
+}
+
+static DeflateBlock *
+deflate_block_new( Deflate *deflate )
+{
+	DeflateBlock *block;
+
+	if( !(block = VIPS_NEW( NULL, DeflateBlock )) )
+		return( NULL );
+	block->in_length = 0;
+	block->in_size = DEFLATE_BLOCK_SIZE + 1 + deflate->rowbytes;
+	block->dict_length = 0;
+	block->last = FALSE;
+	block->level = deflate->level;
+	block->out = NULL;
+	block->out_length = 0;
+	block->adler = 0;
+	block->error = FALSE;
+	vips_semaphore_init( &block->done, 0, "done" );
+
+	if( !(block->in = VIPS_ARRAY( NULL, block->in_size, unsigned char )) ) {
+		deflate_block_free( block );
+		return( NULL );
+	}
+
+	return( block );
+}
+
+/* Compress a block to a raw deflate stream. This runs on the workers.
+ */
+static void
+deflate_block_compress( DeflateBlock *block )
+{
+	int flush = block->last ? Z_FINISH : Z_SYNC_FLUSH;
+
+	z_stream stream;
+	size_t out_size;
+	int result;
+
+	memset( &stream, 0, sizeof( stream ) );
+	if( deflateInit2( &stream, block->level, Z_DEFLATED, 
+		-15, 8, Z_DEFAULT_STRATEGY ) != Z_OK ) {
+		block->error = TRUE;
+		return;
+	}
+
+	if( block->dict_length > 0 &&
+		deflateSetDictionary( &stream, 
+			block->dict, block->dict_length ) != Z_OK ) {
+		deflateEnd( &stream );
+		block->error = TRUE;
+		return;
+	}
+
+	/* deflateBound() assumes Z_FINISH, allow a little extra for the sync
+	 * flush marker.
+	 */
+	out_size = deflateBound( &stream, block->in_length ) + 64;
+	if( !(block->out = VIPS_ARRAY( NULL, out_size, unsigned char )) ) {
+		deflateEnd( &stream );
+		block->error = TRUE;
+		return;
+	}
+
+	stream.next_in = block->in;
+	stream.avail_in = block->in_length;
+	stream.next_out = block->out;
+	stream.avail_out = out_size;
+
+	for(;;) {
+		result = deflate( &stream, flush );
+		if( result == Z_STREAM_ERROR ) {
+			block->error = TRUE;
+			break;
+		}
+
+		/* We're done when the whole input has gone and the flush 
+		 * has had enough space to complete.
+		 */
+		if( result == Z_STREAM_END ||
+			(flush == Z_SYNC_FLUSH && 
+			 stream.avail_in == 0 && 
+			 stream.avail_out > 0) )
+			break;
+
+		/* Out of space, which should never happen. 
+		 */
+		if( stream.avail_out == 0 ) {
+			size_t used = out_size;
+
+			out_size *= 2;
+			if( !(block->out = g_try_realloc( block->out, 
+				out_size )) ) {
+				block->error = TRUE;
+				break;
+			}
+			stream.next_out = block->out + used;
+			stream.avail_out = out_size - used;
+		}
+	}
+
+	block->out_length = out_size - stream.avail_out;
+	deflateEnd( &stream );
+
+	block->adler = adler32( adler32( 0L, Z_NULL, 0 ), 
+		block->in, block->in_length );
+}
+
+static void
+deflate_worker( void *data, void *user_data )
+{
+	DeflateBlock *block = (DeflateBlock *) data;
+
+	deflate_block_compress( block );
+	vips_semaphore_up( &block->done );
+}
+
+/* One set of workers shared by all saves, so we don't start and stop 
+ * threads for every image. Freed by vips__png_shutdown().
+ */
+static GThreadPool *vips__png_deflate_pool = NULL;
+
+static GThreadPool *
+deflate_pool( void )
+{
+	GThreadPool *pool;
+
+	g_mutex_lock( vips__global_lock );
+	if( !vips__png_deflate_pool )
+		vips__png_deflate_pool = g_thread_pool_new( deflate_worker, 
+			NULL, vips_concurrency_get(), FALSE, NULL );
+	pool = vips__png_deflate_pool;
+	g_mutex_unlock( vips__global_lock );
+
+	return( pool );
+}
+
+static void
+deflate_free( Deflate *deflate )
+{
+	DeflateBlock *block;
+	int i;
+
+	/* Wait for any blocks still being compressed.
+	 */
+	if( deflate->pending ) {
+		while( (block = g_queue_pop_head( deflate->pending )) ) {
+			if( deflate->pool )
+				vips_semaphore_down( &block->done );
+			deflate_block_free( block );
+		}
+		VIPS_FREEF( g_queue_free, deflate->pending );
+	}
+
+	VIPS_FREEF( deflate_block_free, deflate->current );
+	VIPS_FREE( deflate->row );
+	VIPS_FREE( deflate->prev );
+	for( i = 0; i < 5; i++ )
+		VIPS_FREE( deflate->try[i] );
+	VIPS_FREE( deflate );
+}
+
+static Deflate *
+deflate_new( Write *write, VipsImage *in, 
+	int level, VipsForeignPngFilter filter )
+{
+	Deflate *deflate;
+	int i;
+
+	if( !(deflate = VIPS_NEW( NULL, Deflate )) )
+		return( NULL );
+	memset( deflate, 0, sizeof( Deflate ) );
+	deflate->write = write;
+	deflate->level = level;
+	deflate->bpp = VIPS_IMAGE_SIZEOF_PEL( in );
+	deflate->rowbytes = VIPS_IMAGE_SIZEOF_LINE( in );
+	deflate->filter = filter & VIPS_FOREIGN_PNG_FILTER_ALL;
+	if( !deflate->filter )
+		deflate->filter = VIPS_FOREIGN_PNG_FILTER_NONE;
+	deflate->swap = in->BandFmt == VIPS_FORMAT_USHORT &&
+		!vips_amiMSBfirst();
+	deflate->adler = adler32( 0L, Z_NULL, 0 );
+	deflate->n_threads = vips_concurrency_get();
+
+	/* prev starts as zero, the row above the image.
+	 */
+	if( !(deflate->row = 
+		VIPS_ARRAY( NULL, deflate->rowbytes, VipsPel )) ||
+		!(deflate->prev = 
+			VIPS_ARRAY( NULL, deflate->rowbytes, VipsPel )) ||
+		!(deflate->pending = g_queue_new()) ||
+		!(deflate->current = deflate_block_new( deflate )) ) {
+		deflate_free( deflate );
+		return( NULL );
+	}
+	memset( deflate->prev, 0, deflate->rowbytes );
+	for( i = 0; i < 5; i++ )
+		if( !(deflate->try[i] = 
+			VIPS_ARRAY( NULL, 1 + deflate->rowbytes, VipsPel )) ) {
+			deflate_free( deflate );
+			return( NULL );
+		}
+
+	/* With one thread we just compress inline.
+	 */
+	if( deflate->n_threads > 1 ) 
+		deflate->pool = deflate_pool();
+
+	return( deflate );
+}
+
+/* Filter @row into @out, with the type byte first.
+ */
+static void
+deflate_filter_row( int type, size_t bpp, size_t rowbytes, 
+	VipsPel *row, VipsPel *prev, VipsPel *out )
+{
+	size_t i;
+
+	out[0] = type;
+	out += 1;
+
+	switch( type ) {
+	case PNG_FILTER_VALUE_NONE:
+		memcpy( out, row, rowbytes );
+		break;
+
+	case PNG_FILTER_VALUE_SUB:
+		for( i = 0; i < bpp; i++ )
+			out[i] = row[i];
+		for( ; i < rowbytes; i++ )
+			out[i] = row[i] - row[i - bpp];
+		break;
+
+	case PNG_FILTER_VALUE_UP:
+		for( i = 0; i < rowbytes; i++ )
+			out[i] = row[i] - prev[i];
+		break;
+
+	case PNG_FILTER_VALUE_AVG:
+		for( i = 0; i < bpp; i++ )
+			out[i] = row[i] - (prev[i] >> 1);
+		for( ; i < rowbytes; i++ )
+			out[i] = row[i] - ((row[i - bpp] + prev[i]) >> 1);
+		break;
+
+	case PNG_FILTER_VALUE_PAETH:
+		for( i = 0; i < bpp; i++ )
+			out[i] = row[i] - prev[i];
+		for( ; i < rowbytes; i++ ) {
+			int a = row[i - bpp];
+			int b = prev[i];
+			int c = prev[i - bpp];
+			int p = b - c;
+			int q = a - c;
+			int pa = abs( p );
+			int pb = abs( q );
+			int pc = abs( p + q );
+
+			if( pb < pa ) {
+				a = b;
+				pa = pb;
+			}
+			if( pc < pa )
+				a = c;
+
+			out[i] = row[i] - a;
+		}
+		break;
+
+	default:
+		g_assert_not_reached();
+	}
+}
+
+/* libpng's heuristic: the filter with the smallest sum of absolute values,
+ * treating bytes as signed.
+ */
+static size_t
+deflate_filter_cost( VipsPel *out, size_t rowbytes )
+{
+	signed char *p = (signed char *) (out + 1);
+
+	size_t sum;
+	size_t i;
+
+	sum = 0;
+	for( i = 0; i < rowbytes; i++ )
+		sum += abs( p[i] );
+
+	return( sum );
+}
+
+/* Filter the scanline in @deflate->row to the end of the current block.
+ */
+static void
+deflate_add_row( Deflate *deflate )
+{
+	DeflateBlock *block = deflate->current;
+	VipsPel *out = block->in + block->in_length;
+
+	int n_filters;
+	int only;
+	int i;
+
+	n_filters = 0;
+	only = PNG_FILTER_VALUE_NONE;
+	for( i = 0; i < PNG_FILTER_VALUE_LAST; i++ )
+		if( deflate->filter & (PNG_FILTER_NONE << i) ) {
+			n_filters += 1;
+			only = i;
+		}
+
+	if( n_filters == 1 )
+		deflate_filter_row( only, deflate->bpp, deflate->rowbytes,
+			deflate->row, deflate->prev, out );
+	else {
+		size_t best_cost;
+		int best;
+
+		best = -1;
+		best_cost = 0;
+		for( i = 0; i < PNG_FILTER_VALUE_LAST; i++ ) 
+			if( deflate->filter & (PNG_FILTER_NONE << i) ) {
+				size_t cost;
+
+				deflate_filter_row( i, 
+					deflate->bpp, deflate->rowbytes,
+					deflate->row, deflate->prev, 
+					deflate->try[i] );
+				cost = deflate_filter_cost( deflate->try[i],
+					deflate->rowbytes );
+				if( best == -1 ||
+					cost < best_cost ) {
+					best = i;
+					best_cost = cost;
+				}
+			}
+
+		memcpy( out, deflate->try[best], 1 + deflate->rowbytes );
+	}
+
+	block->in_length += 1 + deflate->rowbytes;
+
+	VIPS_SWAP( VipsPel *, deflate->row, deflate->prev );
+}
+
+/* Write a compressed block as an IDAT. The first block carries the zlib 
+ * header, the last the Adler-32 of the whole stream.
+ */
+static void
+deflate_write_block( Deflate *deflate, DeflateBlock *block )
+{
+	png_structp pPng = deflate->write->pPng;
+
+	unsigned char header[2];
+	unsigned char trailer[4];
+	size_t length;
+
+	length = block->out_length;
+
+	if( !deflate->header_written ) {
+		int flevel;
+		int cmf;
+		int flg;
+
+		if( deflate->level < 2 )
+			flevel = 0;
+		else if( deflate->level < 6 )
+			flevel = 1;
+		else if( deflate->level == 6 )
+			flevel = 2;
+		else
+			flevel = 3;
+
+		/* Deflate with a 32kb window, and FCHECK to make the pair a 
+		 * multiple of 31.
+		 */
+		cmf = 0x78;
+		flg = flevel << 6;
+		flg += (31 - (cmf * 256 + flg) % 31) % 31;
+
+		header[0] = cmf;
+		header[1] = flg;
+		length += 2;
+	}
+
+	deflate->adler = adler32_combine( deflate->adler, 
+		block->adler, block->in_length );
+
+	if( block->last ) {
+		trailer[0] = (deflate->adler >> 24) & 0xff;
+		trailer[1] = (deflate->adler >> 16) & 0xff;
+		trailer[2] = (deflate->adler >> 8) & 0xff;
+		trailer[3] = deflate->adler & 0xff;
+		length += 4;
+	}
+
+	png_write_chunk_start( pPng, (png_const_bytep) "IDAT", length );
+	if( !deflate->header_written ) {
+		png_write_chunk_data( pPng, header, 2 );
+		deflate->header_written = TRUE;
+	}
+	png_write_chunk_data( pPng, block->out, block->out_length );
+	if( block->last ) 
+		png_write_chunk_data( pPng, trailer, 4 );
+	png_write_chunk_end( pPng );
+}
+
+/* Wait for the oldest pending block and write it.
+ */
+static int
+deflate_write_next( Deflate *deflate )
+{
+	DeflateBlock *block;
+
+	if( !(block = g_queue_pop_head( deflate->pending )) )
+		return( 0 );
+
+	if( deflate->pool )
+		vips_semaphore_down( &block->done );
+
+	if( block->error ) {
+		vips_error( "vips2png", "%s", _( "deflate failed" ) );
+		deflate_block_free( block );
+		return( -1 );
+	}
+
+	deflate_write_block( deflate, block );
+	deflate_block_free( block );
+
+	return( 0 );
+}
+
+/* Send the current block off for compression and start a new one.
+ */
+static int
+deflate_dispatch( Deflate *deflate, gboolean last )
+{
+	DeflateBlock *block = deflate->current;
+
+	deflate->current = NULL;
+	block->last = last;
+	g_queue_push_tail( deflate->pending, block );
+
+	if( deflate->pool )
+		g_thread_pool_push( deflate->pool, block, NULL );
+	else
+		deflate_block_compress( block );
+
+	if( !last ) {
+		size_t n = VIPS_MIN( block->in_length, DEFLATE_WINDOW );
+
+		if( !(deflate->current = deflate_block_new( deflate )) )
+			return( -1 );
+
+		/* The workers only read block->in, so it's safe to take our
+		 * dictionary from it.
+		 */
+		memcpy( deflate->current->dict, 
+			block->in + block->in_length - n, n );
+		deflate->current->dict_length = n;
+	}
+
+	/* Don't let too much work pile up.
+	 */
+	while( g_queue_get_length( deflate->pending ) >= 
+		VIPS_MAX( 1, deflate->n_threads ) * DEFLATE_BLOCKS_PER_THREAD )
+		if( deflate_write_next( deflate ) )
+			return( -1 );
+
+	return( 0 );
+}
+
+static int
+write_png_block_parallel( VipsRegion *region, VipsRect *area, void *a )
+{
+	Deflate *deflate = (Deflate *) a;
+	Write *write = deflate->write;
+
+	int y;
+
+	g_assert( area->left == 0 );
+	g_assert( area->width == region->im->Xsize );
+	g_assert( area->top == deflate->y );
+
+	/* Catch PNG errors from IDAT write.
+	 */
+	if( setjmp( png_jmpbuf( write->pPng ) ) ) 
+		return( -1 );
+
+	for( y = 0; y < area->height; y++ ) {
+		VipsPel *p = VIPS_REGION_ADDR( region, 0, area->top + y );
+
+		if( deflate->swap ) {
+			size_t i;
+
+			for( i = 0; i < deflate->rowbytes; i += 2 ) {
+				deflate->row[i] = p[i + 1];
+				deflate->row[i + 1] = p[i];
+			}
+		}
+		else
+			memcpy( deflate->row, p, deflate->rowbytes );
+
+		deflate_add_row( deflate );
+		deflate->y += 1;
+
+		if( deflate->y == region->im->Ysize ) {
+			if( deflate_dispatch( deflate, TRUE ) )
+				return( -1 );
+		}
+		else if( deflate->current->in_length >= DEFLATE_BLOCK_SIZE ) {
+			if( deflate_dispatch( deflate, FALSE ) )
+				return( -1 );
+		}
+	}
+
+	return( 0 );
+}
+
+/* Write the pixels of @in with the parallel compressor, then the IEND.
+ */
+static int
+write_vips_parallel( Write *write, VipsImage *in, 
+	int compress, VipsForeignPngFilter filter )
+{
+	Deflate *deflate;
+
+	if( !(deflate = deflate_new( write, in, compress, filter )) )
+		return( -1 );
+
+	if( vips_sink_disc( in, write_png_block_parallel, deflate ) ) {
+		deflate_free( deflate );
+		return( -1 );
+	}
+
+	/* The setjmp() was held by our background writer: reset it.
+	 */
+	if( setjmp( png_jmpbuf( write->pPng ) ) ) {
+		deflate_free( deflate );
+		return( -1 );
+	}
+
+	while( !g_queue_is_empty( deflate->pending ) )
+		if( deflate_write_next( deflate ) ) {
+			deflate_free( deflate );
+			return( -1 );
+		}
+
+	deflate_free( deflate );
+
+	/* We've not given libpng any pixels, so png_write_end() would fail. 
+	 * All the ancillary chunks went out with png_write_info().
+	 */
+	png_write_chunk( write->pPng, (png_const_bytep) "IEND", NULL, 0 );
+
+	return( 0 );
+}
+
+#endif /*HAVE_ZLIB*/
+
 /* Write a VIPS image to PNG.
  */
 static int
 write_vips( Write *write, 
 	int compress, int interlace, const char *profile,
 	VipsForeignPngFilter filter, gboolean strip,
-	gboolean palette, int colours, int Q, double dither )
+	gboolean palette, int colours, int Q, double dither,
+	gboolean parallel )
 {
 	VipsImage *in = write->in;
 
@@ -1144,6 +1827,18 @@ write_vips( Write *write,
 
 	png_write_info( write->pPng, write->pInfo );
 
+#ifdef HAVE_ZLIB
+	/* We filter and compress ourselves, libpng just writes the chunks.
+	 * Interlaced images are rare and need seven passes, and small 
+	 * images are over before the workers get going, so leave them to 
+	 * libpng.
+	 */
+	if( parallel &&
+		!interlace &&
+		VIPS_IMAGE_SIZEOF_IMAGE( in ) >= DEFLATE_PARALLEL_THRESHOLD ) 
+		return( write_vips_parallel( write, in, compress, filter ) );
+#endif /*HAVE_ZLIB*/
+
 	/* If we're an intel byte order CPU and this is a 16bit image, we need
 	 * to swap bytes.
 	 */
@@ -1176,7 +1871,8 @@ int
 vips__png_write_target( VipsImage *in, VipsTarget *target,
 	int compression, int interlace,
 	const char *profile, VipsForeignPngFilter filter, gboolean strip,
-	gboolean palette, int colours, int Q, double dither )
+	gboolean palette, int colours, int Q, double dither,
+	gboolean parallel )
 {
 	Write *write;
 
@@ -1185,7 +1881,8 @@ vips__png_write_target( VipsImage *in, VipsTarget *target,
 
 	if( write_vips( write, 
 		compression, interlace, profile, filter, strip, palette,
-		colours, Q, dither ) ) {
+		colours, Q, dither, parallel ) ||
+		vips_target_end( target ) ) {
 		write_finish( write );
 		vips_error( "vips2png", 
 			"%s", _( "unable to write to target" ) );
@@ -1198,3 +1895,23 @@ vips__png_write_target( VipsImage *in, VipsTarget *target,
 }
 
 #endif /*HAVE_PNG*/
+
+/* Called from vips_shutdown().
+ */
+void
+vips__png_shutdown( void )
+{
+#ifdef HAVE_PNG
+	GThreadPool *pool;
+
+	g_mutex_lock( vips__global_lock );
+	pool = vips__png_deflate_pool;
+	vips__png_deflate_pool = NULL;
+	g_mutex_unlock( vips__global_lock );
+
+	/* Any saves still running hold blocks on the queue, let them finish.
+	 */
+	if( pool )
+		g_thread_pool_free( pool, FALSE, TRUE );
+#endif /*HAVE_PNG*/
+}
@@ -26,6 +26,10 @@
  * 	- support array of delays 
  * 14/10/19
  * 	- revise for source IO
+ * 18/10/20
+ * 	- find keyframes during header read, and skip to the nearest one 
+ * 	  when loading a page
+ * 	- clear the canvas before the first frame
  */
 
 /*
@@ -126,6 +130,11 @@ typedef struct {
 	 */
 	int *delays;
 
+	/* For each frame, TRUE if it can be rendered without any previous
+	 * frames.
+	 */
+	gboolean *keyframes;
+
 	/* Parse with this.
 	 */
 	WebPDemuxer *demux;
@@ -335,6 +344,7 @@ read_free( Read *read )
 
 	VIPS_UNREF( read->source );
 	VIPS_FREE( read->delays );
+	VIPS_FREE( read->keyframes );
 	VIPS_FREE( read );
 
 	return( 0 );
@@ -354,6 +364,7 @@ read_new( VipsSource *source, int page, int n, double scale )
 	read->n = n;
 	read->scale = scale;
 	read->delays = NULL;
+	read->keyframes = NULL;
 	read->demux = NULL;
 	read->frame = NULL;
 	read->dispose_method = WEBP_MUX_DISPOSE_NONE;
@@ -446,20 +457,50 @@ read_header( Read *read, VipsImage *out )
 			VIPS_META_PAGE_HEIGHT, read->frame_height );
 
 		if( WebPDemuxGetFrame( read->demux, 1, &iter ) ) {
+			gboolean cleared;
 			int i;
 
 			read->delays = (int *) 
 				g_malloc0( read->frame_count * sizeof( int ) );
 			for( i = 0; i < read->frame_count; i++ ) 
 				read->delays[i] = 40;
+			read->keyframes = (gboolean *) 
+				g_malloc0( read->frame_count * 
+					sizeof( gboolean ) );
+
+			/* The canvas starts out clear.
+			 */
+			cleared = TRUE;
 
 			do {
+				gboolean full;
+
 				g_assert( iter.frame_num >= 1 &&
 					iter.frame_num <= read->frame_count );
 
 				read->delays[iter.frame_num - 1] = 
 					iter.duration;
 
+				/* Same rules as libwebp's AnimDecoder: a 
+				 * frame needs no history if it lands on a 
+				 * clear canvas, or if it replaces every
+				 * pixel.
+				 */
+				full = iter.x_offset == 0 &&
+					iter.y_offset == 0 &&
+					iter.width == read->canvas_width &&
+					iter.height == read->canvas_height;
+				read->keyframes[iter.frame_num - 1] = 
+					cleared ||
+					(full &&
+					 (!iter.has_alpha ||
+					  iter.blend_method == 
+					  	WEBP_MUX_NO_BLEND));
+				cleared = iter.dispose_method == 
+						WEBP_MUX_DISPOSE_BACKGROUND &&
+					(full || 
+					 read->keyframes[iter.frame_num - 1]);
+
 				/* We need the alpha in an animation if:
 				 *   - any frame has transparent pixels 
 				 *   - any frame doesn't fill the whole canvas.
@@ -541,6 +582,8 @@ read_header( Read *read, VipsImage *out )
 
 	if( vips_image_write_prepare( read->frame ) ) 
 		return( -1 );
+	memset( VIPS_IMAGE_ADDR( read->frame, 0, 0 ), 0, 
+		VIPS_IMAGE_SIZEOF_IMAGE( read->frame ) );
 
 	vips_image_init_fields( out,
 		read->width, read->height,
@@ -691,6 +734,45 @@ read_next_frame( Read *read )
 	return( 0 );
 }
 
+/* Skip to the last keyframe at or before @frame, if that's ahead of the next
+ * frame we would render anyway.
+ */
+static int
+read_seek_keyframe( Read *read, int frame )
+{
+	int i;
+
+	if( !read->keyframes )
+		return( 0 );
+
+	for( i = frame; i > read->frame_no + 1; i-- ) 
+		if( read->keyframes[i - 1] )
+			break;
+	if( i <= read->frame_no + 1 )
+		return( 0 );
+
+#ifdef DEBUG
+	printf( "read_seek_keyframe: skipping from frame %d to %d\n", 
+		read->frame_no + 1, i ); 
+#endif /*DEBUG*/
+
+	WebPDemuxReleaseIterator( &read->iter );
+	if( !WebPDemuxGetFrame( read->demux, i, &read->iter ) ) {
+		vips_error( "webp2vips", 
+			"%s", _( "not enough frames" ) ); 
+		return( -1 );
+	}
+
+	/* Keyframes either fill the canvas, or expect it to be clear.
+	 */
+	memset( VIPS_IMAGE_ADDR( read->frame, 0, 0 ), 0, 
+		VIPS_IMAGE_SIZEOF_IMAGE( read->frame ) );
+	read->dispose_method = WEBP_MUX_DISPOSE_NONE;
+	read->frame_no = i - 1;
+
+	return( 0 );
+}
+
 static int
 read_webp_generate( VipsRegion *or, 
 	void *seq, void *a, void *b, gboolean *stop )
@@ -709,6 +791,10 @@ read_webp_generate( VipsRegion *or,
 
 	g_assert( r->height == 1 );
 
+	if( read->frame_no < frame &&
+		read_seek_keyframe( read, frame ) )
+		return( -1 );
+
 	while( read->frame_no < frame ) {
 		if( read_next_frame( read ) )
 			return( -1 );
@@ -402,6 +402,9 @@ int vips_find_trim( VipsImage *in,
 	__attribute__((sentinel));
 int vips_getpoint( VipsImage *in, double **vector, int *n, int x, int y, ... )
 	__attribute__((sentinel));
+int vips_getpoints( VipsImage *in, VipsImage **out, 
+	double *coords, int n, ... )
+	__attribute__((sentinel));
 int vips_hist_find( VipsImage *in, VipsImage **out, ... )
 	__attribute__((sentinel));
 int vips_hist_find_ndim( VipsImage *in, VipsImage **out, ... )
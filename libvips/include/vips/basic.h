@@ -63,6 +63,7 @@ typedef enum {
 	VIPS_PRECISION_INTEGER,
 	VIPS_PRECISION_FLOAT,
 	VIPS_PRECISION_APPROXIMATE,
+	VIPS_PRECISION_RECURSIVE,
 	VIPS_PRECISION_LAST
 } VipsPrecision;
 
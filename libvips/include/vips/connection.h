@@ -90,6 +90,7 @@ const char *vips_connection_filename( VipsConnection *connection );
 const char *vips_connection_nick( VipsConnection *connection );
 
 void vips_pipe_read_limit_set( gint64 limit );
+void vips_source_readahead_set( gint64 readahead );
 
 #define VIPS_TYPE_SOURCE (vips_source_get_type())
 #define VIPS_SOURCE( obj ) \
@@ -219,6 +220,10 @@ int vips_source_decode( VipsSource *source );
 gint64 vips_source_read( VipsSource *source, void *data, size_t length );
 gboolean vips_source_is_mappable( VipsSource *source );
 const void *vips_source_map( VipsSource *source, size_t *length );
+void vips_source_prefetch( VipsSource *source, 
+	gint64 offset, gint64 length );
+void vips_source_get_prefetch_stats( VipsSource *source, 
+	gint64 *prefetched, gint64 *used );
 VipsBlob *vips_source_map_blob( VipsSource *source );
 gint64 vips_source_seek( VipsSource *source, gint64 offset, int whence );
 int vips_source_rewind( VipsSource *source );
@@ -378,6 +383,11 @@ VipsTarget *vips_target_new_to_file( const char *filename );
 VipsTarget *vips_target_new_to_memory( void );
 int vips_target_write( VipsTarget *target, const void *data, size_t length );
 void vips_target_finish( VipsTarget *target );
+int vips_target_end( VipsTarget *target );
+void vips_target_get_stats( VipsTarget *target, 
+	gint64 *bytes_written, gint64 *n_writes,
+	double *write_time, double *max_write_time, double *stall_time );
+void vips_target_background_set( gboolean background );
 unsigned char *vips_target_steal( VipsTarget *target, size_t *length );
 char *vips_target_steal_text( VipsTarget *target );
 
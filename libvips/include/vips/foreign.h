@@ -624,6 +624,12 @@ int vips_gifload_buffer( void *buf, size_t len, VipsImage **out, ... )
 	__attribute__((sentinel));
 int vips_gifload_source( VipsSource *source, VipsImage **out, ... )
 	__attribute__((sentinel));
+int vips_gifsave( VipsImage *in, const char *filename, ... )
+	__attribute__((sentinel));
+int vips_gifsave_buffer( VipsImage *in, void **buf, size_t *len, ... )
+	__attribute__((sentinel));
+int vips_gifsave_target( VipsImage *in, VipsTarget *target, ... )
+	__attribute__((sentinel));
 
 int vips_heifload( const char *filename, VipsImage **out, ... )
 	__attribute__((sentinel));
@@ -61,6 +61,12 @@ G_STMT_START { \
 		vips__thread_malloc_free( -((gint64) (SIZE)) ); \
 } G_STMT_END
 
+#define VIPS_GATE_COUNT( NAME, VALUE ) \
+G_STMT_START { \
+	if( vips__thread_profile ) \
+		vips__thread_profile_count( NAME, (gint64) (VALUE) ); \
+} G_STMT_END
+
 extern gboolean vips__thread_profile;
 
 void vips_profile_set( gboolean profile );
@@ -73,6 +79,7 @@ void vips__thread_gate_start( const char *gate_name );
 void vips__thread_gate_stop( const char *gate_name ); 
 
 void vips__thread_malloc_free( gint64 size );
+void vips__thread_profile_count( const char *name, gint64 value );
 
 #endif /*VIPS_GATE_H*/
 
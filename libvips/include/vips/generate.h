@@ -55,6 +55,10 @@ int vips_sink_screen( VipsImage *in, VipsImage *out, VipsImage *mask,
 	VipsSinkNotify notify_fn, void *a );
 
 int vips_sink_memory( VipsImage *im );
+void vips_sink_memory_numa_set( gboolean numa );
+
+typedef int (*VipsSinkTeeFn)( VipsImage *image, int i, void *a );
+int vips_sink_tee( VipsImage *in, int n, VipsSinkTeeFn fn, void *a );
 
 void *vips_start_one( VipsImage *out, void *a, void *b );
 int vips_stop_one( void *seq, void *a, void *b );
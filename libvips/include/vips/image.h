@@ -309,6 +309,11 @@ typedef struct _VipsImage {
 	 */
 	gboolean delete_on_close;
 	char *delete_on_close_filename;
+
+	/* meta and meta_traverse above point into this. It can be shared
+	 * with other images, see header.c.
+	 */
+	struct _VipsMetaTable *meta_table;
 } VipsImage;
 
 typedef struct _VipsImageClass {
@@ -47,6 +47,23 @@ extern "C" {
  */
 #define VIPS_LSHIFT_INT( I, N ) ((int) ((unsigned int) (I) << (N)))
 
+/* Mark a simple loop for the compiler to vectorise, with clones for wider
+ * vector units selected at runtime from the CPU features. Without orc, this 
+ * is the only way some of our loops get vector code.
+ */
+#if defined(HAVE_TARGET_CLONES) && defined(__GNUC__) && !defined(__clang__)
+#define VIPS_TARGET_CLONES \
+	__attribute__((target_clones( "default", "avx2", "avx512f" ), \
+		optimize( "tree-vectorize" )))
+#elif defined(HAVE_TARGET_CLONES)
+/* clang has no optimize attribute, and vectorises at -O2 anyway.
+ */
+#define VIPS_TARGET_CLONES \
+	__attribute__((target_clones( "default", "avx2", "avx512f" )))
+#else /*!HAVE_TARGET_CLONES*/
+#define VIPS_TARGET_CLONES
+#endif /*HAVE_TARGET_CLONES*/
+
 /* What we store in the Meta hash table. We can't just use GHashTable's 
  * key/value pairs, since we need to iterate over meta in Meta_traverse order.
  *
@@ -54,12 +71,22 @@ extern "C" {
  * their GValue implementation, see eg. MetaArea.
  */
 typedef struct _VipsMeta {
-	VipsImage *im;
+	struct _VipsMetaTable *table;	/* Table we are part of */
 
 	char *name;			/* strdup() of field name */
 	GValue value;			/* copy of value */
 } VipsMeta;
 
+/* A set of metadata. Images share these down pipelines, and an image only 
+ * gets a table of its own when it changes a field. See header.c.
+ */
+typedef struct _VipsMetaTable {
+	int ref_count;			/* Number of images sharing us */
+
+	GHashTable *hash;		/* Hash from name to VipsMeta */
+	GSList *traverse;		/* VipsMeta in order of creation */
+} VipsMetaTable;
+
 int vips__exif_parse( VipsImage *image );
 int vips__exif_update( VipsImage *image );
 
@@ -75,6 +102,7 @@ extern int vips__tile_width;
 extern int vips__tile_height;
 extern int vips__fatstrip_height;
 extern int vips__thinstrip_height;
+extern gboolean vips__tile_autotune;
 
 /* Default n threads.
  */
@@ -115,6 +143,7 @@ void vips__threadpool_init( void );
 void vips__cache_init( void );
 
 void vips__sink_screen_init( void );
+int vips__sink_memory_alloc( VipsImage *image );
 void vips__print_renders( void );
 
 void vips__type_leak( void );
@@ -136,6 +165,16 @@ void *vips__link_map( VipsImage *image, gboolean upstream,
 
 gboolean vips__mmap_supported( int fd );
 void *vips__mmap( int fd, int writeable, size_t length, gint64 offset );
+void *vips__mmap_populate( int fd, 
+	int writeable, size_t length, gint64 offset );
+void vips__madvise( void *start, size_t length, VipsAccess access );
+void vips__file_dontneed( int fd, gint64 offset, gint64 length );
+gboolean vips__file_willneed( int fd, gint64 offset, gint64 length );
+void vips__madvise_hugepage( void *start, size_t length );
+int vips__memory_node( const void *p );
+int vips__thread_node( void );
+
+void *vips__tracked_malloc_untouched( size_t size );
 int vips__munmap( const void *start, size_t length );
 int vips_mapfile( VipsImage * );
 int vips_mapfilerw( VipsImage * );
@@ -161,6 +200,10 @@ void vips_image_preeval( VipsImage *image );
 void vips_image_eval( VipsImage *image, guint64 processed );
 void vips_image_posteval( VipsImage *image );
 VipsImage *vips_image_new_mode( const char *filename, const char *mode );
+VipsImage *vips__image_new_from_source_map( VipsSource *source, 
+	gint64 offset, size_t stride,
+	int width, int height, int bands, VipsBandFormat format,
+	VipsAccess access );
 
 int vips__formatalike_vec( VipsImage **in, VipsImage **out, int n );
 int vips__sizealike_vec( VipsImage **in, VipsImage **out, int n );
@@ -206,6 +249,9 @@ void vips__draw_circle_direct( VipsImage *image, int cx, int cy, int r,
 int vips__insert_just_one( VipsRegion *out, VipsRegion *in, int x, int y );
 int vips__insert_paste_region( VipsRegion *out, VipsRegion *in, VipsRect *pos );
 
+int vips__region_shrink_threaded( VipsRegion *from, VipsRegion *to, 
+	const VipsRect *target, VipsRegionShrink method );
+
 /* Register base vips interpolators, called during startup.
  */
 void vips__interpolate_init( void );
@@ -260,6 +306,20 @@ int vips__foreign_convert_saveable( VipsImage *in, VipsImage **ready,
 
 int vips_foreign_load( const char *filename, VipsImage **out, ... )
 	__attribute__((sentinel));
+int vips__foreign_load_hint_roi( VipsImage *in, VipsImage *out, 
+	const VipsRect *roi );
+gboolean vips__foreign_load_get_roi( VipsImage *image, VipsRect *roi );
+int vips__foreign_load_shrink_header( VipsImage *image, int shrink );
+int vips__foreign_load_shrink( VipsImage *in, VipsImage *real, int shrink );
+
+typedef struct _VipsForeignPool VipsForeignPool;
+typedef void *(*VipsForeignPoolOpenFn)( void *a );
+VipsForeignPool *vips__foreign_pool_new( int max_handles, 
+	VipsForeignPoolOpenFn open_fn, GDestroyNotify free_fn, void *a );
+void vips__foreign_pool_free( VipsForeignPool *pool );
+void vips__foreign_pool_add( VipsForeignPool *pool, void *handle );
+void *vips__foreign_pool_get( VipsForeignPool *pool );
+void vips__foreign_pool_put( VipsForeignPool *pool, void *handle );
 int vips_foreign_save( VipsImage *in, const char *filename, ... )
 	__attribute__((sentinel));
 
@@ -273,6 +333,11 @@ void vips__reorder_clear( VipsImage *image );
  */
 VipsWindow *vips_window_take( VipsWindow *window, 
 	VipsImage *im, int top, int height );
+void vips__window_set_access( VipsImage *image, VipsAccess access );
+
+extern int vips__window_margin_pixels;
+extern int vips__window_margin_bytes;
+extern int vips__window_populate_bytes;
 
 int vips__profile_set( VipsImage *image, const char *name );
 
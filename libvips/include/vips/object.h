@@ -318,6 +318,12 @@ int vips_object_get_argument( VipsObject *object, const char *name,
 	VipsArgumentClass **argument_class,
 	VipsArgumentInstance **argument_instance );
 gboolean vips_object_argument_isset( VipsObject *object, const char *name );
+VipsArgumentClass *vips_object_class_find_argument( 
+	VipsObjectClass *object_class, const char *name );
+int vips_object_set_argument_value( VipsObject *object, 
+	VipsArgumentClass *argument_class, const GValue *value );
+int vips_object_get_argument_value( VipsObject *object, 
+	VipsArgumentClass *argument_class, GValue *value );
 VipsArgumentFlags vips_object_get_argument_flags( VipsObject *object, 
 	const char *name );
 int vips_object_get_argument_priority( VipsObject *object, const char *name );
@@ -548,6 +554,13 @@ struct _VipsObjectClass {
 	GSList *argument_table_traverse;
 	GType argument_table_traverse_gtype;
 
+	/* Hash from argument name to VipsArgumentClass for this class and
+	 * any superclasses. This is rebuilt with argument_table_traverse, so
+	 * it's fixed once the class is initialized and can be read without a
+	 * lock.
+	 */
+	GHashTable *argument_names;
+
 	/* This class is deprecated and therefore hidden from various UI bits.
 	 *
 	 * VipsOperation has a deprecated flag, use that in preference to this
@@ -52,6 +52,16 @@ extern "C" {
  */
 #define VIPS__WINDOW_MARGIN_BYTES (1024 * 1024 * 10)
 
+/* Private to iofuncs: windows this size or smaller are read in as soon as 
+ * they are mapped.
+ */
+#define VIPS__WINDOW_POPULATE_BYTES (1024 * 1024 * 2)
+
+/* Private to iofuncs: memory images this large or larger ask for 
+ * transparent huge pages.
+ */
+#define VIPS__HUGEPAGE_BYTES (1024 * 1024 * 4)
+
 /* sizeof() a VIPS header on disc.
  */
 #define VIPS_SIZEOF_HEADER (64)
@@ -125,6 +135,9 @@ VipsBuffer *vips_buffer_unref_ref( VipsBuffer *buffer,
 void vips_buffer_print( VipsBuffer *buffer );
 
 void vips__render_shutdown( void );
+void vips__source_shutdown( void );
+void vips__png_shutdown( void );
+void vips__region_shutdown( void );
 
 /* Sections of region.h that are private to VIPS.
  */
@@ -169,6 +182,8 @@ VipsArgumentInstance *vips__argument_get_instance(
 	VipsObject *object);
 VipsArgument *vips__argument_table_lookup( VipsArgumentTable *table, 
 	GParamSpec *pspec);
+int vips__object_set_argument_collected( VipsObject *object, 
+	VipsArgumentClass *argument_class, GValue *value );
 
 void vips__demand_hint_array( struct _VipsImage *image, 
 	int hint, struct _VipsImage **in );
@@ -138,6 +138,8 @@ int vips_threadpool_run( VipsImage *im,
 	void *a );
 void vips_get_tile_size( VipsImage *im, 
 	int *tile_width, int *tile_height, int *n_lines );
+void vips_tile_adaptive_set( gboolean adaptive );
+void vips_tile_autotune_set( gboolean autotune );
 
 #ifdef __cplusplus
 }
@@ -6,6 +6,8 @@
  * 	- add a lock so we can run operations from many threads
  * 28/11/19 [MaxKellermann]
  * 	- make invalidate advisory rather than immediate
+ * 18/10/20
+ * 	- hash and compare args with vips_object_get_argument_value()
  */
 
 /*
@@ -351,12 +353,12 @@ vips_object_hash_arg( VipsObject *object,
 	if( (argument_class->flags & VIPS_ARGUMENT_CONSTRUCT) &&
 		(argument_class->flags & VIPS_ARGUMENT_INPUT) &&
 		argument_instance->assigned ) {
-		const char *name = g_param_spec_get_name( pspec );
 		GType type = G_PARAM_SPEC_VALUE_TYPE( pspec );
 		GValue value = { 0, };
 
 		g_value_init( &value, type );
-		g_object_get_property( G_OBJECT( object ), name, &value ); 
+		(void) vips_object_get_argument_value( object, 
+			argument_class, &value ); 
 		*hash = (*hash << 1) ^ vips_value_hash( pspec, &value );
 		g_value_unset( &value );
 	}
@@ -398,7 +400,6 @@ vips_object_equal_arg( VipsObject *object,
 {
 	VipsObject *other = (VipsObject *) a;
 
-	const char *name = g_param_spec_get_name( pspec );
 	GType type = G_PARAM_SPEC_VALUE_TYPE( pspec );
 	GValue v1 = { 0, };
 	GValue v2 = { 0, };
@@ -416,7 +417,7 @@ vips_object_equal_arg( VipsObject *object,
 	 * assigned on @other as well.
 	 */
 	if( !(argument_class->flags & VIPS_ARGUMENT_REQUIRED) &&
-		!vips_object_argument_isset( other, name ) )
+		!vips__argument_get_instance( argument_class, other )->assigned )
 		/* Optional and was not set on other ... we've found a
 		 * difference!
 		 */
@@ -424,8 +425,8 @@ vips_object_equal_arg( VipsObject *object,
 
 	g_value_init( &v1, type );
 	g_value_init( &v2, type );
-	g_object_get_property( G_OBJECT( object ), name, &v1 ); 
-	g_object_get_property( G_OBJECT( other ), name, &v2 ); 
+	(void) vips_object_get_argument_value( object, argument_class, &v1 ); 
+	(void) vips_object_get_argument_value( other, argument_class, &v2 ); 
 	equal = vips_value_equal( pspec, &v1, &v2 );
 	g_value_unset( &v1 );
 	g_value_unset( &v2 );
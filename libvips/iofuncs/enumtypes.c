@@ -176,6 +176,7 @@ vips_precision_get_type( void )
 			{VIPS_PRECISION_INTEGER, "VIPS_PRECISION_INTEGER", "integer"},
 			{VIPS_PRECISION_FLOAT, "VIPS_PRECISION_FLOAT", "float"},
 			{VIPS_PRECISION_APPROXIMATE, "VIPS_PRECISION_APPROXIMATE", "approximate"},
+			{VIPS_PRECISION_RECURSIVE, "VIPS_PRECISION_RECURSIVE", "recursive"},
 			{VIPS_PRECISION_LAST, "VIPS_PRECISION_LAST", "last"},
 			{0, NULL, NULL}
 		};
@@ -1,6 +1,8 @@
 /* gate.c --- thread profiling
  *
  * Written on: 18 nov 13
+ * 18/10/20
+ * 	- add counters
  */
 
 /*
@@ -76,6 +78,11 @@ typedef struct _VipsThreadProfile {
 	GThread *thread;
 	GHashTable *gates;
 	VipsThreadGate *memory;
+
+	/* Named counters. Each gate records times in start and values in 
+	 * stop, like memory.
+	 */
+	GHashTable *counts;
 } VipsThreadProfile; 
 
 gboolean vips__thread_profile = FALSE;
@@ -131,6 +138,19 @@ vips_thread_profile_save_cb( gpointer key, gpointer value, gpointer data )
 	vips_thread_profile_save_gate( gate, fp ); 
 }
 
+static void
+vips_thread_profile_save_count_cb( gpointer key, gpointer value, gpointer data )
+{
+	VipsThreadGate *gate = (VipsThreadGate *) value;
+	FILE *fp = (FILE *) data;
+
+	fprintf( fp, "gate: count: %s\n", gate->name );
+	fprintf( fp, "start:\n" );
+	vips_thread_gate_block_save( gate->start, fp );
+	fprintf( fp, "stop:\n" );
+	vips_thread_gate_block_save( gate->stop, fp );
+}
+
 static void
 vips_thread_profile_save( VipsThreadProfile *profile )
 {
@@ -154,6 +174,8 @@ vips_thread_profile_save( VipsThreadProfile *profile )
 	g_hash_table_foreach( profile->gates, 
 		vips_thread_profile_save_cb, vips__thread_fp );
 	vips_thread_profile_save_gate( profile->memory, vips__thread_fp ); 
+	g_hash_table_foreach( profile->counts, 
+		vips_thread_profile_save_count_cb, vips__thread_fp );
 
 	g_mutex_unlock( vips__global_lock );
 }
@@ -180,6 +202,7 @@ vips_thread_profile_free( VipsThreadProfile *profile )
 
 	VIPS_FREEF( g_hash_table_destroy, profile->gates );
 	VIPS_FREEF( vips_thread_gate_free, profile->memory );
+	VIPS_FREEF( g_hash_table_destroy, profile->counts );
 	VIPS_FREE( profile );
 }
 
@@ -257,6 +280,9 @@ vips__thread_profile_attach( const char *thread_name )
 		g_direct_hash, g_str_equal, 
 		NULL, (GDestroyNotify) vips_thread_gate_free );
 	profile->memory = vips_thread_gate_new( "memory" ); 
+	profile->counts = g_hash_table_new_full( 
+		g_direct_hash, g_str_equal, 
+		NULL, (GDestroyNotify) vips_thread_gate_free );
 	g_private_set( vips_thread_profile_key, profile );
 }
 
@@ -395,3 +421,32 @@ vips__thread_malloc_free( gint64 size )
 		gate->stop->time[gate->stop->i++] = size;
 	}
 }
+
+/* Record a value for a named counter, for example the number of bytes
+ * written. @name must be a static string.
+ */
+void
+vips__thread_profile_count( const char *name, gint64 value )
+{
+	VipsThreadProfile *profile;
+
+	if( (profile = vips_thread_profile_get()) ) { 
+		gint64 time = vips_get_time(); 
+
+		VipsThreadGate *gate;
+
+		if( !(gate = g_hash_table_lookup( profile->counts, name )) ) {
+			gate = vips_thread_gate_new( name );
+			g_hash_table_insert( profile->counts, 
+				(char *) name, gate );
+		}
+
+		if( gate->start->i >= VIPS_GATE_SIZE ) {
+			vips_thread_gate_block_add( &gate->start );
+			vips_thread_gate_block_add( &gate->stop );
+		}
+
+		gate->start->time[gate->start->i++] = time;
+		gate->stop->time[gate->stop->i++] = value;
+	}
+}
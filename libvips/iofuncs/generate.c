@@ -53,6 +53,8 @@
  * 7/7/12
  * 	- lock around link make/break so we can process an image from many
  * 	  threads
+ * 18/10/20
+ * 	- allocate memory output with vips__sink_memory_alloc()
  */
 
 /*
@@ -749,7 +751,8 @@ vips_image_generate( VipsImage *image,
                 image->client1 = a;
                 image->client2 = b;
 
-                if( vips_image_write_prepare( image ) )
+                if( vips__sink_memory_alloc( image ) ||
+			vips_image_write_prepare( image ) )
                         return( -1 );
 
                 if( image->dtype == VIPS_IMAGE_OPENOUT ) 
@@ -38,6 +38,8 @@
  * 	- add vips_image_get/set_array_int()
  * 31/1/19
  * 	- lock for metadata changes
+ * 18/10/20
+ * 	- share metadata tables between images, copy on write
  */
 
 /*
@@ -100,10 +102,12 @@
  *
  * You can attach arbitrary metadata to images. Metadata is copied as images
  * are processed, so all images which used this image as input, directly or
- * indirectly, will have this same bit of metadata attached to them. Copying
- * is implemented with reference-counted pointers, so it is efficient, even for
- * large items of data. This does however mean that metadata items need to be
- * immutable. Metadata is handy for things like ICC profiles or EXIF data.
+ * indirectly, will have this same bit of metadata attached to them. Images 
+ * share a single reference-counted table of metadata until one of them sets 
+ * or removes a field, and only then is the table copied, so it is efficient, 
+ * even for large items of data and long pipelines. This does however mean 
+ * that metadata items need to be immutable. Metadata is handy for things like
+ * ICC profiles or EXIF data.
  *
  * Various convenience functions (eg. vips_image_set_int()) let you easily 
  * attach 
@@ -239,8 +243,8 @@ meta_sanity_on_hash( VipsMeta *meta, VipsImage *im )
 {
 	VipsMeta *found;
 
-	if( meta->im != im )
-		printf( "*** field \"%s\" has incorrect im\n", 
+	if( meta->table != im->meta_table )
+		printf( "*** field \"%s\" has incorrect table\n", 
 			meta->name );
 
 	if( !(found = g_hash_table_lookup( im->meta, meta->name )) )
@@ -261,8 +265,8 @@ meta_sanity_on_traverse( const char *name, VipsMeta *meta, VipsImage *im )
 		printf( "*** field \"%s\" has incorrect name\n", 
 			meta->name );
 
-	if( meta->im != im )
-		printf( "*** field \"%s\" has incorrect im\n", 
+	if( meta->table != im->meta_table )
+		printf( "*** field \"%s\" has incorrect table\n", 
 			meta->name );
 
 	if( !g_slist_find( im->meta_traverse, meta ) )
@@ -295,9 +299,9 @@ meta_free( VipsMeta *meta )
 }
 #endif /*DEBUG*/
 
-	if( meta->im )
-		meta->im->meta_traverse = 
-			g_slist_remove( meta->im->meta_traverse, meta );
+	if( meta->table )
+		meta->table->traverse = 
+			g_slist_remove( meta->table->traverse, meta );
 
 	g_value_unset( &meta->value );
 	g_free( meta->name );
@@ -305,12 +309,12 @@ meta_free( VipsMeta *meta )
 }
 
 static VipsMeta *
-meta_new( VipsImage *image, const char *name, GValue *value )
+meta_new( VipsMetaTable *table, const char *name, GValue *value )
 {
 	VipsMeta *meta;
 
 	meta = g_new( VipsMeta, 1 );
-	meta->im = image;
+	meta->table = table;
 	meta->name = NULL;
 	memset( &meta->value, 0, sizeof( GValue ) );
 	meta->name = g_strdup( name );
@@ -331,8 +335,8 @@ meta_new( VipsImage *image, const char *name, GValue *value )
 	 */
 	(void) g_value_transform( value, &meta->value );
 
-	image->meta_traverse = g_slist_append( image->meta_traverse, meta );
-	g_hash_table_replace( image->meta, meta->name, meta ); 
+	table->traverse = g_slist_append( table->traverse, meta );
+	g_hash_table_replace( table->hash, meta->name, meta ); 
 
 #ifdef DEBUG
 {
@@ -347,23 +351,86 @@ meta_new( VipsImage *image, const char *name, GValue *value )
 	return( meta );
 }
 
+static VipsMetaTable *
+meta_table_new( void )
+{
+	VipsMetaTable *table;
+
+	table = g_new( VipsMetaTable, 1 );
+	table->ref_count = 1;
+	table->hash = g_hash_table_new_full( g_str_hash, g_str_equal,
+		NULL, (GDestroyNotify) meta_free );
+	table->traverse = NULL;
+
+	return( table );
+}
+
+static VipsMetaTable *
+meta_table_ref( VipsMetaTable *table )
+{
+	g_atomic_int_inc( &table->ref_count );
+
+	return( table );
+}
+
+static void
+meta_table_unref( VipsMetaTable *table )
+{
+	if( g_atomic_int_dec_and_test( &table->ref_count ) ) {
+		g_hash_table_destroy( table->hash );
+		g_assert( !table->traverse );
+		g_free( table );
+	}
+}
+
+/* Point the image's meta fields at its table.
+ */
+static void
+meta_sync( VipsImage *image )
+{
+	if( image->meta_table ) {
+		image->meta = image->meta_table->hash;
+		image->meta_traverse = image->meta_table->traverse;
+	}
+	else {
+		image->meta = NULL;
+		image->meta_traverse = NULL;
+	}
+}
+
 /* Destroy all the meta on an image.
  */
 void
 vips__meta_destroy( VipsImage *image )
 {
-	VIPS_FREEF( g_hash_table_destroy, image->meta );
-	g_assert( !image->meta_traverse );
+	VIPS_FREEF( meta_table_unref, image->meta_table );
+	meta_sync( image );
 }
 
+/* Make sure @image has a table of its own, so it can change it. If the 
+ * table is shared, we copy it. Call with vips__meta_lock held.
+ */
 static void
-meta_init( VipsImage *im )
+meta_own( VipsImage *image )
 {
-	if( !im->meta ) {
-		g_assert( !im->meta_traverse );
-		im->meta = g_hash_table_new_full( g_str_hash, g_str_equal,
-			NULL, (GDestroyNotify) meta_free );
+	VipsMetaTable *table = image->meta_table;
+
+	if( !table ) 
+		image->meta_table = meta_table_new();
+	else if( g_atomic_int_get( &table->ref_count ) > 1 ) {
+		GSList *p;
+
+		image->meta_table = meta_table_new();
+		for( p = table->traverse; p; p = p->next ) {
+			VipsMeta *meta = (VipsMeta *) p->data;
+
+			(void) meta_new( image->meta_table, 
+				meta->name, &meta->value );
+		}
+		meta_table_unref( table );
 	}
+
+	meta_sync( image );
 }
 
 /**
@@ -919,7 +986,7 @@ meta_cp_field( VipsMeta *meta, VipsImage *dst )
 }
 #endif /*DEBUG*/
 
-	(void) meta_new( dst, meta->name, &meta->value );
+	(void) meta_new( dst->meta_table, meta->name, &meta->value );
 
 #ifdef DEBUG
 	meta_sanity( dst );
@@ -933,17 +1000,30 @@ meta_cp_field( VipsMeta *meta, VipsImage *dst )
 static int
 meta_cp( VipsImage *dst, const VipsImage *src )
 {
-	if( src->meta ) {
-		/* Loop, copying fields.
-		 */
-		meta_init( dst );
-
+	if( src->meta_traverse ) {
 		/* We lock with vips_image_set() to stop races in highly-
 		 * threaded applications.
 		 */
 		g_mutex_lock( vips__meta_lock );
-		vips_slist_map2( src->meta_traverse,
-			(VipsSListMap2Fn) meta_cp_field, dst, NULL );
+
+		/* If dst has no meta of its own, we can share the table on
+		 * src. It'll be copied if dst changes it. Otherwise, we 
+		 * must loop, copying fields.
+		 */
+		if( dst->meta_table == src->meta_table ) 
+			;
+		else if( !dst->meta_traverse ) {
+			VIPS_FREEF( meta_table_unref, dst->meta_table );
+			dst->meta_table = meta_table_ref( src->meta_table );
+		}
+		else {
+			meta_own( dst );
+			vips_slist_map2( src->meta_traverse,
+				(VipsSListMap2Fn) meta_cp_field, dst, NULL );
+		}
+
+		meta_sync( dst );
+
 		g_mutex_unlock( vips__meta_lock );
 	}
 
@@ -1032,8 +1112,6 @@ vips_image_set( VipsImage *image, const char *name, GValue *value )
 	g_assert( name );
 	g_assert( value );
 
-	meta_init( image );
-
 	/* We lock between modifying metadata and copying metadata between
 	 * images, see meta_cp().
 	 *
@@ -1042,7 +1120,9 @@ vips_image_set( VipsImage *image, const char *name, GValue *value )
 	 * highly-threaded applications.
 	 */
 	g_mutex_lock( vips__meta_lock );
-	(void) meta_new( image, name, value );
+	meta_own( image );
+	(void) meta_new( image->meta_table, name, value );
+	meta_sync( image );
 	g_mutex_unlock( vips__meta_lock );
 
 	/* If we're setting an EXIF data block, we need to automatically expand 
@@ -1249,7 +1329,15 @@ vips_image_remove( VipsImage *image, const char *name )
 		 * crashes in highly-threaded applications.
 		 */
 		g_mutex_lock( vips__meta_lock );
-		result = g_hash_table_remove( image->meta, name );
+
+		/* Only take a copy of a shared table if we will change it.
+		 */
+		if( g_hash_table_lookup( image->meta, name ) ) {
+			meta_own( image );
+			result = g_hash_table_remove( image->meta, name );
+			meta_sync( image );
+		}
+
 		g_mutex_unlock( vips__meta_lock );
 	}
 
@@ -1265,7 +1353,8 @@ static const char *vips_image_header_deprecated[] = {
 };
 
 static void *
-vips_image_map_fn( VipsMeta *meta, VipsImageMapFn fn, void *a )
+vips_image_map_fn( VipsMeta *meta, 
+	VipsImage *image, VipsImageMapFn fn, void *a, void *b )
 {
 	int i;
 
@@ -1275,7 +1364,7 @@ vips_image_map_fn( VipsMeta *meta, VipsImageMapFn fn, void *a )
 		if( strcmp( meta->name, vips_image_header_deprecated[i] ) == 0 )
 			return( NULL );
 
-	return( fn( meta->im, meta->name, &meta->value, a ) );
+	return( fn( image, meta->name, &meta->value, a ) );
 }
 
 /**
@@ -1312,10 +1401,24 @@ vips_image_map( VipsImage *image, VipsImageMapFn fn, void *a )
 			return( result );
 	}
 
-	if( image->meta_traverse && 
-		(result = vips_slist_map2( image->meta_traverse, 
-			(VipsSListMap2Fn) vips_image_map_fn, fn, a )) )
-		return( result );
+	if( image->meta_traverse ) {
+		VipsMetaTable *table;
+
+		/* Hold a ref to the table while we walk it. If @fn changes
+		 * @image, it will get a copy and leave this table alone.
+		 */
+		g_mutex_lock( vips__meta_lock );
+		table = meta_table_ref( image->meta_table );
+		g_mutex_unlock( vips__meta_lock );
+
+		result = vips_slist_map4( table->traverse, 
+			(VipsSListMap4Fn) vips_image_map_fn, image, fn, a, NULL );
+
+		meta_table_unref( table );
+
+		if( result )
+			return( result );
+	}
 
 	return( NULL );
 }
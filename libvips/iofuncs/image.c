@@ -20,6 +20,11 @@
  * 	- fix up vips_image_dump(), it was still using ints not enums
  * 10/12/19
  * 	- add vips_image_new_from_source() / vips_image_write_to_target()
+ * 18/10/20
+ * 	- add vips__image_new_from_source_map()
+ * 	- large memory images ask for transparent huge pages
+ * 	- hint source maps with the load access pattern
+ * 	- only hint sequential source maps, and only over the pixels
  */
 
 /*
@@ -1991,6 +1996,140 @@ vips_image_new_from_file_raw( const char *filename,
 	return( image );
 }
 
+static void
+vips_image_source_map_close_cb( VipsImage *image, VipsSource *source )
+{
+	g_object_unref( source );
+}
+
+/* Make an image which is a view into uncompressed pixels held in @source.
+ * Lines start at @offset and are @stride bytes apart (0 means packed).
+ *
+ * If the source is a file we reopen it as an OPENIN image, so regions on
+ * the result are served from a set of rolling mmap windows and we can work
+ * on files much larger than the address space. Otherwise we map the whole
+ * source and wrap a memory image around it. Either way, vips_region_prepare()
+ * on the result just sets pointers, nothing is copied.
+ *
+ * The mapping is hinted with @access, see vips__window_set_access().
+ *
+ * The pixels are not byteswapped, use vips__byteswap_bool() afterwards if
+ * you need to.
+ */
+VipsImage *
+vips__image_new_from_source_map( VipsSource *source,
+	gint64 offset, size_t stride,
+	int width, int height, int bands, VipsBandFormat format,
+	VipsAccess access )
+{
+	VipsConnection *connection = VIPS_CONNECTION( source );
+	size_t sizeof_pel = vips_format_sizeof_unsafe( format ) * bands;
+
+	gint64 length;
+	int pels_per_line;
+	VipsImage *image;
+	VipsImage *x;
+
+	if( stride == 0 )
+		stride = sizeof_pel * width;
+	if( width <= 0 ||
+		height <= 0 ||
+		sizeof_pel == 0 ||
+		stride < sizeof_pel * width ||
+		stride % sizeof_pel != 0 ) {
+		vips_error( "VipsImage", "%s", _( "bad image geometry" ) );
+		return( NULL );
+	}
+	pels_per_line = stride / sizeof_pel;
+
+	if( (length = vips_source_length( source )) == -1 )
+		return( NULL );
+	if( offset < 0 ||
+		offset + (gint64) stride * height > length ) {
+		vips_error( "VipsImage",
+			_( "unable to read data for \"%s\", %s" ),
+			vips_connection_nick( connection ),
+			_( "file has been truncated" ) );
+		return( NULL );
+	}
+
+	if( !source->data &&
+		connection->filename ) {
+		int fd;
+
+		if( (fd = vips__open_image_read( connection->filename )) == -1 )
+			return( NULL );
+
+		/* Build an OPENIN image by hand, we don't want the
+		 * file length checks that vips_image_new_from_file_raw()
+		 * makes.
+		 */
+		image = vips_image_new();
+		vips_image_init_fields( image,
+			pels_per_line, height, sizeof_pel, VIPS_FORMAT_UCHAR,
+			VIPS_CODING_NONE, VIPS_INTERPRETATION_MULTIBAND,
+			1.0, 1.0 );
+		image->dtype = VIPS_IMAGE_OPENIN;
+		image->dhint = VIPS_DEMAND_STYLE_THINSTRIP;
+		image->fd = fd;
+		image->sizeof_header = offset;
+		image->file_length = length;
+		VIPS_SETSTR( image->filename, connection->filename );
+		vips__window_set_access( image, access );
+	}
+	else {
+		const VipsPel *data;
+
+		if( !(data = vips_source_map( source, NULL )) )
+			return( NULL );
+
+		/* Only file mappings are worth hinting, memory sources
+		 * are already paged in. The default random hint would turn
+		 * off readahead for the whole file, so we only hint 
+		 * sequential reads, and only over the pixels.
+		 */
+		if( source->mmap_baseaddr &&
+			(access == VIPS_ACCESS_SEQUENTIAL ||
+			 access == VIPS_ACCESS_SEQUENTIAL_UNBUFFERED) )
+			vips__madvise( (void *) (data + offset), 
+				stride * height, access );
+
+		if( !(image = vips_image_new_from_memory( data + offset,
+			stride * height,
+			pels_per_line, height, sizeof_pel,
+			VIPS_FORMAT_UCHAR )) )
+			return( NULL );
+
+		/* The pixels are borrowed from the source, so it must stay
+		 * alive until we close.
+		 */
+		g_object_ref( source );
+		g_signal_connect( image, "close",
+			G_CALLBACK( vips_image_source_map_close_cb ), source );
+	}
+
+	if( pels_per_line != width ) {
+		if( vips_extract_area( image, &x, 0, 0, width, height, NULL ) ) {
+			g_object_unref( image );
+			return( NULL );
+		}
+		g_object_unref( image );
+		image = x;
+	}
+
+	if( vips_copy( image, &x,
+		"bands", bands,
+		"format", format,
+		NULL ) ) {
+		g_object_unref( image );
+		return( NULL );
+	}
+	g_object_unref( image );
+	image = x;
+
+	return( image );
+}
+
 /**
  * vips_image_new_from_memory: (constructor)
  * @data: (array length=size) (element-type guint8) (transfer none): start of memory area
@@ -3141,10 +3280,14 @@ vips_image_write_prepare( VipsImage *image )
 		break;
 
 	case VIPS_IMAGE_SETBUF:
-		if( !image->data && 
-			!(image->data = vips_tracked_malloc( 
+		if( !image->data ) {
+			if( !(image->data = vips_tracked_malloc( 
 				VIPS_IMAGE_SIZEOF_IMAGE( image ))) ) 
-			return( -1 );
+				return( -1 );
+
+			vips__madvise_hugepage( image->data, 
+				VIPS_IMAGE_SIZEOF_IMAGE( image ) );
+		}
 
 		break;
 
@@ -30,6 +30,13 @@
  * 	- hide warnings is VIPS_WARNING is set
  * 20/4/19
  * 	- set the min stack, if we can
+ * 18/10/20
+ * 	- add VIPS_READAHEAD and --vips-readahead, free the prefetch pool on
+ * 	  shutdown
+ * 	- add VIPS_BACKGROUND_WRITE and --vips-background-write
+ * 	- add VIPS_NUMA and --vips-numa
+ * 	- add VIPS_TILE_ADAPTIVE, VIPS_TILE_AUTOTUNE, --vips-tile-adaptive and
+ * 	  --vips-tile-autotune
  */
 
 /*
@@ -448,6 +455,17 @@ vips_init( const char *argv0 )
 			g_ascii_strtoll( g_getenv( "VIPS_PIPE_READ_LIMIT" ),
 				NULL, 10 );
 	vips_pipe_read_limit_set( vips_pipe_read_limit );
+	if( g_getenv( "VIPS_READAHEAD" ) ) 
+		vips_source_readahead_set( 
+			vips__parse_size( g_getenv( "VIPS_READAHEAD" ) ) );
+	if( g_getenv( "VIPS_BACKGROUND_WRITE" ) ) 
+		vips_target_background_set( TRUE );
+	if( g_getenv( "VIPS_NUMA" ) ) 
+		vips_sink_memory_numa_set( TRUE );
+	if( g_getenv( "VIPS_TILE_ADAPTIVE" ) ) 
+		vips_tile_adaptive_set( TRUE );
+	if( g_getenv( "VIPS_TILE_AUTOTUNE" ) ) 
+		vips_tile_autotune_set( TRUE );
 
 	/* Register base vips types.
 	 */
@@ -665,6 +683,12 @@ vips_shutdown( void )
 
 	vips__render_shutdown();
 
+	vips__source_shutdown();
+
+	vips__png_shutdown();
+
+	vips__region_shutdown();
+
 	vips_thread_shutdown();
 
 	vips__thread_profile_stop();
@@ -768,6 +792,51 @@ vips_cache_max_files_cb( const gchar *option_name, const gchar *value,
 	return( TRUE ); 
 }
 
+static gboolean
+vips_readahead_cb( const gchar *option_name, const gchar *value, 
+	gpointer data, GError **error )
+{
+	vips_source_readahead_set( vips__parse_size( value ) );
+
+	return( TRUE ); 
+}
+
+static gboolean
+vips_background_write_cb( const gchar *option_name, const gchar *value, 
+	gpointer data, GError **error )
+{
+	vips_target_background_set( TRUE );
+
+	return( TRUE ); 
+}
+
+static gboolean
+vips_numa_cb( const gchar *option_name, const gchar *value, 
+	gpointer data, GError **error )
+{
+	vips_sink_memory_numa_set( TRUE );
+
+	return( TRUE ); 
+}
+
+static gboolean
+vips_tile_adaptive_cb( const gchar *option_name, const gchar *value, 
+	gpointer data, GError **error )
+{
+	vips_tile_adaptive_set( TRUE );
+
+	return( TRUE ); 
+}
+
+static gboolean
+vips_tile_autotune_cb( const gchar *option_name, const gchar *value, 
+	gpointer data, GError **error )
+{
+	vips_tile_autotune_set( TRUE );
+
+	return( TRUE ); 
+}
+
 static GOptionEntry option_entries[] = {
 	{ "vips-info", 0, G_OPTION_FLAG_HIDDEN | G_OPTION_FLAG_NO_ARG, 
 		G_OPTION_ARG_CALLBACK, (gpointer) &vips_lib_info_cb,
@@ -826,6 +895,22 @@ static GOptionEntry option_entries[] = {
 	{ "vips-pipe-read-limit", 0, 0, 
 		G_OPTION_ARG_INT64, (gpointer) &vips_pipe_read_limit, 
 		N_( "read at most this many bytes from a pipe" ), NULL },
+	{ "vips-readahead", 0, 0, 
+		G_OPTION_ARG_CALLBACK, (gpointer) &vips_readahead_cb,
+		N_( "read ahead N bytes from files" ), "N" },
+	{ "vips-background-write", 0, G_OPTION_FLAG_NO_ARG, 
+		G_OPTION_ARG_CALLBACK, (gpointer) &vips_background_write_cb,
+		N_( "write files from a background thread" ), NULL },
+	{ "vips-numa", 0, G_OPTION_FLAG_NO_ARG, 
+		G_OPTION_ARG_CALLBACK, (gpointer) &vips_numa_cb,
+		N_( "try to place memory images on the node of the worker "
+			"that writes them" ), NULL },
+	{ "vips-tile-adaptive", 0, G_OPTION_FLAG_NO_ARG, 
+		G_OPTION_ARG_CALLBACK, (gpointer) &vips_tile_adaptive_cb,
+		N_( "size tiles from pixel size and cache size" ), NULL },
+	{ "vips-tile-autotune", 0, G_OPTION_FLAG_NO_ARG, 
+		G_OPTION_ARG_CALLBACK, (gpointer) &vips_tile_autotune_cb,
+		N_( "time tile widths while computing" ), NULL },
 	{ NULL }
 };
 
@@ -22,6 +22,11 @@
  * 	- set NOCACHE if we can ... helps OS X performance a lot
  * 25/3/11
  * 	- move to vips_ namespace
+ * 18/10/20
+ * 	- add vips__mmap_populate(), vips__madvise(), vips__file_dontneed(),
+ * 	  vips__madvise_hugepage()
+ * 	- add vips__file_willneed()
+ * 	- add vips__memory_node(), vips__thread_node()
  */
 
 /*
@@ -67,6 +72,9 @@
 #include <assert.h>
 
 #include <sys/types.h>
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif /*HAVE_FCNTL_H*/
 #ifdef HAVE_SYS_MMAN_H
 #include <sys/mman.h>
 #endif /*HAVE_SYS_MMAN_H*/
@@ -77,6 +85,9 @@
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif /*HAVE_UNISTD_H*/
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif /*__linux__*/
 #ifdef OS_WIN32 
 #ifndef S_ISREG
 #define S_ISREG(m) (!!(m & _S_IFREG))
@@ -84,6 +95,7 @@
 #endif /*OS_WIN32*/
 
 #include <vips/vips.h>
+#include <vips/internal.h>
 
 #ifdef OS_WIN32
 #include <windows.h>
@@ -143,14 +155,15 @@ vips__mmap_supported( int fd )
 	return( TRUE );
 }
 
-void *
-vips__mmap( int fd, int writeable, size_t length, gint64 offset )
+static void *
+vips_mmap( int fd, int writeable, size_t length, gint64 offset, 
+	gboolean populate )
 {
 	void *baseaddr;
 
 #ifdef DEBUG
-	printf( "vips__mmap: length = 0x%zx, offset = 0x%lx\n", 
-		length, offset );
+	printf( "vips_mmap: length = 0x%zx, offset = 0x%lx, populate = %d\n", 
+		length, offset, populate );
 #endif /*DEBUG*/
 
 #ifdef OS_WIN32
@@ -223,6 +236,14 @@ vips__mmap( int fd, int writeable, size_t length, gint64 offset )
 	flags |= MAP_NOCACHE;
 #endif /*MAP_NOCACHE*/
 
+	/* Read all the pages in now, rather than faulting them in one by one
+	 * later.
+	 */
+#ifdef MAP_POPULATE
+	if( populate )
+		flags |= MAP_POPULATE;
+#endif /*MAP_POPULATE*/
+
 	/* Casting gint64 to off_t should be safe, even on *nixes without
 	 * LARGEFILE.
 	 */
@@ -242,6 +263,144 @@ vips__mmap( int fd, int writeable, size_t length, gint64 offset )
 	return( baseaddr );
 }
 
+void *
+vips__mmap( int fd, int writeable, size_t length, gint64 offset )
+{
+	return( vips_mmap( fd, writeable, length, offset, FALSE ) );
+}
+
+/* As vips__mmap(), but read the area in before returning, if the platform
+ * supports it. Handy for small areas we know we are going to scan.
+ */
+void *
+vips__mmap_populate( int fd, int writeable, size_t length, gint64 offset )
+{
+	return( vips_mmap( fd, writeable, length, offset, TRUE ) );
+}
+
+/* Tell the kernel how we will read a mapped area. Sequential access gets
+ * aggressive readahead, random access gets none, and either way we start
+ * reading the whole area in now. @start is rounded down to a page boundary.
+ *
+ * These are just hints, so errors are ignored.
+ */
+void
+vips__madvise( void *start, size_t length, VipsAccess access )
+{
+#ifdef HAVE_MADVISE
+	guintptr pagesize = getpagesize();
+	guintptr first = VIPS_ROUND_DOWN( (guintptr) start, pagesize );
+	int advice;
+
+	length += (guintptr) start - first;
+	start = (void *) first;
+
+	switch( access ) {
+	case VIPS_ACCESS_SEQUENTIAL:
+	case VIPS_ACCESS_SEQUENTIAL_UNBUFFERED:
+		advice = MADV_SEQUENTIAL;
+		break;
+
+	default:
+		advice = MADV_RANDOM;
+		break;
+	}
+
+	(void) madvise( start, length, advice );
+	(void) madvise( start, length, MADV_WILLNEED );
+#endif /*HAVE_MADVISE*/
+}
+
+/* We've finished with this part of a file, drop it from the page cache so 
+ * a long sequential scan doesn't push everything else out. Pages still
+ * mapped elsewhere are kept.
+ */
+void
+vips__file_dontneed( int fd, gint64 offset, gint64 length )
+{
+#ifdef HAVE_POSIX_FADVISE
+	if( length > 0 )
+		(void) posix_fadvise( fd, 
+			(off_t) offset, (off_t) length, POSIX_FADV_DONTNEED );
+#endif /*HAVE_POSIX_FADVISE*/
+}
+
+/* We'll need this part of a file soon. Ask the kernel to start reading it
+ * into the page cache in the background. FALSE if we have no way to hint.
+ */
+gboolean
+vips__file_willneed( int fd, gint64 offset, gint64 length )
+{
+#ifdef HAVE_POSIX_FADVISE
+	if( length > 0 )
+		(void) posix_fadvise( fd, 
+			(off_t) offset, (off_t) length, POSIX_FADV_WILLNEED );
+
+	return( TRUE );
+#else /*!HAVE_POSIX_FADVISE*/
+	return( FALSE );
+#endif /*HAVE_POSIX_FADVISE*/
+}
+
+/* Large memory buffers can be backed by transparent huge pages, which cuts
+ * TLB misses a lot when we scan big in-memory images. We can only advise
+ * whole pages, so trim to the pages inside the buffer.
+ */
+void
+vips__madvise_hugepage( void *start, size_t length )
+{
+#if defined(HAVE_MADVISE) && defined(MADV_HUGEPAGE)
+	guintptr pagesize = getpagesize();
+	guintptr first = VIPS_ROUND_UP( (guintptr) start, pagesize );
+	guintptr last = VIPS_ROUND_DOWN( (guintptr) start + length, pagesize );
+
+	if( length >= VIPS__HUGEPAGE_BYTES &&
+		last > first )
+		(void) madvise( (void *) first, last - first, MADV_HUGEPAGE );
+#endif /*defined(HAVE_MADVISE) && defined(MADV_HUGEPAGE)*/
+}
+
+/* The NUMA node holding the page at @p, or -1 if we can't tell, for example 
+ * if the page has not been touched yet.
+ */
+int
+vips__memory_node( const void *p )
+{
+#if defined(__linux__) && defined(SYS_move_pages)
+	guintptr pagesize = getpagesize();
+	void *page = (void *) VIPS_ROUND_DOWN( (guintptr) p, pagesize );
+	int status;
+
+	/* move_pages() with no target nodes just reports where pages are.
+	 */
+	if( syscall( SYS_move_pages, 0, 1, &page, NULL, &status, 0 ) ||
+		status < 0 )
+		return( -1 );
+
+	return( status );
+#else /*!defined(__linux__) && defined(SYS_move_pages)*/
+	return( -1 );
+#endif /*defined(__linux__) && defined(SYS_move_pages)*/
+}
+
+/* The NUMA node the calling thread is running on, or -1 if we can't tell.
+ */
+int
+vips__thread_node( void )
+{
+#if defined(__linux__) && defined(SYS_getcpu)
+	unsigned int cpu;
+	unsigned int node;
+
+	if( syscall( SYS_getcpu, &cpu, &node, NULL ) )
+		return( -1 );
+
+	return( (int) node );
+#else /*!defined(__linux__) && defined(SYS_getcpu)*/
+	return( -1 );
+#endif /*defined(__linux__) && defined(SYS_getcpu)*/
+}
+
 int
 vips__munmap( const void *start, size_t length )
 {
@@ -22,6 +22,8 @@
  * 21/9/11
  * 	- rename as vips_tracked_malloc() to emphasise difference from
  * 	  g_malloc()/g_free()
+ * 18/10/20
+ * 	- add vips__tracked_malloc_untouched()
  */
 
 /*
@@ -288,24 +290,8 @@ vips_tracked_init( void )
 		(GThreadFunc) vips_tracked_init_mutex, NULL );
 }
 
-/**
- * vips_tracked_malloc:
- * @size: number of bytes to allocate
- *
- * Allocate an area of memory that will be tracked by vips_tracked_get_mem()
- * and friends. 
- *
- * If allocation fails, vips_malloc() returns %NULL and 
- * sets an error message.
- *
- * You must only free the memory returned with vips_tracked_free().
- *
- * See also: vips_tracked_free(), vips_malloc().
- *
- * Returns: (transfer full): a pointer to the allocated memory, or %NULL on error.
- */
-void *
-vips_tracked_malloc( size_t size )
+static void *
+vips_tracked_malloc_internal( size_t size, gboolean zero )
 {
         void *buf;
 
@@ -317,7 +303,7 @@ vips_tracked_malloc( size_t size )
 	 */
 	size += 16;
 
-        if( !(buf = g_try_malloc0( size )) ) {
+        if( !(buf = zero ? g_try_malloc0( size ) : g_try_malloc( size )) ) {
 #ifdef DEBUG
 		g_assert_not_reached();
 #endif /*DEBUG*/
@@ -352,6 +338,43 @@ vips_tracked_malloc( size_t size )
         return( buf );
 }
 
+/**
+ * vips_tracked_malloc:
+ * @size: number of bytes to allocate
+ *
+ * Allocate an area of memory that will be tracked by vips_tracked_get_mem()
+ * and friends. 
+ *
+ * If allocation fails, vips_malloc() returns %NULL and 
+ * sets an error message.
+ *
+ * You must only free the memory returned with vips_tracked_free().
+ *
+ * See also: vips_tracked_free(), vips_malloc().
+ *
+ * Returns: (transfer full): a pointer to the allocated memory, or %NULL on error.
+ */
+void *
+vips_tracked_malloc( size_t size )
+{
+	return( vips_tracked_malloc_internal( size, TRUE ) );
+}
+
+/* As vips_tracked_malloc(), but the memory is not cleared. 
+ *
+ * This is a hint for first-touch NUMA placement, not a guarantee. Large 
+ * blocks usually come straight from the OS with untouched pages, which are 
+ * then placed on the node of the thread that first writes to them. But the 
+ * allocator is free to reuse pages it has already touched, for example for 
+ * smaller blocks or after a large block has been freed, and those stay where 
+ * they are.
+ */
+void *
+vips__tracked_malloc_untouched( size_t size )
+{
+	return( vips_tracked_malloc_internal( size, FALSE ) );
+}
+
 /**
  * vips_tracked_open:
  * @pathname: name of file to open
@@ -4,6 +4,14 @@
  *
  * 29/5/18
  * 	- added vips_argument_get_id()
+ * 18/10/20
+ * 	- add vips_object_class_find_argument(), 
+ * 	  vips_object_set_argument_value() and 
+ * 	  vips_object_get_argument_value(): set and get args without going 
+ * 	  through the GObject property system
+ * 	- set enum and flags args from strings in 
+ * 	  vips_object_set_argument_value()
+ * 	- name table has "_" forms of names too, eg. "no_rotate"
  */
 
 /*
@@ -770,19 +778,28 @@ vips_object_get_argument( VipsObject *object, const char *name,
 {
 	VipsObjectClass *class = VIPS_OBJECT_GET_CLASS( object );
 
-	if( !(*pspec = g_object_class_find_property( 
-		G_OBJECT_CLASS( class ), name )) ) {
-		vips_error( class->nickname, 
-			_( "no property named `%s'" ), name );
-		return( -1 );
-	}
+	/* Try the name table first, it's much quicker. It only has canonical
+	 * names and their "_" forms, so fall back to the GObject lookup for 
+	 * anything else.
+	 */
+	if( (*argument_class = 
+		vips_object_class_find_argument( class, name )) ) 
+		*pspec = ((VipsArgument *) *argument_class)->pspec;
+	else {
+		if( !(*pspec = g_object_class_find_property( 
+			G_OBJECT_CLASS( class ), name )) ) {
+			vips_error( class->nickname, 
+				_( "no property named `%s'" ), name );
+			return( -1 );
+		}
 
-	if( !(*argument_class = (VipsArgumentClass *)
-		vips__argument_table_lookup( class->argument_table, 
-		*pspec )) ) {
-		vips_error( class->nickname, 
-			_( "no vips argument named `%s'" ), name );
-		return( -1 );
+		if( !(*argument_class = (VipsArgumentClass *)
+			vips__argument_table_lookup( class->argument_table, 
+			*pspec )) ) {
+			vips_error( class->nickname, 
+				_( "no vips argument named `%s'" ), name );
+			return( -1 );
+		}
 	}
 	if( !(*argument_instance = vips__argument_get_instance( 
 		*argument_class, object )) ) {
@@ -794,6 +811,36 @@ vips_object_get_argument( VipsObject *object, const char *name,
 	return( 0 );
 }
 
+/**
+ * vips_object_class_find_argument: (skip)
+ * @object_class: the class to search
+ * @name: arg to find
+ *
+ * Look up an argument by name. This uses a table built when the class is 
+ * initialized, so it does not need to take any locks. Names must be in 
+ * canonical form, ie. exactly as they were installed, or have "_" in place
+ * of every "-".
+ *
+ * The #VipsArgumentClass can be kept and used with
+ * vips_object_set_argument_value() and vips_object_get_argument_value() on
+ * any instance of @object_class.
+ *
+ * See also: vips_object_get_argument().
+ *
+ * Returns: (transfer none): the argument, or %NULL if there's no argument
+ * with that name.
+ */
+VipsArgumentClass *
+vips_object_class_find_argument( VipsObjectClass *object_class, 
+	const char *name )
+{
+	if( !object_class->argument_names )
+		return( NULL );
+
+	return( (VipsArgumentClass *) 
+		g_hash_table_lookup( object_class->argument_names, name ) );
+}
+
 /**
  * vips_object_argument_isset: 
  * @object: the object to fetch the args from
@@ -1176,23 +1223,21 @@ vips_value_is_null( GParamSpec *pspec, const GValue *value )
 	return( FALSE );
 }
 
-/* Also used by subclasses, so not static.
+/* Set an argument from a GValue of exactly the argument type. 
  */
-void
-vips_object_set_property( GObject *gobject,
-	guint property_id, const GValue *value, GParamSpec *pspec )
+static void
+vips_object_set_member_value( VipsObject *object,
+	VipsArgumentClass *argument_class,
+	VipsArgumentInstance *argument_instance,
+	const GValue *value )
 {
-	VipsObject *object = VIPS_OBJECT( gobject );
-	VipsObjectClass *class = VIPS_OBJECT_GET_CLASS( gobject );
-	VipsArgumentClass *argument_class = (VipsArgumentClass *)
-		vips__argument_table_lookup( class->argument_table, pspec );
-	VipsArgumentInstance *argument_instance =
-		vips__argument_get_instance( argument_class, object );
+	GObject *gobject = G_OBJECT( object );
+	GParamSpec *pspec = ((VipsArgument *) argument_class)->pspec;
 
 	g_assert( argument_instance );
 
 #ifdef DEBUG
-	printf( "vips_object_set_property: " );
+	printf( "vips_object_set_member_value: " );
 	vips_object_print_name( object );
 	printf( ".%s\n", g_param_spec_get_name( pspec ) );
 
@@ -1208,7 +1253,6 @@ vips_object_set_property( GObject *gobject,
 }
 #endif /*DEBUG*/
 
-	g_assert( ((VipsArgument *) argument_class)->pspec == pspec );
 	g_assert( ((VipsArgument *) argument_instance)->pspec == pspec );
 
 	/* If this is a construct-only argument, we can only set before we've
@@ -1327,8 +1371,8 @@ vips_object_set_property( GObject *gobject,
 /* Also used by subclasses, so not static.
  */
 void
-vips_object_get_property( GObject *gobject,
-	guint property_id, GValue *value, GParamSpec *pspec )
+vips_object_set_property( GObject *gobject,
+	guint property_id, const GValue *value, GParamSpec *pspec )
 {
 	VipsObject *object = VIPS_OBJECT( gobject );
 	VipsObjectClass *class = VIPS_OBJECT_GET_CLASS( gobject );
@@ -1339,6 +1383,21 @@ vips_object_get_property( GObject *gobject,
 
 	g_assert( ((VipsArgument *) argument_class)->pspec == pspec );
 
+	vips_object_set_member_value( object, 
+		argument_class, argument_instance, value );
+}
+
+/* Get an argument into a GValue of exactly the argument type. 
+ */
+static void
+vips_object_get_member_value( VipsObject *object,
+	VipsArgumentClass *argument_class,
+	VipsArgumentInstance *argument_instance,
+	GValue *value )
+{
+	GObject *gobject = G_OBJECT( object );
+	GParamSpec *pspec = ((VipsArgument *) argument_class)->pspec;
+
 	if( !argument_instance->assigned ) {
 		/* Set the value to the default. Things like Ruby
 		 * gobject-introspection will walk objects during GC, and we
@@ -1421,6 +1480,214 @@ vips_object_get_property( GObject *gobject,
 	}
 }
 
+/* Also used by subclasses, so not static.
+ */
+void
+vips_object_get_property( GObject *gobject,
+	guint property_id, GValue *value, GParamSpec *pspec )
+{
+	VipsObject *object = VIPS_OBJECT( gobject );
+	VipsObjectClass *class = VIPS_OBJECT_GET_CLASS( gobject );
+	VipsArgumentClass *argument_class = (VipsArgumentClass *)
+		vips__argument_table_lookup( class->argument_table, pspec );
+	VipsArgumentInstance *argument_instance =
+		vips__argument_get_instance( argument_class, object );
+
+	g_assert( ((VipsArgument *) argument_class)->pspec == pspec );
+
+	vips_object_get_member_value( object, 
+		argument_class, argument_instance, value );
+}
+
+/* As vips_object_set_argument_value(), but @value must be exactly the 
+ * argument type and is validated in place, so it must be ours to change. 
+ * The varargs paths collect straight into a value of the argument type, so 
+ * this lets them skip the copy.
+ */
+int
+vips__object_set_argument_collected( VipsObject *object, 
+	VipsArgumentClass *argument_class, GValue *value )
+{
+	VipsObjectClass *class = VIPS_OBJECT_GET_CLASS( object );
+	GParamSpec *pspec = ((VipsArgument *) argument_class)->pspec;
+
+	VipsArgumentInstance *argument_instance;
+
+	g_assert( G_VALUE_TYPE( value ) == G_PARAM_SPEC_VALUE_TYPE( pspec ) );
+
+	/* Classes with their own set_property must go via GObject. Test the
+	 * class of the object, not the class that installed the argument, so 
+	 * any override anywhere in the hierarchy sends us to GObject.
+	 */
+	if( G_OBJECT_GET_CLASS( object )->set_property != 
+		vips_object_set_property ) {
+		g_object_set_property( G_OBJECT( object ), 
+			g_param_spec_get_name( pspec ), value );
+		return( 0 );
+	}
+
+	if( !(argument_instance = 
+		vips__argument_get_instance( argument_class, object )) ) {
+		vips_error( class->nickname, 
+			_( "argument `%s' has no instance" ), 
+			g_param_spec_get_name( pspec ) );
+		return( -1 );
+	}
+
+	if( g_param_value_validate( pspec, value ) ) {
+		vips_error( class->nickname, 
+			_( "value out of range for `%s'" ), 
+			g_param_spec_get_name( pspec ) );
+		return( -1 );
+	}
+
+	vips_object_set_member_value( object, 
+		argument_class, argument_instance, value );
+
+	return( 0 );
+}
+
+/**
+ * vips_object_set_argument_value: (skip)
+ * @object: object to set the argument on
+ * @argument_class: the argument to set
+ * @value: the value to set
+ *
+ * Set an argument directly, skipping the GObject property system. This
+ * avoids the property name lookup, the notify queue and its locks. No 
+ * "notify" signal is emitted. @value is copied before it is set.
+ *
+ * @value is converted to the argument type, if it can be, and is checked 
+ * against the range of the argument. Enum and flags arguments can also be 
+ * set from a string holding a nickname, for example "centre".
+ *
+ * Use vips_object_class_find_argument() or vips_object_get_argument() to get
+ * @argument_class.
+ *
+ * See also: vips_object_get_argument_value().
+ *
+ * Returns: 0 on success, or -1 on error.
+ */
+int
+vips_object_set_argument_value( VipsObject *object, 
+	VipsArgumentClass *argument_class, const GValue *value )
+{
+	VipsObjectClass *class = VIPS_OBJECT_GET_CLASS( object );
+	GParamSpec *pspec = ((VipsArgument *) argument_class)->pspec;
+	GType type = G_PARAM_SPEC_VALUE_TYPE( pspec );
+
+	GValue copy = { 0, };
+	int result;
+
+	/* We need a copy anyway, since validation can change the value.
+	 */
+	g_value_init( &copy, type );
+	if( G_VALUE_HOLDS_STRING( value ) &&
+		(G_IS_PARAM_SPEC_ENUM( pspec ) || 
+		 G_IS_PARAM_SPEC_FLAGS( pspec )) ) {
+		const char *nick = g_value_get_string( value );
+		int i;
+
+		if( G_IS_PARAM_SPEC_ENUM( pspec ) ) {
+			if( (i = vips_enum_from_nick( class->nickname, 
+				type, nick )) < 0 ) {
+				g_value_unset( &copy );
+				return( -1 );
+			}
+			g_value_set_enum( &copy, i );
+		}
+		else {
+			if( (i = vips_flags_from_nick( class->nickname, 
+				type, nick )) < 0 ) {
+				g_value_unset( &copy );
+				return( -1 );
+			}
+			g_value_set_flags( &copy, i );
+		}
+	}
+	else if( g_value_type_compatible( G_VALUE_TYPE( value ), type ) )
+		g_value_copy( value, &copy );
+	else if( !g_value_transform( value, &copy ) ) {
+		vips_error( class->nickname, 
+			_( "can't set `%s' from a value of type %s" ), 
+			g_param_spec_get_name( pspec ),
+			G_VALUE_TYPE_NAME( value ) );
+		g_value_unset( &copy );
+		return( -1 );
+	}
+
+	result = vips__object_set_argument_collected( object, 
+		argument_class, &copy );
+
+	g_value_unset( &copy );
+
+	return( result );
+}
+
+/**
+ * vips_object_get_argument_value: (skip)
+ * @object: object to get the argument from
+ * @argument_class: the argument to get
+ * @value: (out): the value of the argument
+ *
+ * Get an argument directly, skipping the GObject property system. @value
+ * must be initialized to the argument type, or to a type the argument can
+ * be converted to.
+ *
+ * See also: vips_object_set_argument_value().
+ *
+ * Returns: 0 on success, or -1 on error.
+ */
+int
+vips_object_get_argument_value( VipsObject *object, 
+	VipsArgumentClass *argument_class, GValue *value )
+{
+	VipsObjectClass *class = VIPS_OBJECT_GET_CLASS( object );
+	GParamSpec *pspec = ((VipsArgument *) argument_class)->pspec;
+	GType type = G_PARAM_SPEC_VALUE_TYPE( pspec );
+
+	VipsArgumentInstance *argument_instance;
+	GValue copy = { 0, };
+
+	if( G_OBJECT_GET_CLASS( object )->get_property != 
+		vips_object_get_property ) {
+		g_object_get_property( G_OBJECT( object ), 
+			g_param_spec_get_name( pspec ), value );
+		return( 0 );
+	}
+
+	if( !(argument_instance = 
+		vips__argument_get_instance( argument_class, object )) ) {
+		vips_error( class->nickname, 
+			_( "argument `%s' has no instance" ), 
+			g_param_spec_get_name( pspec ) );
+		return( -1 );
+	}
+
+	if( G_VALUE_TYPE( value ) == type ) {
+		vips_object_get_member_value( object, 
+			argument_class, argument_instance, value );
+		return( 0 );
+	}
+
+	g_value_init( &copy, type );
+	vips_object_get_member_value( object, 
+		argument_class, argument_instance, &copy );
+	if( g_value_type_compatible( type, G_VALUE_TYPE( value ) ) )
+		g_value_copy( &copy, value );
+	else if( !g_value_transform( &copy, value ) ) {
+		vips_error( class->nickname, 
+			_( "can't get `%s' as a value of type %s" ), 
+			g_param_spec_get_name( pspec ),
+			G_VALUE_TYPE_NAME( value ) );
+		g_value_unset( &copy );
+		return( -1 );
+	}
+	g_value_unset( &copy );
+
+	return( 0 );
+}
+
 static int
 vips_object_real_build( VipsObject *object )
 {
@@ -1590,6 +1857,7 @@ vips_object_class_init( VipsObjectClass *class )
 	class->argument_table = g_hash_table_new_full(
 		g_direct_hash, g_direct_equal, NULL, (GDestroyNotify) g_free );
 	class->argument_table_traverse = NULL;
+	class->argument_names = NULL;
 
 	/* For setting double arguments from the command-line.
 	 */
@@ -1718,7 +1986,10 @@ vips_object_class_install_argument( VipsObjectClass *object_class,
 	VipsArgumentClass *argument_class = g_new( VipsArgumentClass, 1 );
 
 	GSList *argument_table_traverse;
+	GHashTable *argument_names;
+	gboolean own_names;
 	VipsArgumentClass *ac;
+	GSList *p;
 
 #ifdef DEBUG
 	printf( "vips_object_class_install_argument: %p %s %s\n", 
@@ -1753,8 +2024,11 @@ vips_object_class_install_argument( VipsObjectClass *object_class,
 	/* If this is the first argument for a new subclass, we need to clone
 	 * the traverse list we inherit.
 	 */
+	own_names = TRUE;
 	if( object_class->argument_table_traverse_gtype != 
 		G_TYPE_FROM_CLASS( object_class ) ) {
+		own_names = FALSE;
+
 #ifdef DEBUG
 		printf( "vips_object_class_install_argument: "
 			"cloning traverse\n" ); 
@@ -1810,9 +2084,42 @@ vips_object_class_install_argument( VipsObjectClass *object_class,
 
 	g_slist_free( argument_table_traverse );  
 
+	/* And rebuild the name table from the new traverse list. The table we
+	 * inherit belongs to our superclass, so we can only free our own.
+	 *
+	 * C code usually names arguments with "_", eg. "no_rotate", but 
+	 * GObject canonicalises names to "no-rotate", so we add both forms.
+	 */
+	argument_names = g_hash_table_new_full( g_str_hash, g_str_equal,
+		g_free, NULL );
+	for( p = object_class->argument_table_traverse; p; p = p->next ) {
+		VipsArgumentClass *argument_class = 
+			(VipsArgumentClass *) p->data;
+		GParamSpec *pspec = ((VipsArgument *) argument_class)->pspec;
+		const char *name = g_param_spec_get_name( pspec );
+
+		g_hash_table_insert( argument_names, 
+			g_strdup( name ), argument_class );
+
+		if( strchr( name, '-' ) ) {
+			char *alias = g_strdup( name );
+			char *q;
+
+			for( q = alias; *q; q++ )
+				if( *q == '-' )
+					*q = '_';
+			g_hash_table_insert( argument_names, 
+				alias, argument_class );
+		}
+	}
+	VIPS_SWAP( GHashTable *, 
+		argument_names, object_class->argument_names );
+	if( own_names &&
+		argument_names )
+		g_hash_table_destroy( argument_names );
+
 #ifdef DEBUG
 {
-	GSList *p;
 
 	printf( "%d items on traverse %p\n", 
 		g_slist_length( object_class->argument_table_traverse ),
@@ -2413,7 +2720,11 @@ vips_object_set_valist( VipsObject *object, va_list ap )
 
 		VIPS_ARGUMENT_COLLECT_SET( pspec, argument_class, ap );
 
-		g_object_set_property( G_OBJECT( object ), name, &value );
+		if( vips__object_set_argument_collected( object, 
+			argument_class, &value ) ) {
+			g_value_unset( &value );
+			return( -1 );
+		}
 
 		VIPS_ARGUMENT_COLLECT_GET( pspec, argument_class, ap );
 
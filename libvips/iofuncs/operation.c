@@ -2,6 +2,9 @@
  *
  * 30/12/14
  * 	- display default/min/max for pspec in usage
+ * 18/10/20
+ * 	- set and get args with vips_object_set_argument_value(), skipping 
+ * 	  the GObject property system
  */
 
 /*
@@ -710,8 +713,12 @@ vips_operation_set_valist_required( VipsOperation *operation, va_list ap )
 			}
 #endif /*VIPS_DEBUG */
 
-			g_object_set_property( G_OBJECT( operation ),
-				g_param_spec_get_name( pspec ), &value );
+			if( vips__object_set_argument_collected( 
+				VIPS_OBJECT( operation ), 
+				argument_class, &value ) ) {
+				g_value_unset( &value );
+				return( -1 );
+			}
 
 			VIPS_ARGUMENT_COLLECT_GET( pspec, argument_class, ap );
 
@@ -727,6 +734,36 @@ vips_operation_set_valist_required( VipsOperation *operation, va_list ap )
 	return( 0 );
 }
 
+/* Write an output argument to @arg. Output objects are the common case, and
+ * we can read them directly. The caller is handed the operation's ref, so 
+ * there's no need to ref and unref, as g_object_get() would.
+ */
+static void
+vips_operation_get_output( VipsOperation *operation, 
+	GParamSpec *pspec, VipsArgumentClass *argument_class, void **arg )
+{
+	if( G_IS_PARAM_SPEC_OBJECT( pspec ) &&
+		G_OBJECT_GET_CLASS( operation )->get_property ==
+			vips_object_get_property ) 
+		*arg = G_STRUCT_MEMBER( gpointer, operation, 
+			argument_class->offset );
+	else {
+		g_object_get( G_OBJECT( operation ), 
+			g_param_spec_get_name( pspec ), arg, NULL );
+
+		/* If the pspec is an object, that will up the ref
+		 * count. We want to hand over the ref, so we have to
+		 * knock it down again.
+		 */
+		if( G_IS_PARAM_SPEC_OBJECT( pspec ) ) {
+			GObject *object;
+
+			object = *((GObject **) arg);
+			g_object_unref( object ); 
+		}
+	}
+}
+
 static int
 vips_operation_get_valist_required( VipsOperation *operation, va_list ap )
 {
@@ -760,19 +797,8 @@ vips_operation_get_valist_required( VipsOperation *operation, va_list ap )
 			 * to get coredumps.
 			 */
 
-			g_object_get( G_OBJECT( operation ), 
-				g_param_spec_get_name( pspec ), arg, NULL );
-
-			/* If the pspec is an object, that will up the ref
-			 * count. We want to hand over the ref, so we have to
-			 * knock it down again.
-			 */
-			if( G_IS_PARAM_SPEC_OBJECT( pspec ) ) {
-				GObject *object;
-
-				object = *((GObject **) arg);
-				g_object_unref( object ); 
-			}
+			vips_operation_get_output( operation, 
+				pspec, argument_class, arg );
 
 			VIPS_ARGUMENT_COLLECT_END
 		}
@@ -817,22 +843,9 @@ vips_operation_get_valist_optional( VipsOperation *operation, va_list ap )
 
 		/* If the dest pointer is NULL, skip the read.
 		 */
-		if( arg ) {
-			g_object_get( G_OBJECT( operation ), 
-				g_param_spec_get_name( pspec ), arg, 
-				NULL );
-
-			/* If the pspec is an object, that will up 
-			 * the ref count. We want to hand over the 
-			 * ref, so we have to knock it down again.
-			 */
-			if( G_IS_PARAM_SPEC_OBJECT( pspec ) ) {
-				GObject *object;
-
-				object = *((GObject **) arg);
-				g_object_unref( object ); 
-			}
-		}
+		if( arg ) 
+			vips_operation_get_output( operation, 
+				pspec, argument_class, arg );
 
 		VIPS_ARGUMENT_COLLECT_END
 	}
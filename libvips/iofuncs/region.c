@@ -48,6 +48,10 @@
  * 9/6/19
  * 	- saner behaviour for vips_region_fetch() if the request is partly 
  * 	  outside the image
+ * 18/10/20
+ * 	- vectorised line kernels for the 2x2 mean shrink
+ * 	- add vips__region_shrink_threaded()
+ * 	- free the shrink pool in vips_shutdown(), drop empty bands
  */
 
 /*
@@ -1142,43 +1146,101 @@ vips_region_shrink_labpack( VipsRegion *from,
 	}
 }
 
-#define SHRINK_TYPE_MEAN_INT( TYPE ) \
-	for( x = 0; x < target->width; x++ ) { \
-		TYPE *tp = (TYPE *) p; \
-		TYPE *tp1 = (TYPE *) (p + ls); \
-		TYPE *tq = (TYPE *) q; \
- 		\
-		for( z = 0; z < nb; z++ ) { \
-			int tot = tp[z] + tp[z + nb] +  \
-				tp1[z] + tp1[z + nb]; \
+/* The 2x2 mean of a line of pels. NB is the number of bands, or zero for
+ * any number of bands. With a constant band count and no aliasing, the
+ * compiler can vectorise these loops.
+ *
+ * We keep the arithmetic of the old scalar code: ints sum in int and round,
+ * floats sum in double.
+ */
+#define SHRINK_MEAN_LINE( NAME, TYPE, ACC, NB, MEAN ) \
+static void VIPS_TARGET_CLONES \
+NAME( VipsPel * restrict out, \
+	const VipsPel * restrict in, const VipsPel * restrict in1, \
+	int width, int nb ) \
+{ \
+	TYPE * restrict tq = (TYPE *) out; \
+	const TYPE * restrict tp = (const TYPE *) in; \
+	const TYPE * restrict tp1 = (const TYPE *) in1; \
+	const int bands = NB ? NB : nb; \
+	\
+	int x, z; \
+	\
+	for( x = 0; x < width; x++ ) \
+		for( z = 0; z < bands; z++ ) { \
+			ACC tot = (ACC) tp[2 * x * bands + z] + \
+				tp[(2 * x + 1) * bands + z] + \
+				tp1[2 * x * bands + z] + \
+				tp1[(2 * x + 1) * bands + z]; \
 			\
-			tq[z] = (tot + 2) >> 2; \
+			tq[x * bands + z] = MEAN( tot ); \
 		} \
-		\
-		/* Move on two pels in input. \
-		 */ \
-		p += ps << 1; \
-		q += ps; \
-	}
+}
 
-#define SHRINK_TYPE_MEAN_FLOAT( TYPE )  \
-	for( x = 0; x < target->width; x++ ) { \
-		TYPE *tp = (TYPE *) p; \
-		TYPE *tp1 = (TYPE *) (p + ls); \
-		TYPE *tq = (TYPE *) q; \
-		\
-		for( z = 0; z < nb; z++ ) { \
-			double tot = tp[z] + tp[z + nb] +  \
-				tp1[z] + tp1[z + nb]; \
-			\
-			tq[z] = tot / 4; \
-		} \
-		\
-		/* Move on two pels in input. \
-		 */ \
-		p += ps << 1; \
-		q += ps; \
+#define MEAN_INT( TOT ) (((TOT) + 2) >> 2)
+#define MEAN_FLOAT( TOT ) ((TOT) / 4)
+
+typedef void (*VipsShrinkMeanLineFn)( VipsPel * restrict out, 
+	const VipsPel * restrict in, const VipsPel * restrict in1, 
+	int width, int nb );
+
+/* uchar and ushort are the usual formats for pyramids, so they get versions
+ * for the common band counts.
+ */
+SHRINK_MEAN_LINE( shrink_mean_uchar1, unsigned char, int, 1, MEAN_INT )
+SHRINK_MEAN_LINE( shrink_mean_uchar2, unsigned char, int, 2, MEAN_INT )
+SHRINK_MEAN_LINE( shrink_mean_uchar3, unsigned char, int, 3, MEAN_INT )
+SHRINK_MEAN_LINE( shrink_mean_uchar4, unsigned char, int, 4, MEAN_INT )
+SHRINK_MEAN_LINE( shrink_mean_uchar, unsigned char, int, 0, MEAN_INT )
+SHRINK_MEAN_LINE( shrink_mean_ushort1, unsigned short, int, 1, MEAN_INT )
+SHRINK_MEAN_LINE( shrink_mean_ushort2, unsigned short, int, 2, MEAN_INT )
+SHRINK_MEAN_LINE( shrink_mean_ushort3, unsigned short, int, 3, MEAN_INT )
+SHRINK_MEAN_LINE( shrink_mean_ushort4, unsigned short, int, 4, MEAN_INT )
+SHRINK_MEAN_LINE( shrink_mean_ushort, unsigned short, int, 0, MEAN_INT )
+SHRINK_MEAN_LINE( shrink_mean_char, signed char, int, 0, MEAN_INT )
+SHRINK_MEAN_LINE( shrink_mean_short, signed short, int, 0, MEAN_INT )
+SHRINK_MEAN_LINE( shrink_mean_uint, unsigned int, int, 0, MEAN_INT )
+SHRINK_MEAN_LINE( shrink_mean_int, signed int, int, 0, MEAN_INT )
+SHRINK_MEAN_LINE( shrink_mean_float, float, double, 0, MEAN_FLOAT )
+SHRINK_MEAN_LINE( shrink_mean_double, double, double, 0, MEAN_FLOAT )
+
+static VipsShrinkMeanLineFn
+vips_region_shrink_mean_line_fn( VipsBandFormat format, int nb )
+{
+	static const VipsShrinkMeanLineFn uchar_fn[] = {
+		shrink_mean_uchar, 
+		shrink_mean_uchar1, shrink_mean_uchar2, 
+		shrink_mean_uchar3, shrink_mean_uchar4
+	};
+	static const VipsShrinkMeanLineFn ushort_fn[] = {
+		shrink_mean_ushort, 
+		shrink_mean_ushort1, shrink_mean_ushort2, 
+		shrink_mean_ushort3, shrink_mean_ushort4
+	};
+
+	switch( format ) {
+	case VIPS_FORMAT_UCHAR:
+		return( uchar_fn[nb <= 4 ? nb : 0] );
+	case VIPS_FORMAT_USHORT:
+		return( ushort_fn[nb <= 4 ? nb : 0] );
+	case VIPS_FORMAT_CHAR:
+		return( shrink_mean_char );
+	case VIPS_FORMAT_SHORT:
+		return( shrink_mean_short );
+	case VIPS_FORMAT_UINT:
+		return( shrink_mean_uint );
+	case VIPS_FORMAT_INT:
+		return( shrink_mean_int );
+	case VIPS_FORMAT_FLOAT:
+		return( shrink_mean_float );
+	case VIPS_FORMAT_DOUBLE:
+		return( shrink_mean_double );
+
+	default:
+		g_assert_not_reached();
+		return( NULL );
 	}
+}
 
 /* Generate area @target in @to using pixels in @from. Non-complex.
  */
@@ -1187,10 +1249,11 @@ vips_region_shrink_uncoded_mean( VipsRegion *from,
 	VipsRegion *to, const VipsRect *target )
 {
 	int ls = VIPS_REGION_LSKIP( from );
-	int ps = VIPS_IMAGE_SIZEOF_PEL( from->im );
 	int nb = from->im->Bands;
+	VipsShrinkMeanLineFn line = 
+		vips_region_shrink_mean_line_fn( from->im->BandFmt, nb );
 
-	int x, y, z;
+	int y;
 
 	for( y = 0; y < target->height; y++ ) {
 		VipsPel *p = VIPS_REGION_ADDR( from, 
@@ -1198,29 +1261,7 @@ vips_region_shrink_uncoded_mean( VipsRegion *from,
 		VipsPel *q = VIPS_REGION_ADDR( to, 
 			target->left, target->top + y );
 
-		/* Process this line of pels.
-		 */
-		switch( from->im->BandFmt ) {
-		case VIPS_FORMAT_UCHAR:
-			SHRINK_TYPE_MEAN_INT( unsigned char );  break;
-		case VIPS_FORMAT_CHAR:
-			SHRINK_TYPE_MEAN_INT( signed char );  break;
-		case VIPS_FORMAT_USHORT:
-			SHRINK_TYPE_MEAN_INT( unsigned short );  break;
-		case VIPS_FORMAT_SHORT:
-			SHRINK_TYPE_MEAN_INT( signed short );  break;
-		case VIPS_FORMAT_UINT:
-			SHRINK_TYPE_MEAN_INT( unsigned int );  break;
-		case VIPS_FORMAT_INT:
-			SHRINK_TYPE_MEAN_INT( signed int );  break;
-		case VIPS_FORMAT_FLOAT:
-			SHRINK_TYPE_MEAN_FLOAT( float );  break;
-		case VIPS_FORMAT_DOUBLE:
-			SHRINK_TYPE_MEAN_FLOAT( double );  break;
-
-		default:
-			g_assert_not_reached();
-		}
+		line( q, p, p + ls, target->width, nb );
 	}
 }
 
@@ -1552,6 +1593,154 @@ vips_region_shrink_method( VipsRegion *from, VipsRegion *to,
 	return( 0 );
 }
 
+/* Split shrinks into bands of at least this many output lines.
+ */
+#define VIPS_SHRINK_BAND_HEIGHT (16)
+
+/* A set of bands being shrunk by the pool.
+ */
+typedef struct _VipsShrinkBatch {
+	GMutex *lock;
+	GCond *cond;
+	int n_pending;
+} VipsShrinkBatch;
+
+typedef struct _VipsShrinkBand {
+	VipsShrinkBatch *batch;
+	VipsRegion *from;
+	VipsRegion *to;
+	VipsRect target;
+	VipsRegionShrink method;
+} VipsShrinkBand;
+
+static void
+vips_region_shrink_band( VipsShrinkBand *band, void *user_data )
+{
+	VipsShrinkBatch *batch = band->batch;
+
+	(void) vips_region_shrink_method( band->from, band->to, 
+		&band->target, band->method );
+
+	g_mutex_lock( batch->lock );
+	batch->n_pending -= 1;
+	g_cond_signal( batch->cond );
+	g_mutex_unlock( batch->lock );
+}
+
+/* Threads shared by all threaded shrinks. Freed by vips__region_shutdown().
+ */
+static GThreadPool *vips__region_shrink_pool = NULL;
+
+static GThreadPool *
+vips_region_shrink_pool( void )
+{
+	GThreadPool *pool;
+
+	g_mutex_lock( vips__global_lock );
+	if( !vips__region_shrink_pool )
+		vips__region_shrink_pool = g_thread_pool_new( 
+			(GFunc) vips_region_shrink_band, NULL,
+			vips_concurrency_get(), FALSE, NULL );
+	pool = vips__region_shrink_pool;
+	g_mutex_unlock( vips__global_lock );
+
+	return( pool );
+}
+
+/* Called from vips_shutdown().
+ */
+void
+vips__region_shutdown( void )
+{
+	GThreadPool *pool;
+
+	g_mutex_lock( vips__global_lock );
+	pool = vips__region_shrink_pool;
+	vips__region_shrink_pool = NULL;
+	g_mutex_unlock( vips__global_lock );
+
+	if( pool )
+		g_thread_pool_free( pool, FALSE, TRUE );
+}
+
+/* Shrink @target as vips_region_shrink_method(), but split into horizontal
+ * bands and run them on a pool of threads. Pyramid builders call this from
+ * their single write thread, so deep layers don't serialise behind it.
+ *
+ * Shrinks are only memory operations, and each band writes a separate set
+ * of lines, so there's no locking on the regions.
+ */
+int
+vips__region_shrink_threaded( VipsRegion *from, VipsRegion *to, 
+	const VipsRect *target, VipsRegionShrink method )
+{
+	VipsImage *image = from->im;
+	int n_bands = VIPS_MIN( vips_concurrency_get(), 
+		target->height / VIPS_SHRINK_BAND_HEIGHT );
+
+	GThreadPool *pool;
+	VipsShrinkBatch batch;
+	VipsShrinkBand *bands;
+	int band_height;
+	int i;
+
+	if( n_bands <= 1 )
+		return( vips_region_shrink_method( from, to, target, method ) );
+
+	/* Check here, so the bands can't fail.
+	 */
+	if( vips_check_coding_noneorlabq( "vips_region_shrink_method", 
+		image ) ||
+		(image->Coding == VIPS_CODING_NONE &&
+		 vips_check_noncomplex( "vips_region_shrink_method", image )) )
+		return( -1 );
+
+	/* Rounding band_height up can leave nothing for the last few bands, 
+	 * eg. 520 lines in 32 bands is 31 bands of 17 lines, so recount.
+	 */
+	band_height = VIPS_ROUND_UP( target->height, n_bands ) / n_bands;
+	n_bands = VIPS_ROUND_UP( target->height, band_height ) / band_height;
+
+	pool = vips_region_shrink_pool();
+
+	if( !(bands = VIPS_ARRAY( NULL, n_bands, VipsShrinkBand )) )
+		return( -1 );
+	batch.lock = vips_g_mutex_new();
+	batch.cond = vips_g_cond_new();
+	batch.n_pending = n_bands - 1;
+
+	for( i = 0; i < n_bands; i++ ) {
+		VipsShrinkBand *band = &bands[i];
+
+		band->batch = &batch;
+		band->from = from;
+		band->to = to;
+		band->target = *target;
+		band->target.top = target->top + i * band_height;
+		band->target.height = VIPS_MIN( band_height, 
+			VIPS_RECT_BOTTOM( target ) - band->target.top );
+		band->method = method;
+	}
+
+	/* Run the first band ourselves.
+	 */
+	for( i = 1; i < n_bands; i++ ) 
+		g_thread_pool_push( pool, &bands[i], NULL );
+	(void) vips_region_shrink_method( from, to, 
+		&bands[0].target, method );
+
+	g_mutex_lock( batch.lock );
+	while( batch.n_pending > 0 )
+		g_cond_wait( batch.cond, batch.lock );
+	g_mutex_unlock( batch.lock );
+
+	vips_g_mutex_free( batch.lock );
+	vips_g_cond_free( batch.cond );
+	vips_free( bands );
+
+	return( 0 );
+}
+
 /**
  * vips_region_shrink: (skip)
  * @from: source region
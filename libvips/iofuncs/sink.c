@@ -2,6 +2,8 @@
  * 
  * 28/3/10
  * 	- from im_iterate(), reworked for threadpool
+ * 18/10/20
+ * 	- add vips_sink_base_tune()
  */
 
 /*
@@ -181,6 +183,7 @@ sink_area_allocate_fn( VipsThreadState *state, void *a, gboolean *stop )
 	 */
 	if( sink_base->x >= sink->area->rect.width ) {
 		sink_base->x = 0;
+		vips_sink_base_tune( sink_base );
 		sink_base->y += sink_base->tile_height;
 
 		if( sink_base->y >= VIPS_RECT_BOTTOM( &sink->area->rect ) ) {
@@ -368,6 +371,77 @@ vips_sink_base_init( SinkBase *sink_base, VipsImage *image )
 		&sink_base->n_lines );
 
 	sink_base->processed = 0;
+
+	sink_base->tune = vips__tile_autotune &&
+		sink_base->tile_width < image->Xsize;
+	sink_base->tune_step = 0;
+	sink_base->tune_width = sink_base->tile_width;
+	sink_base->tune_start = g_get_monotonic_time();
+	sink_base->tune_processed = 0;
+	sink_base->tune_best_width = sink_base->tile_width;
+	sink_base->tune_best_rate = 0.0;
+
+	VIPS_GATE_COUNT( "sink: tile width", sink_base->tile_width );
+	VIPS_GATE_COUNT( "sink: tile height", sink_base->tile_height );
+}
+
+/* Called by allocate functions as each new row of tiles starts. We skip the
+ * first row, since it includes pipeline startup, then time a row at the
+ * starting width, half that width and twice that width, and keep the
+ * fastest. Tile height can't change, since it must divide n_lines.
+ */
+void
+vips_sink_base_tune( SinkBase *sink_base )
+{
+	gint64 now;
+	double rate;
+
+	if( !sink_base->tune )
+		return;
+
+	/* Someone has set full-width tiles, perhaps sinkmemory. 
+	 */
+	if( sink_base->tile_width >= sink_base->im->Xsize ) {
+		sink_base->tune = FALSE;
+		return;
+	}
+
+	now = g_get_monotonic_time();
+	rate = (double) (sink_base->processed - sink_base->tune_processed) / 
+		VIPS_MAX( 1, now - sink_base->tune_start );
+	if( sink_base->tune_step > 0 &&
+		rate > sink_base->tune_best_rate ) {
+		sink_base->tune_best_rate = rate;
+		sink_base->tune_best_width = sink_base->tile_width;
+	}
+
+	sink_base->tune_step += 1;
+	switch( sink_base->tune_step ) {
+	case 1:
+		sink_base->tile_width = sink_base->tune_width;
+		break;
+
+	case 2:
+		sink_base->tile_width = VIPS_MAX( 16, sink_base->tune_width / 2 );
+		break;
+
+	case 3:
+		sink_base->tile_width = sink_base->tune_width * 2;
+		break;
+
+	default:
+		sink_base->tile_width = sink_base->tune_best_width;
+		sink_base->tune = FALSE;
+
+		VIPS_DEBUG_MSG( "vips_sink_base_tune: picked %d\n", 
+			sink_base->tile_width );
+		VIPS_GATE_COUNT( "sink: tuned tile width", 
+			sink_base->tile_width );
+		break;
+	}
+
+	sink_base->tune_start = now;
+	sink_base->tune_processed = sink_base->processed;
 }
 
 static int
@@ -484,6 +558,10 @@ vips_sink_tile( VipsImage *im,
 	if( tile_width > 0 ) {
 		sink.sink_base.tile_width = tile_width;
 		sink.sink_base.tile_height = tile_height;
+
+		/* The caller has picked a size, so don't tune it.
+		 */
+		sink.sink_base.tune = FALSE;
 	}
 
 	/* vips_sink_base_progress() signals progress on im, so we have to do
@@ -57,6 +57,17 @@ typedef struct _SinkBase {
 	int tile_height;
 	int n_lines;
 
+	/* Tile width tuning: set while we are still timing widths. We time 
+	 * each row of tiles from when it starts to be allocated.
+	 */
+	gboolean tune;
+	int tune_step;
+	int tune_width;
+	gint64 tune_start;
+	guint64 tune_processed;
+	int tune_best_width;
+	double tune_best_rate;
+
 	/* The number of pixels allocate has allocated. Used for progress
 	 * feedback.
 	 */
@@ -66,6 +77,7 @@ typedef struct _SinkBase {
 /* Some function we can share.
  */
 void vips_sink_base_init( SinkBase *sink_base, VipsImage *image );
+void vips_sink_base_tune( SinkBase *sink_base );
 VipsThreadState *vips_sink_thread_state_new( VipsImage *im, void *a );
 int vips_sink_base_allocate( VipsThreadState *state, void *a, gboolean *stop );
 int vips_sink_base_progress( void *a );
@@ -9,6 +9,8 @@
  * 	- we could get stuck if allocate failed (thanks Tim)
  * 23/2/12
  * 	- we could deadlock if generate failed
+ * 18/10/20
+ * 	- tune tile width
  */
 
 /*
@@ -328,6 +330,7 @@ wbuffer_allocate_fn( VipsThreadState *state, void *a, gboolean *stop )
 	 */
 	if( sink_base->x >= write->buf->area.width ) {
 		sink_base->x = 0;
+		vips_sink_base_tune( sink_base );
 		sink_base->y += sink_base->tile_height;
 
 		if( sink_base->y >= VIPS_RECT_BOTTOM( &write->buf->area ) ) {
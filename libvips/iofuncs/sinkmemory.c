@@ -8,6 +8,10 @@
  * 	- from sinkdisc.c
  * 23/2/12
  * 	- we could deadlock if generate failed
+ * 18/10/20
+ * 	- add vips_sink_memory_numa_set() for first-touch placement
+ * 	- record bytes written and remote bytes in profiles
+ * 	- tune tile width
  */
 
 /*
@@ -57,6 +61,12 @@
 
 #include "sink.h"
 
+/* Place output pages on the NUMA node of the worker that fills them.
+ *
+ * This can be configured with vips_sink_memory_numa_set().
+ */
+static gboolean vips__sink_memory_numa = FALSE;
+
 /* A part of the image we are writing. 
  */
 typedef struct _SinkMemoryArea {
@@ -187,6 +197,7 @@ sink_memory_area_allocate_fn( VipsThreadState *state, void *a, gboolean *stop )
 	 */
 	if( sink_base->x >= memory->area->rect.width ) {
 		sink_base->x = 0;
+		vips_sink_base_tune( sink_base );
 		sink_base->y += sink_base->tile_height;
 
 		if( sink_base->y >= VIPS_RECT_BOTTOM( &memory->area->rect ) ) {
@@ -249,6 +260,44 @@ sink_memory_area_allocate_fn( VipsThreadState *state, void *a, gboolean *stop )
 	return( 0 );
 }
 
+/* Record the bytes we wrote for the profiler, and estimate how many of them 
+ * landed on a NUMA node other than the one this thread is running on. 
+ */
+static void
+sink_memory_area_profile( SinkMemory *memory, VipsRect *pos )
+{
+	VipsRegion *region = memory->region;
+	gint64 bytes = (gint64) pos->width * pos->height *
+		VIPS_IMAGE_SIZEOF_PEL( region->im );
+	int node = vips__thread_node();
+
+	VIPS_GATE_COUNT( "sink_memory: bytes", bytes );
+
+	if( node >= 0 ) {
+		int lines[3];
+		int remote;
+		int i;
+
+		/* Sample the first, middle and last lines.
+		 */
+		lines[0] = pos->top;
+		lines[1] = pos->top + pos->height / 2;
+		lines[2] = VIPS_RECT_BOTTOM( pos ) - 1;
+		remote = 0;
+		for( i = 0; i < 3; i++ ) {
+			int page_node = vips__memory_node( 
+				VIPS_REGION_ADDR( region, pos->left, lines[i] ) );
+
+			if( page_node >= 0 &&
+				page_node != node )
+				remote += 1;
+		}
+
+		VIPS_GATE_COUNT( "sink_memory: remote bytes", 
+			bytes * remote / 3 );
+	}
+}
+
 /* Our VipsThreadpoolWork function ... generate a tile!
  */
 static int
@@ -269,6 +318,10 @@ sink_memory_area_work_fn( VipsThreadState *state, void *a )
 	VIPS_DEBUG_MSG( "sink_memory_area_work_fn: %p result = %d\n", 
 		g_thread_self(), result );
 
+	if( vips__thread_profile &&
+		!result )
+		sink_memory_area_profile( memory, &state->pos );
+
 	/* Tell the allocator we're done.
 	 */
 	vips_semaphore_upn( &area->nwrite, 1 );
@@ -291,6 +344,14 @@ sink_memory_init( SinkMemory *memory, VipsImage *image )
 
 	vips_sink_base_init( &memory->sink_base, image );
 	memory->area = NULL;
+
+	/* With first-touch placement, each worker fills whole lines, so
+	 * each page is written by a single thread. Pages then stay on the
+	 * node of the worker that wrote them.
+	 */
+	if( vips__sink_memory_numa )
+		memory->sink_base.tile_width = image->Xsize;
+
 	memory->old_area = NULL;
 
 	all.left = 0;
@@ -309,6 +370,54 @@ sink_memory_init( SinkMemory *memory, VipsImage *image )
 	return( 0 );
 }
 
+/**
+ * vips_sink_memory_numa_set:
+ * @numa: place pages on the node of the worker that writes them
+ *
+ * Set whether vips_sink_memory() tries to keep output pages local to the
+ * worker that fills them. The output buffer is allocated without being
+ * cleared, and workers are given whole lines so each page has a single 
+ * writer. On machines with several NUMA nodes, pages the allocator takes 
+ * fresh from the OS are then placed on the node of the worker that writes 
+ * them. This is best-effort: the allocator may hand back pages it has 
+ * already touched, and those stay on whatever node they are on. The 
+ * pixels written are the same either way.
+ *
+ * If profiling is on, vips_sink_memory() records the number of bytes each 
+ * worker writes and an estimate of how many of them went to a remote node.
+ * The default is %FALSE.
+ *
+ * You can also set this with the environment variable `VIPS_NUMA` or the 
+ * command-line flag `--vips-numa`.
+ *
+ * See also: vips_profile_set().
+ */
+void
+vips_sink_memory_numa_set( gboolean numa )
+{
+	vips__sink_memory_numa = numa;
+}
+
+/* Allocate the memory buffer for @image ahead of vips_image_write_prepare(),
+ * if we are placing pages by first touch. 
+ */
+int
+vips__sink_memory_alloc( VipsImage *image )
+{
+	if( vips__sink_memory_numa &&
+		image->dtype == VIPS_IMAGE_SETBUF &&
+		!image->data &&
+		image->Xsize > 0 &&
+		image->Ysize > 0 &&
+		image->Bands > 0 ) {
+		if( !(image->data = vips__tracked_malloc_untouched( 
+			VIPS_IMAGE_SIZEOF_IMAGE( image ) )) )
+			return( -1 );
+	}
+
+	return( 0 );
+}
+
 /**
  * vips_sink_memory:
  * @im: generate this image to memory
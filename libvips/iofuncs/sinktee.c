@@ -0,0 +1,605 @@
+/* SinkTee an image to several consumers, computing it only once.
+ *
+ * Each consumer (a saver, for example) runs in its own thread and reads from
+ * its own branch image. Branches fetch pixels from a shared window of strips
+ * on the input image. Each strip is computed by the first branch that needs
+ * it and freed once every branch has read it.
+ *
+ * Memory use is bounded by the size of the window: branches that get too far
+ * ahead wait for the others to catch up.
+ *
+ * 18/10/20
+ * 	- from sinkmemory.c
+ * 	- stop at the first branch we can't build
+ * 	- only give up waiting when no branch has read anything for a second
+ */
+
+/*
+
+    This file is part of VIPS.
+
+    VIPS is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301  USA
+
+ */
+
+/*
+
+    These files are distributed with VIPS - http://www.vips.ecs.soton.ac.uk
+
+ */
+
+/*
+#define VIPS_DEBUG
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /*HAVE_CONFIG_H*/
+#include <vips/intl.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vips/vips.h>
+#include <vips/internal.h>
+#include <vips/thread.h>
+#include <vips/debug.h>
+
+/* If a branch waits this long (in microseconds) and no branch reads 
+ * anything from the window meanwhile, it gives up and computes pixels 
+ * itself. This happens if a consumer reads out of order, or if one branch 
+ * stops reading for a long time, for example while a slow encoder catches 
+ * up. Those pixels are then computed more than once.
+ */
+#define VIPS_TEE_STALL (1000000)
+
+/* A set of lines computed from the input.
+ */
+typedef struct _VipsTeeStrip {
+	/* The part of the input this strip holds.
+	 */
+	VipsRect rect;
+	VipsPel *data;
+	size_t bpl;
+
+	/* Set when the pixels have been computed, or computation failed.
+	 */
+	gboolean ready;
+	gboolean failed;
+
+	/* Number of threads copying from this strip.
+	 */
+	int users;
+
+	/* Number of pixels each branch has read from the strip.
+	 */
+	gint64 *seen;
+} VipsTeeStrip;
+
+/* Per-call state. This is shared by all the branches, and freed when the
+ * call and all branches have finished.
+ */
+typedef struct _VipsTee {
+	VipsImage *in;
+
+	/* The branches, and whether each has finished reading.
+	 */
+	int n;
+	VipsImage **branch;
+	gboolean *finished;
+
+	/* Strips are this many lines high, and we keep at most max_strips.
+	 */
+	int strip_height;
+	int max_strips;
+
+	GMutex *lock;
+	GCond *cond;
+
+	/* Strip number -> VipsTeeStrip. All strips before first have been
+	 * read by every branch and freed.
+	 */
+	GHashTable *strips;
+	int first;
+
+	/* Counts reads from the window, so waiting branches can tell if 
+	 * anything is happening.
+	 */
+	gint64 n_reads;
+
+	/* Set when the call returns. Any later reads compute pixels directly.
+	 */
+	gboolean closed;
+
+	int ref_count;
+} VipsTee;
+
+static void
+vips_tee_strip_free( VipsTeeStrip *strip )
+{
+	VIPS_FREEF( vips_tracked_free, strip->data );
+	VIPS_FREE( strip->seen );
+	g_free( strip );
+}
+
+static VipsTeeStrip *
+vips_tee_strip_new( VipsTee *tee, int no )
+{
+	VipsRect image;
+	VipsTeeStrip *strip;
+
+	strip = g_new0( VipsTeeStrip, 1 );
+	image.left = 0;
+	image.top = 0;
+	image.width = tee->in->Xsize;
+	image.height = tee->in->Ysize;
+	strip->rect.left = 0;
+	strip->rect.top = no * tee->strip_height;
+	strip->rect.width = tee->in->Xsize;
+	strip->rect.height = tee->strip_height;
+	vips_rect_intersectrect( &strip->rect, &image, &strip->rect );
+	strip->bpl = VIPS_IMAGE_SIZEOF_LINE( tee->in );
+	strip->seen = g_new0( gint64, tee->n );
+
+	return( strip );
+}
+
+static void
+vips_tee_unref( VipsTee *tee )
+{
+	gboolean last;
+
+	g_mutex_lock( tee->lock );
+	tee->ref_count -= 1;
+	last = tee->ref_count == 0;
+	g_mutex_unlock( tee->lock );
+
+	if( last ) {
+		VIPS_FREEF( g_hash_table_destroy, tee->strips );
+		VIPS_FREEF( vips_g_mutex_free, tee->lock );
+		VIPS_FREEF( vips_g_cond_free, tee->cond );
+		VIPS_UNREF( tee->in );
+		VIPS_FREE( tee->branch );
+		VIPS_FREE( tee->finished );
+		g_free( tee );
+	}
+}
+
+/* Has every branch finished with this strip? Call with the lock held.
+ */
+static gboolean
+vips_tee_strip_done( VipsTee *tee, VipsTeeStrip *strip )
+{
+	gint64 size = (gint64) strip->rect.width * strip->rect.height;
+
+	int i;
+
+	if( strip->users > 0 )
+		return( FALSE );
+	if( strip->failed )
+		return( TRUE );
+	if( !strip->ready )
+		return( FALSE );
+
+	for( i = 0; i < tee->n; i++ )
+		if( !tee->finished[i] &&
+			strip->seen[i] < size )
+			return( FALSE );
+
+	return( TRUE );
+}
+
+/* Free strips from the start of the window that every branch has read. Call
+ * with the lock held.
+ */
+static void
+vips_tee_trim( VipsTee *tee )
+{
+	VipsTeeStrip *strip;
+	int first;
+
+	first = tee->first;
+	while( (strip = g_hash_table_lookup( tee->strips,
+		GINT_TO_POINTER( tee->first ) )) &&
+		vips_tee_strip_done( tee, strip ) ) {
+		VIPS_DEBUG_MSG( "vips_tee_trim: freeing strip %d\n",
+			tee->first );
+
+		g_hash_table_remove( tee->strips,
+			GINT_TO_POINTER( tee->first ) );
+		tee->first += 1;
+	}
+
+	if( tee->first != first )
+		g_cond_broadcast( tee->cond );
+}
+
+/* Compute the pixels for a strip. Call without the lock.
+ */
+static int
+vips_tee_strip_fill( VipsTeeStrip *strip, VipsRegion *ir )
+{
+	int y;
+
+	if( !(strip->data =
+		vips_tracked_malloc( strip->bpl * strip->rect.height )) ||
+		vips_region_prepare( ir, &strip->rect ) )
+		return( -1 );
+
+	for( y = 0; y < strip->rect.height; y++ )
+		memcpy( strip->data + y * strip->bpl,
+			VIPS_REGION_ADDR( ir, 0, strip->rect.top + y ),
+			strip->bpl );
+
+	return( 0 );
+}
+
+/* Get strip @no, computing it if necessary, and pin it. Call with the lock
+ * held. Set @strip to NULL if the branch should compute these pixels itself.
+ */
+static int
+vips_tee_strip_get( VipsTee *tee, VipsRegion *ir, int no,
+	VipsTeeStrip **strip )
+{
+	gint64 deadline = 0;
+	gint64 n_reads = -1;
+
+	for(;;) {
+		VipsTeeStrip *cached;
+		int result;
+
+		/* Already freed, or we're done.
+		 */
+		if( tee->closed ||
+			no < tee->first ) {
+			*strip = NULL;
+			return( 0 );
+		}
+
+		if( (cached = g_hash_table_lookup( tee->strips,
+			GINT_TO_POINTER( no ) )) ) {
+			if( cached->failed )
+				return( -1 );
+
+			if( cached->ready ) {
+				cached->users += 1;
+				*strip = cached;
+				return( 0 );
+			}
+
+			/* Another thread is computing it.
+			 */
+			g_cond_wait( tee->cond, tee->lock );
+			continue;
+		}
+
+		/* Too far ahead: wait for the other branches to catch up.
+		 */
+		if( no >= tee->first + tee->max_strips ) {
+			/* Only count time when nothing is being read.
+			 */
+			if( tee->n_reads != n_reads ) {
+				n_reads = tee->n_reads;
+				deadline = g_get_monotonic_time() +
+					VIPS_TEE_STALL;
+			}
+
+			if( !g_cond_wait_until( tee->cond, tee->lock,
+				deadline ) ) {
+				VIPS_DEBUG_MSG( "vips_tee_strip_get: "
+					"stalled on strip %d\n", no );
+				*strip = NULL;
+				return( 0 );
+			}
+
+			continue;
+		}
+
+		/* Compute it ourselves. Other threads wanting this strip will
+		 * wait for us.
+		 */
+		cached = vips_tee_strip_new( tee, no );
+		g_hash_table_insert( tee->strips, GINT_TO_POINTER( no ), cached );
+
+		g_mutex_unlock( tee->lock );
+		result = vips_tee_strip_fill( cached, ir );
+		g_mutex_lock( tee->lock );
+
+		if( result ) {
+			cached->failed = TRUE;
+			g_cond_broadcast( tee->cond );
+			return( -1 );
+		}
+
+		cached->ready = TRUE;
+		cached->users += 1;
+		g_cond_broadcast( tee->cond );
+		*strip = cached;
+
+		return( 0 );
+	}
+}
+
+static void *
+vips_tee_start( VipsImage *out, void *a, void *b )
+{
+	VipsTee *tee = (VipsTee *) a;
+
+	return( vips_region_new( tee->in ) );
+}
+
+static int
+vips_tee_gen( VipsRegion *or, void *seq, void *a, void *b, gboolean *stop )
+{
+	VipsRegion *ir = (VipsRegion *) seq;
+	VipsTee *tee = (VipsTee *) a;
+	int i = GPOINTER_TO_INT( b );
+	VipsRect *r = &or->valid;
+	int first_no = r->top / tee->strip_height;
+	int last_no = (VIPS_RECT_BOTTOM( r ) - 1) / tee->strip_height;
+	size_t ps = VIPS_IMAGE_SIZEOF_PEL( tee->in );
+
+	int no;
+
+	for( no = first_no; no <= last_no; no++ ) {
+		VipsRect area;
+		VipsTeeStrip *strip;
+		int result;
+		int y;
+
+		area.left = r->left;
+		area.top = no * tee->strip_height;
+		area.width = r->width;
+		area.height = tee->strip_height;
+		vips_rect_intersectrect( &area, r, &area );
+
+		g_mutex_lock( tee->lock );
+		result = vips_tee_strip_get( tee, ir, no, &strip );
+		g_mutex_unlock( tee->lock );
+		if( result )
+			return( -1 );
+
+		if( !strip ) {
+			if( vips_region_prepare( ir, &area ) ||
+				vips_region_copy( ir, or, &area,
+					area.left, area.top ) )
+				return( -1 );
+
+			continue;
+		}
+
+		for( y = 0; y < area.height; y++ ) {
+			VipsPel *p = strip->data +
+				(area.top + y - strip->rect.top) * strip->bpl +
+				area.left * ps;
+			VipsPel *q = VIPS_REGION_ADDR( or,
+				area.left, area.top + y );
+
+			memcpy( q, p, area.width * ps );
+		}
+
+		g_mutex_lock( tee->lock );
+		strip->users -= 1;
+		strip->seen[i] += (gint64) area.width * area.height;
+		tee->n_reads += 1;
+		vips_tee_trim( tee );
+		g_mutex_unlock( tee->lock );
+	}
+
+	return( 0 );
+}
+
+static void
+vips_tee_branch_close( VipsImage *image, VipsTee *tee )
+{
+	vips_tee_unref( tee );
+}
+
+/* A branch has stopped reading.
+ */
+static void
+vips_tee_branch_finish( VipsTee *tee, int i )
+{
+	g_mutex_lock( tee->lock );
+	tee->finished[i] = TRUE;
+	vips_tee_trim( tee );
+	g_cond_broadcast( tee->cond );
+	g_mutex_unlock( tee->lock );
+}
+
+typedef struct _VipsTeeThread {
+	VipsTee *tee;
+	int i;
+	VipsSinkTeeFn fn;
+	void *a;
+
+	GThread *thread;
+	int result;
+} VipsTeeThread;
+
+static void *
+vips_tee_thread( void *a )
+{
+	VipsTeeThread *thread = (VipsTeeThread *) a;
+	VipsTee *tee = thread->tee;
+
+	thread->result = thread->fn( tee->branch[thread->i],
+		thread->i, thread->a );
+	vips_tee_branch_finish( tee, thread->i );
+
+	return( NULL );
+}
+
+/**
+ * VipsSinkTeeFn:
+ * @image: the branch to consume
+ * @i: the index of this branch
+ * @a: client data
+ *
+ * Consume one branch of a vips_sink_tee(), for example by saving it.
+ *
+ * Returns: 0 on success, -1 on error.
+ */
+
+/**
+ * vips_sink_tee: (method)
+ * @in: image to evaluate
+ * @n: number of branches
+ * @fn: (scope call): call this for each branch
+ * @a: client data
+ *
+ * Evaluate @in once and hand the pixels to @n consumers.
+ *
+ * @fn is called @n times, each in a separate thread, with a branch image
+ * holding a copy of @in and the index of the branch. Branches read from a
+ * shared window of strips of @in, so each part of @in is only computed once,
+ * no matter how many branches read it.
+ *
+ * Memory use is bounded by the window size: if one branch gets too far
+ * ahead of the others, it waits for them to catch up. Consumers should read
+ * their branch top-to-bottom, as savers do. 
+ *
+ * If a branch waits for about a second and no other branch reads anything 
+ * in that time, it computes the pixels it needs itself rather than risk
+ * waiting forever. This can happen if a branch reads out of order, or if 
+ * one branch stops reading for a long time. Parts of @in are then computed
+ * more than once.
+ *
+ * For example, to write one image to several files:
+ *
+ * |[
+ * static int
+ * save_branch( VipsImage *image, int i, void *a )
+ * {
+ * 	const char **filenames = (const char **) a;
+ *
+ * 	return( vips_image_write_to_file( image, filenames[i], NULL ) );
+ * }
+ *
+ * const char *filenames[] = { "x.jpg", "x.webp", "x.png" };
+ *
+ * if( vips_sink_tee( in, 3, save_branch, filenames ) )
+ * 	return( -1 );
+ * ]|
+ *
+ * @fn must not keep a reference to the branch image after it returns.
+ *
+ * See also: vips_sink_disc(), vips_image_write_to_file().
+ *
+ * Returns: 0 on success, or -1 on error.
+ */
+int
+vips_sink_tee( VipsImage *in, int n, VipsSinkTeeFn fn, void *a )
+{
+	VipsTee *tee;
+	VipsTeeThread *threads;
+	int tile_width;
+	int tile_height;
+	int n_lines;
+	int result;
+	int i;
+
+	if( n < 1 ) {
+		vips_error( "vips_sink_tee", "%s", _( "bad number of branches" ) );
+		return( -1 );
+	}
+
+	tee = g_new0( VipsTee, 1 );
+	tee->in = in;
+	g_object_ref( in );
+	tee->n = n;
+	tee->branch = g_new0( VipsImage *, n );
+	tee->finished = g_new0( gboolean, n );
+	tee->lock = vips_g_mutex_new();
+	tee->cond = vips_g_cond_new();
+	tee->strips = g_hash_table_new_full( g_direct_hash, g_direct_equal,
+		NULL, (GDestroyNotify) vips_tee_strip_free );
+	tee->ref_count = 1;
+
+	/* Strips are tiles high and as wide as the image. Keep enough for
+	 * every worker to have two in flight.
+	 */
+	vips_get_tile_size( in, &tile_width, &tile_height, &n_lines );
+	tee->strip_height = VIPS_MAX( 16, tile_height );
+	tee->max_strips = VIPS_MAX( 4, 2 * vips_concurrency_get() );
+
+	VIPS_DEBUG_MSG( "vips_sink_tee: %d branches, "
+		"%d strips of %d lines\n",
+		n, tee->max_strips, tee->strip_height );
+
+	/* Stop at the first branch we can't make, we won't start any of 
+	 * them.
+	 */
+	result = 0;
+	for( i = 0; i < n; i++ ) {
+		VipsImage *branch = vips_image_new();
+
+		tee->branch[i] = branch;
+		tee->ref_count += 1;
+		g_signal_connect( branch, "close",
+			G_CALLBACK( vips_tee_branch_close ), tee );
+
+		if( vips_image_pipelinev( branch,
+			VIPS_DEMAND_STYLE_THINSTRIP, in, NULL ) ||
+			vips_image_generate( branch,
+				vips_tee_start, vips_tee_gen, vips_stop_one,
+				tee, GINT_TO_POINTER( i ) ) ) {
+			result = -1;
+			break;
+		}
+	}
+
+	threads = g_new0( VipsTeeThread, n );
+	if( !result ) {
+		for( i = 0; i < n; i++ ) {
+			threads[i].tee = tee;
+			threads[i].i = i;
+			threads[i].fn = fn;
+			threads[i].a = a;
+		}
+
+		/* Run the first branch ourselves.
+		 */
+		for( i = 1; i < n; i++ )
+			if( !(threads[i].thread = vips_g_thread_new(
+				"tee", vips_tee_thread, &threads[i] )) ) {
+				threads[i].result = -1;
+				vips_tee_branch_finish( tee, i );
+			}
+		vips_tee_thread( &threads[0] );
+
+		for( i = 1; i < n; i++ )
+			if( threads[i].thread )
+				(void) vips_g_thread_join( threads[i].thread );
+
+		for( i = 0; i < n; i++ )
+			if( threads[i].result )
+				result = -1;
+	}
+	g_free( threads );
+
+	g_mutex_lock( tee->lock );
+	tee->closed = TRUE;
+	g_hash_table_remove_all( tee->strips );
+	g_mutex_unlock( tee->lock );
+
+	for( i = 0; i < n; i++ )
+		VIPS_UNREF( tee->branch[i] );
+	vips_tee_unref( tee );
+
+	return( result );
+}
@@ -5,6 +5,10 @@
  *
  * 3/2/20
  * 	- add vips_pipe_read_limit_set()
+ * 18/10/20
+ * 	- add vips_source_prefetch(), vips_source_readahead_set()
+ * 	- keep prefetch state out of VipsSource, free the prefetch pool on 
+ * 	  shutdown
  */
 
 /*
@@ -117,6 +121,195 @@ vips_pipe_read_limit_set( gint64 limit )
 	vips__pipe_read_limit = limit;
 }
 
+/* Bytes to read ahead of sequential reads from file descriptors. 0 means 
+ * no readahead and no prefetch.
+ *
+ * This can be configured with vips_source_readahead_set().
+ */
+static gint64 vips__source_readahead = 0;
+
+/**
+ * vips_source_readahead_set:
+ * @readahead: bytes to read ahead
+ *
+ * Sources attached to seekable file descriptors can ask for parts of the 
+ * file to be fetched in the background before they are needed. This is 
+ * useful on slow or network filesystems, where each read can stall the 
+ * pipeline for a long time.
+ *
+ * Set a value greater than zero to enable prefetch. Sequential reads will 
+ * then read ahead by this many bytes, and loaders can use 
+ * vips_source_prefetch() to ask for ranges they will need soon.
+ * The default is 0, meaning no prefetch.
+ *
+ * You can also set this with the environment variable `VIPS_READAHEAD` or
+ * the command-line flag `--vips-readahead`.
+ *
+ * See also: vips_source_prefetch().
+ */
+void
+vips_source_readahead_set( gint64 readahead )
+{
+	vips__source_readahead = VIPS_MAX( 0, readahead );
+}
+
+/* A range of a source we've prefetched.
+ */
+typedef struct _VipsSourceRange {
+	gint64 start;
+	gint64 end;
+} VipsSourceRange;
+
+/* Don't track more than this many prefetched ranges per source. We drop the
+ * oldest. 
+ */
+#define MAX_PREFETCH_RANGES (256)
+
+/* The size of the chunks we read in prefetch threads.
+ */
+#define PREFETCH_CHUNK (256 * 1024)
+
+/* Prefetch state, see vips_source_prefetch(). This is attached to the 
+ * source as qdata the first time we prefetch, so sources which never 
+ * prefetch pay nothing.
+ */
+static GQuark vips__source_prefetch_quark = 0; 
+
+typedef struct _VipsSourcePrefetchState {
+	/* Ranges we've asked to be read ahead and which have not been read 
+	 * yet.
+	 */
+	GArray *ranges;
+
+	/* The end of the current sequential readahead, and the end of the 
+	 * last read.
+	 */
+	gint64 readahead_end;
+	gint64 last_read_end;
+
+	gint64 bytes_prefetched;
+	gint64 bytes_prefetch_used;
+} VipsSourcePrefetchState;
+
+static void
+vips_source_prefetch_state_free( VipsSourcePrefetchState *state )
+{
+	VIPS_FREEF( g_array_unref, state->ranges ); 
+	g_free( state );
+}
+
+static VipsSourcePrefetchState *
+vips_source_prefetch_state( VipsSource *source )
+{
+	return( (VipsSourcePrefetchState *) 
+		g_object_get_qdata( G_OBJECT( source ), 
+			vips__source_prefetch_quark ) ); 
+}
+
+/* Get the prefetch state, making it if necessary.
+ */
+static VipsSourcePrefetchState *
+vips_source_prefetch_state_new( VipsSource *source )
+{
+	VipsSourcePrefetchState *state;
+
+	if( !(state = vips_source_prefetch_state( source )) ) {
+		state = g_new0( VipsSourcePrefetchState, 1 );
+		state->ranges = 
+			g_array_new( FALSE, FALSE, sizeof( VipsSourceRange ) );
+		g_object_set_qdata_full( G_OBJECT( source ), 
+			vips__source_prefetch_quark, state, 
+			(GDestroyNotify) vips_source_prefetch_state_free ); 
+	}
+
+	return( state );
+}
+
+#ifdef HAVE_PREAD
+/* If the kernel can't read ahead for us, we read ranges with a pool of
+ * threads to pull them into the page cache. Each job has its own dup() of 
+ * the descriptor, so the source can be closed while jobs are still running.
+ */
+typedef struct _VipsSourcePrefetch {
+	int descriptor;
+	gint64 offset;
+	gint64 length;
+} VipsSourcePrefetch;
+
+static void
+vips_source_prefetch_work( VipsSourcePrefetch *prefetch, void *user_data )
+{
+	char *buf;
+
+	if( (buf = g_try_malloc( PREFETCH_CHUNK )) ) {
+		gint64 offset;
+
+		for( offset = prefetch->offset; 
+			offset < prefetch->offset + prefetch->length; ) {
+			size_t chunk = VIPS_MIN( PREFETCH_CHUNK,
+				prefetch->offset + prefetch->length - offset );
+			gint64 bytes_read;
+
+			do { 
+				bytes_read = pread( prefetch->descriptor, 
+					buf, chunk, offset );
+			} while( bytes_read < 0 && errno == EINTR );
+
+			if( bytes_read <= 0 ) 
+				break;
+
+			offset += bytes_read;
+		}
+
+		g_free( buf );
+	}
+
+	close( prefetch->descriptor );
+	g_free( prefetch );
+}
+
+/* Made on first use, freed by vips__source_shutdown().
+ */
+static GThreadPool *vips__source_prefetch_pool = NULL;
+
+static GThreadPool *
+vips_source_prefetch_pool( void )
+{
+	GThreadPool *pool;
+
+	g_mutex_lock( vips__global_lock );
+	if( !vips__source_prefetch_pool )
+		vips__source_prefetch_pool = g_thread_pool_new( 
+			(GFunc) vips_source_prefetch_work, NULL, 
+			vips_concurrency_get(), FALSE, NULL );
+	pool = vips__source_prefetch_pool;
+	g_mutex_unlock( vips__global_lock );
+
+	return( pool );
+}
+#endif /*HAVE_PREAD*/
+
+/* Called from vips_shutdown().
+ */
+void
+vips__source_shutdown( void )
+{
+#ifdef HAVE_PREAD
+	GThreadPool *pool;
+
+	g_mutex_lock( vips__global_lock );
+	pool = vips__source_prefetch_pool;
+	vips__source_prefetch_pool = NULL;
+	g_mutex_unlock( vips__global_lock );
+
+	/* Let any queued jobs run, they each hold a dup of a descriptor 
+	 * which they must close.
+	 */
+	if( pool )
+		g_thread_pool_free( pool, FALSE, TRUE );
+#endif /*HAVE_PREAD*/
+}
+
 G_DEFINE_TYPE( VipsSource, vips_source, VIPS_TYPE_CONNECTION );
 
 /* We can't test for seekability or length during _build, since the read and 
@@ -356,6 +549,10 @@ vips_source_class_init( VipsSourceClass *class )
 
 	object_class->build = vips_source_build;
 
+	if( !vips__source_prefetch_quark )
+		vips__source_prefetch_quark = 
+			g_quark_from_static_string( "vips-source-prefetch" );
+
 	class->read = vips_source_read_real;
 	class->seek = vips_source_seek_real;
 
@@ -653,6 +850,188 @@ vips_source_decode( VipsSource *source )
 	return( 0 );
 }
 
+/* Only seekable file descriptor sources can prefetch. Don't unminimise
+ * just for a hint.
+ */
+static gboolean
+vips_source_can_prefetch( VipsSource *source )
+{
+	return( vips__source_readahead > 0 &&
+		source->have_tested_seek &&
+		!source->is_pipe &&
+		!source->data &&
+		VIPS_CONNECTION( source )->descriptor != -1 );
+}
+
+/* Start a background read of a range and note it for the stats.
+ */
+static void
+vips_source_prefetch_range( VipsSource *source, gint64 offset, gint64 length )
+{
+	int descriptor = VIPS_CONNECTION( source )->descriptor;
+
+	VipsSourcePrefetchState *state;
+	VipsSourceRange range;
+
+	VIPS_DEBUG_MSG( "vips_source_prefetch_range: "
+		"%" G_GINT64_FORMAT " bytes at %" G_GINT64_FORMAT "\n",
+		length, offset );
+
+	if( !vips__file_willneed( descriptor, offset, length ) ) {
+#ifdef HAVE_PREAD
+		VipsSourcePrefetch *prefetch;
+
+		prefetch = g_new( VipsSourcePrefetch, 1 );
+		if( (prefetch->descriptor = dup( descriptor )) == -1 ) {
+			g_free( prefetch );
+			return;
+		}
+		prefetch->offset = offset;
+		prefetch->length = length;
+		g_thread_pool_push( vips_source_prefetch_pool(), 
+			prefetch, NULL );
+#else /*!HAVE_PREAD*/
+		/* No way to read ahead.
+		 */
+		return;
+#endif /*HAVE_PREAD*/
+	}
+
+	state = vips_source_prefetch_state_new( source );
+	if( state->ranges->len >= MAX_PREFETCH_RANGES )
+		g_array_remove_index( state->ranges, 0 );
+	range.start = offset;
+	range.end = offset + length;
+	g_array_append_val( state->ranges, range );
+	state->bytes_prefetched += length;
+}
+
+/* Some bytes have been read. Count any which came from a prefetched range,
+ * and trim them from it.
+ *
+ * A read from the middle of a range leaves the range as it is, so the stats 
+ * are approximate.
+ */
+static void
+vips_source_prefetch_used( VipsSource *source, gint64 start, gint64 length )
+{
+	VipsSourcePrefetchState *state = vips_source_prefetch_state( source );
+	gint64 end = start + length;
+
+	guint i;
+
+	if( !state )
+		return;
+
+	for( i = 0; i < state->ranges->len; ) {
+		VipsSourceRange *range = &g_array_index( 
+			state->ranges, VipsSourceRange, i );
+		gint64 left = VIPS_MAX( start, range->start );
+		gint64 right = VIPS_MIN( end, range->end );
+
+		if( right > left ) {
+			state->bytes_prefetch_used += right - left;
+
+			if( left == range->start )
+				range->start = right;
+			else if( right == range->end )
+				range->end = left;
+		}
+
+		if( range->end <= range->start )
+			g_array_remove_index( state->ranges, i );
+		else
+			i += 1;
+	}
+}
+
+/* If this read carries on from the previous one, keep the readahead
+ * window ahead of it. We top the window up when it's half used so we issue 
+ * a few large requests rather than many small ones.
+ */
+static void
+vips_source_readahead( VipsSource *source, gint64 start, gint64 length )
+{
+	VipsSourcePrefetchState *state = 
+		vips_source_prefetch_state_new( source );
+	gint64 end = start + length;
+
+	if( start == state->last_read_end &&
+		end + vips__source_readahead / 2 > state->readahead_end ) {
+		gint64 from = VIPS_MAX( end, state->readahead_end );
+		gint64 to = end + vips__source_readahead;
+
+		if( source->length != -1 )
+			to = VIPS_MIN( to, source->length );
+
+		if( to > from ) {
+			vips_source_prefetch_range( source, from, to - from );
+			state->readahead_end = to;
+		}
+	}
+
+	state->last_read_end = end;
+}
+
+/**
+ * vips_source_prefetch:
+ * @source: source to operate on
+ * @offset: start of range
+ * @length: number of bytes in range
+ *
+ * Hint that @length bytes from @offset will be read soon. Loaders which 
+ * know their access pattern, for example a row of tiles in a TIFF, can call
+ * this to fetch the whole batch in the background while they decode the
+ * previous one.
+ *
+ * Where possible the kernel is asked to read ahead, otherwise a pool of
+ * threads reads the range into the page cache.
+ *
+ * This does nothing unless prefetch has been enabled with 
+ * vips_source_readahead_set(), or if @source is not attached to a seekable
+ * file descriptor.
+ *
+ * See also: vips_source_readahead_set(), vips_source_get_prefetch_stats().
+ */
+void
+vips_source_prefetch( VipsSource *source, gint64 offset, gint64 length )
+{
+	if( offset < 0 ||
+		!vips_source_can_prefetch( source ) )
+		return;
+
+	if( source->length != -1 )
+		length = VIPS_MIN( length, source->length - offset );
+	if( length <= 0 )
+		return;
+
+	vips_source_prefetch_range( source, offset, length );
+}
+
+/**
+ * vips_source_get_prefetch_stats:
+ * @source: source to operate on
+ * @prefetched: (out) (allow-none): bytes prefetched
+ * @used: (out) (allow-none): prefetched bytes that were later read
+ *
+ * Get the number of bytes that have been prefetched from @source, and 
+ * roughly how many of them were read afterwards. A low ratio means 
+ * prefetch is wasting IO.
+ *
+ * See also: vips_source_prefetch().
+ */
+void
+vips_source_get_prefetch_stats( VipsSource *source, 
+	gint64 *prefetched, gint64 *used )
+{
+	VipsSourcePrefetchState *state = vips_source_prefetch_state( source );
+
+	if( prefetched )
+		*prefetched = state ? state->bytes_prefetched : 0;
+	if( used )
+		*used = state ? state->bytes_prefetch_used : 0;
+}
+
 /**
  * vips_source_read:
  * @source: source to operate on
@@ -747,6 +1126,14 @@ vips_source_read( VipsSource *source, void *buffer, size_t length )
 				g_byte_array_append( source->header_bytes, 
 					buffer, bytes_read );
 
+			if( vips_source_can_prefetch( source ) &&
+				bytes_read > 0 ) {
+				vips_source_prefetch_used( source, 
+					source->read_position, bytes_read );
+				vips_source_readahead( source, 
+					source->read_position, bytes_read );
+			}
+
 			source->read_position += bytes_read;
 			total_read += bytes_read;
 		}
@@ -2,6 +2,9 @@
  * socket, node.js stream, etc.
  * 
  * J.Cupitt, 19/6/14
+ * 18/10/20
+ * 	- add background writes, vips_target_get_stats()
+ * 	- add vips_target_end(), so background write errors reach the saver
  */
 
 /*
@@ -51,6 +54,9 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif /*HAVE_SYS_UIO_H*/
 
 #include <vips/vips.h>
 #include <vips/internal.h>
@@ -78,8 +84,294 @@
 #define MODE_READWRITE BINARYIZE (O_RDWR)
 #define MODE_WRITE BINARYIZE (O_WRONLY | O_CREAT | O_TRUNC)
 
+/* Background writes gather output into chunks of about this size.
+ */
+#define VIPS_TARGET_CHUNK_SIZE (256 * 1024)
+
+/* Let up to this many bytes queue for the background writer before we 
+ * block.
+ */
+#define VIPS_TARGET_HIGH_WATER (16 * 1024 * 1024)
+
+/* The writer thread writes at most this many chunks with one writev().
+ */
+#define VIPS_TARGET_MAX_BATCH (16)
+
+/* Keep this many spare chunks for reuse.
+ */
+#define VIPS_TARGET_MAX_SPARE (4)
+
+/* Whether descriptor targets write from a background thread by default. 
+ *
+ * This can be configured with vips_target_background_set().
+ */
+static gboolean vips__target_background = FALSE;
+
+/**
+ * vips_target_background_set:
+ * @background: write from a background thread
+ *
+ * Set whether targets attached to files and descriptors write from a 
+ * background thread by default. Output is gathered into large chunks and
+ * queued for a writer thread, so encoding and IO can overlap. This is 
+ * useful when writing to slow pipes or sockets.
+ *
+ * Writes block when more than #VipsTarget:high-water bytes are waiting.
+ * Set #VipsTarget:background on a target to override this default.
+ * The default is %FALSE.
+ *
+ * You can also set this with the environment variable 
+ * `VIPS_BACKGROUND_WRITE` or the command-line flag 
+ * `--vips-background-write`.
+ *
+ * See also: vips_target_get_stats().
+ */
+void
+vips_target_background_set( gboolean background )
+{
+	vips__target_background = background;
+}
+
+/* Background write state and write stats. This is attached to each target
+ * as qdata, so the size of VipsTarget does not change.
+ */
+static GQuark vips__target_private_quark = 0; 
+
+typedef struct _VipsTargetPrivate {
+	/* Write from a background thread, and the number of bytes we let
+	 * queue up before writes block. These back the "background" and 
+	 * "high-water" properties. 
+	 */
+	gboolean background;
+	gboolean background_set;
+	guint64 high_water;
+
+	/* Chunks waiting for the writer thread, spare chunks for reuse, the 
+	 * chunk we are filling, and the errno of any failed write.
+	 */
+	GThread *writer;
+	GMutex *lock;
+	GCond *cond;
+	GQueue *queue;
+	GQueue *spare;
+	GByteArray *chunk;
+	guint64 queued_bytes;
+	gboolean writer_stop;
+	int writer_errno;
+
+	/* Write stats, see vips_target_get_stats().
+	 */
+	gint64 bytes_written;
+	gint64 n_writes;
+	gint64 write_usec;
+	gint64 max_write_usec;
+	gint64 stall_usec;
+} VipsTargetPrivate;
+
+static VipsTargetPrivate *
+vips_target_private( VipsTarget *target )
+{
+	return( (VipsTargetPrivate *) 
+		g_object_get_qdata( G_OBJECT( target ), 
+			vips__target_private_quark ) ); 
+}
+
+/* The writer must have stopped.
+ */
+static void
+vips_target_private_free( VipsTargetPrivate *priv )
+{
+	g_assert( !priv->writer );
+
+	if( priv->queue ) {
+		g_queue_free_full( priv->queue, 
+			(GDestroyNotify) g_byte_array_unref );
+		priv->queue = NULL;
+	}
+	if( priv->spare ) {
+		g_queue_free_full( priv->spare, 
+			(GDestroyNotify) g_byte_array_unref );
+		priv->spare = NULL;
+	}
+	VIPS_FREEF( g_byte_array_unref, priv->chunk ); 
+	VIPS_FREEF( vips_g_mutex_free, priv->lock ); 
+	VIPS_FREEF( vips_g_cond_free, priv->cond ); 
+	g_free( priv );
+}
+
 G_DEFINE_TYPE( VipsTarget, vips_target, VIPS_TYPE_CONNECTION );
 
+/* Called with the lock held.
+ */
+static void
+vips_target_stats_add( VipsTarget *target, gint64 bytes, gint64 usec )
+{
+	VipsTargetPrivate *priv = vips_target_private( target );
+
+	priv->bytes_written += bytes;
+	priv->n_writes += 1;
+	priv->write_usec += usec;
+	priv->max_write_usec = VIPS_MAX( priv->max_write_usec, usec );
+}
+
+/* Write a set of chunks to the descriptor. Return 0, or an errno.
+ */
+static int
+vips_target_writer_write( VipsTarget *target, GByteArray **batch, int n )
+{
+	int descriptor = VIPS_CONNECTION( target )->descriptor;
+
+#if defined(HAVE_WRITEV) && defined(HAVE_SYS_UIO_H)
+	struct iovec iov[VIPS_TARGET_MAX_BATCH];
+	int first;
+	int i;
+
+	for( i = 0; i < n; i++ ) {
+		iov[i].iov_base = batch[i]->data;
+		iov[i].iov_len = batch[i]->len;
+	}
+
+	first = 0;
+	while( first < n ) {
+		gint64 bytes_written;
+
+		do {
+			bytes_written = 
+				writev( descriptor, iov + first, n - first );
+		} while( bytes_written < 0 && errno == EINTR );
+
+		/* n == 0 isn't strictly an error, but we treat it as 
+		 * one to make sure we don't get stuck in this loop.
+		 */
+		if( bytes_written <= 0 ) 
+			return( bytes_written < 0 ? errno : EIO );
+
+		/* Skip the chunks we wrote, and trim any partial chunk.
+		 */
+		while( first < n &&
+			bytes_written >= iov[first].iov_len ) {
+			bytes_written -= iov[first].iov_len;
+			first += 1;
+		}
+		if( first < n ) {
+			iov[first].iov_base = 
+				(char *) iov[first].iov_base + bytes_written;
+			iov[first].iov_len -= bytes_written;
+		}
+	}
+#else /*!HAVE_WRITEV*/
+	int i;
+
+	for( i = 0; i < n; i++ ) {
+		unsigned char *data = batch[i]->data;
+		size_t length = batch[i]->len;
+
+		while( length > 0 ) {
+			gint64 bytes_written;
+
+			do {
+				bytes_written = 
+					write( descriptor, data, length );
+			} while( bytes_written < 0 && errno == EINTR );
+
+			if( bytes_written <= 0 ) 
+				return( bytes_written < 0 ? errno : EIO );
+
+			length -= bytes_written;
+			data += bytes_written;
+		}
+	}
+#endif /*HAVE_WRITEV*/
+
+	return( 0 );
+}
+
+/* The background writer. Take batches of chunks off the queue and write 
+ * them. We only exit when we've been asked to stop and the queue is empty.
+ */
+static void *
+vips_target_writer( void *a )
+{
+	VipsTarget *target = (VipsTarget *) a;
+	VipsTargetPrivate *priv = vips_target_private( target );
+
+	VIPS_DEBUG_MSG( "vips_target_writer: starting\n" );
+
+	for(;;) {
+		GByteArray *batch[VIPS_TARGET_MAX_BATCH];
+		int n;
+		int error;
+		gint64 bytes;
+		gint64 start;
+		gint64 usec;
+		int i;
+
+		g_mutex_lock( priv->lock );
+		while( g_queue_is_empty( priv->queue ) &&
+			!priv->writer_stop )
+			g_cond_wait( priv->cond, priv->lock );
+		if( g_queue_is_empty( priv->queue ) ) {
+			g_mutex_unlock( priv->lock );
+			break;
+		}
+
+		bytes = 0;
+		for( n = 0; n < VIPS_TARGET_MAX_BATCH && 
+			(batch[n] = g_queue_pop_head( priv->queue )); n++ ) 
+			bytes += batch[n]->len;
+		error = priv->writer_errno;
+		g_mutex_unlock( priv->lock );
+
+		/* After an error, just drop output.
+		 */
+		start = g_get_monotonic_time();
+		if( !error )
+			error = vips_target_writer_write( target, batch, n );
+		usec = g_get_monotonic_time() - start;
+
+		g_mutex_lock( priv->lock );
+		if( !priv->writer_errno ) {
+			priv->writer_errno = error;
+			vips_target_stats_add( target, bytes, usec );
+		}
+		for( i = 0; i < n; i++ ) {
+			priv->queued_bytes -= batch[i]->len;
+
+			if( g_queue_get_length( priv->spare ) < 
+				VIPS_TARGET_MAX_SPARE ) {
+				g_byte_array_set_size( batch[i], 0 );
+				g_queue_push_tail( priv->spare, batch[i] );
+			}
+			else
+				g_byte_array_unref( batch[i] );
+		}
+		g_cond_broadcast( priv->cond );
+		g_mutex_unlock( priv->lock );
+	}
+
+	VIPS_DEBUG_MSG( "vips_target_writer: stopping\n" );
+
+	return( NULL );
+}
+
+/* Ask the writer to finish the queue and exit, and wait for it.
+ */
+static void
+vips_target_writer_stop( VipsTarget *target )
+{
+	VipsTargetPrivate *priv = vips_target_private( target );
+
+	if( priv->writer ) {
+		g_mutex_lock( priv->lock );
+		priv->writer_stop = TRUE;
+		g_cond_broadcast( priv->cond );
+		g_mutex_unlock( priv->lock );
+
+		(void) vips_g_thread_join( priv->writer );
+		priv->writer = NULL;
+	}
+}
+
 static void
 vips_target_finalize( GObject *gobject )
 {
@@ -87,6 +379,10 @@ vips_target_finalize( GObject *gobject )
 
 	VIPS_DEBUG_MSG( "vips_target_finalize:\n" );
 
+	/* The writer uses the descriptor, so it must stop before our
+	 * parent closes it.
+	 */
+	vips_target_writer_stop( target );
 	VIPS_FREEF( g_byte_array_unref, target->memory_buffer ); 
 	if( target->blob ) { 
 		vips_area_unref( VIPS_AREA( target->blob ) ); 
@@ -96,11 +392,15 @@ vips_target_finalize( GObject *gobject )
 	G_OBJECT_CLASS( vips_target_parent_class )->finalize( gobject );
 }
 
+static gint64 vips_target_write_real( VipsTarget *target, 
+	const void *data, size_t length );
+
 static int
 vips_target_build( VipsObject *object )
 {
 	VipsConnection *connection = VIPS_CONNECTION( object );
 	VipsTarget *target = VIPS_TARGET( object );
+	VipsTargetPrivate *priv = vips_target_private( target );
 
 	VIPS_DEBUG_MSG( "vips_target_build: %p\n", connection );
 
@@ -140,6 +440,26 @@ vips_target_build( VipsObject *object )
 		target->memory_buffer = g_byte_array_new();
 	}
 
+	if( !priv->background_set )
+		priv->background = vips__target_background;
+
+	/* We can only write from another thread to a plain descriptor, 
+	 * subclasses might need to write from the calling thread.
+	 */
+	if( priv->background &&
+		!target->memory_buffer &&
+		connection->descriptor != -1 &&
+		VIPS_TARGET_GET_CLASS( target )->write == 
+			vips_target_write_real ) {
+		priv->lock = vips_g_mutex_new();
+		priv->cond = vips_g_cond_new();
+		priv->queue = g_queue_new();
+		priv->spare = g_queue_new();
+		if( !(priv->writer = vips_g_thread_new( "target", 
+			vips_target_writer, target )) )
+			return( -1 );
+	}
+
 	return( 0 );
 }
 
@@ -159,6 +479,70 @@ vips_target_finish_real( VipsTarget *target )
 	VIPS_DEBUG_MSG( "vips_target_finish_real:\n" );
 }
 
+/* "background" and "high-water" are plain GObject properties backed by the
+ * private struct, so the layout of VipsTarget does not change. Everything 
+ * else goes to the vips argument system.
+ */
+enum {
+	PROP_BACKGROUND = 1000,
+	PROP_HIGH_WATER
+};
+
+static void
+vips_target_set_property( GObject *gobject,
+	guint property_id, const GValue *value, GParamSpec *pspec )
+{
+	VipsTarget *target = VIPS_TARGET( gobject );
+	VipsTargetPrivate *priv = vips_target_private( target );
+
+	if( pspec->owner_type != VIPS_TYPE_TARGET ) {
+		vips_object_set_property( gobject, property_id, value, pspec );
+		return;
+	}
+
+	switch( property_id ) {
+	case PROP_BACKGROUND:
+		priv->background = g_value_get_boolean( value );
+		priv->background_set = TRUE;
+		break;
+
+	case PROP_HIGH_WATER:
+		priv->high_water = g_value_get_uint64( value );
+		break;
+
+	default:
+		vips_object_set_property( gobject, property_id, value, pspec );
+		break;
+	}
+}
+
+static void
+vips_target_get_property( GObject *gobject,
+	guint property_id, GValue *value, GParamSpec *pspec )
+{
+	VipsTarget *target = VIPS_TARGET( gobject );
+	VipsTargetPrivate *priv = vips_target_private( target );
+
+	if( pspec->owner_type != VIPS_TYPE_TARGET ) {
+		vips_object_get_property( gobject, property_id, value, pspec );
+		return;
+	}
+
+	switch( property_id ) {
+	case PROP_BACKGROUND:
+		g_value_set_boolean( value, priv->background );
+		break;
+
+	case PROP_HIGH_WATER:
+		g_value_set_uint64( value, priv->high_water );
+		break;
+
+	default:
+		vips_object_get_property( gobject, property_id, value, pspec );
+		break;
+	}
+}
+
 static void
 vips_target_class_init( VipsTargetClass *class )
 {
@@ -166,14 +550,18 @@ vips_target_class_init( VipsTargetClass *class )
 	VipsObjectClass *object_class = VIPS_OBJECT_CLASS( class );
 
 	gobject_class->finalize = vips_target_finalize;
-	gobject_class->set_property = vips_object_set_property;
-	gobject_class->get_property = vips_object_get_property;
+	gobject_class->set_property = vips_target_set_property;
+	gobject_class->get_property = vips_target_get_property;
 
 	object_class->nickname = "target";
 	object_class->description = _( "Target" );
 
 	object_class->build = vips_target_build;
 
+	if( !vips__target_private_quark )
+		vips__target_private_quark = 
+			g_quark_from_static_string( "vips-target-private" );
+
 	class->write = vips_target_write_real;
 	class->finish = vips_target_finish_real;
 
@@ -194,13 +582,35 @@ vips_target_class_init( VipsTargetClass *class )
 		G_STRUCT_OFFSET( VipsTarget, blob ),
 		VIPS_TYPE_BLOB );
 
+	g_object_class_install_property( gobject_class, PROP_BACKGROUND, 
+		g_param_spec_boolean( "background", 
+			_( "Background" ), 
+			_( "Write from a background thread" ),
+			FALSE,
+			G_PARAM_READWRITE ) );
+
+	g_object_class_install_property( gobject_class, PROP_HIGH_WATER, 
+		g_param_spec_uint64( "high-water", 
+			_( "High water" ), 
+			_( "Block writes when this many bytes are queued" ),
+			0, G_MAXUINT64, VIPS_TARGET_HIGH_WATER,
+			G_PARAM_READWRITE ) );
+
 }
 
 static void
 vips_target_init( VipsTarget *target )
 {
 	target->blob = vips_blob_new( NULL, NULL, 0 );
+	VipsTargetPrivate *priv;
+
 	target->write_point = 0;
+
+	priv = g_new0( VipsTargetPrivate, 1 );
+	priv->high_water = VIPS_TARGET_HIGH_WATER;
+	g_object_set_qdata_full( G_OBJECT( target ), 
+		vips__target_private_quark, priv,
+		(GDestroyNotify) vips_target_private_free ); 
 }
 
 /**
@@ -291,11 +701,125 @@ vips_target_new_to_memory( void )
 	return( target ); 
 }
 
+static int
+vips_target_writer_error( VipsTarget *target )
+{
+	VipsTargetPrivate *priv = vips_target_private( target );
+
+	int error;
+
+	g_mutex_lock( priv->lock );
+	error = priv->writer_errno;
+	g_mutex_unlock( priv->lock );
+
+	if( error ) {
+		vips_error_system( error, 
+			vips_connection_nick( VIPS_CONNECTION( target ) ),
+			"%s", _( "write error" ) ); 
+		return( -1 ); 
+	}
+
+	return( 0 );
+}
+
+/* Send the current chunk to the writer thread. If too much is queued
+ * already, wait for the writer to catch up. 
+ */
+static int
+vips_target_queue_chunk( VipsTarget *target )
+{
+	VipsTargetPrivate *priv = vips_target_private( target );
+
+	GByteArray *chunk;
+
+	if( !priv->chunk ||
+		priv->chunk->len == 0 )
+		return( 0 );
+
+	chunk = priv->chunk;
+	priv->chunk = NULL;
+
+	g_mutex_lock( priv->lock );
+
+	/* A chunk larger than high_water can still go if the queue is empty.
+	 */
+	if( priv->queued_bytes > 0 &&
+		priv->queued_bytes + chunk->len > priv->high_water ) {
+		gint64 start = g_get_monotonic_time();
+
+		while( priv->queued_bytes > 0 &&
+			priv->queued_bytes + chunk->len > 
+				priv->high_water &&
+			!priv->writer_errno )
+			g_cond_wait( priv->cond, priv->lock );
+
+		priv->stall_usec += g_get_monotonic_time() - start;
+	}
+
+	if( priv->writer_errno ) 
+		g_byte_array_unref( chunk );
+	else {
+		g_queue_push_tail( priv->queue, chunk );
+		priv->queued_bytes += chunk->len;
+		g_cond_broadcast( priv->cond );
+	}
+
+	g_mutex_unlock( priv->lock );
+
+	return( vips_target_writer_error( target ) );
+}
+
+/* Add bytes to the current chunk, queueing it when it's full.
+ */
+static int
+vips_target_queue( VipsTarget *target, const void *data, size_t length )
+{
+	VipsTargetPrivate *priv = vips_target_private( target );
+
+	if( !priv->chunk ) {
+		g_mutex_lock( priv->lock );
+		priv->chunk = g_queue_pop_head( priv->spare );
+		g_mutex_unlock( priv->lock );
+
+		if( !priv->chunk )
+			priv->chunk = g_byte_array_sized_new( 
+				VIPS_TARGET_CHUNK_SIZE );
+	}
+
+	g_byte_array_append( priv->chunk, data, length );
+
+	if( priv->chunk->len >= VIPS_TARGET_CHUNK_SIZE &&
+		vips_target_queue_chunk( target ) )
+		return( -1 );
+
+	return( 0 );
+}
+
+/* Queue any partial chunk, then wait for the writer to empty the queue.
+ */
+static int
+vips_target_drain( VipsTarget *target )
+{
+	VipsTargetPrivate *priv = vips_target_private( target );
+
+	if( vips_target_queue_chunk( target ) )
+		return( -1 );
+
+	g_mutex_lock( priv->lock );
+	while( priv->queued_bytes > 0 &&
+		!priv->writer_errno )
+		g_cond_wait( priv->cond, priv->lock );
+	g_mutex_unlock( priv->lock );
+
+	return( vips_target_writer_error( target ) );
+}
+
 static int
 vips_target_write_unbuffered( VipsTarget *target, 
 	const void *data, size_t length )
 {
 	VipsTargetClass *class = VIPS_TARGET_GET_CLASS( target );
+	VipsTargetPrivate *priv = vips_target_private( target );
 
 	VIPS_DEBUG_MSG( "vips_target_write_unbuffered:\n" );
 
@@ -304,8 +828,14 @@ vips_target_write_unbuffered( VipsTarget *target,
 
 	if( target->memory_buffer ) 
 		g_byte_array_append( target->memory_buffer, data, length );
+	else if( priv->writer ) {
+		if( vips_target_queue( target, data, length ) )
+			return( -1 );
+	}
 	else 
 		while( length > 0 ) { 
+			gint64 start = g_get_monotonic_time();
+
 			gint64 bytes_written;
 
 			bytes_written = class->write( target, data, length );
@@ -321,6 +851,9 @@ vips_target_write_unbuffered( VipsTarget *target,
 				return( -1 ); 
 			}
 
+			vips_target_stats_add( target, bytes_written, 
+				g_get_monotonic_time() - start );
+
 			length -= bytes_written;
 			data += bytes_written;
 		}
@@ -381,27 +914,50 @@ vips_target_write( VipsTarget *target, const void *buffer, size_t length )
 }
 
 /**
- * vips_target_finish:
+ * vips_target_end:
  * @target: target to operate on
- * @buffer: bytes to write
- * @length: length of @buffer in bytes
  *
  * Call this at the end of write to make the target do any cleaning up. You
  * can call it many times. 
  *
- * After a target has been finished, further writes will do nothing.
+ * After a target has been ended, further writes will do nothing.
+ *
+ * Unlike vips_target_finish(), this reports errors. For background 
+ * targets, this is where an error from the final writes turns up, so 
+ * savers should use this on success.
+ *
+ * Returns: 0 on success, -1 on error.
  */
-void
-vips_target_finish( VipsTarget *target )
+int
+vips_target_end( VipsTarget *target )
 {
 	VipsTargetClass *class = VIPS_TARGET_GET_CLASS( target );
+	VipsTargetPrivate *priv = vips_target_private( target );
 
-	VIPS_DEBUG_MSG( "vips_target_finish:\n" );
+	int result;
+
+	VIPS_DEBUG_MSG( "vips_target_end:\n" );
 
 	if( target->finished )
-		return;
+		return( 0 );
 
-	(void) vips_target_flush( target );
+	result = vips_target_flush( target );
+
+	/* Wait for any background writes to complete. We must stop the
+	 * writer even if the flush failed.
+	 */
+	if( priv->writer ) {
+		if( !result &&
+			vips_target_drain( target ) )
+			result = -1;
+		vips_target_writer_stop( target );
+
+		/* The writer may have failed after the last drain.
+		 */
+		if( !result &&
+			vips_target_writer_error( target ) )
+			result = -1;
+	}
 
 	/* Move the target buffer into the blob so it can be read out.
 	 */
@@ -419,6 +975,67 @@ vips_target_finish( VipsTarget *target )
 		class->finish( target );
 
 	target->finished = TRUE;
+
+	return( result );
+}
+
+/**
+ * vips_target_finish:
+ * @target: target to operate on
+ *
+ * As vips_target_end(), but ignore any error. Handy for cleaning up after 
+ * a failed save.
+ *
+ * See also: vips_target_end().
+ */
+void
+vips_target_finish( VipsTarget *target )
+{
+	(void) vips_target_end( target );
+}
+
+/**
+ * vips_target_get_stats:
+ * @target: target to operate on
+ * @bytes_written: (out) (allow-none): bytes written so far
+ * @n_writes: (out) (allow-none): number of write calls
+ * @write_time: (out) (allow-none): total seconds spent in write calls
+ * @max_write_time: (out) (allow-none): longest write call, in seconds
+ * @stall_time: (out) (allow-none): seconds spent waiting for the 
+ * background writer
+ *
+ * Get write stats for @target. For background targets, write times are
+ * for the writer thread and @stall_time is how long the saver spent 
+ * blocked because the queue was full. A large @stall_time means output is
+ * the bottleneck.
+ *
+ * Memory targets do no writes and report zero.
+ *
+ * See also: vips_target_background_set().
+ */
+void
+vips_target_get_stats( VipsTarget *target, 
+	gint64 *bytes_written, gint64 *n_writes,
+	double *write_time, double *max_write_time, double *stall_time )
+{
+	VipsTargetPrivate *priv = vips_target_private( target );
+
+	if( priv->lock )
+		g_mutex_lock( priv->lock );
+
+	if( bytes_written )
+		*bytes_written = priv->bytes_written;
+	if( n_writes )
+		*n_writes = priv->n_writes;
+	if( write_time )
+		*write_time = priv->write_usec / 1000000.0;
+	if( max_write_time )
+		*max_write_time = priv->max_write_usec / 1000000.0;
+	if( stall_time )
+		*stall_time = priv->stall_usec / 1000000.0;
+
+	if( priv->lock )
+		g_mutex_unlock( priv->lock );
 }
 
 /**
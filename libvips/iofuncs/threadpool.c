@@ -23,6 +23,8 @@
  * 	- don't depend on image width when setting n_lines
  * 27/2/19 jtorresfabra
  * 	- free threadpool earlier 
+ * 18/10/20
+ * 	- add vips_tile_adaptive_set() and vips_tile_autotune_set()
  */
 
 /*
@@ -105,6 +107,12 @@ int vips__tile_height = VIPS__TILE_HEIGHT;
 int vips__fatstrip_height = VIPS__FATSTRIP_HEIGHT;
 int vips__thinstrip_height = VIPS__THINSTRIP_HEIGHT;
 
+/* Size small tiles from the pixel size and the L2 cache, and tune tile
+ * widths while sinks run. See vips_tile_adaptive_set().
+ */
+static gboolean vips__tile_adaptive = FALSE;
+gboolean vips__tile_autotune = FALSE;
+
 /* Default n threads ... 0 means get from environment.
  */
 int vips__concurrency = 0;
@@ -1026,6 +1034,121 @@ vips__threadpool_init( void )
 		vips__stall = TRUE;
 }
 
+/**
+ * vips_tile_adaptive_set:
+ * @adaptive: pick tile sizes from pixel size and cache size
+ *
+ * Set whether vips_get_tile_size() adapts the size of small tiles to the 
+ * image. Tiles for images with large pixels are made smaller so they stay 
+ * inside the L2 cache, and tiles for images with small pixels are made 
+ * wider. Strip geometries are not changed. The default is %FALSE.
+ *
+ * You can also set this with the environment variable `VIPS_TILE_ADAPTIVE` 
+ * or the command-line flag `--vips-tile-adaptive`.
+ *
+ * See also: vips_tile_autotune_set(), vips_get_tile_size().
+ */
+void
+vips_tile_adaptive_set( gboolean adaptive )
+{
+	vips__tile_adaptive = adaptive;
+}
+
+/**
+ * vips_tile_autotune_set:
+ * @autotune: time tile widths while sinks run
+ *
+ * Set whether sinks tune the width of small tiles as they run. The first 
+ * few rows of tiles are computed with a range of widths, and the sink keeps
+ * the width that gave the highest throughput. The default is %FALSE.
+ *
+ * You can also set this with the environment variable `VIPS_TILE_AUTOTUNE` 
+ * or the command-line flag `--vips-tile-autotune`.
+ *
+ * Tile geometry, before and after tuning, is recorded in the profile.
+ *
+ * See also: vips_tile_adaptive_set(), vips_profile_set().
+ */
+void
+vips_tile_autotune_set( gboolean autotune )
+{
+	vips__tile_autotune = autotune;
+}
+
+/* Find the size of the L2 cache in bytes. Default to 256kb if we can't tell.
+ */
+static void *
+vips_get_l2_cache_size_once( void *client )
+{
+	size_t *size = (size_t *) client;
+
+	char *contents;
+
+	*size = 0;
+
+#ifdef _SC_LEVEL2_CACHE_SIZE
+	if( sysconf( _SC_LEVEL2_CACHE_SIZE ) > 0 )
+		*size = sysconf( _SC_LEVEL2_CACHE_SIZE );
+#endif /*_SC_LEVEL2_CACHE_SIZE*/
+
+	if( !*size &&
+		g_file_get_contents( 
+			"/sys/devices/system/cpu/cpu0/cache/index2/size", 
+			&contents, NULL, NULL ) ) {
+		*size = vips__parse_size( contents );
+		g_free( contents );
+	}
+
+	if( !*size )
+		*size = 256 * 1024;
+
+	VIPS_DEBUG_MSG( "vips_get_l2_cache_size: %zd bytes\n", *size ); 
+
+	return( NULL );
+}
+
+static size_t
+vips_get_l2_cache_size( void )
+{
+	static GOnce once = G_ONCE_INIT;
+	static size_t size = 0;
+
+	VIPS_ONCE( &once, vips_get_l2_cache_size_once, &size );
+
+	return( size );
+}
+
+/* Adapt a small tile to the pixel size. We aim for about a quarter of the
+ * L2 cache per tile, leaving room for the input and output of several 
+ * operations.
+ *
+ * Tile heights must stay divisors of vips__tile_height, so that n_lines is
+ * the same everywhere in the pipeline. We only halve the height, and only
+ * widen.
+ */
+static void
+vips_tile_size_adapt( VipsImage *im, int *tile_width, int *tile_height )
+{
+	size_t target = vips_get_l2_cache_size() / 4;
+	size_t bpp = VIPS_IMAGE_SIZEOF_PEL( im );
+	int width = *tile_width;
+	int height = *tile_height;
+
+	while( (size_t) width * height * bpp > target &&
+		height % 2 == 0 &&
+		height / 2 >= 16 ) {
+		width = VIPS_MAX( 16, width / 2 );
+		height /= 2;
+	}
+
+	while( (size_t) width * 2 * height * bpp <= target &&
+		width * 2 <= 8 * vips__tile_width )
+		width *= 2;
+
+	*tile_width = width;
+	*tile_height = height;
+}
+
 /**
  * vips_get_tile_size: (method)
  * @im: image to guess for
@@ -1059,6 +1182,8 @@ vips_get_tile_size( VipsImage *im,
 	case VIPS_DEMAND_STYLE_SMALLTILE:
 		*tile_width = vips__tile_width;
 		*tile_height = vips__tile_height;
+		if( vips__tile_adaptive )
+			vips_tile_size_adapt( im, tile_width, tile_height );
 		break;
 
 	case VIPS_DEMAND_STYLE_ANY:
@@ -1091,6 +1216,12 @@ vips_get_tile_size( VipsImage *im,
 			typical_image_width;
 	*n_lines = VIPS_MAX( *n_lines, vips__fatstrip_height * nthr );
 	*n_lines = VIPS_MAX( *n_lines, vips__thinstrip_height * nthr );
+
+	/* Adapted tile heights divide vips__tile_height, so round to that 
+	 * first to keep n_lines independent of pixel size.
+	 */
+	if( vips__tile_adaptive )
+		*n_lines = VIPS_ROUND_UP( *n_lines, vips__tile_height );
 	*n_lines = VIPS_ROUND_UP( *n_lines, *tile_height );
 
 	/* We make this assumption in several places.
@@ -4,6 +4,9 @@
  *	- from region.c
  * 19/3/09
  *	- block mmaps of nodata images
+ * 18/10/20
+ * 	- hint the access pattern with madvise(), populate small windows, 
+ * 	  drop finished windows from the page cache on sequential access
  */
 
 /*
@@ -76,6 +79,16 @@ int vips__window_margin_pixels = VIPS__WINDOW_MARGIN_PIXELS;
  */
 int vips__window_margin_bytes = VIPS__WINDOW_MARGIN_BYTES;
 
+/* Windows this size or smaller are read in when we map them. Set to 0 to
+ * disable.
+ */
+int vips__window_populate_bytes = VIPS__WINDOW_POPULATE_BYTES;
+
+/* The access pattern the image was opened with, if the loader set one. We
+ * store VipsAccess + 1, so 0 means no hint.
+ */
+static GQuark vips__window_access_quark = 0;
+
 /* Track global mmap usage.
  */
 #ifdef DEBUG_TOTAL
@@ -83,6 +96,56 @@ static int total_mmap_usage = 0;
 static int max_mmap_usage = 0;
 #endif /*DEBUG_TOTAL*/
 
+/* Get any access hint set with vips__window_set_access(), or -1.
+ */
+static int
+vips_window_get_access( VipsImage *im )
+{
+	if( !vips__window_access_quark )
+		return( -1 );
+
+	return( GPOINTER_TO_INT( g_object_get_qdata( G_OBJECT( im ), 
+		vips__window_access_quark ) ) - 1 );
+}
+
+static gboolean
+vips_window_sequential( VipsImage *im )
+{
+	int access = vips_window_get_access( im );
+
+	return( access == VIPS_ACCESS_SEQUENTIAL ||
+		access == VIPS_ACCESS_SEQUENTIAL_UNBUFFERED );
+}
+
+/* The file offset of line @y.
+ */
+static gint64
+vips_window_line_offset( VipsImage *im, int y )
+{
+	return( im->sizeof_header + 
+		(gint64) VIPS_IMAGE_SIZEOF_LINE( im ) * y );
+}
+
+/**
+ * vips__window_set_access:
+ * @image: image to hint
+ * @access: how @image will be read
+ *
+ * Loaders call this to say how a disc image will be read. Windows on 
+ * @image are then mapped with matching madvise() hints, and on sequential
+ * access, lines we have scrolled past are dropped from the page cache.
+ */
+void
+vips__window_set_access( VipsImage *image, VipsAccess access )
+{
+	if( !vips__window_access_quark )
+		vips__window_access_quark = 
+			g_quark_from_static_string( "vips-window-access" );
+
+	g_object_set_qdata( G_OBJECT( image ), 
+		vips__window_access_quark, GINT_TO_POINTER( access + 1 ) );
+}
+
 static int
 vips_window_unmap( VipsWindow *window )
 {
@@ -124,6 +187,15 @@ vips_window_free( VipsWindow *window )
 	g_assert( g_slist_find( im->windows, window ) );
 	im->windows = g_slist_remove( im->windows, window );
 
+	if( window->baseaddr &&
+		vips_window_sequential( im ) ) {
+		gint64 start = vips_window_line_offset( im, window->top );
+		gint64 end = vips_window_line_offset( im, 
+			window->top + window->height );
+
+		vips__file_dontneed( im->fd, start, end - start );
+	}
+
 	if( vips_window_unmap( window ) )
 		return( -1 );
 
@@ -213,6 +285,8 @@ static int
 vips_window_set( VipsWindow *window, int top, int height )
 {
 	int pagesize = vips_getpagesize();
+	VipsImage *im = window->im;
+	int access = vips_window_get_access( im );
 
 	void *baseaddr;
 	gint64 start, end, pagestart;
@@ -237,13 +311,35 @@ vips_window_set( VipsWindow *window, int top, int height )
 		return( -1 );
 	}
 
+	/* On sequential access, a window that scrolls down won't come back 
+	 * to the lines above it.
+	 */
+	if( window->baseaddr &&
+		vips_window_sequential( im ) &&
+		window->top < top ) {
+		gint64 old_start = 
+			vips_window_line_offset( im, window->top );
+		gint64 old_end = vips_window_line_offset( im, 
+			VIPS_MIN( window->top + window->height, top ) );
+
+		vips__file_dontneed( im->fd, old_start, old_end - old_start );
+	}
+
 	if( vips_window_unmap( window ) )
 		return( -1 );
 
-	if( !(baseaddr = vips__mmap( window->im->fd, 
-		0, pagelength, pagestart )) )
+	if( vips__window_populate_bytes > 0 &&
+		pagelength <= (size_t) vips__window_populate_bytes ) 
+		baseaddr = vips__mmap_populate( im->fd, 
+			0, pagelength, pagestart );
+	else
+		baseaddr = vips__mmap( im->fd, 0, pagelength, pagestart );
+	if( !baseaddr )
 		return( -1 ); 
 
+	if( access != -1 )
+		vips__madvise( baseaddr, pagelength, access );
+
 	window->baseaddr = baseaddr;
 	window->length = pagelength;
 
@@ -28,6 +28,8 @@
  * 	- smarter heif thumbnail selection
  * 12/10/19
  * 	- add thumbnail_source
+ * 18/10/20
+ * 	- block shrink-on-load for png, gif and non-pyramidal tiff
  */
 
 /*
@@ -131,6 +133,12 @@ typedef struct _VipsThumbnail {
 	int heif_thumbnail_width;
 	int heif_thumbnail_height;
 
+	/* For loaders with a block shrink-on-load (png, gif and tiff), the
+	 * "shrink" factor to use. This is separate from the open() factor, 
+	 * since tiff uses that to pick a pyramid page.
+	 */
+	int box_shrink;
+
 } VipsThumbnail;
 
 typedef struct _VipsThumbnailClass {
@@ -420,6 +428,28 @@ vips_thumbnail_find_jpegshrink( VipsThumbnail *thumbnail,
 		return( 1 );
 }
 
+/* Find the best block shrink for loaders that can only decode at full
+ * resolution, but can average blocks of lines as they arrive.
+ */
+static int
+vips_thumbnail_find_boxshrink( VipsThumbnail *thumbnail, 
+	int width, int height )
+{
+	double shrink = vips_thumbnail_calculate_common_shrink( thumbnail, 
+		width, height ); 
+
+	/* As with jpeg, the block average is in the device space of the 
+	 * image, not linear space.
+	 */
+	if( thumbnail->linear )
+		return( 1 ); 
+
+	/* Leave at least a factor of two for the final resize step, as for
+	 * jpeg.
+	 */
+	return( VIPS_CLIP( 1, (int) (shrink / 2.0), 16 ) );
+}
+
 /* Find the best pyramid (openslide or tiff) level.
  */
 static int
@@ -480,11 +510,30 @@ vips_thumbnail_open( VipsThumbnail *thumbnail )
 	if( vips_isprefix( "VipsForeignLoadJpeg", thumbnail->loader ) ) 
 		factor = vips_thumbnail_find_jpegshrink( thumbnail, 
 			thumbnail->input_width, thumbnail->input_height );
+	else if( vips_isprefix( "VipsForeignLoadTiff", thumbnail->loader ) &&
+		thumbnail->level_count < 2 ) {
+		/* Not a pyramid (a single page tiff is found as a one level 
+		 * pyramid), so load page 0 with a block shrink.
+		 */
+		thumbnail->box_shrink = vips_thumbnail_find_boxshrink( 
+			thumbnail, 
+			thumbnail->input_width, 
+			thumbnail->page_height );
+		factor = 0;
+	}
 	else if( vips_isprefix( "VipsForeignLoadTiff", thumbnail->loader ) ||
 		vips_isprefix( "VipsForeignLoadOpenslide", 
 		thumbnail->loader ) ) 
 		factor = vips_thumbnail_find_pyrlevel( thumbnail, 
 			thumbnail->input_width, thumbnail->input_height );
+	else if( vips_isprefix( "VipsForeignLoadPng", thumbnail->loader ) ||
+		vips_isprefix( "VipsForeignLoadGif", thumbnail->loader ) ) {
+		thumbnail->box_shrink = vips_thumbnail_find_boxshrink( 
+			thumbnail, 
+			thumbnail->input_width, 
+			thumbnail->page_height );
+		factor = thumbnail->box_shrink;
+	}
 	else if( vips_isprefix( "VipsForeignLoadPdf", thumbnail->loader ) ||
 		vips_isprefix( "VipsForeignLoadWebp", thumbnail->loader ) ||
 		vips_isprefix( "VipsForeignLoadSvg", thumbnail->loader ) ) 
@@ -898,6 +947,7 @@ vips_thumbnail_init( VipsThumbnail *thumbnail )
 	thumbnail->height = 1;
 	thumbnail->auto_rotate = TRUE;
 	thumbnail->intent = VIPS_INTENT_RELATIVE;
+	thumbnail->box_shrink = 1;
 }
 
 typedef struct _VipsThumbnailFile {
@@ -940,7 +990,9 @@ vips_thumbnail_file_open( VipsThumbnail *thumbnail, double factor )
 {
 	VipsThumbnailFile *file = (VipsThumbnailFile *) thumbnail;
 
-	if( vips_isprefix( "VipsForeignLoadJpeg", thumbnail->loader ) ) {
+	if( vips_isprefix( "VipsForeignLoadJpeg", thumbnail->loader ) ||
+		vips_isprefix( "VipsForeignLoadPng", thumbnail->loader ) ||
+		vips_isprefix( "VipsForeignLoadGif", thumbnail->loader ) ) {
 		return( vips_image_new_from_file( file->filename, 
 			"access", VIPS_ACCESS_SEQUENTIAL,
 			"shrink", (int) factor,
@@ -965,6 +1017,7 @@ vips_thumbnail_file_open( VipsThumbnail *thumbnail, double factor )
 		return( vips_image_new_from_file( file->filename, 
 			"access", VIPS_ACCESS_SEQUENTIAL,
 			"page", (int) factor,
+			"shrink", thumbnail->box_shrink,
 			NULL ) );
 	}
 	else if( vips_isprefix( "VipsForeignLoadHeif", thumbnail->loader ) ) {
@@ -1132,7 +1185,9 @@ vips_thumbnail_buffer_open( VipsThumbnail *thumbnail, double factor )
 {
 	VipsThumbnailBuffer *buffer = (VipsThumbnailBuffer *) thumbnail;
 
-	if( vips_isprefix( "VipsForeignLoadJpeg", thumbnail->loader ) ) {
+	if( vips_isprefix( "VipsForeignLoadJpeg", thumbnail->loader ) ||
+		vips_isprefix( "VipsForeignLoadPng", thumbnail->loader ) ||
+		vips_isprefix( "VipsForeignLoadGif", thumbnail->loader ) ) {
 		return( vips_image_new_from_buffer( 
 			buffer->buf->data, buffer->buf->length, 
 			buffer->option_string,
@@ -1165,6 +1220,7 @@ vips_thumbnail_buffer_open( VipsThumbnail *thumbnail, double factor )
 			buffer->option_string,
 			"access", VIPS_ACCESS_SEQUENTIAL,
 			"page", (int) factor,
+			"shrink", thumbnail->box_shrink,
 			NULL ) );
 	}
 	else if( vips_isprefix( "VipsForeignLoadHeif", thumbnail->loader ) ) {
@@ -1308,7 +1364,9 @@ vips_thumbnail_source_open( VipsThumbnail *thumbnail, double factor )
 {
 	VipsThumbnailSource *source = (VipsThumbnailSource *) thumbnail;
 
-	if( vips_isprefix( "VipsForeignLoadJpeg", thumbnail->loader ) ) {
+	if( vips_isprefix( "VipsForeignLoadJpeg", thumbnail->loader ) ||
+		vips_isprefix( "VipsForeignLoadPng", thumbnail->loader ) ||
+		vips_isprefix( "VipsForeignLoadGif", thumbnail->loader ) ) {
 		return( vips_image_new_from_source( 
 			source->source, 
 			source->option_string,
@@ -1341,6 +1399,7 @@ vips_thumbnail_source_open( VipsThumbnail *thumbnail, double factor )
 			source->option_string,
 			"access", VIPS_ACCESS_SEQUENTIAL,
 			"page", (int) factor,
+			"shrink", thumbnail->box_shrink,
 			NULL ) );
 	}
 	else if( vips_isprefix( "VipsForeignLoadHeif", thumbnail->loader ) ) {
@@ -573,6 +573,32 @@ class TestArithmetic:
             assert pytest.approx(p1) == 0
             assert pytest.approx(p2) == 10
 
+    def test_getpoints(self):
+        if pyvips.type_find("VipsOperation", "getpoints") != 0:
+            im = pyvips.Image.xyz(300, 200)
+            test = im[0] + im[1] * 1000
+
+            # spread over several tiles, out of order
+            coords = [250.0, 150.0, 3.0, 4.0, 140.0, 10.0, 3.0, 4.5]
+            for x in noncomplex_formats:
+                a = test.cast(x)
+                matrix = a.getpoints(coords)
+                assert matrix.width == 1
+                assert matrix.height == 4
+                for i in range(4):
+                    predict = a(int(coords[i * 2]), int(coords[i * 2 + 1]))
+                    assert_almost_equal_objects(matrix(0, i), predict)
+
+            # bilinear halfway between two rows
+            bilinear = pyvips.Interpolate.new("bilinear")
+            matrix = test.getpoints([10.0, 20.5], interpolate=bilinear)
+            assert pytest.approx(matrix(0, 0)[0]) == 10 + 20.5 * 1000
+
+            rgb = test.bandjoin([test, test])
+            matrix = rgb.getpoints(coords)
+            assert matrix.width == 3
+            assert_almost_equal_objects(matrix(2, 0), [250 + 150 * 1000])
+
     def test_find_trim(self):
         if pyvips.type_find("VipsOperation", "find_trim") != 0:
             im = pyvips.Image.black(50, 60) + 100
@@ -595,6 +621,45 @@ class TestArithmetic:
             assert width == 50
             assert height == 60
 
+            # all background
+            im = pyvips.Image.black(200, 300) + 255
+            left, top, width, height = im.find_trim()
+            assert left == 200
+            assert top == 300
+            assert width == 0
+            assert height == 0
+
+            # a one pixel wide object on each edge ... large enough to
+            # need many tiles in each band
+            im = pyvips.Image.black(2000, 1500) + 255
+            edges = [
+                [0, 0, 1, 1500],
+                [1999, 0, 1, 1500],
+                [0, 0, 2000, 1],
+                [0, 1499, 2000, 1]
+            ]
+            for edge in edges:
+                test = im.draw_rect(0, *edge, fill=True)
+                assert list(test.find_trim()) == edge
+
+            # an object in the middle of a large image
+            test = im.draw_rect(0, 700, 800, 3, 3, fill=True)
+            assert list(test.find_trim()) == [700, 800, 3, 3]
+
+            # object pixels must differ from the background by more than
+            # threshold
+            test = im.draw_rect(245, 100, 200, 50, 60, fill=True)
+            left, top, width, height = test.find_trim(threshold=10)
+            assert left == 2000
+            assert top == 1500
+            assert width == 0
+            assert height == 0
+            left, top, width, height = test.find_trim(threshold=9.5)
+            assert left == 100
+            assert top == 200
+            assert width == 50
+            assert height == 60
+
     def test_profile(self):
         test = pyvips.Image.black(100, 100).draw_rect(100, 40, 50, 1, 1)
 
@@ -645,6 +710,38 @@ class TestArithmetic:
             assert_almost_equal_objects(matrix(4, 1), [a.avg()])
             assert_almost_equal_objects(matrix(5, 1), [a.deviate()])
 
+    def test_stats_histogram(self):
+        im = pyvips.Image.black(50, 50)
+        test = im.insert(im + 10, 50, 0, expand=True)
+        test = test.bandjoin(test + 200)
+
+        for x in noncomplex_formats:
+            a = test.cast(x)
+            matrix, opts = a.stats(histogram=True, hist=True)
+            hist = opts['hist']
+            hist2 = a.hist_find()
+
+            assert_almost_equal_objects(matrix(0, 0), [a.min()])
+            assert_almost_equal_objects(matrix(1, 0), [a.max()])
+
+            assert hist.width == hist2.width
+            assert hist.bands == hist2.bands
+            assert hist.format == hist2.format
+            assert (hist - hist2).abs().max() == 0
+
+        # signed char is cast to uchar, so negative values go to bin 0 and
+        # there are always 256 bins
+        a = (test - 100).cast(pyvips.BandFormat.CHAR)
+        matrix, opts = a.stats(histogram=True, hist=True)
+        hist = opts['hist']
+        hist2 = a.hist_find()
+
+        assert hist.width == 256
+        assert hist.width == hist2.width
+        assert hist.format == hist2.format
+        assert hist(0, 0) == [5000, 0]
+        assert (hist - hist2).abs().max() == 0
+
     def test_sum(self):
         for fmt in all_formats:
             im = pyvips.Image.black(50, 50)
@@ -625,6 +625,38 @@ class TestConversion:
         assert im.height == max_height
         assert im.bands == max_bands
 
+        # a grid of flat tiles, each a different value, with a ragged last
+        # row
+        tiles = [pyvips.Image.black(20, 10) + i for i in range(11)]
+        im = pyvips.Image.arrayjoin(tiles, across=4, shim=2)
+        assert im.width == 4 * 20 + 3 * 2
+        assert im.height == 3 * 10 + 2 * 2
+        for i in range(11):
+            x = (i % 4) * 22
+            y = (i // 4) * 12
+            assert im(x + 10, y + 5) == [i]
+            assert im(x + 19, y + 9) == [i]
+        # the final box is stretched to the right edge with background
+        assert im(im.width - 1, 2 * 12 + 5) == [0]
+
+        # lazy mode keeps about half the file budget open, so make the
+        # budget small enough that inputs are closed and reopened
+        max_files = pyvips.cache_get_max_files()
+        pyvips.cache_set_max_files(4)
+        try:
+            lazy = pyvips.Image.arrayjoin(tiles, across=4, shim=2, lazy=True)
+            assert (im - lazy).abs().max() == 0
+
+            # crops of one file share an upstream image, so they must
+            # not be closed under each other
+            jpeg = pyvips.Image.new_from_file(JPEG_FILE)
+            crops = [jpeg.crop(i * 20, i * 10, 20, 10) for i in range(11)]
+            im = pyvips.Image.arrayjoin(crops, across=4, shim=2)
+            lazy = pyvips.Image.arrayjoin(crops, across=4, shim=2, lazy=True)
+            assert (im - lazy).abs().max() == 0
+        finally:
+            pyvips.cache_set_max_files(max_files)
+
     def test_msb(self):
         for fmt in unsigned_formats:
             mx = max_value[fmt]
@@ -4,7 +4,7 @@ import pytest
 from functools import reduce
 
 import pyvips
-from helpers import noncomplex_formats, run_fn2, run_fn, \
+from helpers import noncomplex_formats, int_formats, run_fn2, run_fn, \
     assert_almost_equal_objects, assert_less_threshold
 
 
@@ -80,6 +80,21 @@ class TestConvolution:
                     true = conv(im, msk, 49, 49)
                     assert_almost_equal_objects(result, true)
 
+    def test_conv_int(self):
+        # the int path should match float to within rounding for every
+        # int format, and for masks too large for the vector path
+        big = pyvips.Image.gaussmat(8, 0.01,
+                                    precision=pyvips.Precision.INTEGER)
+        for im in self.all_images:
+            for fmt in int_formats:
+                test = (im * 10).cast(fmt)
+                for msk in [self.blur, big]:
+                    a = test.conv(msk, precision=pyvips.Precision.INTEGER)
+                    b = test.conv(msk, precision=pyvips.Precision.FLOAT)
+
+                    assert a.format == test.format
+                    assert (a - b).abs().max() <= 1
+
     # don't test conva, it's still not done
     def dont_est_conva(self):
         for im in self.all_images:
@@ -151,6 +166,26 @@ class TestConvolution:
 
                 assert_almost_equal_objects(a_point, b_point, threshold=0.1)
 
+    def test_convsep_fused(self):
+        # convsep runs the two passes together, it should match two
+        # separate convolutions exactly
+        for im in self.all_images:
+            for fmt in noncomplex_formats:
+                test = im.cast(fmt)
+                for prec in [pyvips.Precision.INTEGER,
+                             pyvips.Precision.FLOAT]:
+                    gmask = pyvips.Image.gaussmat(1.5, 0.1,
+                                                  separable=True,
+                                                  precision=prec)
+                    gmask_rot = gmask.rot90()
+
+                    a = test.conv(gmask, precision=prec) \
+                        .conv(gmask_rot, precision=prec)
+                    b = test.convsep(gmask, precision=prec)
+
+                    assert a.format == b.format
+                    assert (a - b).abs().max() == 0
+
     def test_fastcor(self):
         for im in self.all_images:
             for fmt in noncomplex_formats:
@@ -190,6 +225,21 @@ class TestConvolution:
                     assert_almost_equal_objects(a_point, b_point,
                                                 threshold=0.1)
 
+    def test_gaussblur_recursive(self):
+        for im in self.all_images:
+            for sigma in [0.3, 2, 10]:
+                a = im.gaussblur(sigma, min_ampl=0.001,
+                                 precision=pyvips.Precision.FLOAT)
+                b = im.gaussblur(sigma, precision="recursive")
+
+                assert a.width == b.width
+                assert a.height == b.height
+                assert b.format == pyvips.BandFormat.FLOAT
+
+                for x, y in [(0, 0), (25, 50), (50, 50), (99, 99)]:
+                    assert_almost_equal_objects(a(x, y), b(x, y),
+                                                threshold=0.1)
+
     def test_sharpen(self):
         for im in self.all_images:
             for fmt in noncomplex_formats:
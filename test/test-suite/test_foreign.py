@@ -128,6 +128,31 @@ class TestForeign:
 
         x = None
 
+    def test_vips_windows(self):
+        # disc images are read through rolling mmap windows, hinted with
+        # the access pattern, check every access pattern sees the same
+        # pixels, including reads out of order which remap the windows
+        im = self.colour.replicate(4, 4)
+        filename = temp_filename(self.tempdir, ".v")
+        im.write_to_file(filename)
+        for access in ["random", "sequential"]:
+            x = pyvips.Image.new_from_file(filename, access=access)
+            assert (im - x).abs().max() == 0
+        x = pyvips.Image.new_from_file(filename, access="random")
+        assert (im.flipver() - x.flipver()).abs().max() == 0
+        for top in [im.height - 10, 0, im.height // 2]:
+            a = im.crop(0, top, im.width, 10)
+            b = x.crop(0, top, im.width, 10)
+            assert (a - b).abs().max() == 0
+
+        # mapped tiff and ppm pixels pass the access hint on too
+        for suffix in [".tif", ".ppm"]:
+            filename = temp_filename(self.tempdir, suffix)
+            im.write_to_file(filename)
+            for access in ["random", "sequential"]:
+                x = pyvips.Image.new_from_file(filename, access=access)
+                assert (im - x).abs().max() == 0
+
     @skip_if_no("jpegload")
     def test_jpeg(self):
         def jpeg_valid(im):
@@ -311,6 +336,83 @@ class TestForeign:
         self.save_load_file(".png", "[interlace]", self.colour, 0)
         self.save_load_file(".png", "[interlace]", self.mono, 0)
 
+    @skip_if_no("pngload")
+    def test_png_parallel(self):
+        # the parallel deflate path must make a png that decodes to exactly
+        # the same pixels as libpng's, for all filters and bit depths
+        rgba = self.colour.bandjoin(255)
+        ushort = (self.colour * 256 + 12).cast("ushort")
+        ushort = ushort.copy(interpretation="rgb16")
+        for im in [self.mono, self.colour, rgba, ushort]:
+            # large enough to need several blocks, and to be over the
+            # size threshold for the parallel path
+            im = im.replicate(3, 3)
+            for filter in [0x08, 0x10, 0x20, 0x40, 0x80, 0xf8]:
+                for compression in [0, 6]:
+                    buf1 = im.pngsave_buffer(filter=filter,
+                                             compression=compression,
+                                             parallel=True)
+                    buf2 = im.pngsave_buffer(filter=filter,
+                                             compression=compression,
+                                             parallel=False)
+                    im1 = pyvips.Image.new_from_buffer(buf1, "")
+                    im2 = pyvips.Image.new_from_buffer(buf2, "")
+                    assert im1.format == im2.format
+                    assert im1.bands == im2.bands
+                    assert (im1 - im2).abs().max() == 0
+                    assert (im1 - im).abs().max() == 0
+
+        # small images fall back to libpng even with parallel set
+        small = self.colour.crop(0, 0, 16, 16)
+        buf = small.pngsave_buffer(parallel=True)
+        im = pyvips.Image.new_from_buffer(buf, "")
+        assert (im - small).abs().max() == 0
+
+    @skip_if_no("jpegload")
+    @skip_if_no("tiffload")
+    def test_load_roi(self):
+        # an extract directly after a sequential load lets the loader skip
+        # lines above the area, the pixels must not change
+        for filename in [JPEG_FILE, TIF_FILE]:
+            full = pyvips.Image.new_from_file(filename)
+            left = 10
+            top = full.height // 2
+            width = full.width // 2
+            height = full.height // 4
+            expected = full.crop(left, top, width, height)
+
+            im = pyvips.Image.new_from_file(filename, access="sequential")
+            crop = im.crop(left, top, width, height)
+
+            assert (crop - expected).abs().max() == 0
+
+    def test_load_shrink(self):
+        # block shrink-on-load should match a box filter on the full image
+        for loader, filename in [("pngload", PNG_FILE),
+                                 ("tiffload", TIF_FILE),
+                                 ("gifload", GIF_FILE)]:
+            if not have(loader):
+                continue
+
+            full = pyvips.Image.new_from_file(filename)
+            im = pyvips.Image.new_from_file(filename, shrink=2)
+            assert im.width == full.width // 2
+            assert im.height == full.height // 2
+
+            # alpha images are weighted by alpha, so won't match shrink
+            if not full.hasalpha():
+                expected = full.crop(0, 0, im.width * 2, im.height * 2)
+                expected = expected.shrink(2, 2)
+                assert (im - expected).abs().max() <= 1
+
+        # each page of an animation shrinks separately
+        if have("gifload"):
+            full = pyvips.Image.new_from_file(GIF_ANIM_FILE, n=-1)
+            im = pyvips.Image.new_from_file(GIF_ANIM_FILE, n=-1, shrink=3)
+            page_height = full.get("page-height") // 3
+            assert im.get("page-height") == page_height
+            assert im.height == page_height * full.get("n-pages")
+
     @skip_if_no("tiffload")
     def test_tiff(self):
         def tiff_valid(im):
@@ -401,6 +503,20 @@ class TestForeign:
         assert x1.xres == 100
         assert x1.yres == 200
 
+        # uncompressed strip images are mapped rather than decoded, check we
+        # get the same pixels in any order
+        for fmt in ["uchar", "ushort", "float"]:
+            x = self.colour.cast(fmt)
+            filename = temp_filename(self.tempdir, '.tif')
+            x.write_to_file(filename)
+            with open(filename, 'rb') as f:
+                buf = f.read()
+            for y in [pyvips.Image.new_from_file(filename),
+                      pyvips.Image.new_from_buffer(buf, "")]:
+                assert y.format == fmt
+                assert (x.flipver() - y.flipver()).abs().max() == 0
+                assert (x.rot90() - y.rot90()).abs().max() == 0
+
         # OME support in 8.5
         x = pyvips.Image.new_from_file(OME_FILE)
         assert x.width == 439
@@ -458,6 +574,39 @@ class TestForeign:
         buf = x.tiffsave_buffer(tile=True, pyramid=True,
                                 region_shrink="nearest")
 
+        # pyramid layers are shrunk in parallel bands, each layer must
+        # match a 2x2 shrink of the one above ... alpha is opaque, so
+        # layers with alpha match too, give or take rounding
+        xyz = pyvips.Image.xyz(512, 512)
+        base = (xyz[0] * 3 + xyz[1] * 7) % 251
+        for fmt, scale, error in [("uchar", 1, 1),
+                                  ("ushort", 200, 1),
+                                  ("float", 0.01, 0.001)]:
+            for bands in range(1, 5):
+                has_alpha = bands in [2, 4]
+                n_colour = bands - 1 if has_alpha else bands
+                x = base
+                for i in range(1, n_colour):
+                    x = x.bandjoin((base + 50 * i) % 251)
+                if has_alpha:
+                    x = x.bandjoin(255)
+                x = (x * scale).cast(fmt)
+                filename = temp_filename(self.tempdir, '.tif')
+                x.tiffsave(filename, tile=True, pyramid=True,
+                           tile_width=128, tile_height=128)
+                n_pages = pyvips.Image.new_from_file(filename) \
+                    .get("n-pages")
+                assert n_pages > 2
+                above = pyvips.Image.new_from_file(filename, page=0)
+                for page in range(1, n_pages):
+                    layer = pyvips.Image.new_from_file(filename, page=page)
+                    predict = above.shrink(2, 2)
+                    assert layer.width == predict.width
+                    assert layer.height == predict.height
+                    assert layer.bands == bands
+                    assert (layer - predict).abs().max() <= error
+                    above = layer
+
     @skip_if_no("magickload")
     def test_magickload(self):
         def bmp_valid(im):
@@ -615,6 +764,38 @@ class TestForeign:
             assert x1.get("page-height") == x2.get("page-height")
             assert x1.get("gif-loop") == x2.get("gif-loop")
 
+            # single pages can skip ahead to a keyframe
+            page_height = x2.get("page-height")
+            for page in [0, 1, x2.get("n-pages") - 1]:
+                x3 = pyvips.Image.new_from_buffer(w1, "", page=page)
+                frame = x2.crop(0, page * page_height, x2.width, page_height)
+                assert (x3 - frame).abs().max() == 0
+
+        # the picture is filled in strips ... try an odd-sized image with
+        # transparency in just one strip
+        x = self.colour.crop(0, 0, 101, 77)
+        alpha = pyvips.Image.black(101, 77).invert()
+        alpha = alpha.draw_rect(0, 0, 40, 101, 5, fill=True)
+        rgba = x.bandjoin(alpha)
+
+        buf = rgba.webpsave_buffer(lossless=True)
+        im = pyvips.Image.new_from_buffer(buf, "")
+        assert im.width == 101
+        assert im.height == 77
+        assert im.bands == 4
+        assert (im[3] - alpha).abs().max() == 0
+        assert (im.crop(0, 0, 101, 40) - rgba.crop(0, 0, 101, 40)) \
+            .abs().max() == 0
+
+        buf = rgba.webpsave_buffer(Q=90)
+        im = pyvips.Image.new_from_buffer(buf, "")
+        assert im.width == 101
+        assert im.height == 77
+        assert im.bands == 4
+        assert (im[3] - alpha).abs().max() < 10
+        assert abs(im.crop(0, 45, 101, 32).avg() -
+                   rgba.crop(0, 45, 101, 32).avg()) < 2
+
     @skip_if_no("analyzeload")
     def test_analyzeload(self):
         def analyze_valid(im):
@@ -708,6 +889,14 @@ class TestForeign:
         assert abs(im.width * 2 - x.width) < 2
         assert abs(im.height * 2 - x.height) < 2
 
+        # strips render in parallel on separate documents ... they must 
+        # join up, whatever order we fetch them in
+        full = pyvips.Image.new_from_file(PDF_FILE, dpi=300).copy_memory()
+        x = pyvips.Image.new_from_file(PDF_FILE, dpi=300)
+        bottom = x.crop(0, x.height - 600, x.width, 600).copy_memory()
+        assert (bottom - full.crop(0, x.height - 600, x.width, 600)) \
+            .abs().max() == 0
+
     @skip_if_no("gifload")
     def test_gifload(self):
         def gif_valid(im):
@@ -768,6 +957,91 @@ class TestForeign:
 
         assert filecmp.cmp(GIF_ANIM_DISPOSE_PREVIOUS_EXPECTED_PNG_FILE, filename, shallow=False)
 
+    @skip_if_no("gifsave")
+    @skip_if_no("gifload")
+    def test_gifsave(self):
+        # a few colours, so quantisation is exact
+        x = (pyvips.Image.black(64, 48, bands=3) + [10, 20, 30]).cast("uchar")
+        x = x.draw_rect([255, 0, 0], 10, 10, 20, 15, fill=True)
+        buf = x.gifsave_buffer()
+        y = pyvips.Image.new_from_buffer(buf, "")
+        assert y.width == x.width
+        assert y.height == x.height
+        assert (x - y).abs().max() == 0
+
+        # an animation with a moving square exercises frame differencing,
+        # and there's an unchanged frame in there too
+        frames = []
+        for i in [0, 10, 10, 20]:
+            frames.append(x.draw_rect([0, 255, 0], i, 30, 8, 8, fill=True))
+        anim = pyvips.Image.arrayjoin(frames, across=1)
+        anim = anim.copy()
+        anim.set_type(pyvips.GValue.gint_type, "page-height", 48)
+        anim.set_type(pyvips.GValue.array_int_type, "delay",
+                      [100, 200, 300, 400])
+        anim.set_type(pyvips.GValue.gint_type, "loop", 3)
+        for global_palette in [False, True]:
+            buf = anim.gifsave_buffer(global_palette=global_palette)
+            y = pyvips.Image.new_from_buffer(buf, "", n=-1)
+            assert y.get("n-pages") == 4
+            assert y.get("page-height") == 48
+            assert y.get("delay") == [100, 200, 300, 400]
+            assert y.get("loop") == 3
+            # unchanged pixels are written as transparent, so gifload
+            # will add an alpha, though every pixel should be opaque
+            assert y.bands == 4
+            assert y.extract_band(3).min() == 255
+            assert (anim - y.extract_band(0, n=3)).abs().max() == 0
+
+        # three colours plus transparency fit exactly in a four colour
+        # palette, since a slot is kept free for the transparent entry
+        t = x.draw_rect([0, 0, 255], 40, 5, 10, 10, fill=True).bandjoin(255)
+        t = t.draw_rect([0, 0, 0, 0], 5, 30, 20, 10, fill=True)
+        buf = t.gifsave_buffer(colours=4)
+        y = pyvips.Image.new_from_buffer(buf, "")
+        assert y.bands == 4
+        assert (t[3] - y[3]).abs().max() == 0
+        opaque = t[3] == 255
+        diff = opaque.ifthenelse(t, 0) - opaque.ifthenelse(y, 0)
+        assert diff.abs().max() == 0
+
+        # a real animation, with transparency
+        x1 = pyvips.Image.new_from_file(GIF_ANIM_FILE, n=-1)
+        buf = x1.gifsave_buffer()
+        x2 = pyvips.Image.new_from_buffer(buf, "", n=-1)
+        assert x1.width == x2.width
+        assert x1.height == x2.height
+        assert x1.bands == x2.bands
+        assert x1.get("delay") == x2.get("delay")
+        assert x1.get("page-height") == x2.get("page-height")
+        assert x1.get("loop") == x2.get("loop")
+        assert (x1 - x2).abs().avg() < 5
+
+        # and a colour image, picking the saver from the suffix
+        filename = temp_filename(self.tempdir, '.gif')
+        self.colour.write_to_file(filename)
+        im = pyvips.Image.new_from_file(filename)
+        assert im.width == self.colour.width
+        assert im.height == self.colour.height
+        assert abs(im.avg() - self.colour.extract_band(0, n=3).avg()) < 10
+
+    @skip_if_no("gifload")
+    def test_gifload_page(self):
+        # single pages can skip ahead to a keyframe, they must match the
+        # same page rendered as part of the whole animation
+        for filename in [GIF_ANIM_FILE,
+                         GIF_ANIM_DISPOSE_BACKGROUND_FILE,
+                         GIF_ANIM_DISPOSE_PREVIOUS_FILE]:
+            animation = pyvips.Image.new_from_file(filename, n=-1)
+            page_height = animation.get("page-height")
+            n_pages = animation.get("n-pages")
+            for page in range(n_pages):
+                im = pyvips.Image.new_from_file(filename, page=page)
+                frame = animation.crop(0, page * page_height,
+                                       animation.width, page_height)
+                assert im.bands == frame.bands
+                assert (im - frame).abs().max() == 0
+
     @skip_if_no("svgload")
     def test_svgload(self):
         def svg_valid(im):
@@ -795,6 +1069,13 @@ class TestForeign:
         assert abs(im.width * 2 - x.width) < 2
         assert abs(im.height * 2 - x.height) < 2
 
+        # tiles render in parallel on separate handles
+        full = pyvips.Image.new_from_file(SVG_FILE, scale=4).copy_memory()
+        x = pyvips.Image.new_from_file(SVG_FILE, scale=4)
+        bottom = x.crop(0, x.height - 600, x.width, 600).copy_memory()
+        assert (bottom - full.crop(0, x.height - 600, x.width, 600)) \
+            .abs().max() == 0
+
     def test_csv(self):
         self.save_load("%s.csv", self.mono)
 
@@ -972,6 +1253,24 @@ class TestForeign:
         self.file_loader("heifload", HEIC_FILE, heif_valid)
         self.buffer_loader("heifload_buffer", HEIC_FILE, heif_valid)
 
+        # this is a grid image, so regions may be decoded tile by tile ...
+        # crops across tile edges, and out of order access, must match a
+        # full decode ... autorotate turns off the tiled path, and this
+        # image has no rotation, so use that for the reference
+        full = pyvips.Image.new_from_file(HEIC_FILE,
+                                          autorotate=True).copy_memory()
+        im = pyvips.Image.new_from_file(HEIC_FILE)
+        assert full.width == im.width
+        assert full.height == im.height
+        assert (im - full).abs().max() == 0
+        im = pyvips.Image.new_from_file(HEIC_FILE)
+        crop = im.crop(1000, 500, 100, 600).copy_memory()
+        assert (crop - full.crop(1000, 500, 100, 600)).abs().max() == 0
+        im = pyvips.Image.new_from_file(HEIC_FILE)
+        assert im(4000, 3000) == full(4000, 3000)
+        assert im(10, 10) == full(10, 10)
+        assert im(2048, 1536) == full(2048, 1536)
+
     @skip_if_no("heifsave")
     def test_heifsave(self):
         self.save_load_buffer("heifsave_buffer", "heifload_buffer",
@@ -81,6 +81,41 @@ class TestIofuncs:
         assert len(fields) > 10
         assert fields[0] == 'width'
 
+    def test_meta_copy_on_write(self):
+        a = pyvips.Image.black(10, 10).copy()
+        a.set_type(pyvips.GValue.gint_type, "banana", 12)
+
+        # metadata flows down the pipeline
+        b = (a + 1).copy()
+        assert b.get("banana") == 12
+
+        # changing or removing a field on b must not affect a
+        b.set_type(pyvips.GValue.gint_type, "banana", 13)
+        b.set_type(pyvips.GValue.gint_type, "apple", 1)
+        assert b.get("banana") == 13
+        assert a.get("banana") == 12
+        assert a.get_typeof("apple") == 0
+
+        c = (a * 2).copy()
+        c.remove("banana")
+        assert c.get_typeof("banana") == 0
+        assert a.get("banana") == 12
+        assert (a + 1).get("banana") == 12
+
+        # and changing or removing a field on a must not affect images
+        # made from it
+        d = (a - 1).copy()
+        a.set_type(pyvips.GValue.gint_type, "banana", 14)
+        a.set_type(pyvips.GValue.gint_type, "cherry", 2)
+        assert a.get("banana") == 14
+        assert d.get("banana") == 12
+        assert d.get_typeof("cherry") == 0
+        assert b.get("banana") == 13
+        a.remove("banana")
+        assert a.get_typeof("banana") == 0
+        assert d.get("banana") == 12
+        assert b.get("banana") == 13
+
     def test_write_to_memory(self):
         s = bytearray(200)
         im = pyvips.Image.new_from_memory(s, 20, 10, 1, 'uchar')
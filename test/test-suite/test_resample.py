@@ -2,7 +2,8 @@
 import pytest
 
 import pyvips
-from helpers import JPEG_FILE, HEIC_FILE, all_formats, have
+from helpers import JPEG_FILE, HEIC_FILE, PNG_FILE, TIF_FILE, \
+    all_formats, have
 
 
 # Run a function expecting a complex image on a two-band image
@@ -166,6 +167,13 @@ class TestResample:
         im2 = pyvips.Image.thumbnail_buffer(buf, 100)
         assert abs(im1.avg() - im2.avg()) < 1
 
+        # png and strip tiff use block shrink-on-load, we should still get
+        # the exact size
+        for filename in [PNG_FILE, TIF_FILE]:
+            for size in [20, 57, 100]:
+                im = pyvips.Image.thumbnail(filename, size)
+                assert max(im.width, im.height) == size
+
         if have("heifload"):
             # this image is orientation 6 ... thumbnail should flip it
             im = pyvips.Image.new_from_file(HEIC_FILE)
@@ -178,6 +186,31 @@ class TestResample:
             assert thumb.width < thumb.height
             assert thumb.height == 100
 
+    def test_thumbnail_tiff(self):
+        # two pages, but not a pyramid ... thumbnail must use page 0
+        page0 = pyvips.Image.black(200, 100) + 50
+        page1 = pyvips.Image.black(200, 100) + 200
+        im = page0.join(page1, "vertical").cast("uchar").copy()
+        im.set_type(pyvips.GValue.gint_type, "page-height", 100)
+        buf = im.tiffsave_buffer()
+        thumb = pyvips.Image.thumbnail_buffer(buf, 50)
+        assert thumb.width == 50
+        assert thumb.height == 25
+        assert thumb.min() == 50
+        assert thumb.max() == 50
+
+        # a single page tiff is block shrunk on load, it should be close
+        # to a plain resize
+        im = pyvips.Image.xyz(200, 100)[0].cast("uchar")
+        buf = im.tiffsave_buffer()
+        thumb = pyvips.Image.thumbnail_buffer(buf, 50)
+        ref = im.resize(0.25)
+        assert thumb.width == 50
+        assert thumb.height == 25
+        assert (thumb - ref).abs().max() <= 2
+        assert thumb(0, 0)[0] < 5
+        assert thumb(49, 0)[0] > 190
+
     def test_similarity(self):
         im = pyvips.Image.new_from_file(JPEG_FILE)
         im2 = im.similarity(angle=90)
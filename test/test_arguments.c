@@ -0,0 +1,493 @@
+/* Test setting and getting operation arguments directly, with
+ * vips_object_set_argument_value() and vips_object_get_argument_value().
+ */
+
+#include <string.h>
+#include <vips/vips.h>
+
+/* The number of times our subclass set_property has been called.
+ */
+static int n_set_property = 0;
+
+static VipsObject *
+operation_new( const char *name )
+{
+	VipsOperation *operation;
+
+	if( !(operation = vips_operation_new( name )) )
+		vips_error_exit( NULL );
+
+	return( VIPS_OBJECT( operation ) );
+}
+
+static VipsArgumentClass *
+argument_find( VipsObject *object, const char *name )
+{
+	VipsArgumentClass *argument_class;
+
+	if( !(argument_class = vips_object_class_find_argument(
+		VIPS_OBJECT_GET_CLASS( object ), name )) )
+		vips_error_exit( "no argument %s", name );
+
+	return( argument_class );
+}
+
+/* Check the argument holds @expect, read both directly and via GObject.
+ */
+static void
+check_arg( VipsObject *object, const char *name, const GValue *expect )
+{
+	VipsArgumentClass *argument_class = argument_find( object, name );
+	GParamSpec *pspec = ((VipsArgument *) argument_class)->pspec;
+	GType type = G_PARAM_SPEC_VALUE_TYPE( pspec );
+
+	GValue direct = { 0 };
+	GValue gobject = { 0 };
+
+	g_value_init( &direct, type );
+	g_value_init( &gobject, type );
+	if( vips_object_get_argument_value( object, argument_class, &direct ) )
+		vips_error_exit( NULL );
+	g_object_get_property( G_OBJECT( object ), name, &gobject );
+
+	if( g_param_values_cmp( pspec, &direct, expect ) != 0 )
+		vips_error_exit( "%s: direct get differs", name );
+	if( g_param_values_cmp( pspec, &gobject, expect ) != 0 )
+		vips_error_exit( "%s: GObject get differs", name );
+
+	g_value_unset( &direct );
+	g_value_unset( &gobject );
+}
+
+/* Set @value directly and check we can read it back. Then set @other via
+ * GObject and check the direct get sees that.
+ */
+static void
+test_arg( const char *operation_name, const char *name,
+	const GValue *value, const GValue *other )
+{
+	VipsObject *object;
+
+	printf( "testing %s.%s, %s ... ",
+		operation_name, name, G_VALUE_TYPE_NAME( value ) );
+
+	object = operation_new( operation_name );
+
+	if( vips_object_set_argument_value( object,
+		argument_find( object, name ), value ) )
+		vips_error_exit( NULL );
+	check_arg( object, name, value );
+
+	g_object_set_property( G_OBJECT( object ), name, other );
+	check_arg( object, name, other );
+
+	g_object_unref( object );
+
+	printf( "ok\n" );
+}
+
+/* Setting @value must fail and leave the argument unchanged.
+ */
+static void
+test_arg_fail( const char *operation_name, const char *name,
+	const GValue *value )
+{
+	VipsObject *object;
+	VipsArgumentClass *argument_class;
+	GParamSpec *pspec;
+	GValue before = { 0 };
+	char *str;
+
+	str = g_strdup_value_contents( value );
+	printf( "testing %s.%s rejects %s ... ",
+		operation_name, name, str );
+	g_free( str );
+
+	object = operation_new( operation_name );
+	argument_class = argument_find( object, name );
+	pspec = ((VipsArgument *) argument_class)->pspec;
+
+	g_value_init( &before, G_PARAM_SPEC_VALUE_TYPE( pspec ) );
+	g_object_get_property( G_OBJECT( object ), name, &before );
+
+	if( !vips_object_set_argument_value( object, argument_class, value ) )
+		vips_error_exit( "%s: bad value accepted", name );
+	if( !strlen( vips_error_buffer() ) )
+		vips_error_exit( "%s: no error message", name );
+	vips_error_clear();
+
+	if( vips_object_argument_isset( object, name ) )
+		vips_error_exit( "%s: set after error", name );
+	check_arg( object, name, &before );
+
+	g_value_unset( &before );
+	g_object_unref( object );
+
+	printf( "ok\n" );
+}
+
+static void
+test_int( void )
+{
+	GValue value = { 0 };
+	GValue other = { 0 };
+
+	g_value_init( &value, G_TYPE_INT );
+	g_value_init( &other, G_TYPE_INT );
+	g_value_set_int( &value, 12 );
+	g_value_set_int( &other, 13 );
+	test_arg( "embed", "width", &value, &other );
+
+	/* Below the minimum.
+	 */
+	g_value_set_int( &value, 0 );
+	test_arg_fail( "embed", "width", &value );
+
+	g_value_unset( &value );
+	g_value_unset( &other );
+
+	/* Conversion from another numeric type.
+	 */
+	g_value_init( &value, G_TYPE_DOUBLE );
+	g_value_init( &other, G_TYPE_INT );
+	g_value_set_double( &value, 12.0 );
+	g_value_set_int( &other, 12 );
+	test_arg( "embed", "x", &value, &other );
+	g_value_unset( &value );
+	g_value_unset( &other );
+
+	/* No conversion from a string.
+	 */
+	g_value_init( &value, G_TYPE_STRING );
+	g_value_set_string( &value, "12" );
+	test_arg_fail( "embed", "width", &value );
+	g_value_unset( &value );
+}
+
+static void
+test_double( void )
+{
+	GValue value = { 0 };
+	GValue other = { 0 };
+
+	g_value_init( &value, G_TYPE_DOUBLE );
+	g_value_init( &other, G_TYPE_DOUBLE );
+	g_value_set_double( &value, 2.5 );
+	g_value_set_double( &other, 3.5 );
+	test_arg( "copy", "xres", &value, &other );
+
+	g_value_set_double( &value, -1.0 );
+	test_arg_fail( "copy", "xres", &value );
+	g_value_set_double( &value, 1e10 );
+	test_arg_fail( "copy", "xres", &value );
+
+	g_value_unset( &value );
+	g_value_unset( &other );
+}
+
+static void
+test_bool( void )
+{
+	GValue value = { 0 };
+	GValue other = { 0 };
+
+	g_value_init( &value, G_TYPE_BOOLEAN );
+	g_value_init( &other, G_TYPE_BOOLEAN );
+	g_value_set_boolean( &value, TRUE );
+	g_value_set_boolean( &other, FALSE );
+	test_arg( "copy", "swap", &value, &other );
+	g_value_unset( &value );
+	g_value_unset( &other );
+}
+
+/* Names with "-" can also be found in their "_" form.
+ */
+static void
+test_names( void )
+{
+	VipsObject *object;
+
+	printf( "testing argument name forms ... " );
+
+	object = operation_new( "thumbnail_image" );
+	if( argument_find( object, "no-rotate" ) != 
+		argument_find( object, "no_rotate" ) )
+		vips_error_exit( "no_rotate and no-rotate differ" );
+	if( vips_object_class_find_argument( VIPS_OBJECT_GET_CLASS( object ), 
+		"no_rotate_" ) )
+		vips_error_exit( "found a bad name" );
+	g_object_unref( object );
+
+	printf( "ok\n" );
+}
+
+static void
+test_enum( void )
+{
+	GValue value = { 0 };
+	GValue other = { 0 };
+	GValue nick = { 0 };
+	VipsObject *object;
+
+	g_value_init( &value, VIPS_TYPE_EXTEND );
+	g_value_init( &other, VIPS_TYPE_EXTEND );
+	g_value_set_enum( &value, VIPS_EXTEND_MIRROR );
+	g_value_set_enum( &other, VIPS_EXTEND_COPY );
+	test_arg( "embed", "extend", &value, &other );
+
+	g_value_set_enum( &value, VIPS_EXTEND_LAST + 10 );
+	test_arg_fail( "embed", "extend", &value );
+
+	/* Set from a nickname.
+	 */
+	printf( "testing embed.extend from a string ... " );
+	g_value_init( &nick, G_TYPE_STRING );
+	g_value_set_string( &nick, "mirror" );
+	g_value_set_enum( &value, VIPS_EXTEND_MIRROR );
+	object = operation_new( "embed" );
+	if( vips_object_set_argument_value( object,
+		argument_find( object, "extend" ), &nick ) )
+		vips_error_exit( NULL );
+	check_arg( object, "extend", &value );
+	g_object_unref( object );
+	printf( "ok\n" );
+
+	g_value_set_string( &nick, "banana" );
+	test_arg_fail( "embed", "extend", &nick );
+
+	g_value_unset( &value );
+	g_value_unset( &other );
+	g_value_unset( &nick );
+}
+
+static void
+test_flags( void )
+{
+	GType type;
+	GValue value = { 0 };
+	GValue other = { 0 };
+	GValue nick = { 0 };
+	VipsObject *object;
+
+	if( !vips_type_find( "VipsOperation", "pngsave" ) ) {
+		printf( "no pngsave, skipping flags tests\n" );
+		return;
+	}
+
+	type = VIPS_TYPE_FOREIGN_PNG_FILTER;
+	g_value_init( &value, type );
+	g_value_init( &other, type );
+	g_value_set_flags( &value, VIPS_FOREIGN_PNG_FILTER_SUB );
+	g_value_set_flags( &other, VIPS_FOREIGN_PNG_FILTER_ALL );
+	test_arg( "pngsave", "filter", &value, &other );
+
+	printf( "testing pngsave.filter from a string ... " );
+	g_value_init( &nick, G_TYPE_STRING );
+	g_value_set_string( &nick, "sub" );
+	object = operation_new( "pngsave" );
+	if( vips_object_set_argument_value( object,
+		argument_find( object, "filter" ), &nick ) )
+		vips_error_exit( NULL );
+	check_arg( object, "filter", &value );
+	g_object_unref( object );
+	printf( "ok\n" );
+
+	g_value_unset( &value );
+	g_value_unset( &other );
+	g_value_unset( &nick );
+}
+
+static void
+test_string( void )
+{
+	GValue value = { 0 };
+	GValue other = { 0 };
+
+	g_value_init( &value, G_TYPE_STRING );
+	g_value_init( &other, G_TYPE_STRING );
+	g_value_set_string( &value, "echo %s" );
+	g_value_set_string( &other, "cat %s" );
+	test_arg( "system", "cmd_format", &value, &other );
+	g_value_unset( &value );
+	g_value_unset( &other );
+}
+
+static void
+test_image( void )
+{
+	VipsImage *a;
+	VipsImage *b;
+	GValue value = { 0 };
+	GValue other = { 0 };
+
+	if( vips_black( &a, 10, 10, NULL ) ||
+		vips_black( &b, 20, 20, NULL ) )
+		vips_error_exit( NULL );
+
+	g_value_init( &value, VIPS_TYPE_IMAGE );
+	g_value_init( &other, VIPS_TYPE_IMAGE );
+	g_value_set_object( &value, a );
+	g_value_set_object( &other, b );
+	test_arg( "embed", "in", &value, &other );
+
+	/* Arrays of images.
+	 */
+	g_value_unset( &value );
+	g_value_unset( &other );
+	g_value_init( &value, VIPS_TYPE_ARRAY_IMAGE );
+	g_value_init( &other, VIPS_TYPE_ARRAY_IMAGE );
+	vips_value_set_array_image( &value, 2 );
+	vips_value_get_array_image( &value, NULL )[0] = a;
+	vips_value_get_array_image( &value, NULL )[1] = b;
+	g_object_ref( a );
+	g_object_ref( b );
+	vips_value_set_array_image( &other, 1 );
+	vips_value_get_array_image( &other, NULL )[0] = b;
+	g_object_ref( b );
+	test_arg( "bandjoin", "in", &value, &other );
+
+	g_value_unset( &value );
+	g_value_unset( &other );
+	g_object_unref( a );
+	g_object_unref( b );
+}
+
+static void
+test_array( void )
+{
+	double d1[] = { 1, 2, 3 };
+	double d2[] = { 4 };
+	int i1[] = { VIPS_BLEND_MODE_OVER };
+	int i2[] = { VIPS_BLEND_MODE_MULTIPLY };
+
+	GValue value = { 0 };
+	GValue other = { 0 };
+
+	g_value_init( &value, VIPS_TYPE_ARRAY_DOUBLE );
+	g_value_init( &other, VIPS_TYPE_ARRAY_DOUBLE );
+	vips_value_set_array_double( &value, d1, VIPS_NUMBER( d1 ) );
+	vips_value_set_array_double( &other, d2, VIPS_NUMBER( d2 ) );
+	test_arg( "embed", "background", &value, &other );
+	g_value_unset( &value );
+	g_value_unset( &other );
+
+	g_value_init( &value, VIPS_TYPE_ARRAY_INT );
+	g_value_init( &other, VIPS_TYPE_ARRAY_INT );
+	vips_value_set_array_int( &value, i1, VIPS_NUMBER( i1 ) );
+	vips_value_set_array_int( &other, i2, VIPS_NUMBER( i2 ) );
+	test_arg( "composite", "mode", &value, &other );
+	g_value_unset( &value );
+	g_value_unset( &other );
+}
+
+/* A subclass of copy with its own set_property and an extra argument.
+ * Setting args directly must go through its set_property.
+ */
+static int test_copy_offset = 0;
+
+static void
+test_copy_set_property( GObject *gobject,
+	guint property_id, const GValue *value, GParamSpec *pspec )
+{
+	n_set_property += 1;
+
+	vips_object_set_property( gobject, property_id, value, pspec );
+}
+
+static void
+test_copy_class_init( gpointer class, gpointer data )
+{
+	GObjectClass *gobject_class = G_OBJECT_CLASS( class );
+	VipsObjectClass *object_class = VIPS_OBJECT_CLASS( class );
+
+	gobject_class->set_property = test_copy_set_property;
+	gobject_class->get_property = vips_object_get_property;
+
+	object_class->nickname = "test_copy";
+
+	VIPS_ARG_INT( class, "test", 100, 
+		"Test", 
+		"Test argument",
+		VIPS_ARGUMENT_OPTIONAL_INPUT,
+		test_copy_offset,
+		0, 100, 0 );
+}
+
+static void
+test_override( void )
+{
+	GType parent = g_type_from_name( "VipsCopy" );
+
+	GTypeQuery query;
+	GType type;
+	VipsObject *object;
+	GValue value = { 0 };
+
+	printf( "testing subclass set_property is used ... " );
+
+	/* Our extra int goes after the parent instance.
+	 */
+	g_type_query( parent, &query );
+	test_copy_offset = query.instance_size;
+	type = g_type_register_static_simple( parent, "TestCopy",
+		query.class_size, test_copy_class_init,
+		query.instance_size + sizeof( int ), NULL, 0 );
+	object = VIPS_OBJECT( g_object_new( type, NULL ) );
+
+	g_value_init( &value, G_TYPE_INT );
+	g_value_set_int( &value, 42 );
+	n_set_property = 0;
+	if( vips_object_set_argument_value( object,
+		argument_find( object, "test" ), &value ) )
+		vips_error_exit( NULL );
+	if( n_set_property != 1 )
+		vips_error_exit( "subclass set_property not called" );
+	check_arg( object, "test", &value );
+
+	/* And the varargs path.
+	 */
+	n_set_property = 0;
+	if( vips_object_set( object, "test", 43, NULL ) )
+		vips_error_exit( NULL );
+	if( n_set_property != 1 )
+		vips_error_exit( "subclass set_property not called" );
+	g_value_set_int( &value, 43 );
+	check_arg( object, "test", &value );
+
+	/* Args the parent installed must still work.
+	 */
+	g_value_unset( &value );
+	g_value_init( &value, G_TYPE_DOUBLE );
+	g_value_set_double( &value, 2.5 );
+	if( vips_object_set_argument_value( object,
+		argument_find( object, "xres" ), &value ) )
+		vips_error_exit( NULL );
+	check_arg( object, "xres", &value );
+
+	g_value_unset( &value );
+	g_object_unref( object );
+
+	printf( "ok\n" );
+}
+
+int
+main( int argc, char **argv )
+{
+	if( VIPS_INIT( argv[0] ) )
+		vips_error_exit( NULL );
+
+	test_int();
+	test_double();
+	test_bool();
+	test_enum();
+	test_flags();
+	test_string();
+	test_image();
+	test_array();
+	test_override();
+	test_names();
+
+	vips_shutdown();
+
+	return( 0 );
+}
@@ -0,0 +1,10 @@
+#!/bin/sh
+
+# test setting and getting operation arguments directly
+
+# set -x
+set -e
+
+. ./variables.sh
+
+./test_arguments
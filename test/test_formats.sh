@@ -105,6 +105,24 @@ test_raw() {
 	echo "ok"
 }
 
+# load with readahead and prefetch on, we must get the same pixels
+test_readahead() {
+	in=$1
+	format=$2
+	mode=$3
+
+	printf "testing $(basename $in) $format$mode with readahead ... "
+
+	$vips copy $in $tmp/t1.$format$mode
+	$vips copy $tmp/t1.$format $tmp/before.v
+	$vips --vips-readahead=16k copy $tmp/t1.$format $tmp/after.v
+	test_difference $tmp/before.v $tmp/after.v 0
+	VIPS_READAHEAD=16k $vips copy $tmp/t1.$format $tmp/after.v
+	test_difference $tmp/before.v $tmp/after.v 0
+
+	echo "ok"
+}
+
 # a format for which we only have a load (eg. matlab)
 # pass in a reference file as well and compare to that
 test_loader() {
@@ -183,6 +201,16 @@ if test_supported tiffload; then
 	test_format $cmyk tif 90 [compression=jpeg,tile,pyramid]
 fi
 
+if test_supported tiffload; then
+	test_readahead $image tif 
+	test_readahead $image tif [tile,tile-width=16,tile-height=16]
+	test_readahead $image tif [compression=deflate,tile]
+fi
+if test_supported pngload; then
+	test_readahead $image png 
+fi
+test_readahead $image ppm 
+
 test_rad $rad 
 
 test_raw $mono 
@@ -0,0 +1,103 @@
+/* Test that first-touch NUMA placement (VIPS_NUMA) doesn't change the pixels
+ * vips_sink_memory() makes.
+ */
+
+#include <string.h>
+#include <vips/vips.h>
+
+/* Test images are this high.
+ */
+#define TEST_HEIGHT (257)
+
+/* Make a test image: @bands bands of x and y coordinates cast to @format.
+ */
+static VipsImage *
+test_image( int width, int bands, VipsBandFormat format )
+{
+	VipsImage *base = vips_image_new();
+	VipsImage **t = (VipsImage **) vips_object_local_array( 
+		VIPS_OBJECT( base ), 4 );
+
+	VipsImage *out;
+
+	if( vips_xyz( &t[0], width, TEST_HEIGHT, NULL ) ||
+		vips_bandjoin2( t[0], t[0], &t[1], NULL ) ||
+		vips_extract_band( t[1], &t[2], 0, "n", bands, NULL ) ||
+		vips_cast( t[2], &out, format, NULL ) ) {
+		g_object_unref( base );
+		return( NULL );
+	}
+	g_object_unref( base );
+
+	return( out );
+}
+
+static void *
+write_memory( VipsImage *image, gboolean numa, size_t *length )
+{
+	void *data;
+
+	vips_sink_memory_numa_set( numa );
+	data = vips_image_write_to_memory( image, length );
+	vips_sink_memory_numa_set( FALSE );
+
+	return( data );
+}
+
+static void
+test_numa( int width, int bands, VipsBandFormat format )
+{
+	VipsImage *image;
+	void *before;
+	void *after;
+	size_t before_length;
+	size_t after_length;
+
+	printf( "testing %d x %d, %d bands, %s ... ", 
+		width, TEST_HEIGHT, bands, 
+		vips_enum_nick( VIPS_TYPE_BAND_FORMAT, format ) );
+
+	if( !(image = test_image( width, bands, format )) ||
+		!(before = write_memory( image, FALSE, &before_length )) ||
+		!(after = write_memory( image, TRUE, &after_length )) )
+		vips_error_exit( NULL );
+
+	if( before_length != after_length ||
+		memcmp( before, after, before_length ) != 0 )
+		vips_error_exit( "pixels differ with numa set" );
+
+	g_free( before );
+	g_free( after );
+	g_object_unref( image );
+
+	printf( "ok\n" );
+}
+
+int
+main( int argc, char **argv )
+{
+	/* Widths which don't give page-aligned lines.
+	 */
+	int widths[] = { 1, 333, 1021, 4099 };
+	int bands[] = { 1, 3, 4 };
+	VipsBandFormat formats[] = {
+		VIPS_FORMAT_UCHAR,
+		VIPS_FORMAT_USHORT,
+		VIPS_FORMAT_FLOAT,
+		VIPS_FORMAT_DOUBLE
+	};
+
+	int i, j, k;
+
+	if( VIPS_INIT( argv[0] ) )
+		vips_error_exit( NULL );
+
+	for( i = 0; i < VIPS_NUMBER( widths ); i++ )
+		for( j = 0; j < VIPS_NUMBER( bands ); j++ )
+			for( k = 0; k < VIPS_NUMBER( formats ); k++ )
+				test_numa( widths[i], bands[j], formats[k] );
+
+	vips_shutdown();
+
+	return( 0 );
+}
@@ -0,0 +1,10 @@
+#!/bin/sh
+
+# test memory images with first-touch numa placement
+
+# set -x
+set -e
+
+. ./variables.sh
+
+./test_sinkmemory
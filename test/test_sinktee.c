@@ -0,0 +1,221 @@
+/* Test vips_sink_tee().
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <vips/vips.h>
+
+/* Test images are this size. Large enough for many strips.
+ */
+#define TEST_WIDTH (1000)
+#define TEST_HEIGHT (2000)
+
+/* At most this many branches.
+ */
+#define TEST_MAX_BRANCHES (3)
+
+/* Fail the test rather than hang if the tee deadlocks.
+ */
+#define TEST_TIMEOUT (120)
+
+/* The number of pixels the counted image has generated.
+ */
+static int n_pixels = 0;
+
+typedef struct _Branches {
+	/* Each branch writes to memory here.
+	 */
+	void *data[TEST_MAX_BRANCHES];
+	size_t length[TEST_MAX_BRANCHES];
+
+	/* This branch fails after reading part of the image, or -1.
+	 */
+	int fail;
+} Branches;
+
+static int
+counted_gen( VipsRegion *or, void *seq, void *a, void *b, gboolean *stop )
+{
+	VipsRegion *ir = (VipsRegion *) seq;
+	VipsRect *r = &or->valid;
+
+	if( vips_region_prepare( ir, r ) ||
+		vips_region_region( or, ir, r, r->left, r->top ) )
+		return( -1 );
+
+	g_atomic_int_add( &n_pixels, r->width * r->height );
+
+	return( 0 );
+}
+
+/* A copy of @in which counts the pixels it computes.
+ */
+static VipsImage *
+counted_new( VipsImage *in )
+{
+	VipsImage *out;
+
+	out = vips_image_new();
+	if( vips_image_pipelinev( out, 
+		VIPS_DEMAND_STYLE_THINSTRIP, in, NULL ) ||
+		vips_image_generate( out,
+			vips_start_one, counted_gen, vips_stop_one,
+			in, NULL ) ) {
+		VIPS_UNREF( out );
+		return( NULL );
+	}
+
+	return( out );
+}
+
+static int
+save_branch( VipsImage *image, int i, void *a )
+{
+	Branches *branches = (Branches *) a;
+
+	if( i == branches->fail ) {
+		VipsImage *t;
+		double avg;
+
+		if( vips_extract_area( image, &t,
+			0, 0, image->Xsize, image->Ysize / 3, NULL ) )
+			return( -1 );
+		if( vips_avg( t, &avg, NULL ) ) {
+			g_object_unref( t );
+			return( -1 );
+		}
+		g_object_unref( t );
+
+		vips_error( "test_sinktee", "branch %d failed", i );
+
+		return( -1 );
+	}
+
+	if( !(branches->data[i] = vips_image_write_to_memory( image,
+		&branches->length[i] )) )
+		return( -1 );
+
+	return( 0 );
+}
+
+static void
+branches_free( Branches *branches )
+{
+	int i;
+
+	for( i = 0; i < TEST_MAX_BRANCHES; i++ )
+		VIPS_FREE( branches->data[i] );
+}
+
+/* Tee @n branches and check each matches a separate save, and that the
+ * upstream image is computed at least once.
+ */
+static void
+test_tee( VipsImage *in, int n, int fail )
+{
+	void *data;
+	size_t length;
+	VipsImage *counted;
+	Branches branches;
+	int result;
+	int i;
+
+	printf( "testing %d branches%s ... ", n,
+		fail >= 0 ? ", one failing" : "" );
+
+	if( !(data = vips_image_write_to_memory( in, &length )) )
+		vips_error_exit( NULL );
+
+	memset( &branches, 0, sizeof( branches ) );
+	branches.fail = fail;
+	n_pixels = 0;
+
+	if( !(counted = counted_new( in )) )
+		vips_error_exit( NULL );
+	result = vips_sink_tee( counted, n, save_branch, &branches );
+	g_object_unref( counted );
+
+	if( fail >= 0 ) {
+		if( !result )
+			vips_error_exit( "failing branch not reported" );
+		vips_error_clear();
+	}
+	else {
+		if( result )
+			vips_error_exit( NULL );
+		/* Each pixel is usually computed once, but a branch that
+		 * stalls for a second (a heavily loaded machine, say) will
+		 * compute some pixels again, so we can only check that 
+		 * nothing was missed. 
+		 */
+		if( n_pixels < TEST_WIDTH * TEST_HEIGHT )
+			vips_error_exit( "computed %d pixels, expected %d",
+				n_pixels, TEST_WIDTH * TEST_HEIGHT );
+		if( n_pixels > TEST_WIDTH * TEST_HEIGHT )
+			printf( "(%d pixels recomputed) ", 
+				n_pixels - TEST_WIDTH * TEST_HEIGHT );
+	}
+
+	/* The other branches must run to the end.
+	 */
+	for( i = 0; i < n; i++ ) {
+		if( i == fail )
+			continue;
+
+		if( !branches.data[i] ||
+			branches.length[i] != length ||
+			memcmp( branches.data[i], data, length ) != 0 )
+			vips_error_exit( "branch %d differs", i );
+	}
+
+	branches_free( &branches );
+	g_free( data );
+
+	printf( "ok\n" );
+}
+
+/* No branches is an error.
+ */
+static void
+test_zero( VipsImage *in )
+{
+	Branches branches;
+
+	printf( "testing zero branches ... " );
+
+	memset( &branches, 0, sizeof( branches ) );
+	branches.fail = -1;
+	if( !vips_sink_tee( in, 0, save_branch, &branches ) )
+		vips_error_exit( "zero branches succeeded" );
+	vips_error_clear();
+
+	printf( "ok\n" );
+}
+
+int
+main( int argc, char **argv )
+{
+	VipsImage *in;
+
+	if( VIPS_INIT( argv[0] ) )
+		vips_error_exit( NULL );
+
+	alarm( TEST_TIMEOUT );
+
+	if( vips_xyz( &in, TEST_WIDTH, TEST_HEIGHT, NULL ) )
+		vips_error_exit( NULL );
+
+	test_tee( in, 1, -1 );
+	test_tee( in, 2, -1 );
+	test_tee( in, 3, -1 );
+	test_tee( in, 3, 0 );
+	test_tee( in, 3, 1 );
+	test_tee( in, 2, 1 );
+	test_zero( in );
+
+	g_object_unref( in );
+
+	vips_shutdown();
+
+	return( 0 );
+}
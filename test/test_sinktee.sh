@@ -0,0 +1,10 @@
+#!/bin/sh
+
+# test vips_sink_tee()
+
+# set -x
+set -e
+
+. ./variables.sh
+
+./test_sinktee
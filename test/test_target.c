@@ -0,0 +1,263 @@
+/* Test background writes to targets.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <vips/vips.h>
+
+/* Write this much in each test.
+ */
+#define TEST_SIZE (4 * 1024 * 1024)
+
+/* Queue at most this much in the backpressure test.
+ */
+#define TEST_HIGH_WATER (64 * 1024)
+
+typedef struct _Reader {
+	int fd;
+	unsigned char *data;
+	size_t length;
+	gboolean slow;
+} Reader;
+
+static VipsTarget *
+target_new( int fd, gboolean background, guint64 high_water )
+{
+	VipsTarget *target;
+
+	target = VIPS_TARGET( g_object_new( VIPS_TYPE_TARGET,
+		"descriptor", fd,
+		"background", background,
+		"high-water", high_water,
+		NULL ) );
+	if( vips_object_build( VIPS_OBJECT( target ) ) ) {
+		VIPS_UNREF( target );
+		return( NULL );
+	}
+
+	return( target );
+}
+
+static void
+fill( unsigned char *data, size_t length )
+{
+	size_t i;
+
+	for( i = 0; i < length; i++ )
+		data[i] = (i * 7 + i / 4099) & 0xff;
+}
+
+/* Write @data in a range of sizes, small enough to be buffered and large
+ * enough to skip the buffer.
+ */
+static int
+write_all( VipsTarget *target, unsigned char *data, size_t length )
+{
+	size_t sizes[] = { 1, 100, 8191, 100000, 3 };
+	size_t i;
+	size_t j;
+	size_t n;
+
+	for( i = 0, j = 0; i < length; i += n, j++ ) {
+		n = VIPS_MIN( sizes[j % VIPS_NUMBER( sizes )], length - i );
+		if( vips_target_write( target, data + i, n ) )
+			return( -1 );
+	}
+
+	return( 0 );
+}
+
+static void *
+reader( void *a )
+{
+	Reader *reader = (Reader *) a;
+
+	gint64 bytes_read;
+
+	do {
+		bytes_read = read( reader->fd,
+			reader->data + reader->length,
+			VIPS_MIN( 16 * 1024, TEST_SIZE - reader->length ) );
+		if( bytes_read > 0 )
+			reader->length += bytes_read;
+
+		/* Keep the writer waiting.
+		 */
+		if( reader->slow )
+			g_usleep( 1000 );
+	} while( bytes_read > 0 &&
+		reader->length < TEST_SIZE );
+
+	return( NULL );
+}
+
+/* Write to a pipe, check the bytes that come out and the stats.
+ */
+static void
+test_pipe( unsigned char *data, gboolean background, gboolean slow )
+{
+	Reader state;
+	GThread *thread;
+	VipsTarget *target;
+	int fd[2];
+	gint64 bytes_written;
+	gint64 n_writes;
+	double write_time;
+	double max_write_time;
+	double stall_time;
+
+	printf( "testing %s target, %s reader ... ",
+		background ? "background" : "foreground",
+		slow ? "slow" : "fast" );
+
+	if( pipe( fd ) )
+		vips_error_exit( "unable to make pipe" );
+
+	state.fd = fd[0];
+	state.data = g_malloc( TEST_SIZE );
+	state.length = 0;
+	state.slow = slow;
+	if( !(thread = vips_g_thread_new( "reader", reader, &state )) )
+		vips_error_exit( NULL );
+
+	if( !(target = target_new( fd[1], background, TEST_HIGH_WATER )) ||
+		write_all( target, data, TEST_SIZE ) ||
+		vips_target_end( target ) )
+		vips_error_exit( NULL );
+
+	vips_target_get_stats( target, &bytes_written, &n_writes,
+		&write_time, &max_write_time, &stall_time );
+
+	/* The target holds a dup of the write end, the reader sees EOF when
+	 * both are closed.
+	 */
+	VIPS_UNREF( target );
+	close( fd[1] );
+	(void) vips_g_thread_join( thread );
+	close( fd[0] );
+
+	if( state.length != TEST_SIZE ||
+		memcmp( state.data, data, TEST_SIZE ) != 0 )
+		vips_error_exit( "bytes differ" );
+	if( bytes_written != TEST_SIZE )
+		vips_error_exit( "bytes_written is %" G_GINT64_FORMAT,
+			bytes_written );
+	if( n_writes < 1 ||
+		write_time < max_write_time ||
+		max_write_time < 0 )
+		vips_error_exit( "bad write stats" );
+
+	/* With 4MB to write, 64kb queued at most and a slow reader, the
+	 * saver must have stalled.
+	 */
+	if( background &&
+		slow &&
+		stall_time <= 0 )
+		vips_error_exit( "no stall with a full queue" );
+	if( !background &&
+		stall_time != 0 )
+		vips_error_exit( "stall without a queue" );
+
+	g_free( state.data );
+
+	printf( "ok\n" );
+}
+
+/* Write to a pipe with no reader. The error must come back from a write or
+ * from finish.
+ */
+static void
+test_fail( unsigned char *data, gboolean background )
+{
+	VipsTarget *target;
+	int fd[2];
+	int result;
+
+	printf( "testing %s target write error ... ",
+		background ? "background" : "foreground" );
+
+	if( pipe( fd ) )
+		vips_error_exit( "unable to make pipe" );
+	close( fd[0] );
+
+	if( !(target = target_new( fd[1], background, TEST_HIGH_WATER )) )
+		vips_error_exit( NULL );
+	result = write_all( target, data, TEST_SIZE );
+	if( vips_target_end( target ) )
+		result = -1;
+	if( !result )
+		vips_error_exit( "write error not reported" );
+	vips_error_clear();
+
+	/* Finish can be called again, it must not block or fail.
+	 */
+	if( vips_target_end( target ) )
+		vips_error_exit( "second finish failed" );
+
+	VIPS_UNREF( target );
+	close( fd[1] );
+
+	printf( "ok\n" );
+}
+
+/* A saver writing to a failing background target must fail.
+ */
+static void
+test_save_fail( void )
+{
+	VipsImage *image;
+	VipsTarget *target;
+	int fd[2];
+
+	printf( "testing save to a failing background target ... " );
+
+	if( pipe( fd ) )
+		vips_error_exit( "unable to make pipe" );
+	close( fd[0] );
+
+	if( vips_black( &image, 1000, 1000, "bands", 3, NULL ) ||
+		!(target = target_new( fd[1], TRUE, TEST_HIGH_WATER )) )
+		vips_error_exit( NULL );
+	if( !vips_image_write_to_target( image, ".ppm", target, NULL ) )
+		vips_error_exit( "save to a failing target succeeded" );
+	vips_error_clear();
+
+	VIPS_UNREF( target );
+	VIPS_UNREF( image );
+	close( fd[1] );
+
+	printf( "ok\n" );
+}
+
+int
+main( int argc, char **argv )
+{
+	unsigned char *data;
+
+	if( VIPS_INIT( argv[0] ) )
+		vips_error_exit( NULL );
+
+	/* We want EPIPE, not a signal.
+	 */
+	signal( SIGPIPE, SIG_IGN );
+
+	data = g_malloc( TEST_SIZE );
+	fill( data, TEST_SIZE );
+
+	test_pipe( data, FALSE, FALSE );
+	test_pipe( data, TRUE, FALSE );
+	test_pipe( data, TRUE, TRUE );
+	test_fail( data, FALSE );
+	test_fail( data, TRUE );
+	test_save_fail();
+
+	g_free( data );
+
+	vips_shutdown();
+
+	return( 0 );
+}
@@ -0,0 +1,10 @@
+#!/bin/sh
+
+# test background writes to targets
+
+# set -x
+set -e
+
+. ./variables.sh
+
+./test_target
@@ -0,0 +1,59 @@
+#!/bin/sh
+
+# test that adaptive tile sizes and tile width autotuning don't change the 
+# pixels we compute
+
+# set -x
+set -e
+
+. ./variables.sh
+
+# run $oper on $in with each tiling mode, we must get the same pixels
+test_tiling() {
+	in=$1
+	oper=$2
+	shift 2
+
+	printf "testing $oper $(basename "$in") with tile tuning ... "
+
+	$vips $oper "$in" $tmp/before.v "$@"
+
+	VIPS_TILE_ADAPTIVE=1 $vips $oper "$in" $tmp/after.v "$@"
+	test_difference $tmp/before.v $tmp/after.v 0
+
+	VIPS_TILE_AUTOTUNE=1 $vips $oper "$in" $tmp/after.v "$@"
+	test_difference $tmp/before.v $tmp/after.v 0
+
+	VIPS_TILE_ADAPTIVE=1 VIPS_TILE_AUTOTUNE=1 \
+		$vips $oper "$in" $tmp/after.v "$@"
+	test_difference $tmp/before.v $tmp/after.v 0
+
+	$vips --vips-tile-adaptive --vips-tile-autotune \
+		$oper "$in" $tmp/after.v "$@"
+	test_difference $tmp/before.v $tmp/after.v 0
+
+	echo "ok"
+}
+
+# large enough for autotuning to try several tile widths
+printf "building test images ... "
+$vips replicate $image $tmp/big.v 4 4
+$vips cast $tmp/big.v $tmp/float.v float
+$vips bandjoin_const $tmp/big.v $tmp/rgba.v 128
+$vips copy $tmp/big.v $tmp/big.jpg
+echo "ok"
+
+for in in $tmp/big.v $tmp/float.v $tmp/rgba.v; do
+	test_tiling $in copy
+	test_tiling $in gaussblur 1.5
+	test_tiling $in shrink 3 3
+done
+
+# sequential sources give thinstrip pipelines
+test_tiling "$tmp/big.jpg[access=sequential]" copy
+test_tiling "$tmp/big.jpg[access=sequential]" shrink 3 3
+if test_supported pngload; then
+	$vips copy $tmp/rgba.v $tmp/rgba.png
+	test_tiling "$tmp/rgba.png[access=sequential]" copy
+	test_tiling "$tmp/rgba.png[access=sequential]" shrink 3 3
+fi